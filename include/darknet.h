@@ -227,6 +227,7 @@ struct layer {
     void(*backward_gpu)  (struct layer, struct network_state);
     void(*update_gpu)    (struct layer, int, float, float, float, float);
     layer *share_layer;
+    int param_arena;    // parameter/update/EMA/Adam arrays are views into network.params & co, not separate allocations
     int train;
     int avgpool;
     int batch_normalize;
@@ -425,6 +426,10 @@ struct layer {
     float scale_x_y;
     int objectness_smooth;
     int new_coords;
+    int lazy_class_logistic;    // [yolo]: class channels of l.output are still logits (CPU inference forward)
+    float *train_scratch;       // [yolo]: per-thread buffers of the training loss, train_scratch_slots threads
+    int *train_scratch_int;
+    int train_scratch_slots;
     int show_details;
     float max_delta;
     float uc_normalizer;
@@ -504,9 +509,13 @@ struct layer {
     float *c_cpu;
     float *stored_c_cpu;
     float *dc_cpu;
+    float *packed_state_weights;    // [lstm]/[gru]/[conv_lstm]: hidden-to-gate weights stacked for one GEMM per step
+    float *packed_state_output;
 
     float *binary_input;
     uint32_t *bin_re_packed_input;
+    uint32_t *bin_re_packed_output;     // next XNOR layer's bin_re_packed_input, filled by this layer (CPU inference)
+    int bin_input_packed;               // bin_re_packed_input is filled by the previous XNOR layer
     char *t_bit_input;
 
     struct layer *input_layer;
@@ -803,6 +812,17 @@ typedef struct network {
     int index;
     float *cost;
     float clip;
+    struct detection_arena *dets_arena;     // reusable output of get_network_boxes_view()
+    struct network_profiler *profiler;      // per-layer timing of forward_network(), see profiler.h
+
+    // parameter arena: weights, biases, scales and rolling statistics of all layers in weights-file order,
+    // the layer arrays are views into it; the other arenas hold gradients, EMA and Adam moments at the same offsets
+    float *params;
+    float *param_updates;
+    float *params_ema;
+    float *params_m;
+    float *params_v;
+    size_t nparams;
 
 //#ifdef GPU
     //float *input_gpu;
@@ -1028,15 +1048,18 @@ LIB_API load_args get_base_args(network *net);
 LIB_API void do_nms_sort(detection *dets, int total, int classes, float thresh);
 LIB_API void do_nms_obj(detection *dets, int total, int classes, float thresh);
 LIB_API void diounms_sort(detection *dets, int total, int classes, float thresh, NMS_KIND nms_kind, float beta1);
+LIB_API void soft_nms_sort(detection *dets, int total, int classes, float sigma, float score_thresh);
 
 // network.h
 LIB_API float *network_predict(network net, float *input);
 LIB_API float *network_predict_ptr(network *net, float *input);
 LIB_API detection *get_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, int *num, int letter);
+LIB_API detection *get_network_boxes_view(network *net, int w, int h, float thresh, float hier, int *map, int relative, int *num, int letter);
 LIB_API det_num_pair* network_predict_batch(network *net, image im, int batch_size, int w, int h, float thresh, float hier, int *map, int relative, int letter);
 LIB_API void free_detections(detection *dets, int n);
 LIB_API void free_batch_detections(det_num_pair *det_num_pairs, int n);
 LIB_API void fuse_conv_batchnorm(network net);
+LIB_API void optimize_network_graph(network *net);
 LIB_API void calculate_binary_weights(network net);
 LIB_API char *detection_to_json(detection *dets, int nboxes, int classes, char **names, long long int frame_id, char *filename);
 
@@ -1046,6 +1069,8 @@ LIB_API detection *make_network_boxes(network *net, float thresh, int *num);
 LIB_API void reset_rnn(network *net);
 LIB_API float *network_predict_image(network *net, image im);
 LIB_API float *network_predict_image_letterbox(network *net, image im);
+LIB_API float *network_input_from_bytes(network *net, const unsigned char *data, int w, int h, int c, int stride, int swap_rb, int letter);
+LIB_API float *network_predict_bytes(network *net, const unsigned char *data, int w, int h, int c, int stride, int swap_rb, int letter);
 LIB_API float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, float thresh_calc_avg_iou, const float iou_thresh, const int map_points, int letter_box, network *existing_net);
 LIB_API void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, int ngpus, int clear, int dont_show, int calc_map, float thresh, float iou_thresh, int mjpeg_port, int show_imgs, int benchmark_layers, char* chart_path);
 LIB_API void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filename, float thresh,
@@ -1060,6 +1085,7 @@ LIB_API image make_attention_image(int img_size, float *original_delta_cpu, floa
 LIB_API image resize_image(image im, int w, int h);
 LIB_API void quantize_image(image im);
 LIB_API void copy_image_from_bytes(image im, char *pdata);
+LIB_API void bytes_to_image_into(const unsigned char *src, int src_w, int src_h, int src_c, int stride, int swap_rb, int letter, image dst);
 LIB_API image letterbox_image(image im, int w, int h);
 LIB_API void rgbgr_image(image im);
 LIB_API image make_image(int w, int h, int c);
@@ -1114,6 +1140,10 @@ LIB_API int fill_remaining_id(detection *new_dets, int new_dets_num, int new_tra
 // gemm.h
 LIB_API void init_cpu();
 
+// thread_pool.h
+// threads <= 0 - DARKNET_THREADS or the number of CPUs; pin - bind the workers to CPUs (Linux)
+LIB_API void init_thread_pool(int threads, int pin);
+
 #ifdef __cplusplus
 }
 #endif  // __cplusplus
@@ -81,6 +81,8 @@ public:
 
     LIB_API std::vector<bbox_t> detect(std::string image_filename, float thresh = 0.2, bool use_mean = false);
     LIB_API std::vector<bbox_t> detect(image_t img, float thresh = 0.2, bool use_mean = false);
+    // packed 8-bit frame (c = 1, 3 or 4 interleaved channels, rows stride bytes apart), boxes are in frame pixels
+    LIB_API std::vector<bbox_t> detect_bytes(const unsigned char *data, int w, int h, int c, int stride, bool bgr = true, float thresh = 0.2, bool use_mean = false);
     LIB_API std::vector<std::vector<bbox_t>> detectBatch(image_t img, int batch_size, int width, int height, float thresh, bool make_nms = true);
     static LIB_API image_t load_image(std::string image_filename);
     static LIB_API void free_image(image_t m);
@@ -111,6 +113,8 @@ public:
     {
         if(mat.data == NULL)
             throw std::runtime_error("Image is empty");
+        if (mat.depth() == CV_8U && (mat.channels() == 1 || mat.channels() == 3 || mat.channels() == 4))
+            return detect_bytes(mat.data, mat.cols, mat.rows, mat.channels(), (int)mat.step, true, thresh, use_mean);
         auto image_ptr = mat_to_image_resize(mat);
         return detect_resized(*image_ptr, mat.cols, mat.rows, thresh, use_mean);
     }
@@ -1,4 +1,5 @@
 #include "activations.h"
+#include "thread_pool.h"
 
 #include <math.h>
 #include <stdio.h>
@@ -112,54 +113,86 @@ float activate(float x, ACTIVATION a)
     return 0;
 }
 
-void activate_array(float *x, const int n, const ACTIVATION a)
+// the element-wise kernels run on the thread pool in chunks of this many elements,
+// shorter arrays stay on the calling thread
+#define ACTIVATION_GRAIN 16384
+
+typedef struct activation_args {
+    const float *x;
+    const float *y;         // sigmoid / activation input of the gradients
+    float *out;
+    float *out2;
+    ACTIVATION a;
+} activation_args;
+
+static void activate_range(int begin, int end, void *arg)
 {
+    activation_args *args = (activation_args*)arg;
+    float *x = args->out;
     int i;
-    if (a == LINEAR) {}
-    else if (a == LEAKY) {
-        #pragma omp parallel for
-        for (i = 0; i < n; ++i) {
-            x[i] = leaky_activate(x[i]);
-        }
+    if (args->a == LEAKY) {
+        for (i = begin; i < end; ++i) x[i] = leaky_activate(x[i]);
     }
-    else if (a == LOGISTIC) {
-        #pragma omp parallel for
-        for (i = 0; i < n; ++i) {
-            x[i] = logistic_activate(x[i]);
-        }
+    else if (args->a == LOGISTIC) {
+        for (i = begin; i < end; ++i) x[i] = logistic_activate(x[i]);
     }
     else {
-        for (i = 0; i < n; ++i) {
-            x[i] = activate(x[i], a);
-        }
+        for (i = begin; i < end; ++i) x[i] = activate(x[i], args->a);
     }
 }
 
-void activate_array_swish(float *x, const int n, float * output_sigmoid, float * output)
+void activate_array(float *x, const int n, const ACTIVATION a)
+{
+    if (a == LINEAR) return;
+    activation_args args = { 0 };
+    args.out = x;
+    args.a = a;
+    parallel_for(n, ACTIVATION_GRAIN, activate_range, &args);
+}
+
+static void swish_range(int begin, int end, void *arg)
 {
+    activation_args *args = (activation_args*)arg;
     int i;
-    #pragma omp parallel for
-    for (i = 0; i < n; ++i) {
-        float x_val = x[i];
+    for (i = begin; i < end; ++i) {
+        float x_val = args->x[i];
         float sigmoid = logistic_activate(x_val);
-        output_sigmoid[i] = sigmoid;
-        output[i] = x_val * sigmoid;
+        args->out2[i] = sigmoid;
+        args->out[i] = x_val * sigmoid;
     }
 }
 
-// https://github.com/digantamisra98/Mish
-void activate_array_mish(float *x, const int n, float * activation_input, float * output)
+void activate_array_swish(float *x, const int n, float * output_sigmoid, float * output)
+{
+    activation_args args = { 0 };
+    args.x = x;
+    args.out = output;
+    args.out2 = output_sigmoid;
+    parallel_for(n, ACTIVATION_GRAIN, swish_range, &args);
+}
+
+static void mish_range(int begin, int end, void *arg)
 {
     const float MISH_THRESHOLD = 20;
+    activation_args *args = (activation_args*)arg;
     int i;
-    #pragma omp parallel for
-    for (i = 0; i < n; ++i) {
-        float x_val = x[i];
-        activation_input[i] = x_val;    // store value before activation
-        output[i] = x_val * tanh_activate( softplus_activate(x_val, MISH_THRESHOLD) );
+    for (i = begin; i < end; ++i) {
+        float x_val = args->x[i];
+        args->out2[i] = x_val;    // store value before activation
+        args->out[i] = x_val * tanh_activate( softplus_activate(x_val, MISH_THRESHOLD) );
     }
 }
 
+// https://github.com/digantamisra98/Mish
+void activate_array_mish(float *x, const int n, float * activation_input, float * output)
+{
+    activation_args args = { 0 };
+    args.x = x;
+    args.out = output;
+    args.out2 = activation_input;
+    parallel_for(n, ACTIVATION_GRAIN, mish_range, &args);
+}
+
 static float hard_mish_yashas(float x)
 {
     if (x > 0)
@@ -169,17 +202,26 @@ static float hard_mish_yashas(float x)
     return 0;
 }
 
-void activate_array_hard_mish(float *x, const int n, float * activation_input, float * output)
+static void hard_mish_range(int begin, int end, void *arg)
 {
+    activation_args *args = (activation_args*)arg;
     int i;
-    #pragma omp parallel for
-    for (i = 0; i < n; ++i) {
-        float x_val = x[i];
-        activation_input[i] = x_val;    // store value before activation
-        output[i] = hard_mish_yashas(x_val);
+    for (i = begin; i < end; ++i) {
+        float x_val = args->x[i];
+        args->out2[i] = x_val;    // store value before activation
+        args->out[i] = hard_mish_yashas(x_val);
     }
 }
 
+void activate_array_hard_mish(float *x, const int n, float * activation_input, float * output)
+{
+    activation_args args = { 0 };
+    args.x = x;
+    args.out = output;
+    args.out2 = activation_input;
+    parallel_for(n, ACTIVATION_GRAIN, hard_mish_range, &args);
+}
+
 void activate_array_normalize_channels(float *x, const int n, int batch, int channels, int wh_step, float *output)
 {
     int size = n / channels;
@@ -353,43 +395,60 @@ float gradient(float x, ACTIVATION a)
     return 0;
 }
 
+static void gradient_range(int begin, int end, void *arg)
+{
+    activation_args *args = (activation_args*)arg;
+    int i;
+    for (i = begin; i < end; ++i) {
+        args->out[i] *= gradient(args->x[i], args->a);
+    }
+}
+
 void gradient_array(const float *x, const int n, const ACTIVATION a, float *delta)
 {
+    activation_args args = { 0 };
+    args.x = x;
+    args.out = delta;
+    args.a = a;
+    parallel_for(n, ACTIVATION_GRAIN, gradient_range, &args);
+}
+
+static void gradient_swish_range(int begin, int end, void *arg)
+{
+    activation_args *args = (activation_args*)arg;
     int i;
-    #pragma omp parallel for
-    for(i = 0; i < n; ++i){
-        delta[i] *= gradient(x[i], a);
+    for (i = begin; i < end; ++i) {
+        float swish = args->x[i];
+        args->out[i] *= swish + args->y[i]*(1 - swish);
     }
 }
 
 // https://github.com/BVLC/caffe/blob/04ab089db018a292ae48d51732dd6c66766b36b6/src/caffe/layers/swish_layer.cpp#L54-L56
 void gradient_array_swish(const float *x, const int n, const float * sigmoid, float * delta)
 {
-    int i;
-    #pragma omp parallel for
-    for (i = 0; i < n; ++i) {
-        float swish = x[i];
-        delta[i] *= swish + sigmoid[i]*(1 - swish);
-    }
+    activation_args args = { 0 };
+    args.x = x;
+    args.y = sigmoid;
+    args.out = delta;
+    parallel_for(n, ACTIVATION_GRAIN, gradient_swish_range, &args);
 }
 
-// https://github.com/digantamisra98/Mish
-void gradient_array_mish(const int n, const float * activation_input, float * delta)
+static void gradient_mish_range(int begin, int end, void *arg)
 {
+    activation_args *args = (activation_args*)arg;
     int i;
-    #pragma omp parallel for
-    for (i = 0; i < n; ++i) {
+    for (i = begin; i < end; ++i) {
         const float MISH_THRESHOLD = 20.0f;
 
         // implementation from TensorFlow: https://github.com/tensorflow/addons/commit/093cdfa85d334cbe19a37624c33198f3140109ed
         // implementation from Pytorch: https://github.com/thomasbrandon/mish-cuda/blob/master/csrc/mish.h#L26-L31
-        float inp = activation_input[i];
+        float inp = args->y[i];
         const float sp = softplus_activate(inp, MISH_THRESHOLD);
         const float grad_sp = 1 - exp(-sp);
         const float tsp = tanh(sp);
         const float grad_tsp = (1 - tsp*tsp) * grad_sp;
         const float grad = inp * grad_tsp + tsp;
-        delta[i] *= grad;
+        args->out[i] *= grad;
 
 
         //float x = activation_input[i];
@@ -400,6 +459,15 @@ void gradient_array_mish(const int n, const float * activation_input, float * de
     }
 }
 
+// https://github.com/digantamisra98/Mish
+void gradient_array_mish(const int n, const float * activation_input, float * delta)
+{
+    activation_args args = { 0 };
+    args.y = activation_input;
+    args.out = delta;
+    parallel_for(n, ACTIVATION_GRAIN, gradient_mish_range, &args);
+}
+
 static float hard_mish_yashas_grad(float x)
 {
     if (x > 0)
@@ -409,12 +477,20 @@ static float hard_mish_yashas_grad(float x)
     return 0;
 }
 
-void gradient_array_hard_mish(const int n, const float * activation_input, float * delta)
+static void gradient_hard_mish_range(int begin, int end, void *arg)
 {
+    activation_args *args = (activation_args*)arg;
     int i;
-    #pragma omp parallel for
-    for (i = 0; i < n; ++i) {
-        float inp = activation_input[i];
-        delta[i] *= hard_mish_yashas_grad(inp);
+    for (i = begin; i < end; ++i) {
+        float inp = args->y[i];
+        args->out[i] *= hard_mish_yashas_grad(inp);
     }
 }
+
+void gradient_array_hard_mish(const int n, const float * activation_input, float * delta)
+{
+    activation_args args = { 0 };
+    args.y = activation_input;
+    args.out = delta;
+    parallel_for(n, ACTIVATION_GRAIN, gradient_hard_mish_range, &args);
+}
@@ -223,11 +223,8 @@ void backward_batchnorm_layer(const layer l, network_state state)
 void update_batchnorm_layer(layer l, int batch, float learning_rate, float momentum, float decay)
 {
     //int size = l.nweights;
-    axpy_cpu(l.c, learning_rate / batch, l.bias_updates, 1, l.biases, 1);
-    scal_cpu(l.c, momentum, l.bias_updates, 1);
-
-    axpy_cpu(l.c, learning_rate / batch, l.scale_updates, 1, l.scales, 1);
-    scal_cpu(l.c, momentum, l.scale_updates, 1);
+    sgd_update_cpu(l.c, l.biases, l.bias_updates, NULL, learning_rate / batch, momentum, 0, 0);
+    sgd_update_cpu(l.c, l.scales, l.scale_updates, NULL, learning_rate / batch, momentum, 0, 0);
 }
 
 
@@ -1,5 +1,6 @@
 #include "blas.h"
 #include "utils.h"
+#include "thread_pool.h"
 
 #include <math.h>
 #include <assert.h>
@@ -342,6 +343,96 @@ void fill_cpu(int N, float ALPHA, float *X, int INCX)
     }
 }
 
+// the update sweeps run on the thread pool in chunks of this many weights, shorter arrays
+// (biases, scales) stay on the calling thread
+#define UPDATE_GRAIN 16384
+
+typedef struct update_sweep_args {
+    float *w, *u, *m, *v, *ema;
+    float rate, momentum, decay, ema_alpha;
+    float B1, B2, eps, c1, c2;
+} update_sweep_args;
+
+static void sgd_update_range(int begin, int end, void *arg)
+{
+    const update_sweep_args a = *(update_sweep_args*)arg;
+    int i;
+    if (a.ema) {
+        for (i = begin; i < end; ++i) {
+            const float g = a.u[i] - a.decay*a.w[i];
+            const float x = a.w[i] + a.rate*g;
+            a.w[i] = x;
+            a.u[i] = a.momentum*g;
+            a.ema[i] = a.ema_alpha*a.ema[i] + (1 - a.ema_alpha)*x;
+        }
+    }
+    else {
+        for (i = begin; i < end; ++i) {
+            const float g = a.u[i] - a.decay*a.w[i];
+            a.w[i] += a.rate*g;
+            a.u[i] = a.momentum*g;
+        }
+    }
+}
+
+// One sweep of SGD with momentum and weight decay, the same arithmetic as the
+// axpy_cpu(-decay, w, u) / axpy_cpu(rate, u, w) / scal_cpu(momentum, u) sequence:
+//   g = u - decay*w;  w += rate*g;  u = momentum*g
+// With ema != NULL the updated weight is also blended into its moving average:
+//   ema = ema_alpha*ema + (1 - ema_alpha)*w
+void sgd_update_cpu(int N, float *w, float *u, float *ema, float rate, float momentum, float decay, float ema_alpha)
+{
+    update_sweep_args a = { 0 };
+    a.w = w;
+    a.u = u;
+    a.ema = ema;
+    a.rate = rate;
+    a.momentum = momentum;
+    a.decay = decay;
+    a.ema_alpha = ema_alpha;
+    parallel_for(N, UPDATE_GRAIN, sgd_update_range, &a);
+}
+
+static void adam_update_range(int begin, int end, void *arg)
+{
+    const update_sweep_args a = *(update_sweep_args*)arg;
+    int i;
+    for (i = begin; i < end; ++i) {
+        const float g = a.u[i] - a.decay*a.w[i];
+        const float mi = a.B1*a.m[i] + (1 - a.B1)*g;
+        const float vi = a.B2*a.v[i] + (1 - a.B2)*g*g;
+        const float x = a.w[i] + a.rate * (mi*a.c1) / (sqrtf(vi*a.c2) + a.eps);
+        a.m[i] = mi;
+        a.v[i] = vi;
+        a.w[i] = x;
+        a.u[i] = 0;
+        if (a.ema) a.ema[i] = a.ema_alpha*a.ema[i] + (1 - a.ema_alpha)*x;
+    }
+}
+
+// One sweep of Adam, the CPU counterpart of adam_update_gpu(): the decayed gradient updates the
+// first/second moments m and v, w takes the bias-corrected step of iteration t (t >= 1) and the
+// gradient accumulator u is cleared. ema as in sgd_update_cpu().
+void adam_update_cpu(int N, float *w, float *u, float *m, float *v, float *ema, float B1, float B2, float eps,
+    float rate, float decay, int t, float ema_alpha)
+{
+    update_sweep_args a = { 0 };
+    a.w = w;
+    a.u = u;
+    a.m = m;
+    a.v = v;
+    a.ema = ema;
+    a.B1 = B1;
+    a.B2 = B2;
+    a.eps = eps;
+    a.rate = rate;
+    a.decay = decay;
+    a.ema_alpha = ema_alpha;
+    a.c1 = 1.f / (1.f - powf(B1, t));
+    a.c2 = 1.f / (1.f - powf(B2, t));
+    parallel_for(N, UPDATE_GRAIN, adam_update_range, &a);
+}
+
 void deinter_cpu(int NX, float *X, int NY, float *Y, int B, float *OUT)
 {
     int i, j;
@@ -31,6 +31,9 @@ void scal_cpu(int N, float ALPHA, float *X, int INCX);
 void scal_add_cpu(int N, float ALPHA, float BETA, float *X, int INCX);
 void fill_cpu(int N, float ALPHA, float * X, int INCX);
 float dot_cpu(int N, float *X, int INCX, float *Y, int INCY);
+void sgd_update_cpu(int N, float *w, float *u, float *ema, float rate, float momentum, float decay, float ema_alpha);
+void adam_update_cpu(int N, float *w, float *u, float *m, float *v, float *ema, float B1, float B2, float eps,
+    float rate, float decay, int t, float ema_alpha);
 void test_gpu_blas();
 void shortcut_cpu(int batch, int w1, int h1, int c1, float *add, int w2, int h2, int c2, float *out);
 void shortcut_multilayer_cpu(int size, int src_outputs, int batch, int n, int *outputs_of_layers, float **layers_output, float *out, float *in, float *weights, int nweights, WEIGHTS_NORMALIZATION_T weights_normalization);
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifndef M_PI
 #define M_PI 3.141592
@@ -255,6 +256,68 @@ float box_ciou(box a, box b)
     return iou - ciou_term;
 }
 
+// intersection and union of the box (x, y, w, h) with the box a as in box_iou()
+static inline void box_intersection_union(box a, float x, float y, float w, float h, float *I, float *U)
+{
+    const float l = x - w / 2;
+    const float r = x + w / 2;
+    const float t = y - h / 2;
+    const float b = y + h / 2;
+    const float al = a.x - a.w / 2;
+    const float ar = a.x + a.w / 2;
+    const float at = a.y - a.h / 2;
+    const float ab = a.y + a.h / 2;
+    const float ow = (r < ar ? r : ar) - (l > al ? l : al);
+    const float oh = (b < ab ? b : ab) - (t > at ? t : at);
+    *I = (ow < 0 || oh < 0) ? 0 : ow*oh;
+    *U = w*h + a.w*a.h - *I;
+}
+
+// iou[i] = box_iou_kind(b[i], a, iou_kind) for the n boxes b[i] = (x[i], y[i], w[i], h[i]), e.g. all
+// predictions of a yolo layer against one truth. The same formulas as above but without branches
+// in the IoU loop, so that it vectorizes. Equal to box_iou_kind() within float rounding: with -Ofast
+// the vectorized I / U uses a reciprocal estimate and can differ from it in the last bit.
+void box_iou_kind_soa(box a, const float *x, const float *y, const float *w, const float *h, int n, IOU_LOSS iou_kind, float *iou)
+{
+    int i;
+    for (i = 0; i < n; ++i) {
+        float I, U;
+        box_intersection_union(a, x[i], y[i], w[i], h[i], &I, &U);
+        iou[i] = (I == 0 || U == 0) ? 0 : I / U;
+    }
+    if (iou_kind != GIOU && iou_kind != DIOU && iou_kind != CIOU) return;
+
+    const float ar_gt = a.w / a.h;
+    for (i = 0; i < n; ++i) {
+        box b = { x[i], y[i], w[i], h[i] };
+        boxabs ba = box_c(b, a);
+        const float cw = ba.right - ba.left;
+        const float ch = ba.bot - ba.top;
+        if (iou_kind == GIOU) {
+            const float c = cw*ch;
+            if (c == 0) continue;
+            float I, U;
+            box_intersection_union(a, b.x, b.y, b.w, b.h, &I, &U);
+            iou[i] = iou[i] - (c - U) / c;
+            continue;
+        }
+        const float c = cw*cw + ch*ch;
+        if (c == 0) continue;
+        const float d = (b.x - a.x) * (b.x - a.x) + (b.y - a.y) * (b.y - a.y);
+        if (iou_kind == DIOU) {
+            const float diou_term = pow(d / c, 0.6);
+            iou[i] = iou[i] - diou_term;
+        }
+        else {
+            const float ar_pred = b.w / b.h;
+            const float ar_loss = 4 / (M_PI * M_PI) * (atan(ar_gt) - atan(ar_pred)) * (atan(ar_gt) - atan(ar_pred));
+            const float alpha = ar_loss / (1 - iou[i] + ar_loss + 0.000001);
+            const float ciou_term = d / c + alpha * ar_loss;
+            iou[i] = iou[i] - ciou_term;
+        }
+    }
+}
+
 dxrep dx_box_iou(box pred, box truth, IOU_LOSS iou_loss) {
  boxabs pred_tblr = to_tblr(pred);
     float pred_t = fmin(pred_tblr.top, pred_tblr.bot);
@@ -773,7 +836,7 @@ int nms_comparator_v3(const void *pa, const void *pb)
     return 0;
 }
 
-void do_nms_obj(detection *dets, int total, int classes, float thresh)
+void do_nms_obj_legacy(detection *dets, int total, int classes, float thresh)
 {
     int i, j, k;
     k = total - 1;
@@ -809,7 +872,7 @@ void do_nms_obj(detection *dets, int total, int classes, float thresh)
     }
 }
 
-void do_nms_sort(detection *dets, int total, int classes, float thresh)
+void do_nms_sort_legacy(detection *dets, int total, int classes, float thresh)
 {
     int i, j, k;
     k = total - 1;
@@ -865,7 +928,7 @@ void do_nms(box *boxes, float **probs, int total, int classes, float thresh)
 
 // https://github.com/Zzh-tju/DIoU-darknet
 // https://arxiv.org/abs/1911.08287
-void diounms_sort(detection *dets, int total, int classes, float thresh, NMS_KIND nms_kind, float beta1)
+void diounms_sort_legacy(detection *dets, int total, int classes, float thresh, NMS_KIND nms_kind, float beta1)
 {
     int i, j, k;
     k = total - 1;
@@ -929,6 +992,296 @@ void diounms_sort(detection *dets, int total, int classes, float thresh, NMS_KIN
     }
 }
 
+// Class-aware NMS engine.
+// Candidates of each class (objectness != 0, prob > 0) are gathered once into compact
+// struct-of-arrays buffers and only those are sorted, instead of qsort()-ing the whole detection
+// array once per class. Suppression is the same greedy pass as the *_legacy functions above:
+// small classes use a branch-free IoU sweep over the SoA arrays, large ones (low thresholds)
+// only visit boxes that overlap in x, found through an x-sorted order. Boxes that do not overlap
+// have IoU (and DIoU) <= 0, so for thresh >= 0 they can never suppress each other.
+
+#define NMS_SWEEP_MIN 128   // classes with more candidates use the sorted-x sweep
+
+typedef struct nms_rank {
+    float score;
+    int det;
+} nms_rank;
+
+static int nms_rank_comparator(const void *pa, const void *pb)
+{
+    const nms_rank *a = (const nms_rank *)pa;
+    const nms_rank *b = (const nms_rank *)pb;
+    if (a->score > b->score) return -1;
+    if (a->score < b->score) return 1;
+    return a->det - b->det;   // ties keep detection order, so results are deterministic
+}
+
+typedef struct nms_soa {
+    int n;
+    nms_rank *rank;             // candidates sorted by decreasing score
+    float *x0, *y0, *x1, *y1, *area;
+    float *score;
+    unsigned char *dead;
+    nms_rank *xorder;           // (x0, rank) sorted by x0, for the sweep
+} nms_soa;
+
+static nms_soa make_nms_soa(int n)
+{
+    nms_soa s;
+    s.n = 0;
+    s.rank = (nms_rank*)xcalloc(n, sizeof(nms_rank));
+    s.x0 = (float*)xcalloc(6 * (size_t)n, sizeof(float));
+    s.y0 = s.x0 + n;
+    s.x1 = s.y0 + n;
+    s.y1 = s.x1 + n;
+    s.area = s.y1 + n;
+    s.score = s.area + n;
+    s.dead = (unsigned char*)xcalloc(n, sizeof(unsigned char));
+    s.xorder = (nms_rank*)xcalloc(n, sizeof(nms_rank));
+    return s;
+}
+
+static void free_nms_soa(nms_soa s)
+{
+    free(s.rank);
+    free(s.x0);
+    free(s.dead);
+    free(s.xorder);
+}
+
+// Sorts the s.n gathered candidates by score and fills the box arrays in rank order.
+static void sort_nms_soa(nms_soa *s, detection *dets)
+{
+    int i;
+    qsort(s->rank, s->n, sizeof(nms_rank), nms_rank_comparator);
+    for (i = 0; i < s->n; ++i) {
+        box b = dets[s->rank[i].det].bbox;
+        s->x0[i] = b.x - b.w / 2;
+        s->x1[i] = b.x + b.w / 2;
+        s->y0[i] = b.y - b.h / 2;
+        s->y1[i] = b.y + b.h / 2;
+        s->area[i] = b.w * b.h;
+        s->score[i] = s->rank[i].score;
+        s->dead[i] = 0;
+    }
+}
+
+static inline float nms_iou(const nms_soa *s, int i, int j)
+{
+    const float iw = fminf(s->x1[i], s->x1[j]) - fmaxf(s->x0[i], s->x0[j]);
+    const float ih = fminf(s->y1[i], s->y1[j]) - fmaxf(s->y0[i], s->y0[j]);
+    const float inter = (iw > 0 && ih > 0) ? iw * ih : 0;
+    const float uni = s->area[i] + s->area[j] - inter;
+    return (uni > 0) ? inter / uni : 0;
+}
+
+// IoU passed the threshold; DIoU variants subtract a distance penalty and have to pass it again
+static int nms_suppresses(detection *dets, const nms_soa *s, int i, int j, float thresh, NMS_KIND nms_kind, float beta1)
+{
+    if (nms_kind == GREEDY_NMS) return box_diou(dets[s->rank[i].det].bbox, dets[s->rank[j].det].bbox) > thresh;
+    if (nms_kind == DIOU_NMS) return box_diounms(dets[s->rank[i].det].bbox, dets[s->rank[j].det].bbox, beta1) > thresh;
+    return 1;
+}
+
+// Greedy suppression over the ranked candidates of one class; marks s->dead.
+static void nms_greedy(detection *dets, nms_soa *s, float thresh, NMS_KIND nms_kind, float beta1, float *iou)
+{
+    const int n = s->n;
+    int i, j;
+    if (n < NMS_SWEEP_MIN) {
+        for (i = 0; i < n; ++i) {
+            if (s->dead[i]) continue;
+            const float x0 = s->x0[i], y0 = s->y0[i], x1 = s->x1[i], y1 = s->y1[i], area = s->area[i];
+            // branch-free, vectorizable IoU of box i against every lower-ranked box
+            for (j = i + 1; j < n; ++j) {
+                const float iw = fmaxf(0, fminf(x1, s->x1[j]) - fmaxf(x0, s->x0[j]));
+                const float ih = fmaxf(0, fminf(y1, s->y1[j]) - fmaxf(y0, s->y0[j]));
+                const float inter = iw * ih;
+                const float uni = area + s->area[j] - inter;
+                iou[j] = inter / (uni > 0 ? uni : 1);
+            }
+            for (j = i + 1; j < n; ++j) {
+                if (iou[j] > thresh && !s->dead[j] && nms_suppresses(dets, s, i, j, thresh, nms_kind, beta1)) s->dead[j] = 1;
+            }
+        }
+        return;
+    }
+
+    float maxw = 0;
+    for (i = 0; i < n; ++i) {
+        s->xorder[i].score = -s->x0[i];   // nms_rank_comparator sorts by decreasing score
+        s->xorder[i].det = i;
+        maxw = fmaxf(maxw, s->x1[i] - s->x0[i]);
+    }
+    qsort(s->xorder, n, sizeof(nms_rank), nms_rank_comparator);
+    float *xs = iou;   // x0 in x order, for the binary search
+    for (i = 0; i < n; ++i) xs[i] = -s->xorder[i].score;
+
+    for (i = 0; i < n; ++i) {
+        if (s->dead[i]) continue;
+        // boxes overlapping box i in x start within (x0 - maxw, x1)
+        const float from = s->x0[i] - maxw;
+        int lo = 0, hi = n;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (xs[mid] <= from) lo = mid + 1;
+            else hi = mid;
+        }
+        for (j = lo; j < n && xs[j] < s->x1[i]; ++j) {
+            const int r = s->xorder[j].det;
+            if (r <= i || s->dead[r]) continue;
+            if (nms_iou(s, i, r) > thresh && nms_suppresses(dets, s, i, r, thresh, nms_kind, beta1)) s->dead[r] = 1;
+        }
+    }
+}
+
+// Gathers candidates and runs the greedy pass per class (or once on objectness if by_objectness),
+// then zeroes the prob (or objectness and all probs) of every suppressed detection.
+static void nms_engine(detection *dets, int total, int classes, float thresh, NMS_KIND nms_kind, float beta1, int by_objectness)
+{
+    int i, k, r;
+    if (total <= 0) return;
+    if (by_objectness) {
+        nms_soa s = make_nms_soa(total);
+        float *iou = (float*)xcalloc(total, sizeof(float));
+        for (i = 0; i < total; ++i) {
+            if (dets[i].objectness == 0) continue;
+            s.rank[s.n].score = dets[i].objectness;
+            s.rank[s.n].det = i;
+            ++s.n;
+        }
+        sort_nms_soa(&s, dets);
+        nms_greedy(dets, &s, thresh, nms_kind, beta1, iou);
+        for (r = 0; r < s.n; ++r) {
+            if (!s.dead[r]) continue;
+            detection *d = &dets[s.rank[r].det];
+            d->objectness = 0;
+            for (k = 0; k < classes; ++k) d->prob[k] = 0;
+        }
+        free(iou);
+        free_nms_soa(s);
+        return;
+    }
+
+    // candidates of class k are cand[start[k]] .. cand[start[k + 1] - 1]
+    int *start = (int*)xcalloc(classes + 1, sizeof(int));
+    for (i = 0; i < total; ++i) {
+        if (dets[i].objectness == 0) continue;
+        const float *prob = dets[i].prob;
+        for (k = 0; k < classes; ++k) start[k + 1] += prob[k] > 0;
+    }
+    int max_n = 0;
+    for (k = 0; k < classes; ++k) {
+        max_n = max_val_cmp(max_n, start[k + 1]);
+        start[k + 1] += start[k];
+    }
+    if (max_n < 2) {
+        free(start);
+        return;
+    }
+    int *cand = (int*)xcalloc(start[classes], sizeof(int));
+    int *fill = (int*)xcalloc(classes, sizeof(int));
+    memcpy(fill, start, classes * sizeof(int));
+    for (i = 0; i < total; ++i) {
+        if (dets[i].objectness == 0) continue;
+        const float *prob = dets[i].prob;
+        for (k = 0; k < classes; ++k) if (prob[k] > 0) cand[fill[k]++] = i;
+    }
+
+    nms_soa s = make_nms_soa(max_n);
+    float *iou = (float*)xcalloc(max_n, sizeof(float));
+    for (k = 0; k < classes; ++k) {
+        s.n = start[k + 1] - start[k];
+        if (s.n < 2) continue;
+        for (i = 0; i < s.n; ++i) {
+            const int d = cand[start[k] + i];
+            s.rank[i].score = dets[d].prob[k];
+            s.rank[i].det = d;
+        }
+        sort_nms_soa(&s, dets);
+        nms_greedy(dets, &s, thresh, nms_kind, beta1, iou);
+        for (r = 0; r < s.n; ++r) {
+            if (s.dead[r]) dets[s.rank[r].det].prob[k] = 0;
+        }
+    }
+    free(iou);
+    free_nms_soa(s);
+    free(cand);
+    free(fill);
+    free(start);
+}
+
+void do_nms_sort(detection *dets, int total, int classes, float thresh)
+{
+    if (thresh < 0) do_nms_sort_legacy(dets, total, classes, thresh);   // the overlap pruning needs thresh >= 0
+    else nms_engine(dets, total, classes, thresh, DEFAULT_NMS, 0, 0);
+}
+
+void do_nms_obj(detection *dets, int total, int classes, float thresh)
+{
+    if (thresh < 0) do_nms_obj_legacy(dets, total, classes, thresh);
+    else nms_engine(dets, total, classes, thresh, DEFAULT_NMS, 0, 1);
+}
+
+// https://github.com/Zzh-tju/DIoU-darknet
+// https://arxiv.org/abs/1911.08287
+void diounms_sort(detection *dets, int total, int classes, float thresh, NMS_KIND nms_kind, float beta1)
+{
+    if (thresh < 0) diounms_sort_legacy(dets, total, classes, thresh, nms_kind, beta1);
+    else nms_engine(dets, total, classes, thresh, nms_kind, beta1, 0);
+}
+
+// Gaussian soft-NMS (https://arxiv.org/abs/1704.04503): instead of being removed, every box is decayed
+// by exp(-iou^2 / sigma) for each higher-scored box of its class; prob drops to 0 below score_thresh.
+void soft_nms_sort(detection *dets, int total, int classes, float sigma, float score_thresh)
+{
+    int i, j, k;
+    if (total <= 0) return;
+    nms_soa s = make_nms_soa(total);
+    float *iou = (float*)xcalloc(total, sizeof(float));
+    for (k = 0; k < classes; ++k) {
+        s.n = 0;
+        for (i = 0; i < total; ++i) {
+            if (dets[i].objectness == 0 || dets[i].prob[k] <= 0) continue;
+            s.rank[s.n].score = dets[i].prob[k];
+            s.rank[s.n].det = i;
+            ++s.n;
+        }
+        if (s.n == 0) continue;
+        sort_nms_soa(&s, dets);
+        int n = s.n;
+        for (i = 0; i < n; ++i) {
+            // decayed scores are no longer sorted: bring the best remaining box to position i
+            int best = i;
+            for (j = i + 1; j < n; ++j) if (s.score[j] > s.score[best]) best = j;
+            if (best != i) {
+                nms_rank tr = s.rank[i]; s.rank[i] = s.rank[best]; s.rank[best] = tr;
+                float t;
+                t = s.x0[i]; s.x0[i] = s.x0[best]; s.x0[best] = t;
+                t = s.y0[i]; s.y0[i] = s.y0[best]; s.y0[best] = t;
+                t = s.x1[i]; s.x1[i] = s.x1[best]; s.x1[best] = t;
+                t = s.y1[i]; s.y1[i] = s.y1[best]; s.y1[best] = t;
+                t = s.area[i]; s.area[i] = s.area[best]; s.area[best] = t;
+                t = s.score[i]; s.score[i] = s.score[best]; s.score[best] = t;
+            }
+            const float x0 = s.x0[i], y0 = s.y0[i], x1 = s.x1[i], y1 = s.y1[i], area = s.area[i];
+            for (j = i + 1; j < n; ++j) {
+                const float iw = fmaxf(0, fminf(x1, s.x1[j]) - fmaxf(x0, s.x0[j]));
+                const float ih = fmaxf(0, fminf(y1, s.y1[j]) - fmaxf(y0, s.y0[j]));
+                const float inter = iw * ih;
+                const float uni = area + s.area[j] - inter;
+                iou[j] = inter / (uni > 0 ? uni : 1);
+                s.score[j] *= expf(-iou[j] * iou[j] / sigma);
+            }
+        }
+        for (i = 0; i < n; ++i) {
+            dets[s.rank[i].det].prob[k] = (s.score[i] >= score_thresh) ? s.score[i] : 0;
+        }
+    }
+    free(iou);
+    free_nms_soa(s);
+}
+
 box encode_box(box b, box anchor)
 {
     box encode;
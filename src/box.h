@@ -39,6 +39,7 @@ dxrep dx_box_iou(box a, box b, IOU_LOSS iou_loss);
 float box_giou(box a, box b);
 float box_diou(box a, box b);
 float box_ciou(box a, box b);
+void box_iou_kind_soa(box a, const float *x, const float *y, const float *w, const float *h, int n, IOU_LOSS iou_kind, float *iou);
 dbox diou(box a, box b);
 boxabs to_tblr(box a);
 void do_nms(box *boxes, float **probs, int total, int classes, float thresh);
@@ -46,6 +47,11 @@ void do_nms_sort_v2(box *boxes, float **probs, int total, int classes, float thr
 //LIB_API void do_nms_sort(detection *dets, int total, int classes, float thresh);
 //LIB_API void do_nms_obj(detection *dets, int total, int classes, float thresh);
 //LIB_API void diounms_sort(detection *dets, int total, int classes, float thresh, NMS_KIND nms_kind, float beta1);
+float box_diounms(box a, box b, float beta1);
+// qsort()-per-class implementations replaced by the NMS engine, kept as reference for benchmark_nms()
+void do_nms_sort_legacy(detection *dets, int total, int classes, float thresh);
+void do_nms_obj_legacy(detection *dets, int total, int classes, float thresh);
+void diounms_sort_legacy(detection *dets, int total, int classes, float thresh, NMS_KIND nms_kind, float beta1);
 box decode_box(box b, box anchor);
 box encode_box(box b, box anchor);
 
@@ -0,0 +1,303 @@
+#include "checkpoint.h"
+#include "network.h"
+#include "parser.h"
+#include "utils.h"
+#include "version.h"
+#include "darkunistd.h"
+#ifdef GPU
+#include "dark_cuda.h"
+#include "convolutional_layer.h"
+#include "connected_layer.h"
+#include "batchnorm_layer.h"
+#include "shortcut_layer.h"
+#include "representation_layer.h"
+#include "rnn_layer.h"
+#include "crnn_layer.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+typedef enum {
+    JOB_FREE, JOB_FILLING, JOB_QUEUED, JOB_WRITING
+} checkpoint_job_state;
+
+typedef struct checkpoint_job {
+    checkpoint_job_state state;
+    unsigned int seq;       // jobs are written in the order they were queued
+    char filename[4096];
+    uint64_t seen;
+    float *data;            // staging copy of net.params[0, size)
+    size_t size;
+    size_t capacity;
+    double stall;           // seconds the training thread spent on the snapshot
+} checkpoint_job;
+
+struct checkpoint_writer {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;    // broadcast on every job state change
+    checkpoint_job *jobs;
+    int buffers;
+    unsigned int seq;
+    int exit;
+
+    int written;
+    double write_time;      // seconds spent writing on the background thread
+    double stall_time;      // seconds the training thread was blocked by checkpoints
+};
+
+static int write_checkpoint_file(checkpoint_job *job)
+{
+    char tmp[4096 + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", job->filename);
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) return 0;
+
+    int major = MAJOR_VERSION;
+    int minor = MINOR_VERSION;
+    int revision = PATCH_VERSION;
+    int ok = fwrite(&major, sizeof(int), 1, fp) == 1;
+    ok = ok && fwrite(&minor, sizeof(int), 1, fp) == 1;
+    ok = ok && fwrite(&revision, sizeof(int), 1, fp) == 1;
+    ok = ok && fwrite(&job->seen, sizeof(uint64_t), 1, fp) == 1;
+    ok = ok && fwrite(job->data, sizeof(float), job->size, fp) == job->size;
+    ok = ok && fflush(fp) == 0;
+#ifdef _WIN32
+    ok = ok && _commit(fileno(fp)) == 0;
+#else
+    ok = ok && fsync(fileno(fp)) == 0;
+#endif
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok) {
+        remove(tmp);
+        return 0;
+    }
+#ifdef _WIN32
+    remove(job->filename);  // rename() doesn't replace an existing file on Windows
+#endif
+    if (rename(tmp, job->filename) != 0) {
+        remove(tmp);
+        return 0;
+    }
+    return 1;
+}
+
+static void *checkpoint_writer_thread(void *ptr)
+{
+    checkpoint_writer *w = (checkpoint_writer*)ptr;
+    pthread_mutex_lock(&w->mutex);
+    while (1) {
+        checkpoint_job *job = NULL;
+        int i;
+        for (i = 0; i < w->buffers; ++i) {
+            if (w->jobs[i].state == JOB_QUEUED && (!job || w->jobs[i].seq < job->seq)) job = &w->jobs[i];
+        }
+        if (!job) {
+            if (w->exit) break;
+            pthread_cond_wait(&w->cond, &w->mutex);
+            continue;
+        }
+        job->state = JOB_WRITING;
+        pthread_mutex_unlock(&w->mutex);
+
+        double start = what_time_is_it_now();
+        int ok = write_checkpoint_file(job);
+        double time = what_time_is_it_now() - start;
+        if (ok) {
+            printf(" Saved %s in the background: %.1f MB in %.0f ms, training was blocked for %.0f ms \n",
+                job->filename, (double)job->size * sizeof(float) / (1024 * 1024), time * 1000, job->stall * 1000);
+        }
+        else fprintf(stderr, " Error: couldn't write the checkpoint %s \n", job->filename);
+
+        pthread_mutex_lock(&w->mutex);
+        if (ok) {
+            w->written++;
+            w->write_time += time;
+        }
+        job->state = JOB_FREE;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return 0;
+}
+
+checkpoint_writer *make_checkpoint_writer(int buffers)
+{
+    checkpoint_writer *w = (checkpoint_writer*)xcalloc(1, sizeof(checkpoint_writer));
+    if (buffers < 1) buffers = 1;
+    w->buffers = buffers;
+    w->jobs = (checkpoint_job*)xcalloc(buffers, sizeof(checkpoint_job));
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if (pthread_create(&w->thread, 0, checkpoint_writer_thread, w)) error("Thread creation failed", DARKNET_LOC);
+    return w;
+}
+
+// number of floats of net.params the checkpoint consists of, 0 if it has to be saved layer by layer
+static size_t checkpoint_span(network net)
+{
+    return network_parameter_span(net, net.n);
+}
+
+#ifdef GPU
+// copies the current parameters from the device into the host arrays, i.e. into net.params,
+// the same layers save_weights_upto() pulls while it writes them
+static void pull_checkpoint_parameters(network net)
+{
+    int i;
+    cuda_set_device(net.gpu_index);
+    for (i = 0; i < net.n; ++i) {
+        layer l = net.layers[i];
+        if (l.type == CONVOLUTIONAL && l.share_layer == NULL) pull_convolutional_layer(l);
+        else if (l.type == SHORTCUT && l.nweights > 0) pull_shortcut_layer(l);
+        else if (l.type == IMPLICIT) pull_implicit_layer(l);
+        else if (l.type == CONNECTED) pull_connected_layer(l);
+        else if (l.type == BATCHNORM) pull_batchnorm_layer(l);
+        else if (l.type == RNN) pull_rnn_layer(l);
+        else if (l.type == CRNN) pull_crnn_layer(l);
+        else if (l.type == GRU) {
+            pull_connected_layer(*(l.input_z_layer));
+            pull_connected_layer(*(l.input_r_layer));
+            pull_connected_layer(*(l.input_h_layer));
+            pull_connected_layer(*(l.state_z_layer));
+            pull_connected_layer(*(l.state_r_layer));
+            pull_connected_layer(*(l.state_h_layer));
+        }
+        else if (l.type == LSTM) {
+            pull_connected_layer(*(l.wf));
+            pull_connected_layer(*(l.wi));
+            pull_connected_layer(*(l.wg));
+            pull_connected_layer(*(l.wo));
+            pull_connected_layer(*(l.uf));
+            pull_connected_layer(*(l.ui));
+            pull_connected_layer(*(l.ug));
+            pull_connected_layer(*(l.uo));
+        }
+        else if (l.type == CONV_LSTM) {
+            if (l.peephole) {
+                pull_convolutional_layer(*(l.vf));
+                pull_convolutional_layer(*(l.vi));
+                pull_convolutional_layer(*(l.vo));
+            }
+            pull_convolutional_layer(*(l.wf));
+            if (!l.bottleneck) {
+                pull_convolutional_layer(*(l.wi));
+                pull_convolutional_layer(*(l.wg));
+                pull_convolutional_layer(*(l.wo));
+            }
+            pull_convolutional_layer(*(l.uf));
+            pull_convolutional_layer(*(l.ui));
+            pull_convolutional_layer(*(l.ug));
+            pull_convolutional_layer(*(l.uo));
+        }
+    }
+}
+#endif
+
+// save_convolutional_weights_ema() writes the EMA biases, scales and weights of the conv layers
+// (rolling statistics and all other layers as they are): put them over the copy of net.params
+static void overlay_ema(float *data, network net)
+{
+    int i;
+    for (i = 0; i < net.n; ++i) {
+        layer l = net.layers[i];
+        if (l.type != CONVOLUTIONAL || l.share_layer) continue;
+        if (l.biases_ema) memcpy(data + (l.biases - net.params), l.biases_ema, l.n * sizeof(float));
+        if (l.batch_normalize && l.scales_ema) memcpy(data + (l.scales - net.params), l.scales_ema, l.n * sizeof(float));
+        if (l.weights_ema) memcpy(data + (l.weights - net.params), l.weights_ema, l.nweights * sizeof(float));
+    }
+}
+
+void save_weights_async(checkpoint_writer *w, network net, char *filename, int save_ema)
+{
+    double start = what_time_is_it_now();
+    size_t span = checkpoint_span(net);
+    if (!span || strlen(filename) >= sizeof(w->jobs[0].filename)) {
+        wait_checkpoint_writer(w);  // keep the files in order
+        save_weights_upto(net, filename, net.n, save_ema);
+        pthread_mutex_lock(&w->mutex);
+        w->stall_time += what_time_is_it_now() - start;
+        pthread_mutex_unlock(&w->mutex);
+        return;
+    }
+
+    checkpoint_job *job = NULL;
+    int i;
+    pthread_mutex_lock(&w->mutex);
+    while (!job) {
+        for (i = 0; i < w->buffers && !job; ++i) {
+            if (w->jobs[i].state == JOB_FREE) job = &w->jobs[i];
+        }
+        if (!job) pthread_cond_wait(&w->cond, &w->mutex);
+    }
+    job->state = JOB_FILLING;
+    pthread_mutex_unlock(&w->mutex);
+
+    if (job->capacity < span) {
+        free(job->data);
+        job->data = (float*)xmalloc(span * sizeof(float));
+        job->capacity = span;
+    }
+    job->size = span;
+#ifdef GPU
+    // the current parameters are on the device: the pull is the only part that blocks training
+    if (gpu_index >= 0) pull_checkpoint_parameters(net);
+#endif
+    memcpy(job->data, net.params, span * sizeof(float));
+    if (save_ema) overlay_ema(job->data, net);
+    strcpy(job->filename, filename);
+    // as save_weights_upto(): seen follows the iteration counter
+    (*net.seen) = get_current_iteration(net) * net.batch * net.subdivisions;
+    job->seen = *net.seen;
+    job->stall = what_time_is_it_now() - start;
+    fprintf(stderr, "Saving weights to %s in the background\n", filename);
+
+    pthread_mutex_lock(&w->mutex);
+    job->seq = w->seq++;
+    job->state = JOB_QUEUED;
+    w->stall_time += job->stall;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+void wait_checkpoint_writer(checkpoint_writer *w)
+{
+    int i, busy = 1;
+    pthread_mutex_lock(&w->mutex);
+    while (busy) {
+        busy = 0;
+        for (i = 0; i < w->buffers; ++i) {
+            if (w->jobs[i].state != JOB_FREE) busy = 1;
+        }
+        if (busy) pthread_cond_wait(&w->cond, &w->mutex);
+    }
+    pthread_mutex_unlock(&w->mutex);
+}
+
+void free_checkpoint_writer(checkpoint_writer *w)
+{
+    int i;
+    if (!w) return;
+    double start = what_time_is_it_now();
+    wait_checkpoint_writer(w);
+    const double final_wait = what_time_is_it_now() - start;
+
+    pthread_mutex_lock(&w->mutex);
+    w->exit = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    pthread_join(w->thread, 0);
+
+    if (w->written) {
+        printf(" Checkpoints: %d written in the background in %.2f s, training was blocked for %.2f s (+ %.2f s at exit) \n",
+            w->written, w->write_time, w->stall_time, final_wait);
+    }
+    for (i = 0; i < w->buffers; ++i) free(w->jobs[i].data);
+    free(w->jobs);
+    pthread_mutex_destroy(&w->mutex);
+    pthread_cond_destroy(&w->cond);
+    free(w);
+}
@@ -0,0 +1,30 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "darknet.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Background weights-file writer for training: save_weights_async() copies the parameters to a
+// staging buffer and returns, a writer thread writes the file to <filename>.tmp, syncs it to disk
+// and renames it over <filename>, so an interrupted save never leaves a truncated checkpoint.
+// Up to `buffers` checkpoints can be in flight, the next save waits for a free staging buffer.
+typedef struct checkpoint_writer checkpoint_writer;
+
+checkpoint_writer *make_checkpoint_writer(int buffers);
+// Writes the same file as save_weights_upto(net, filename, net.n, save_ema). GPU training pulls the
+// parameters into the host arena first. Falls back to the synchronous save when the parameters
+// aren't in the arena (fused/removed layers).
+void save_weights_async(checkpoint_writer *w, network net, char *filename, int save_ema);
+// blocks until every queued checkpoint is on disk
+void wait_checkpoint_writer(checkpoint_writer *w);
+// waits for the queued checkpoints, prints the totals and stops the writer thread
+void free_checkpoint_writer(checkpoint_writer *w);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
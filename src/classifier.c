@@ -5,6 +5,7 @@
 #include "blas.h"
 #include "assert.h"
 #include "classifier.h"
+#include "checkpoint.h"
 #include "dark_cuda.h"
 #ifdef WIN32
 #include <time.h>
@@ -56,6 +57,9 @@ void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
         nets[i].learning_rate *= ngpus;
     }
     srand(time(0));
+#ifndef GPU
+    if (ngpus > 1 && !share_network_parameters(nets, ngpus)) error("CPU data-parallel training (-train_threads) doesn't support the layers of this network", DARKNET_LOC);
+#endif
     network net = nets[0];
 
     int imgs = net.batch * net.subdivisions * ngpus;
@@ -140,6 +144,7 @@ void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
 
     int iter_save = get_current_batch(net);
     int iter_save_last = get_current_batch(net);
+    checkpoint_writer *checkpoints = make_checkpoint_writer(2);
     int iter_topk = get_current_batch(net);
     float topk = 0;
 
@@ -165,7 +170,8 @@ void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
             loss = train_networks(nets, ngpus, train, 4);
         }
 #else
-        loss = train_network(net, train);
+        if (ngpus == 1) loss = train_network(net, train);
+        else loss = train_networks_cpu(nets, ngpus, train);
 #endif
         if(avg_loss == -1 || isnan(avg_loss) || isinf(avg_loss)) avg_loss = loss;
         avg_loss = avg_loss*.9 + loss*.1;
@@ -228,7 +234,7 @@ void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
 #endif
             char buff[256];
             sprintf(buff, "%s/%s_%d.weights", backup_directory, base, i);
-            save_weights(net, buff);
+            save_weights_async(checkpoints, net, buff, 0);
         }
 
         if (i >= (iter_save_last + 100)) {
@@ -238,7 +244,7 @@ void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
 #endif
             char buff[256];
             sprintf(buff, "%s/%s_last.weights", backup_directory, base);
-            save_weights(net, buff);
+            save_weights_async(checkpoints, net, buff, 0);
         }
         free_data(train);
     }
@@ -247,7 +253,8 @@ void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
 #endif
     char buff[256];
     sprintf(buff, "%s/%s_final.weights", backup_directory, base);
-    save_weights(net, buff);
+    save_weights_async(checkpoints, net, buff, 0);
+    free_checkpoint_writer(checkpoints);
 
 #ifdef OPENCV
     release_mat(&img);
@@ -258,6 +265,9 @@ void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
     free_data(buffer);
 
     //free_network(net);
+#ifndef GPU
+    if (ngpus > 1) unshare_network_parameters(nets, ngpus);
+#endif
     for (i = 0; i < ngpus; ++i) free_network(nets[i]);
     free(nets);
 
@@ -606,6 +616,7 @@ float validate_classifier_single(char *datacfg, char *filename, char *weightfile
         }
         //set_batch_network(&net, 1);
         fuse_conv_batchnorm(net);
+        optimize_network_graph(&net);
         calculate_binary_weights(net);
     }
     srand(time(0));
@@ -833,6 +844,7 @@ void predict_classifier(char *datacfg, char *cfgfile, char *weightfile, char *fi
     srand(2222222);
 
     fuse_conv_batchnorm(net);
+    optimize_network_graph(&net);
     calculate_binary_weights(net);
 
     list *options = read_data_cfg(datacfg);
@@ -1254,6 +1266,7 @@ void demo_classifier(char *datacfg, char *cfgfile, char *weightfile, int cam_ind
     list *options = read_data_cfg(datacfg);
 
     fuse_conv_batchnorm(net);
+    optimize_network_graph(&net);
     calculate_binary_weights(net);
 
     srand(2222222);
@@ -1381,6 +1394,14 @@ void run_classifier(int argc, char **argv)
         gpus = &gpu;
         ngpus = 1;
     }
+#ifndef GPU
+    // CPU builds: train this many replicas of the network in parallel, one part of the data each
+    int train_threads = find_int_arg(argc, argv, "-train_threads", 1);
+    if (train_threads > 1 && !gpu_list) {
+        ngpus = train_threads;
+        gpus = (int*)xcalloc(ngpus, sizeof(int));
+    }
+#endif
 
     int dont_show = find_arg(argc, argv, "-dont_show");
     int benchmark = find_arg(argc, argv, "-benchmark");
@@ -1413,5 +1434,5 @@ void run_classifier(int argc, char **argv)
     else if(0==strcmp(argv[2], "validcrop")) validate_classifier_crop(data, cfg, weights);
     else if(0==strcmp(argv[2], "validfull")) validate_classifier_full(data, cfg, weights);
 
-    if (gpus && gpu_list && ngpus > 1) free(gpus);
+    if (gpus && ngpus > 1) free(gpus);
 }
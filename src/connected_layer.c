@@ -159,17 +159,13 @@ connected_layer make_connected_layer(int batch, int steps, int inputs, int outpu
 
 void update_connected_layer(connected_layer l, int batch, float learning_rate, float momentum, float decay)
 {
-    axpy_cpu(l.outputs, learning_rate/batch, l.bias_updates, 1, l.biases, 1);
-    scal_cpu(l.outputs, momentum, l.bias_updates, 1);
+    sgd_update_cpu(l.outputs, l.biases, l.bias_updates, NULL, learning_rate/batch, momentum, 0, 0);
 
     if(l.batch_normalize){
-        axpy_cpu(l.outputs, learning_rate/batch, l.scale_updates, 1, l.scales, 1);
-        scal_cpu(l.outputs, momentum, l.scale_updates, 1);
+        sgd_update_cpu(l.outputs, l.scales, l.scale_updates, NULL, learning_rate/batch, momentum, 0, 0);
     }
 
-    axpy_cpu(l.inputs*l.outputs, -decay*batch, l.weights, 1, l.weight_updates, 1);
-    axpy_cpu(l.inputs*l.outputs, learning_rate/batch, l.weight_updates, 1, l.weights, 1);
-    scal_cpu(l.inputs*l.outputs, momentum, l.weight_updates, 1);
+    sgd_update_cpu(l.inputs*l.outputs, l.weights, l.weight_updates, NULL, learning_rate/batch, momentum, decay*batch, 0);
 }
 
 void forward_connected_layer(connected_layer l, network_state state)
@@ -207,6 +203,38 @@ void forward_connected_layer(connected_layer l, network_state state)
     activate_array(l.output, l.outputs*l.batch, l.activation);
 }
 
+// Stacks the weights of n connected layers that read the same input (same inputs/outputs, no batch
+// normalization) into one [n*outputs x inputs] matrix for forward_connected_layers_packed().
+// The copy has to be packed again whenever the weights of the layers change.
+void pack_connected_weights(layer **ls, int n, float *packed)
+{
+    int j;
+    const size_t size = (size_t)ls[0]->outputs * ls[0]->inputs;
+    for (j = 0; j < n; ++j) memcpy(packed + j*size, ls[j]->weights, size * sizeof(float));
+}
+
+// forward_connected_layer() of the n layers packed by pack_connected_weights() with a single GEMM:
+// scratch (batch x n*outputs) takes the stacked products, which are split into the layer outputs
+void forward_connected_layers_packed(layer **ls, int n, float *packed, float *scratch, network_state state)
+{
+    int i, j, o;
+    const int m = ls[0]->batch;
+    const int k = ls[0]->inputs;
+    const int outputs = ls[0]->outputs;
+    const int stacked = n * outputs;
+    fill_cpu(m*stacked, 0, scratch, 1);
+    gemm(0,1,m,stacked,k,1,state.input,k,packed,k,1,scratch,stacked);
+    for (j = 0; j < n; ++j) {
+        layer l = *ls[j];
+        for (i = 0; i < m; ++i) {
+            const float *src = scratch + i*stacked + j*outputs;
+            float *out = l.output + i*outputs;
+            for (o = 0; o < outputs; ++o) out[o] = src[o] + l.biases[o];
+        }
+        activate_array(l.output, outputs*m, l.activation);
+    }
+}
+
 void backward_connected_layer(connected_layer l, network_state state)
 {
     int i;
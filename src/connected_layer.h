@@ -17,6 +17,8 @@ void forward_connected_layer(connected_layer layer, network_state state);
 void backward_connected_layer(connected_layer layer, network_state state);
 void update_connected_layer(connected_layer layer, int batch, float learning_rate, float momentum, float decay);
 void denormalize_connected_layer(layer l);
+void pack_connected_weights(layer **ls, int n, float *packed);
+void forward_connected_layers_packed(layer **ls, int n, float *packed, float *scratch, network_state state);
 void statistics_connected_layer(layer l);
 
 #ifdef GPU
@@ -179,6 +179,15 @@ layer make_conv_lstm_layer(int batch, int h, int w, int c, int output_filters, i
     l.dc_cpu =          (float*)xcalloc(batch*outputs, sizeof(float));
     l.dh_cpu =          (float*)xcalloc(batch*outputs, sizeof(float));
 
+    // the hidden-to-gate convolutions wf/wi/wg/wo read the same h: their weights are also kept stacked
+    // for one [4*filters x size*size*filters] GEMM per image (not with batch normalization, which
+    // works per sublayer, nor with XNOR, groups or the bottleneck, whose convolutions differ)
+    if (!batch_normalize && !xnor && groups == 1 && !bottleneck) {
+        l.packed_state_weights = (float*)xcalloc(4 * l.wf->nweights, sizeof(float));
+        l.packed_state_output = (float*)xcalloc(4 * l.wf->outputs, sizeof(float));
+        pack_conv_lstm_weights(l);
+    }
+
     /*
     {
         int k;
@@ -447,6 +456,14 @@ void update_conv_lstm_layer(layer l, int batch, float learning_rate, float momen
     update_convolutional_layer(*(l.ui), batch, learning_rate, momentum, decay);
     update_convolutional_layer(*(l.ug), batch, learning_rate, momentum, decay);
     update_convolutional_layer(*(l.uo), batch, learning_rate, momentum, decay);
+    pack_conv_lstm_weights(l);
+}
+
+void pack_conv_lstm_weights(layer l)
+{
+    if (!l.packed_state_weights) return;
+    layer *w[4] = { l.wf, l.wi, l.wg, l.wo };
+    pack_convolutional_weights(w, 4, l.packed_state_weights);
 }
 
 void resize_conv_lstm_layer(layer *l, int w, int h)
@@ -518,6 +535,7 @@ void resize_conv_lstm_layer(layer *l, int w, int h)
     l->dc_cpu = (float*)xrealloc(l->dc_cpu, batch*outputs * sizeof(float));
     l->dh_cpu = (float*)xrealloc(l->dh_cpu, batch*outputs * sizeof(float));
     l->stored_c_cpu = (float*)xrealloc(l->stored_c_cpu, batch*outputs * sizeof(float));
+    if (l->packed_state_output) l->packed_state_output = (float*)xrealloc(l->packed_state_output, 4 * outputs * sizeof(float));
     l->stored_h_cpu = (float*)xrealloc(l->stored_h_cpu, batch*outputs * sizeof(float));
 
 #ifdef GPU
@@ -636,6 +654,42 @@ void restore_state_conv_lstm(layer l)
 #endif  // GPU
 }
 
+// f = logistic(wf + uf + vf), i = logistic(wi + ui + vi), g = tanh(wg + ug), c = f*c + i*g
+// in one pass, vf/vi are NULL without peephole. The gate activations aren't stored:
+// backward_conv_lstm_layer() recomputes them from the sublayer outputs.
+static void conv_lstm_cell_cpu(int n, float *wf, float *uf, float *vf, float *wi, float *ui, float *vi,
+    float *wg, float *ug, float *c)
+{
+    int j;
+    #pragma omp parallel for
+    for (j = 0; j < n; ++j) {
+        const float f = logistic_activate(vf ? wf[j] + uf[j] + vf[j] : wf[j] + uf[j]);
+        const float in = logistic_activate(vi ? wi[j] + ui[j] + vi[j] : wi[j] + ui[j]);
+        const float g = tanh_activate(wg[j] + ug[j]);
+        const float temp = in*g;
+        c[j] = c[j] * f + temp;
+    }
+}
+
+// o = logistic(wo + uo + vo(c_new)), h = o * tanh(c), then constrain/fix c and h and store them
+// for the timestep, vo is NULL without peephole
+static void conv_lstm_output_cpu(int n, float *wo, float *uo, float *vo, float state_constrain,
+    float *c, float *h, float *cell, float *output)
+{
+    int j;
+    #pragma omp parallel for
+    for (j = 0; j < n; ++j) {
+        const float o = logistic_activate(vo ? wo[j] + uo[j] + vo[j] : wo[j] + uo[j]);
+        float cj = c[j];
+        float hj = tanh_activate(cj) * o;
+        if (state_constrain) cj = fminf(state_constrain, fmaxf(-state_constrain, cj));
+        if (isnan(cj) || isinf(cj)) cj = 1.0f / j;  // as fix_nan_and_inf_cpu()
+        if (isnan(hj) || isinf(hj)) hj = 1.0f / j;
+        c[j] = cell[j] = cj;
+        h[j] = output[j] = hj;
+    }
+}
+
 void forward_conv_lstm_layer(layer l, network_state state)
 {
     network_state s = { 0 };
@@ -656,6 +710,7 @@ void forward_conv_lstm_layer(layer l, network_state state)
     layer ui = *(l.ui);
     layer ug = *(l.ug);
     layer uo = *(l.uo);
+    layer *w[4] = { &wf, &wi, &wg, &wo };
 
     if (state.train) {
         if (l.peephole) {
@@ -677,6 +732,24 @@ void forward_conv_lstm_layer(layer l, network_state state)
         fill_cpu(l.outputs * l.batch * l.steps, 0, l.delta, 1);
     }
 
+    // the input convolutions don't depend on the recurrence: run them over all timesteps at once,
+    // unless batch normalization collects per-step training statistics (or XNOR binarizes the input
+    // into a buffer of a single step)
+    const int batched = !(state.train && uf.batch_normalize) && !uf.xnor;
+    if (batched) {
+        assert(l.inputs == uf.w * uf.h * uf.c);
+        s.input = state.input;
+        uf.batch *= l.steps;
+        ui.batch *= l.steps;
+        ug.batch *= l.steps;
+        uo.batch *= l.steps;
+        forward_convolutional_layer(uf, s);
+        forward_convolutional_layer(ui, s);
+        forward_convolutional_layer(ug, s);
+        forward_convolutional_layer(uo, s);
+        uf.batch = ui.batch = ug.batch = uo.batch = l.batch;
+    }
+
     for (i = 0; i < l.steps; ++i)
     {
         if (l.peephole) {
@@ -691,65 +764,36 @@ void forward_conv_lstm_layer(layer l, network_state state)
         assert(wf.c == l.out_c && wi.c == l.out_c && wg.c == l.out_c && wo.c == l.out_c);
 
         s.input = l.h_cpu;
-        forward_convolutional_layer(wf, s);
-        forward_convolutional_layer(wi, s);
-        forward_convolutional_layer(wg, s);
-        forward_convolutional_layer(wo, s);
+        if (l.packed_state_weights) forward_convolutional_layers_packed(w, 4, l.packed_state_weights, l.packed_state_output, s);
+        else {
+            forward_convolutional_layer(wf, s);
+            forward_convolutional_layer(wi, s);
+            forward_convolutional_layer(wg, s);
+            forward_convolutional_layer(wo, s);
+        }
 
         assert(l.inputs == uf.w * uf.h * uf.c);
         assert(uf.c == l.c && ui.c == l.c && ug.c == l.c && uo.c == l.c);
 
-        s.input = state.input;
-        forward_convolutional_layer(uf, s);
-        forward_convolutional_layer(ui, s);
-        forward_convolutional_layer(ug, s);
-        forward_convolutional_layer(uo, s);
-
-        // f = wf + uf + vf
-        copy_cpu(l.outputs*l.batch, wf.output, 1, l.f_cpu, 1);
-        axpy_cpu(l.outputs*l.batch, 1, uf.output, 1, l.f_cpu, 1);
-        if (l.peephole) axpy_cpu(l.outputs*l.batch, 1, vf.output, 1, l.f_cpu, 1);
-
-        // i = wi + ui + vi
-        copy_cpu(l.outputs*l.batch, wi.output, 1, l.i_cpu, 1);
-        axpy_cpu(l.outputs*l.batch, 1, ui.output, 1, l.i_cpu, 1);
-        if (l.peephole) axpy_cpu(l.outputs*l.batch, 1, vi.output, 1, l.i_cpu, 1);
-
-        // g = wg + ug
-        copy_cpu(l.outputs*l.batch, wg.output, 1, l.g_cpu, 1);
-        axpy_cpu(l.outputs*l.batch, 1, ug.output, 1, l.g_cpu, 1);
-
-        activate_array(l.f_cpu, l.outputs*l.batch, LOGISTIC);
-        activate_array(l.i_cpu, l.outputs*l.batch, LOGISTIC);
-        activate_array(l.g_cpu, l.outputs*l.batch, TANH);
+        if (!batched) {
+            s.input = state.input;
+            forward_convolutional_layer(uf, s);
+            forward_convolutional_layer(ui, s);
+            forward_convolutional_layer(ug, s);
+            forward_convolutional_layer(uo, s);
+        }
 
         // c = f*c + i*g
-        copy_cpu(l.outputs*l.batch, l.i_cpu, 1, l.temp_cpu, 1);
-        mul_cpu(l.outputs*l.batch, l.g_cpu, 1, l.temp_cpu, 1);
-        mul_cpu(l.outputs*l.batch, l.f_cpu, 1, l.c_cpu, 1);
-        axpy_cpu(l.outputs*l.batch, 1, l.temp_cpu, 1, l.c_cpu, 1);
+        conv_lstm_cell_cpu(l.outputs*l.batch, wf.output, uf.output, l.peephole ? vf.output : NULL,
+            wi.output, ui.output, l.peephole ? vi.output : NULL, wg.output, ug.output, l.c_cpu);
 
-        // o = wo + uo + vo(c_new)
+        // o = wo + uo + vo(c_new), h = o * tanh(c)
         if (l.peephole) {
             s.input = l.c_cpu;
             forward_convolutional_layer(vo, s);
         }
-        copy_cpu(l.outputs*l.batch, wo.output, 1, l.o_cpu, 1);
-        axpy_cpu(l.outputs*l.batch, 1, uo.output, 1, l.o_cpu, 1);
-        if (l.peephole) axpy_cpu(l.outputs*l.batch, 1, vo.output, 1, l.o_cpu, 1);
-        activate_array(l.o_cpu, l.outputs*l.batch, LOGISTIC);
-
-        // h = o * tanh(c)
-        copy_cpu(l.outputs*l.batch, l.c_cpu, 1, l.h_cpu, 1);
-        activate_array(l.h_cpu, l.outputs*l.batch, TANH);
-        mul_cpu(l.outputs*l.batch, l.o_cpu, 1, l.h_cpu, 1);
-
-        if (l.state_constrain) constrain_cpu(l.outputs*l.batch, l.state_constrain, l.c_cpu);
-        fix_nan_and_inf_cpu(l.c_cpu, l.outputs*l.batch);
-        fix_nan_and_inf_cpu(l.h_cpu, l.outputs*l.batch);
-
-        copy_cpu(l.outputs*l.batch, l.c_cpu, 1, l.cell_cpu, 1);
-        copy_cpu(l.outputs*l.batch, l.h_cpu, 1, l.output, 1);
+        conv_lstm_output_cpu(l.outputs*l.batch, wo.output, uo.output, l.peephole ? vo.output : NULL,
+            l.state_constrain, l.c_cpu, l.h_cpu, l.cell_cpu, l.output);
 
         state.input += l.inputs*l.batch;
         l.output    += l.outputs*l.batch;
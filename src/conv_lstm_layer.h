@@ -19,6 +19,7 @@ void restore_state_conv_lstm(layer l);
 void forward_conv_lstm_layer(layer l, network_state state);
 void backward_conv_lstm_layer(layer l, network_state state);
 void update_conv_lstm_layer(layer l, int batch, float learning_rate, float momentum, float decay);
+void pack_conv_lstm_weights(layer l);
 
 layer make_history_layer(int batch, int h, int w, int c, int history_size, int steps, int train);
 void forward_history_layer(layer l, network_state state);
@@ -143,6 +143,9 @@ size_t get_workspace_size32(layer l){
         if (workspace_size < re_packed_input_size) workspace_size = re_packed_input_size;
         return workspace_size;
     }
+    // forward_convolutional_groups() unfolds all the groups at once, except for the depthwise convolutions
+    // that run the direct kernel (the same condition as there)
+    if (l.groups > 1 && !(l.groups == l.c && l.n % l.c == 0)) return (size_t)l.out_h*l.out_w*l.size*l.size*l.c*sizeof(float);
     return (size_t)l.out_h*l.out_w*l.size*l.size*(l.c / l.groups)*sizeof(float);
 }
 
@@ -481,6 +484,10 @@ void cudnn_convolutional_setup(layer *l, int cudnn_preference, size_t workspace_
 void free_convolutional_batchnorm(convolutional_layer *l)
 {
     if (!l->share_layer) {
+        if (l->param_arena) {   // views into the network parameter arena
+            l->scales = l->scale_updates = l->scales_ema = l->rolling_mean = l->rolling_variance = NULL;
+            l->scale_m = l->scale_v = NULL;
+        }
         if (l->scales)          free(l->scales),            l->scales = NULL;
         if (l->scale_updates)   free(l->scale_updates),     l->scale_updates = NULL;
         if (l->mean)            free(l->mean),              l->mean = NULL;
@@ -1209,6 +1216,67 @@ size_t binary_transpose_align_input(int k, int n, float *b, char **t_bit_input,
 }
 
 
+// add_bias() and activate_array_cpu_custom() over the output of one image in a single pass, which also
+// packs the signs of the activated outputs for the next XNOR layer as repack_input_bin() does
+static void add_bias_activate_repack_bin(float *output, float *biases, int n, int size, ACTIVATION a, uint32_t *re_packed_bin)
+{
+    int chan;
+    #pragma omp parallel for
+    for (chan = 0; chan < n; chan += 32) {
+        uint32_t *dst = re_packed_bin + (chan / 32)*size;
+        int i, c_pack;
+        for (i = 0; i < size; ++i) dst[i] = 0;
+        for (c_pack = 0; c_pack < 32; ++c_pack) {
+            float *out = output + (chan + c_pack)*size;
+            const float bias = biases[chan + c_pack];
+            for (i = 0; i < size; ++i) {
+                float x = out[i] + bias;
+                if (a == LEAKY) x = (x > 0) ? x : .1*x;
+                else if (a != LINEAR) x = activate(x, a);
+                out[i] = x;
+                dst[i] |= (uint32_t)(x > 0) << c_pack;
+            }
+        }
+    }
+}
+
+// groups > 1 (never XNOR): the depthwise convolutions (groups == c, n a multiple of c) run the direct
+// kernel, the other grouped ones unfold the whole input once and run the GEMMs of all the groups as one batch
+static void forward_convolutional_groups(convolutional_layer l, network_state state, int out_h, int out_w)
+{
+    const int m = l.n / l.groups;
+    const int k = l.size*l.size*l.c / l.groups;
+    const int n = out_h*out_w;
+    int i;
+    for (i = 0; i < l.batch; ++i) {
+        float *im = state.input + (size_t)i*l.c*l.h*l.w;
+        float *c = l.output + (size_t)i*l.n*n;
+        if (l.groups == l.c && l.n % l.c == 0) {
+            convolution_depthwise(l.w, l.h, l.c, l.n, l.size, l.stride_x, l.stride_y,
+                l.pad * l.dilation, l.dilation, out_w, out_h, l.weights, im, c);
+            continue;
+        }
+        float *b = im;
+        if (!(l.size == 1 && l.stride == 1 && l.dilation == 1)) {
+            b = state.workspace;
+            im2col_cpu_ext(im, l.c, l.h, l.w, l.size, l.size, l.pad * l.dilation, l.pad * l.dilation,
+                l.stride_y, l.stride_x, l.dilation, l.dilation, b);
+        }
+        gemm_groups(l.groups, m, n, k, 1, l.weights, k, l.nweights / l.groups, b, n, (size_t)k*n, 1, c, n, (size_t)m*n);
+    }
+}
+
+static void activate_convolutional_output(convolutional_layer l)
+{
+    if (l.activation == SWISH) activate_array_swish(l.output, l.outputs*l.batch, l.activation_input, l.output);
+    else if (l.activation == MISH) activate_array_mish(l.output, l.outputs*l.batch, l.activation_input, l.output);
+    else if (l.activation == HARD_MISH) activate_array_hard_mish(l.output, l.outputs*l.batch, l.activation_input, l.output);
+    else if (l.activation == NORM_CHAN) activate_array_normalize_channels(l.output, l.outputs*l.batch, l.batch, l.out_c, l.out_w*l.out_h, l.output);
+    else if (l.activation == NORM_CHAN_SOFTMAX) activate_array_normalize_channels_softmax(l.output, l.outputs*l.batch, l.batch, l.out_c, l.out_w*l.out_h, l.output, 0);
+    else if (l.activation == NORM_CHAN_SOFTMAX_MAXVAL) activate_array_normalize_channels_softmax(l.output, l.outputs*l.batch, l.batch, l.out_c, l.out_w*l.out_h, l.output, 1);
+    else activate_array_cpu_custom(l.output, l.outputs*l.batch, l.activation);
+}
+
 void forward_convolutional_layer(convolutional_layer l, network_state state)
 {
     int out_h = convolutional_out_height(l);
@@ -1234,7 +1302,10 @@ void forward_convolutional_layer(convolutional_layer l, network_state state)
     static int u = 0;
     u++;
 
-    for(i = 0; i < l.batch; ++i)
+    if (l.groups > 1) {
+        forward_convolutional_groups(l, state, out_h, out_w);
+    }
+    else for(i = 0; i < l.batch; ++i)
     {
         for (j = 0; j < l.groups; ++j)
         {
@@ -1246,8 +1317,6 @@ void forward_convolutional_layer(convolutional_layer l, network_state state)
             //gemm_nn_custom(m, n, k, 1, a, k, b, n, c, n);
             if (l.xnor && l.align_bit_weights && !state.train && l.stride_x == l.stride_y)
             {
-                memset(b, 0, l.bit_align*l.size*l.size*l.c * sizeof(float));
-
                 if (l.c % 32 == 0)
                 {
                     //printf(" l.index = %d - new XNOR \n", l.index);
@@ -1257,21 +1326,14 @@ void forward_convolutional_layer(convolutional_layer l, network_state state)
                     //size_t t_intput_size = new_ldb * l.bit_align;// n;
                     //size_t t_bit_input_size = t_intput_size / 8;// +1;
 
-                    int re_packed_input_size = l.c * l.w * l.h;
-                    memset(state.workspace, 0, re_packed_input_size * sizeof(float));
-
                     const size_t new_c = l.c / 32;
-                    size_t in_re_packed_input_size = new_c * l.w * l.h + 1;
-                    memset(l.bin_re_packed_input, 0, in_re_packed_input_size * sizeof(uint32_t));
 
                     //float *re_packed_input = calloc(l.c * l.w * l.h, sizeof(float));
                     //uint32_t *bin_re_packed_input = calloc(new_c * l.w * l.h + 1, sizeof(uint32_t));
 
-                    // float32x4 by channel (as in cuDNN)
-                    repack_input(state.input, state.workspace, l.w, l.h, l.c);
-
-                    // 32 x floats -> 1 x uint32_t
-                    float_to_bit(state.workspace, (unsigned char *)l.bin_re_packed_input, l.c * l.w * l.h);
+                    // 32 x floats by channel -> 1 x uint32_t (as in cuDNN),
+                    // unless the previous XNOR layer has already packed its output here
+                    if (!l.bin_input_packed) repack_input_bin(state.input, l.bin_re_packed_input, l.w, l.h, l.c);
 
                     //free(re_packed_input);
 
@@ -1317,6 +1379,10 @@ void forward_convolutional_layer(convolutional_layer l, network_state state)
                     //--------------------------------------------------------
                     //printf(" l.index = %d - old XNOR \n", l.index);
 
+                    // im2col_cpu_custom_bin() only sets the bits of the positive inputs,
+                    // transpose_bin() reads them by 32 x 32 blocks
+                    memset(b, 0, (size_t)l.bit_align*((k + 31) / 32 * 32) / 8);
+
                     //im2col_cpu_custom_align(state.input, l.c, l.h, l.w, l.size, l.stride, l.pad, b, l.bit_align);
                     im2col_cpu_custom_bin(state.input, l.c, l.h, l.w, l.size, l.stride, l.pad, state.workspace, l.bit_align);
 
@@ -1354,6 +1420,11 @@ void forward_convolutional_layer(convolutional_layer l, network_state state)
 
                 }
 
+                if (l.bin_re_packed_output) {
+                    add_bias_activate_repack_bin(l.output, l.biases, l.n, out_h*out_w, l.activation, l.bin_re_packed_output);
+                    return;
+                }
+
                 add_bias(l.output, l.biases, l.batch, l.n, out_h*out_w);
 
                 //activate_array(l.output, m*n*l.batch, l.activation);
@@ -1403,13 +1474,7 @@ void forward_convolutional_layer(convolutional_layer l, network_state state)
     }
 
     //activate_array(l.output, m*n*l.batch, l.activation);
-    if (l.activation == SWISH) activate_array_swish(l.output, l.outputs*l.batch, l.activation_input, l.output);
-    else if (l.activation == MISH) activate_array_mish(l.output, l.outputs*l.batch, l.activation_input, l.output);
-    else if (l.activation == HARD_MISH) activate_array_hard_mish(l.output, l.outputs*l.batch, l.activation_input, l.output);
-    else if (l.activation == NORM_CHAN) activate_array_normalize_channels(l.output, l.outputs*l.batch, l.batch, l.out_c, l.out_w*l.out_h, l.output);
-    else if (l.activation == NORM_CHAN_SOFTMAX) activate_array_normalize_channels_softmax(l.output, l.outputs*l.batch, l.batch, l.out_c, l.out_w*l.out_h, l.output, 0);
-    else if (l.activation == NORM_CHAN_SOFTMAX_MAXVAL) activate_array_normalize_channels_softmax(l.output, l.outputs*l.batch, l.batch, l.out_c, l.out_w*l.out_h, l.output, 1);
-    else activate_array_cpu_custom(l.output, l.outputs*l.batch, l.activation);
+    activate_convolutional_output(l);
 
     if(l.binary || l.xnor) swap_binary(&l);
 
@@ -1430,6 +1495,44 @@ void forward_convolutional_layer(convolutional_layer l, network_state state)
     }
 }
 
+// Stacks the weights of n convolutional layers that read the same input (same geometry, groups = 1,
+// no batch normalization or XNOR) into one [n*l.n x size*size*c] matrix for
+// forward_convolutional_layers_packed(). The copy has to be packed again whenever the weights change.
+void pack_convolutional_weights(layer **ls, int n, float *packed)
+{
+    int j;
+    for (j = 0; j < n; ++j) memcpy(packed + (size_t)j*ls[0]->nweights, ls[j]->weights, ls[j]->nweights * sizeof(float));
+}
+
+// forward_convolutional_layer() of the n layers packed by pack_convolutional_weights(): the input of
+// an image is unfolded once and one GEMM fills scratch ([n*l.n x out_h*out_w]), whose row blocks are
+// the outputs of the layers
+void forward_convolutional_layers_packed(layer **ls, int n, float *packed, float *scratch, network_state state)
+{
+    int i, j;
+    const convolutional_layer l = *ls[0];
+    const int m = n*l.n;
+    const int k = l.size*l.size*l.c;
+    const int out_hw = l.out_h*l.out_w;
+    for (i = 0; i < l.batch; ++i) {
+        float *b = state.input + (size_t)i*l.c*l.h*l.w;
+        if (!(l.size == 1 && l.stride == 1 && l.dilation == 1)) {
+            im2col_cpu_ext(b, l.c, l.h, l.w, l.size, l.size, l.pad * l.dilation, l.pad * l.dilation,
+                l.stride_y, l.stride_x, l.dilation, l.dilation, state.workspace);
+            b = state.workspace;
+        }
+        fill_cpu(m*out_hw, 0, scratch, 1);
+        gemm(0, 0, m, out_hw, k, 1, packed, k, b, out_hw, 1, scratch, out_hw);
+        for (j = 0; j < n; ++j) {
+            memcpy(ls[j]->output + (size_t)i*l.n*out_hw, scratch + (size_t)j*l.n*out_hw, (size_t)l.n*out_hw*sizeof(float));
+        }
+    }
+    for (j = 0; j < n; ++j) {
+        add_bias(ls[j]->output, ls[j]->biases, l.batch, l.n, out_hw);
+        activate_convolutional_output(*ls[j]);
+    }
+}
+
 void assisted_excitation_forward(convolutional_layer l, network_state state)
 {
     const int iteration_num = (*state.net.seen) / (state.net.batch*state.net.subdivisions);
@@ -1606,21 +1709,34 @@ void backward_convolutional_layer(convolutional_layer l, network_state state)
 
 void update_convolutional_layer(convolutional_layer l, int batch, float learning_rate_init, float momentum, float decay)
 {
-    float learning_rate = learning_rate_init*l.learning_rate_scale;
-    //float momentum = a.momentum;
-    //float decay = a.decay;
-    //int batch = a.batch;
-
-    axpy_cpu(l.nweights, -decay*batch, l.weights, 1, l.weight_updates, 1);
-    axpy_cpu(l.nweights, learning_rate / batch, l.weight_updates, 1, l.weights, 1);
-    scal_cpu(l.nweights, momentum, l.weight_updates, 1);
+    update_convolutional_layer_ema(l, batch, learning_rate_init, momentum, decay, -1);
+}
 
-    axpy_cpu(l.n, learning_rate / batch, l.bias_updates, 1, l.biases, 1);
-    scal_cpu(l.n, momentum, l.bias_updates, 1);
+// ema_alpha >= 0 also blends the updated weights, biases and scales into their EMA copies in the same pass
+void update_convolutional_layer_ema(convolutional_layer l, int batch, float learning_rate_init, float momentum, float decay, float ema_alpha)
+{
+    float learning_rate = learning_rate_init*l.learning_rate_scale;
+    const int ema = ema_alpha >= 0;
+
+    if (l.adam) {
+        adam_update_cpu(l.nweights, l.weights, l.weight_updates, l.m, l.v, ema ? l.weights_ema : NULL,
+            l.B1, l.B2, l.eps, learning_rate, decay*batch, l.t, ema_alpha);
+        adam_update_cpu(l.n, l.biases, l.bias_updates, l.bias_m, l.bias_v, ema ? l.biases_ema : NULL,
+            l.B1, l.B2, l.eps, learning_rate, decay*batch, l.t, ema_alpha);
+        if (l.scales) {
+            adam_update_cpu(l.n, l.scales, l.scale_updates, l.scale_m, l.scale_v, ema ? l.scales_ema : NULL,
+                l.B1, l.B2, l.eps, learning_rate, decay*batch, l.t, ema_alpha);
+        }
+        return;
+    }
 
+    sgd_update_cpu(l.nweights, l.weights, l.weight_updates, ema ? l.weights_ema : NULL,
+        learning_rate / batch, momentum, decay*batch, ema_alpha);
+    sgd_update_cpu(l.n, l.biases, l.bias_updates, ema ? l.biases_ema : NULL,
+        learning_rate / batch, momentum, 0, ema_alpha);
     if (l.scales) {
-        axpy_cpu(l.n, learning_rate / batch, l.scale_updates, 1, l.scales, 1);
-        scal_cpu(l.n, momentum, l.scale_updates, 1);
+        sgd_update_cpu(l.n, l.scales, l.scale_updates, ema ? l.scales_ema : NULL,
+            learning_rate / batch, momentum, 0, ema_alpha);
     }
 }
 
@@ -36,7 +36,10 @@ void denormalize_convolutional_layer(convolutional_layer l);
 void set_specified_workspace_limit(convolutional_layer *l, size_t workspace_size_limit);
 void resize_convolutional_layer(convolutional_layer *layer, int w, int h);
 void forward_convolutional_layer(const convolutional_layer layer, network_state state);
+void pack_convolutional_weights(layer **ls, int n, float *packed);
+void forward_convolutional_layers_packed(layer **ls, int n, float *packed, float *scratch, network_state state);
 void update_convolutional_layer(convolutional_layer layer, int batch, float learning_rate, float momentum, float decay);
+void update_convolutional_layer_ema(convolutional_layer layer, int batch, float learning_rate, float momentum, float decay, float ema_alpha);
 image *visualize_convolutional_layer(convolutional_layer layer, char *window, image *prev_weights);
 void binarize_weights(float *weights, int n, int size, float *binary);
 void swap_binary(convolutional_layer *l);
@@ -31,6 +31,8 @@ extern void run_cifar(int argc, char **argv);
 extern void run_go(int argc, char **argv);
 extern void run_art(int argc, char **argv);
 extern void run_super(int argc, char **argv);
+extern void run_benchmark(int argc, char **argv);
+extern void run_fxcheck(int argc, char **argv);
 
 void average(int argc, char *argv[])
 {
@@ -479,6 +481,12 @@ int main(int argc, char **argv)
 
 #endif  // GPU
 
+    // -pool_threads N: size of the CPU thread pool (and of the OpenMP teams), -pin_threads: bind them to CPUs,
+    // without them the pool is sized from DARKNET_THREADS or the CPUs when it is first used
+    int pool_threads = find_int_arg(argc, argv, "-pool_threads", 0);
+    int pin_threads = find_arg(argc, argv, "-pin_threads");
+    if (pool_threads > 0 || pin_threads) init_thread_pool(pool_threads, pin_threads);
+
     show_opencv_info();
 
     if (0 == strcmp(argv[1], "average")){
@@ -542,6 +550,10 @@ int main(int argc, char **argv)
         rescale_net(argv[2], argv[3], argv[4]);
     } else if (0 == strcmp(argv[1], "ops")){
         operations(argv[2]);
+    } else if (0 == strcmp(argv[1], "benchmark")){
+        run_benchmark(argc, argv);
+    } else if (0 == strcmp(argv[1], "fxcheck")){
+        run_fxcheck(argc, argv);
     } else if (0 == strcmp(argv[1], "speed")){
         speed(argv[2], (argc > 3 && argv[3]) ? atoi(argv[3]) : 0);
     } else if (0 == strcmp(argv[1], "oneoff")){
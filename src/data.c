@@ -4,6 +4,7 @@
 #include "dark_cuda.h"
 #include "box.h"
 #include "http_stream.h"
+#include "thread_pool.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -1048,6 +1049,7 @@ void blend_truth_mosaic(float *new_truth, int boxes, int truth_size, float *old_
 #ifdef OPENCV
 
 #include "http_stream.h"
+#include "thread_pool.h"
 
 data load_data_detection(int n, char **paths, int m, int w, int h, int c, int boxes, int truth_size, int classes, int use_flip, int use_gaussian_noise, int use_blur, int use_mixup,
     float jitter, float resize, float hue, float saturation, float exposure, int mini_batch, int track, int augment_speed, int letter_box, int mosaic_bound, int contrastive, int contrastive_jit_flip, int contrastive_color, int show_imgs)
@@ -1324,7 +1326,7 @@ data load_data_detection(int n, char **paths, int m, int w, int h, int c, int bo
             }
 
 
-            if (show_imgs && i_mixup == use_mixup)   // delete i_mixup
+            if (show_imgs && i_mixup == use_mixup)
             {
                 image tmp_ai = copy_image(ai);
                 char buff[1000];
@@ -1372,54 +1374,97 @@ void blend_images(image new_img, float alpha, image old_img, float beta)
         new_img.data[i] = new_img.data[i] * alpha + old_img.data[i] * beta;
 }
 
-data load_data_detection(int n, char **paths, int m, int w, int h, int c, int boxes, int truth_size, int classes, int use_flip, int gaussian_noise, int use_blur, int use_mixup,
+// CPU counterpart of image_data_augmentation() from image_opencv.cpp:
+// crop + resize + flip in one resampling pass, fused HSV jitter, then optional blur
+static image image_data_augmentation_cpu(image orig, int w, int h,
+    int pleft, int ptop, int swidth, int sheight, int flip,
+    float dhue, float dsat, float dexp,
+    int blur, int num_boxes, int truth_size, float *truth)
+{
+    image sized = crop_resize_image(orig, pleft, ptop, swidth, sheight, w, h, flip);
+
+    if (dsat != 1 || dexp != 1 || dhue != 0) distort_image(sized, dhue, dsat, dexp);
+
+    if (blur) {
+        int ksize = (blur == 1) ? 17 : (blur / 2) * 2 + 1;
+        image dst = blur_image(sized, ksize);
+        if (blur == 1) {
+            // blur only the background, keep the objects sharp
+            int t, k, y;
+            for (t = 0; t < num_boxes; ++t) {
+                box b = float_to_box_stride(truth + t*truth_size, 1);
+                if (!b.x) break;
+                int left = max_val_cmp(0, (b.x - b.w / 2.)*w);
+                int top = max_val_cmp(0, (b.y - b.h / 2.)*h);
+                int right = min_val_cmp(w, left + b.w*w);
+                int bot = min_val_cmp(h, top + b.h*h);
+                if (right <= left) continue;
+                for (k = 0; k < sized.c; ++k) {
+                    for (y = top; y < bot; ++y) {
+                        int j = k*w*h + y*w + left;
+                        memcpy(&dst.data[j], &sized.data[j], (right - left) * sizeof(float));
+                    }
+                }
+            }
+        }
+        free_image(sized);
+        sized = dst;
+    }
+    return sized;
+}
+
+data load_data_detection(int n, char **paths, int m, int w, int h, int c, int boxes, int truth_size, int classes, int use_flip, int use_gaussian_noise, int use_blur, int use_mixup,
     float jitter, float resize, float hue, float saturation, float exposure, int mini_batch, int track, int augment_speed, int letter_box, int mosaic_bound, int contrastive, int contrastive_jit_flip, int contrastive_color, int show_imgs)
 {
     const int random_index = random_gen();
     c = c ? c : 3;
-    char **random_paths;
-    char **mixup_random_paths = NULL;
-    if(track) random_paths = get_sequential_paths(paths, n, m, mini_batch, augment_speed, contrastive);
-    else random_paths = get_random_paths_custom(paths, n, m, contrastive);
 
-    //assert(use_mixup < 2);
-    if (use_mixup == 2) {
-        printf("\n cutmix=1 - isn't supported for Detector \n");
-        exit(0);
-    }
-    if (use_mixup == 3 || use_mixup == 4) {
-        printf("\n mosaic=1 - compile Darknet with OpenCV for using mosaic=1 \n");
-        exit(0);
+    if (use_mixup == 2) error("cutmix=1 - isn't supported for Detector (use cutmix=1 only for Classifier)", DARKNET_LOC);
+    if (use_mixup == 4) {
+        printf("\n cutmix=1 - isn't supported for Detector (use cutmix=1 only for Classifier) \n");
+        if (check_mistakes) getchar();
+        use_mixup = 3;
     }
-    int mixup = use_mixup ? random_gen() % 2 : 0;
-    //printf("\n mixup = %d \n", mixup);
-    if (mixup) {
-        if (track) mixup_random_paths = get_sequential_paths(paths, n, m, mini_batch, augment_speed, contrastive);
-        else mixup_random_paths = get_random_paths(paths, n, m);
+    if (random_gen() % 2 == 0) use_mixup = 0;
+    int i;
+
+    int *cut_x = NULL, *cut_y = NULL;
+    if (use_mixup == 3) {
+        cut_x = (int*)calloc(n, sizeof(int));
+        cut_y = (int*)calloc(n, sizeof(int));
+        const float min_offset = 0.2; // 20%
+        for (i = 0; i < n; ++i) {
+            cut_x[i] = rand_int(w*min_offset, w*(1 - min_offset));
+            cut_y[i] = rand_int(h*min_offset, h*(1 - min_offset));
+        }
     }
 
-    int i;
-    data d = { 0 };
+    data d = {0};
     d.shallow = 0;
 
     d.X.rows = n;
     d.X.vals = (float**)xcalloc(d.X.rows, sizeof(float*));
     d.X.cols = h*w*c;
 
-    float r1 = 0, r2 = 0, r3 = 0, r4 = 0, r_scale;
+    float r1 = 0, r2 = 0, r3 = 0, r4 = 0, r_scale = 0;
     float resize_r1 = 0, resize_r2 = 0;
-    float dhue = 0, dsat = 0, dexp = 0, flip = 0;
+    float dhue = 0, dsat = 0, dexp = 0, flip = 0, blur = 0;
     int augmentation_calculated = 0;
 
-    d.y = make_matrix(n, truth_size * boxes);
+    d.y = make_matrix(n, truth_size*boxes);
     int i_mixup = 0;
-    for (i_mixup = 0; i_mixup <= mixup; i_mixup++) {
-        if (i_mixup) augmentation_calculated = 0;
+    for (i_mixup = 0; i_mixup <= use_mixup; i_mixup++) {
+        if (i_mixup) augmentation_calculated = 0;   // recalculate augmentation for the 2nd sequence if(track==1)
+
+        char **random_paths;
+        if (track) random_paths = get_sequential_paths(paths, n, m, mini_batch, augment_speed, contrastive);
+        else random_paths = get_random_paths_custom(paths, n, m, contrastive);
+
         for (i = 0; i < n; ++i) {
             float *truth = (float*)xcalloc(truth_size * boxes, sizeof(float));
-            char *filename = (i_mixup) ? mixup_random_paths[i] : random_paths[i];
+            const char *filename = random_paths[i];
 
-            image orig = load_image(filename, 0, 0, c);
+            image orig = load_image((char*)filename, 0, 0, c);
 
             int oh = orig.h;
             int ow = orig.w;
@@ -1429,12 +1474,12 @@ data load_data_detection(int n, char **paths, int m, int w, int h, int c, int bo
 
             float resize_down = resize, resize_up = resize;
             if (resize_down > 1.0) resize_down = 1 / resize_down;
-            int min_rdw = ow*(1 - (1 / resize_down)) / 2;
-            int min_rdh = oh*(1 - (1 / resize_down)) / 2;
+            int min_rdw = ow*(1 - (1 / resize_down)) / 2;   // < 0
+            int min_rdh = oh*(1 - (1 / resize_down)) / 2;   // < 0
 
             if (resize_up < 1.0) resize_up = 1 / resize_up;
-            int max_rdw = ow*(1 - (1 / resize_up)) / 2;
-            int max_rdh = oh*(1 - (1 / resize_up)) / 2;
+            int max_rdw = ow*(1 - (1 / resize_up)) / 2;     // > 0
+            int max_rdh = oh*(1 - (1 / resize_up)) / 2;     // > 0
 
             if (!augmentation_calculated || !track)
             {
@@ -1460,6 +1505,14 @@ data load_data_detection(int n, char **paths, int m, int w, int h, int c, int bo
                     dsat = rand_scale(saturation);
                     dexp = rand_scale(exposure);
                 }
+
+                if (use_blur) {
+                    int tmp_blur = rand_int(0, 2);  // 0 - disable, 1 - blur background, 2 - blur the whole image
+                    if (tmp_blur == 0) blur = 0;
+                    else if (tmp_blur == 1) blur = 1;
+                    else blur = use_blur;
+                }
+
             }
 
             int pleft = rand_precalc_random(-dw, dw, r1);
@@ -1486,22 +1539,35 @@ data load_data_detection(int n, char **paths, int m, int w, int h, int c, int bo
                 float img_ar = (float)ow / (float)oh;
                 float net_ar = (float)w / (float)h;
                 float result_ar = img_ar / net_ar;
-                //printf(" ow = %d, oh = %d, w = %d, h = %d, img_ar = %f, net_ar = %f, result_ar = %f \n", ow, oh, w, h, img_ar, net_ar, result_ar);
                 if (result_ar > 1)  // sheight - should be increased
                 {
                     float oh_tmp = ow / net_ar;
-                    float delta_h = (oh_tmp - oh) / 2;
+                    float delta_h = (oh_tmp - oh)/2;
                     ptop = ptop - delta_h;
                     pbot = pbot - delta_h;
-                    //printf(" result_ar = %f, oh_tmp = %f, delta_h = %d, ptop = %f, pbot = %f \n", result_ar, oh_tmp, delta_h, ptop, pbot);
                 }
                 else  // swidth - should be increased
                 {
                     float ow_tmp = oh * net_ar;
-                    float delta_w = (ow_tmp - ow) / 2;
+                    float delta_w = (ow_tmp - ow)/2;
                     pleft = pleft - delta_w;
                     pright = pright - delta_w;
-                    //printf(" result_ar = %f, ow_tmp = %f, delta_w = %d, pleft = %f, pright = %f \n", result_ar, ow_tmp, delta_w, pleft, pright);
+                }
+            }
+
+            // move each 2nd image to the corner - so that most of it was visible
+            if (use_mixup == 3 && random_gen() % 2 == 0) {
+                if (flip) {
+                    if (i_mixup == 0) pleft += pright, pright = 0, pbot += ptop, ptop = 0;
+                    if (i_mixup == 1) pright += pleft, pleft = 0, pbot += ptop, ptop = 0;
+                    if (i_mixup == 2) pleft += pright, pright = 0, ptop += pbot, pbot = 0;
+                    if (i_mixup == 3) pright += pleft, pleft = 0, ptop += pbot, pbot = 0;
+                }
+                else {
+                    if (i_mixup == 0) pright += pleft, pleft = 0, pbot += ptop, ptop = 0;
+                    if (i_mixup == 1) pleft += pright, pright = 0, pbot += ptop, ptop = 0;
+                    if (i_mixup == 2) pright += pleft, pleft = 0, ptop += pbot, pbot = 0;
+                    if (i_mixup == 3) pleft += pright, pright = 0, ptop += pbot, pbot = 0;
                 }
             }
 
@@ -1511,64 +1577,117 @@ data load_data_detection(int n, char **paths, int m, int w, int h, int c, int bo
             float sx = (float)swidth / ow;
             float sy = (float)sheight / oh;
 
-            image cropped = crop_image(orig, pleft, ptop, swidth, sheight);
-
             float dx = ((float)pleft / ow) / sx;
             float dy = ((float)ptop / oh) / sy;
 
-            image sized = resize_image(cropped, w, h);
-            if (flip) flip_image(sized);
-            distort_image(sized, dhue, dsat, dexp);
-            //random_distort_image(sized, hue, saturation, exposure);
-
-            fill_truth_detection(filename, boxes, truth_size, truth, classes, flip, dx, dy, 1. / sx, 1. / sy, w, h);
-
-            if (i_mixup) {
-                image old_img = sized;
-                old_img.data = d.X.vals[i];
-                //show_image(sized, "new");
-                //show_image(old_img, "old");
-                //wait_until_press_key_cv();
-                blend_images(sized, 0.5, old_img, 0.5);
-                blend_truth(truth, boxes, truth_size, d.y.vals[i]);
-                free_image(old_img);
+
+            int min_w_h = fill_truth_detection(filename, boxes, truth_size, truth, classes, flip, dx, dy, 1. / sx, 1. / sy, w, h);
+
+            if ((min_w_h / 8) < blur && blur > 1) blur = min_w_h / 8;   // disable blur if one of the objects is too small
+
+            image ai = image_data_augmentation_cpu(orig, w, h, pleft, ptop, swidth, sheight, flip, dhue, dsat, dexp,
+                blur, boxes, truth_size, truth);
+
+            if (use_mixup == 0) {
+                d.X.vals[i] = ai.data;
+                memcpy(d.y.vals[i], truth, truth_size * boxes * sizeof(float));
             }
+            else if (use_mixup == 1) {
+                if (i_mixup == 0) {
+                    d.X.vals[i] = ai.data;
+                    memcpy(d.y.vals[i], truth, truth_size * boxes * sizeof(float));
+                }
+                else if (i_mixup == 1) {
+                    image old_img = make_empty_image(w, h, c);
+                    old_img.data = d.X.vals[i];
+                    blend_images(ai, 0.5, old_img, 0.5);
+                    blend_truth(d.y.vals[i], boxes, truth_size, truth);
+                    free_image(old_img);
+                    d.X.vals[i] = ai.data;
+                }
+            }
+            else if (use_mixup == 3) {
+                if (i_mixup == 0) {
+                    image tmp_img = make_image(w, h, c);
+                    d.X.vals[i] = tmp_img.data;
+                }
+
+                if (flip) {
+                    int tmp = pleft;
+                    pleft = pright;
+                    pright = tmp;
+                }
+
+                const int left_shift = min_val_cmp(cut_x[i], max_val_cmp(0, (-pleft*w / ow)));
+                const int top_shift = min_val_cmp(cut_y[i], max_val_cmp(0, (-ptop*h / oh)));
+
+                const int right_shift = min_val_cmp((w - cut_x[i]), max_val_cmp(0, (-pright*w / ow)));
+                const int bot_shift = min_val_cmp(h - cut_y[i], max_val_cmp(0, (-pbot*h / oh)));
+
+
+                int k, y;
+                for (k = 0; k < c; ++k) {
+                    for (y = 0; y < h; ++y) {
+                        int j = y*w + k*w*h;
+                        if (i_mixup == 0 && y < cut_y[i]) {
+                            int j_src = (w - cut_x[i] - right_shift) + (y + h - cut_y[i] - bot_shift)*w + k*w*h;
+                            memcpy(&d.X.vals[i][j + 0], &ai.data[j_src], cut_x[i] * sizeof(float));
+                        }
+                        if (i_mixup == 1 && y < cut_y[i]) {
+                            int j_src = left_shift + (y + h - cut_y[i] - bot_shift)*w + k*w*h;
+                            memcpy(&d.X.vals[i][j + cut_x[i]], &ai.data[j_src], (w-cut_x[i]) * sizeof(float));
+                        }
+                        if (i_mixup == 2 && y >= cut_y[i]) {
+                            int j_src = (w - cut_x[i] - right_shift) + (top_shift + y - cut_y[i])*w + k*w*h;
+                            memcpy(&d.X.vals[i][j + 0], &ai.data[j_src], cut_x[i] * sizeof(float));
+                        }
+                        if (i_mixup == 3 && y >= cut_y[i]) {
+                            int j_src = left_shift + (top_shift + y - cut_y[i])*w + k*w*h;
+                            memcpy(&d.X.vals[i][j + cut_x[i]], &ai.data[j_src], (w - cut_x[i]) * sizeof(float));
+                        }
+                    }
+                }
 
-            d.X.vals[i] = sized.data;
-            memcpy(d.y.vals[i], truth, truth_size * boxes * sizeof(float));
+                blend_truth_mosaic(d.y.vals[i], boxes, truth_size, truth, w, h, cut_x[i], cut_y[i], i_mixup, left_shift, right_shift, top_shift, bot_shift, w, h, mosaic_bound);
 
-            if (show_imgs)// && i_mixup)
+                free_image(ai);
+                ai.data = d.X.vals[i];
+            }
+
+
+            if (show_imgs && i_mixup == use_mixup)
             {
+                image tmp_ai = copy_image(ai);
                 char buff[1000];
-                sprintf(buff, "aug_%d_%d_%s_%d", random_index, i, basecfg(filename), random_gen());
-
+                sprintf(buff, "aug_%d_%d_%d", random_index, i, random_gen());
                 int t;
                 for (t = 0; t < boxes; ++t) {
                     box b = float_to_box_stride(d.y.vals[i] + t*truth_size, 1);
                     if (!b.x) break;
-                    int left = (b.x - b.w / 2.)*sized.w;
-                    int right = (b.x + b.w / 2.)*sized.w;
-                    int top = (b.y - b.h / 2.)*sized.h;
-                    int bot = (b.y + b.h / 2.)*sized.h;
-                    draw_box_width(sized, left, top, right, bot, 1, 150, 100, 50); // 3 channels RGB
+                    int left = (b.x - b.w / 2.)*ai.w;
+                    int right = (b.x + b.w / 2.)*ai.w;
+                    int top = (b.y - b.h / 2.)*ai.h;
+                    int bot = (b.y + b.h / 2.)*ai.h;
+                    draw_box_width(tmp_ai, left, top, right, bot, 1, 150, 100, 50); // 3 channels RGB
                 }
 
-                save_image(sized, buff);
+                save_image(tmp_ai, buff);
                 if (show_imgs == 1) {
-                    show_image(sized, buff);
+                    show_image(tmp_ai, buff);
                     wait_until_press_key_cv();
                 }
-                printf("\nYou use flag -show_imgs, so will be saved aug_...jpg images. Press Enter: \n");
-                //getchar();
+                printf("\nYou use flag -show_imgs, so will be saved aug_...jpg images. Click on window and press ESC button \n");
+                free_image(tmp_ai);
             }
 
             free_image(orig);
-            free_image(cropped);
             free(truth);
         }
+        if (random_paths) free(random_paths);
     }
-    free(random_paths);
-    if (mixup_random_paths) free(mixup_random_paths);
+    if (cut_x) free(cut_x);
+    if (cut_y) free(cut_y);
+
     return d;
 }
 #endif    // OPENCV
@@ -1621,40 +1740,12 @@ pthread_t load_data_in_thread(load_args args)
     return thread;
 }
 
-static const int thread_wait_ms = 5;
-static volatile int flag_exit;
-static volatile int * run_load_data = NULL;
-static load_args * args_swap = NULL;
-static pthread_t* threads = NULL;
-
-pthread_mutex_t mtx_load_data = PTHREAD_MUTEX_INITIALIZER;
-
-void *run_thread_loop(void *ptr)
+static void load_data_task(void *ptr)
 {
-    const int i = *(int *)ptr;
-
-    while (!custom_atomic_load_int(&flag_exit)) {
-        while (!custom_atomic_load_int(&run_load_data[i])) {
-            if (custom_atomic_load_int(&flag_exit)) {
-                free(ptr);
-                return 0;
-            }
-            this_thread_sleep_for(thread_wait_ms);
-        }
-
-        pthread_mutex_lock(&mtx_load_data);
-        load_args *args_local = (load_args *)xcalloc(1, sizeof(load_args));
-        *args_local = args_swap[i];
-        pthread_mutex_unlock(&mtx_load_data);
-
-        load_thread(args_local);
-
-        custom_atomic_store_int(&run_load_data[i], 0);
-    }
-    free(ptr);
-    return 0;
+    load_thread(ptr);
 }
 
+// the parts of the batch are loaded by the worker threads of the shared pool
 void *load_threads(void *ptr)
 {
     //srand(time(0));
@@ -1665,44 +1756,15 @@ void *load_threads(void *ptr)
     int total = args.n;
     free(ptr);
     data* buffers = (data*)xcalloc(args.threads, sizeof(data));
-    if (!threads) {
-        threads = (pthread_t*)xcalloc(args.threads, sizeof(pthread_t));
-        run_load_data = (volatile int *)xcalloc(args.threads, sizeof(int));
-        args_swap = (load_args *)xcalloc(args.threads, sizeof(load_args));
-        fprintf(stderr, " Create %d permanent cpu-threads \n", args.threads);
-
-        for (i = 0; i < args.threads; ++i) {
-            int* ptr = (int*)xcalloc(1, sizeof(int));
-            *ptr = i;
-            if (pthread_create(&threads[i], 0, run_thread_loop, ptr)) error("Thread creation failed", DARKNET_LOC);
-        }
-    }
-
-    for (i = 0; i < args.threads; ++i) {
-        args.d = buffers + i;
-        args.n = (i + 1) * total / args.threads - i * total / args.threads;
-
-        pthread_mutex_lock(&mtx_load_data);
-        args_swap[i] = args;
-        pthread_mutex_unlock(&mtx_load_data);
-
-        custom_atomic_store_int(&run_load_data[i], 1);  // run thread
-    }
+    task_group group = { 0 };
     for (i = 0; i < args.threads; ++i) {
-        while (custom_atomic_load_int(&run_load_data[i])) this_thread_sleep_for(thread_wait_ms); //   join
-    }
-
-    /*
-    pthread_t* threads = (pthread_t*)xcalloc(args.threads, sizeof(pthread_t));
-    for(i = 0; i < args.threads; ++i){
-        args.d = buffers + i;
-        args.n = (i+1) * total/args.threads - i * total/args.threads;
-        threads[i] = load_data_in_thread(args);
-    }
-    for(i = 0; i < args.threads; ++i){
-        pthread_join(threads[i], 0);
+        load_args *part = (load_args *)xcalloc(1, sizeof(load_args));   // freed by load_thread()
+        *part = args;
+        part->d = buffers + i;
+        part->n = (i + 1) * total / args.threads - i * total / args.threads;
+        task_group_run(&group, load_data_task, part);
     }
-    */
+    task_group_wait(&group);
 
     *out = concat_datas(buffers, args.threads);
     out->shallow = 0;
@@ -1711,26 +1773,12 @@ void *load_threads(void *ptr)
         free_data(buffers[i]);
     }
     free(buffers);
-    //free(threads);
     return 0;
 }
 
+// the loader has no threads of its own anymore, kept for the API
 void free_load_threads(void *ptr)
 {
-    load_args args = *(load_args *)ptr;
-    if (args.threads == 0) args.threads = 1;
-    int i;
-    if (threads) {
-        custom_atomic_store_int(&flag_exit, 1);
-        for (i = 0; i < args.threads; ++i) {
-            pthread_join(threads[i], 0);
-        }
-        free((void*)run_load_data);
-        free(args_swap);
-        free(threads);
-        threads = NULL;
-        custom_atomic_store_int(&flag_exit, 0);
-    }
 }
 
 pthread_t load_data(load_args args)
@@ -18,6 +18,7 @@
 #ifdef OPENCV
 
 #include "http_stream.h"
+#include <pthread.h>
 
 static char **demo_names;
 static image **demo_alphabet;
@@ -108,9 +109,10 @@ void *detect_in_thread(void *ptr)
         demo_index = (demo_index + 1) % avg_frames;
 
         if (letter_box)
-            dets = get_network_boxes(&net, get_width_mat(in_img), get_height_mat(in_img), demo_thresh, demo_thresh, 0, 1, &nboxes, 1); // letter box
+            dets = get_network_boxes_view(&net, get_width_mat(in_img), get_height_mat(in_img), demo_thresh, demo_thresh, 0, 1, &nboxes, 1); // letter box
         else
-            dets = get_network_boxes(&net, net.w, net.h, demo_thresh, demo_thresh, 0, 1, &nboxes, 0); // resized
+            dets = get_network_boxes_view(&net, net.w, net.h, demo_thresh, demo_thresh, 0, 1, &nboxes, 0); // resized
+        // the view stays valid while the main loop draws it and the next frame is detected into the other arena slot
 
         //const float nms = .45;
         //if (nms) {
@@ -165,6 +167,7 @@ void demo(char *cfgfile, char *weightfile, float thresh, float hier_thresh, int
     if (net.letter_box) letter_box = 1;
     net.benchmark_layers = benchmark_layers;
     fuse_conv_batchnorm(net);
+    optimize_network_graph(&net);
     calculate_binary_weights(net);
     srand(2222222);
 
@@ -222,7 +225,6 @@ void demo(char *cfgfile, char *weightfile, float thresh, float hier_thresh, int
     det_s = in_s;
 
     for (j = 0; j < avg_frames / 2; ++j) {
-        free_detections(dets, nboxes);
         fetch_in_thread_sync(0); //fetch_in_thread(0);
         detect_in_thread_sync(0); //fetch_in_thread(0);
         det_img = in_img;
@@ -303,7 +305,6 @@ void demo(char *cfgfile, char *weightfile, float thresh, float hier_thresh, int
             }
 
             if (!benchmark && !dontdraw_bbox) draw_detections_cv_v3(show_img, local_dets, local_nboxes, demo_thresh, demo_names, demo_alphabet, demo_classes, demo_ext_output);
-            free_detections(local_dets, local_nboxes);
 
             printf("\nFPS:%.1f \t AVG_FPS:%.1f\n", fps, avg_fps);
 
@@ -404,7 +405,6 @@ void demo(char *cfgfile, char *weightfile, float thresh, float hier_thresh, int
 
     // free memory
     free_image(in_s);
-    free_detections(dets, nboxes);
 
     demo_index = (avg_frames + demo_index - 1) % avg_frames;
     for (j = 0; j < avg_frames; ++j) {
@@ -425,6 +425,404 @@ void demo(char *cfgfile, char *weightfile, float thresh, float hier_thresh, int
     free_network(net);
     //cudaProfilerStop();
 }
+
+// ----------------------------------------
+// Multi-source demo: one decoder thread per source, one inference thread that batches the latest
+// frames of all sources into a single forward pass of the shared network, and the main thread that
+// draws and outputs each result on its own stream. Frames (decoded image + network input) come from
+// a fixed pool, so steady-state operation does not allocate.
+
+typedef struct demo_frame {
+    mat_cv *mat;                // decoded frame, detections are drawn on it
+    image input;                // net.w x net.h x net.c network input
+    int stream;
+    int nboxes;
+    detection *dets;
+    struct demo_frame *next;
+} demo_frame;
+
+typedef struct demo_stream {
+    int id;
+    char name[256];
+    cap_cv *cap;
+    int live;                   // camera or network stream: drop stale frames instead of blocking the decoder
+    int finished;
+    demo_frame *ready;          // latest decoded frame waiting for inference
+    custom_thread_t thread;
+    struct multi_demo *md;
+
+    char window[64];
+    write_cv *writer;
+    long long frame_id;
+    int frames;                 // frames shown since the last fps report
+} demo_stream;
+
+typedef struct multi_demo {
+    network net;
+    int letter_box;
+    float thresh, hier_thresh;
+    int max_batch, max_latency_ms;
+
+    int nstreams;
+    demo_stream *streams;
+    demo_frame *frames;
+    int nframes;
+    demo_frame *free_frames;
+    demo_frame *done_head, *done_tail;
+    int inference_finished;
+    volatile int exit;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        // broadcast on every state change
+} multi_demo;
+
+// NULL once the demo exits: a live source always has frames to decode, so the decoder stops here
+static demo_frame *pop_free_frame(multi_demo *md)
+{
+    while (!md->free_frames && !md->exit) pthread_cond_wait(&md->cond, &md->mutex);
+    if (md->exit) return NULL;
+    demo_frame *f = md->free_frames;
+    if (f) md->free_frames = f->next;
+    return f;
+}
+
+static void push_free_frame(multi_demo *md, demo_frame *f)
+{
+    f->next = md->free_frames;
+    md->free_frames = f;
+}
+
+void *multi_demo_decode_thread(void *ptr)
+{
+    demo_stream *s = (demo_stream *)ptr;
+    multi_demo *md = s->md;
+    while (!md->exit) {
+        pthread_mutex_lock(&md->mutex);
+        demo_frame *f = pop_free_frame(md);
+        pthread_mutex_unlock(&md->mutex);
+        if (!f) break;
+
+        mat_cv *mat = get_capture_frame_cv(s->cap);
+        if (!mat || get_width_mat(mat) < 1 || get_height_mat(mat) < 1) {
+            if (mat) release_mat(&mat);
+            pthread_mutex_lock(&md->mutex);
+            push_free_frame(md, f);
+            s->finished = 1;
+            pthread_cond_broadcast(&md->cond);
+            pthread_mutex_unlock(&md->mutex);
+            printf(" Stream %d closed: %s \n", s->id, s->name);
+            break;
+        }
+        f->mat = mat;
+        f->stream = s->id;
+        mat_to_input_cv(mat, f->input, md->letter_box);
+
+        pthread_mutex_lock(&md->mutex);
+        if (s->live && s->ready) {
+            release_mat(&s->ready->mat);
+            push_free_frame(md, s->ready);
+            s->ready = NULL;
+        }
+        while (s->ready && !md->exit) pthread_cond_wait(&md->cond, &md->mutex);
+        if (md->exit) {
+            release_mat(&f->mat);
+            push_free_frame(md, f);
+        }
+        else s->ready = f;
+        pthread_cond_broadcast(&md->cond);
+        pthread_mutex_unlock(&md->mutex);
+    }
+    return 0;
+}
+
+static void wait_ms(multi_demo *md, int ms)
+{
+    struct timeval now;
+    struct timespec deadline;
+    gettimeofday(&now, NULL);
+    long long ns = (long long)now.tv_usec * 1000 + (long long)ms * 1000000;
+    deadline.tv_sec = now.tv_sec + (time_t)(ns / 1000000000);
+    deadline.tv_nsec = (long)(ns % 1000000000);
+    pthread_cond_timedwait(&md->cond, &md->mutex, &deadline);
+}
+
+void *multi_demo_detect_thread(void *ptr)
+{
+    multi_demo *md = (multi_demo *)ptr;
+    network *net = &md->net;
+    layer l = net->layers[net->n - 1];
+    const size_t size = (size_t)net->w * net->h * net->c;
+    float *batch_input = (float*)xcalloc(md->max_batch * size, sizeof(float));
+    demo_frame **batch = (demo_frame **)xcalloc(md->max_batch, sizeof(demo_frame *));
+    int next_stream = 0;
+    int i;
+    while (1) {
+        int n = 0;
+        pthread_mutex_lock(&md->mutex);
+        double first_ready = 0;    // when the oldest frame of this batch was seen, us
+        while (!md->exit) {
+            int ready = 0, active = 0;
+            for (i = 0; i < md->nstreams; ++i) {
+                if (md->streams[i].ready) ++ready;
+                else if (!md->streams[i].finished) ++active;
+            }
+            if (ready == 0 && active == 0) break;
+            const double now = get_time_point();
+            if (ready > 0 && first_ready == 0) first_ready = now;
+            const int waited_ms = ready > 0 ? (int)((now - first_ready) / 1000) : 0;
+            // a full batch, or every open source has a frame, or the oldest frame has waited long enough
+            if (ready >= md->max_batch || (ready > 0 && (active == 0 || waited_ms >= md->max_latency_ms))) {
+                for (i = 0; i < md->nstreams && n < md->max_batch; ++i) {
+                    demo_stream *s = &md->streams[(next_stream + i) % md->nstreams];
+                    if (!s->ready) continue;
+                    batch[n++] = s->ready;
+                    s->ready = NULL;
+                }
+                next_stream = (next_stream + 1) % md->nstreams;
+                pthread_cond_broadcast(&md->cond);
+                break;
+            }
+            if (ready > 0) wait_ms(md, md->max_latency_ms - waited_ms);
+            else pthread_cond_wait(&md->cond, &md->mutex);
+        }
+        pthread_mutex_unlock(&md->mutex);
+        if (n == 0) break;
+
+        for (i = 0; i < n; ++i) memcpy(batch_input + i*size, batch[i]->input.data, size * sizeof(float));
+        if (net->batch != n) set_batch_network(net, n);
+        network_predict(*net, batch_input);
+
+        const float nms = .45;    // 0.4F
+        for (i = 0; i < n; ++i) {
+            demo_frame *f = batch[i];
+            int w = md->letter_box ? get_width_mat(f->mat) : net->w;
+            int h = md->letter_box ? get_height_mat(f->mat) : net->h;
+            f->dets = make_network_boxes_batch(net, md->thresh, &f->nboxes, i);
+            fill_network_boxes_batch(net, w, h, md->thresh, md->hier_thresh, 0, 1, f->dets, md->letter_box, i);
+            if (l.nms_kind == DEFAULT_NMS) do_nms_sort(f->dets, f->nboxes, l.classes, nms);
+            else diounms_sort(f->dets, f->nboxes, l.classes, nms, l.nms_kind, l.beta_nms);
+        }
+
+        pthread_mutex_lock(&md->mutex);
+        for (i = 0; i < n; ++i) {
+            batch[i]->next = NULL;
+            if (md->done_tail) md->done_tail->next = batch[i];
+            else md->done_head = batch[i];
+            md->done_tail = batch[i];
+        }
+        pthread_cond_broadcast(&md->cond);
+        pthread_mutex_unlock(&md->mutex);
+    }
+    pthread_mutex_lock(&md->mutex);
+    md->inference_finished = 1;
+    pthread_cond_broadcast(&md->cond);
+    pthread_mutex_unlock(&md->mutex);
+    free(batch_input);
+    free(batch);
+    return 0;
+}
+
+// "video.mp4" -> "video_2.mp4"
+static void stream_out_filename(char *dst, size_t dst_size, const char *out_filename, int id)
+{
+    const char *dot = strrchr(out_filename, '.');
+    const char *slash = strrchr(out_filename, '/');
+    if (!dot || (slash && slash > dot)) dot = out_filename + strlen(out_filename);
+    snprintf(dst, dst_size, "%.*s_%d%s", (int)(dot - out_filename), out_filename, id, dot);
+}
+
+void demo_multi(char *cfgfile, char *weightfile, float thresh, float hier_thresh, char *sources, char **names, int classes,
+    int max_batch, int max_latency_ms, char *out_filename, int mjpeg_port, int json_port, int dont_show, int ext_output,
+    int letter_box_in, int time_limit_sec, int benchmark_layers)
+{
+    multi_demo md = { 0 };
+    int i, j;
+
+    md.nstreams = 1;
+    for (i = 0; sources[i]; ++i) if (sources[i] == ',') ++md.nstreams;
+    md.streams = (demo_stream *)xcalloc(md.nstreams, sizeof(demo_stream));
+    if (max_batch < 1) max_batch = md.nstreams;
+    md.max_batch = max_batch;
+    md.max_latency_ms = max_latency_ms;
+    md.thresh = thresh;
+    md.hier_thresh = hier_thresh;
+    md.letter_box = letter_box_in;
+
+    image **alphabet = load_alphabet();
+    md.net = parse_network_cfg_custom(cfgfile, md.max_batch, 1);    // weights are shared by all streams
+    if (weightfile) {
+        load_weights(&md.net, weightfile);
+    }
+    if (md.net.letter_box) md.letter_box = 1;
+    // only [yolo] heads have a batched decode, the others detect one frame per forward
+    for (i = 0; i < md.net.n; ++i) {
+        LAYER_TYPE type = md.net.layers[i].type;
+        if (type == GAUSSIAN_YOLO || type == REGION || type == DETECTION) md.max_batch = 1;
+    }
+    if (md.net.batch != md.max_batch) set_batch_network(&md.net, md.max_batch);
+    printf("Demo: %d sources, batch %d\n", md.nstreams, md.max_batch);
+    md.net.benchmark_layers = benchmark_layers;
+    fuse_conv_batchnorm(md.net);
+    optimize_network_graph(&md.net);
+    calculate_binary_weights(md.net);
+    layer l = md.net.layers[md.net.n - 1];
+    if (l.classes != classes) {
+        printf("\n Parameters don't match: in cfg-file classes=%d, in data-file classes=%d \n", l.classes, classes);
+        getchar();
+        exit(0);
+    }
+
+    char *src = sources;
+    for (i = 0; i < md.nstreams; ++i) {
+        demo_stream *s = &md.streams[i];
+        char *comma = strchr(src, ',');
+        size_t len = comma ? (size_t)(comma - src) : strlen(src);
+        if (len >= sizeof(s->name)) len = sizeof(s->name) - 1;
+        memcpy(s->name, src, len);
+        s->name[len] = 0;
+        src = comma ? comma + 1 : src + strlen(src);
+
+        s->id = i;
+        s->md = &md;
+        char *end;
+        long cam_index = strtol(s->name, &end, 10);
+        if (*s->name && *end == 0) {
+            printf("Stream %d: webcam index %ld\n", i, cam_index);
+            s->cap = get_capture_webcam((int)cam_index);
+            s->live = 1;
+        }
+        else {
+            printf("Stream %d: video file %s\n", i, s->name);
+            s->cap = get_capture_video_stream(s->name);
+            s->live = is_live_stream(s->name);
+        }
+        if (!s->cap) error("Couldn't connect to video source.", DARKNET_LOC);
+        sprintf(s->window, "Demo %d", i);
+        if (!dont_show) create_window_cv(s->window, 0, 640, 480);
+    }
+
+    // every stream can hold one frame in decoding and one waiting, plus a batch in flight and its outputs
+    md.nframes = 2 * md.nstreams + 2 * md.max_batch;
+    md.frames = (demo_frame *)xcalloc(md.nframes, sizeof(demo_frame));
+    for (i = 0; i < md.nframes; ++i) {
+        md.frames[i].input = make_image(md.net.w, md.net.h, md.net.c);
+        push_free_frame(&md, &md.frames[i]);
+    }
+    pthread_mutex_init(&md.mutex, NULL);
+    pthread_cond_init(&md.cond, NULL);
+
+    custom_thread_t detect_thread = NULL;
+    for (i = 0; i < md.nstreams; ++i) {
+        if (custom_create_thread(&md.streams[i].thread, 0, multi_demo_decode_thread, &md.streams[i])) error("Thread creation failed", DARKNET_LOC);
+    }
+    if (custom_create_thread(&detect_thread, 0, multi_demo_detect_thread, &md)) error("Thread creation failed", DARKNET_LOC);
+
+    const double start_time_lim = get_time_point();
+    double report_time = get_time_point();
+    while (1) {
+        pthread_mutex_lock(&md.mutex);
+        while (!md.done_head && !md.inference_finished) pthread_cond_wait(&md.cond, &md.mutex);
+        demo_frame *f = md.done_head;
+        if (f) {
+            md.done_head = f->next;
+            if (!md.done_head) md.done_tail = NULL;
+        }
+        pthread_mutex_unlock(&md.mutex);
+        if (!f) break;
+
+        demo_stream *s = &md.streams[f->stream];
+        ++s->frame_id;
+        ++s->frames;
+        if (json_port > 0) {
+            int timeout = 400000;
+            send_json(f->dets, f->nboxes, l.classes, names, s->frame_id, json_port + s->id, timeout);
+        }
+        draw_detections_cv_v3(f->mat, f->dets, f->nboxes, thresh, names, alphabet, classes, ext_output);
+        free_detections(f->dets, f->nboxes);
+        f->dets = NULL;
+
+        // if you run it with param -mjpeg_port 8090 then stream N is at http://localhost:(8090 + N)
+        if (mjpeg_port > 0) {
+            int timeout = 400000;
+            int jpeg_quality = 40;    // 1 - 100
+            send_mjpeg(f->mat, mjpeg_port + s->id, timeout, jpeg_quality);
+        }
+        if (out_filename) {
+            if (!s->writer) {
+                char buff[512];
+                stream_out_filename(buff, sizeof(buff), out_filename, s->id);
+                s->writer = create_video_writer(buff, 'D', 'I', 'V', 'X', get_stream_fps_cpp_cv(s->cap),
+                    get_width_mat(f->mat), get_height_mat(f->mat), 1);
+            }
+            write_frame_cv(s->writer, f->mat);
+        }
+        if (!dont_show) {
+            show_image_mat(f->mat, s->window);
+            int c = wait_key_cv(1);
+            if (c == 27 || c == 1048603) md.exit = 1;    // ESC - exit (OpenCV 2.x / 3.x)
+        }
+        release_mat(&f->mat);
+
+        pthread_mutex_lock(&md.mutex);
+        push_free_frame(&md, f);
+        pthread_cond_broadcast(&md.cond);
+        pthread_mutex_unlock(&md.mutex);
+
+        const double now = get_time_point();
+        if (now - report_time > 3000000) {
+            int total = 0;
+            printf("\n FPS:");
+            for (i = 0; i < md.nstreams; ++i) {
+                printf(" %d: %.1f ", i, md.streams[i].frames * 1000000. / (now - report_time));
+                total += md.streams[i].frames;
+                md.streams[i].frames = 0;
+            }
+            printf("\t total: %.1f \n", total * 1000000. / (now - report_time));
+            report_time = now;
+        }
+        if (time_limit_sec > 0 && (now - start_time_lim) / 1000000 > time_limit_sec) md.exit = 1;
+        if (md.exit) {
+            pthread_mutex_lock(&md.mutex);
+            pthread_cond_broadcast(&md.cond);
+            pthread_mutex_unlock(&md.mutex);
+        }
+    }
+    printf("input video streams closed. \n");
+
+    md.exit = 1;
+    pthread_mutex_lock(&md.mutex);
+    pthread_cond_broadcast(&md.cond);
+    pthread_mutex_unlock(&md.mutex);
+    custom_join(detect_thread, 0);
+    for (i = 0; i < md.nstreams; ++i) {
+        demo_stream *s = &md.streams[i];
+        custom_join(s->thread, 0);
+        if (s->ready) release_mat(&s->ready->mat);
+        if (s->writer) release_video_writer(&s->writer);
+        release_capture(s->cap);
+    }
+    // frames still queued for output when exiting early
+    for (demo_frame *f = md.done_head; f; f = f->next) {
+        free_detections(f->dets, f->nboxes);
+        release_mat(&f->mat);
+    }
+    for (i = 0; i < md.nframes; ++i) free_image(md.frames[i].input);
+    free(md.frames);
+    free(md.streams);
+    pthread_mutex_destroy(&md.mutex);
+    pthread_cond_destroy(&md.cond);
+
+    free_ptrs((void **)names, l.classes);
+    const int nsize = 8;
+    for (j = 0; j < nsize; ++j) {
+        for (i = 32; i < 127; ++i) {
+            free_image(alphabet[j][i]);
+        }
+        free(alphabet[j]);
+    }
+    free(alphabet);
+    free_network(md.net);
+}
 #else
 void demo(char *cfgfile, char *weightfile, float thresh, float hier_thresh, int cam_index, const char *filename, char **names, int classes, int avgframes,
     int frame_skip, char *prefix, char *out_filename, int mjpeg_port, int dontdraw_bbox, int json_port, int dont_show, int ext_output, int letter_box_in, int time_limit_sec, char *http_post_host,
@@ -432,4 +830,11 @@ void demo(char *cfgfile, char *weightfile, float thresh, float hier_thresh, int
 {
     fprintf(stderr, "Demo needs OpenCV for webcam images.\n");
 }
+
+void demo_multi(char *cfgfile, char *weightfile, float thresh, float hier_thresh, char *sources, char **names, int classes,
+    int max_batch, int max_latency_ms, char *out_filename, int mjpeg_port, int json_port, int dont_show, int ext_output,
+    int letter_box_in, int time_limit_sec, int benchmark_layers)
+{
+    fprintf(stderr, "Demo needs OpenCV for webcam images.\n");
+}
 #endif
@@ -8,6 +8,8 @@
 #include "box.h"
 #include "demo.h"
 #include "option_list.h"
+#include "profiler.h"
+#include "checkpoint.h"
 
 #ifndef __COMPAR_FN_T
 #define __COMPAR_FN_T
@@ -21,6 +23,8 @@ typedef __compar_fn_t comparison_fn_t;
 
 int check_mistakes = 0;
 
+static void free_map_truth();
+
 static int coco_ids[] = { 1,2,3,4,5,6,7,8,9,10,11,13,14,15,16,17,18,19,20,21,22,23,24,25,27,28,31,32,33,34,35,36,37,38,39,40,41,42,43,44,46,47,48,49,50,51,52,53,54,55,56,57,58,59,60,61,62,63,64,65,67,70,72,73,74,75,76,77,78,79,80,81,82,84,85,86,87,88,89,90 };
 
 void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, int ngpus, int clear, int dont_show, int calc_map, float thresh, float iou_thresh, int mjpeg_port, int show_imgs, int benchmark_layers, char* chart_path)
@@ -48,6 +52,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
 
         int k;  // free memory unnecessary arrays
         for (k = 0; k < net_map.n - 1; ++k) free_layer_custom(net_map.layers[k], 1);
+        free_network_parameter_arena(&net_map);
 
         char *name_list = option_find_str(options, "names", "data/names.list");
         int names_size = 0;
@@ -87,6 +92,9 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
         nets[k].learning_rate *= ngpus;
     }
     srand(time(0));
+#ifndef GPU
+    if (ngpus > 1 && !share_network_parameters(nets, ngpus)) error("CPU data-parallel training (-train_threads) doesn't support the layers of this network", DARKNET_LOC);
+#endif
     network net = nets[0];
 
     const int actual_batch_size = net.batch * net.subdivisions;
@@ -126,6 +134,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
     iter_map = get_current_iteration(net);
     float mean_average_precision = -1;
     float best_map = mean_average_precision;
+    checkpoint_writer *checkpoints = make_checkpoint_writer(2);
 
     load_args args = { 0 };
     args.w = net.w;
@@ -290,7 +299,8 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
             loss = train_networks(nets, ngpus, train, 4);
         }
 #else
-        loss = train_network(net, train);
+        if (ngpus == 1) loss = train_network(net, train);
+        else loss = train_networks_cpu(nets, ngpus, train);
 #endif
         if (avg_loss < 0 || avg_loss != avg_loss) avg_loss = loss;    // if(-inf or nan)
         avg_loss = avg_loss*.9 + loss*.1;
@@ -360,7 +370,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
                 printf("New best mAP!\n");
                 char buff[256];
                 sprintf(buff, "%s/%s_best.weights", backup_directory, base);
-                save_weights(net, buff);
+                save_weights_async(checkpoints, net, buff, 0);
             }
 
             draw_precision = 1;
@@ -391,7 +401,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
 #endif
             char buff[256];
             sprintf(buff, "%s/%s_%d.weights", backup_directory, base, iteration);
-            save_weights(net, buff);
+            save_weights_async(checkpoints, net, buff, 0);
         }
 
         if (iteration >= (iter_save_last + 100) || (iteration % 100 == 0 && iteration > 1)) {
@@ -401,11 +411,11 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
 #endif
             char buff[256];
             sprintf(buff, "%s/%s_last.weights", backup_directory, base);
-            save_weights(net, buff);
+            save_weights_async(checkpoints, net, buff, 0);
 
             if (net.ema_alpha && is_ema_initialized(net)) {
                 sprintf(buff, "%s/%s_ema.weights", backup_directory, base);
-                save_weights_upto(net, buff, net.n, 1);
+                save_weights_async(checkpoints, net, buff, 1);
                 printf(" EMA weights are saved to the file: %s \n", buff);
             }
         }
@@ -416,7 +426,8 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
 #endif
     char buff[256];
     sprintf(buff, "%s/%s_final.weights", backup_directory, base);
-    save_weights(net, buff);
+    save_weights_async(checkpoints, net, buff, 0);
+    free_checkpoint_writer(checkpoints);
     printf("If you want to train from the beginning, then use flag in the end of training command: -clear \n");
 
 #ifdef OPENCV
@@ -438,6 +449,9 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
     free_list_contents_kvp(options);
     free_list(options);
 
+#ifndef GPU
+    if (ngpus > 1) unshare_network_parameters(nets, ngpus);
+#endif
     for (k = 0; k < ngpus; ++k) free_network(nets[k]);
     free(nets);
     //free_network(net);
@@ -445,6 +459,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
     if (calc_map) {
         net_map.n = 0;
         free_network(net_map);
+        free_map_truth();
     }
 }
 
@@ -649,6 +664,7 @@ void validate_detector(char *datacfg, char *cfgfile, char *weightfile, char *out
     }
     //set_batch_network(&net, 1);
     fuse_conv_batchnorm(net);
+    optimize_network_graph(&net);
     calculate_binary_weights(net);
     fprintf(stderr, "Learning Rate: %g, Momentum: %g, Decay: %g\n", net.learning_rate, net.momentum, net.decay);
     srand(time(0));
@@ -840,6 +856,7 @@ void validate_detector_recall(char *datacfg, char *cfgfile, char *weightfile)
     }
     //set_batch_network(&net, 1);
     fuse_conv_batchnorm(net);
+    optimize_network_graph(&net);
     srand(time(0));
 
     //list *plist = get_paths("data/coco_val_5k.list");
@@ -908,23 +925,184 @@ void validate_detector_recall(char *datacfg, char *cfgfile, char *weightfile)
     }
 }
 
+// One scored detection of a class, already matched against the ground truth of its image
 typedef struct {
-    box b;
     float p;
-    int class_id;
-    int image_index;
-    int truth_flag;
-    int unique_truth_index;
-} box_prob;
+    int order;                  // arrival order, ties in p keep it as the stable global sort did
+    int unique_truth_index;     // -1 if it matched no object (false positive)
+} map_det;
 
-int detections_comparator(const void *pa, const void *pb)
+typedef struct {
+    map_det *d;
+    int n, size;
+} map_class_dets;
+
+static void map_class_dets_push(map_class_dets *c, float p, int unique_truth_index)
 {
-    box_prob a = *(const box_prob *)pa;
-    box_prob b = *(const box_prob *)pb;
-    float diff = a.p - b.p;
-    if (diff < 0) return 1;
-    else if (diff > 0) return -1;
-    return 0;
+    if (c->n == c->size) {
+        c->size = c->size ? 2 * c->size : 256;
+        c->d = (map_det*)xrealloc(c->d, c->size * sizeof(map_det));
+    }
+    map_det *d = &c->d[c->n];
+    d->p = p;
+    d->order = c->n++;
+    d->unique_truth_index = unique_truth_index;
+}
+
+static int map_det_comparator(const void *pa, const void *pb)
+{
+    const map_det *a = (const map_det *)pa;
+    const map_det *b = (const map_det *)pb;
+    if (a->p != b->p) return (a->p < b->p) ? 1 : -1;
+    return a->order - b->order;
+}
+
+// Parsed ground truth of the validation list. It is kept across validate_detector_map() calls,
+// since train_detector -map re-validates the same list every few thousand iterations.
+typedef struct {
+    box_label *truth;
+    box_label *truth_dif;
+    int num_labels;
+    int num_labels_dif;
+    int unique_truth_offset;    // index of the first object of this image among all objects
+} map_image_truth;
+
+typedef struct {
+    char *valid_images;
+    char *difficult_images;
+    int m;
+    int unique_truth_count;
+    int max_labels;
+    map_image_truth *images;
+} map_truth_cache;
+
+static map_truth_cache map_truth;
+
+static void free_map_truth()
+{
+    map_truth_cache *c = &map_truth;
+    int i;
+    for (i = 0; i < c->m; ++i) {
+        free(c->images[i].truth);
+        free(c->images[i].truth_dif);
+    }
+    free(c->images);
+    free(c->valid_images);
+    free(c->difficult_images);
+    memset(c, 0, sizeof(*c));
+}
+
+static map_truth_cache *get_map_truth(char *valid_images, char *difficult_images, char **paths, char **paths_dif, int m)
+{
+    map_truth_cache *c = &map_truth;
+    if (c->images && c->m == m && !strcmp(c->valid_images, valid_images) &&
+        ((!c->difficult_images && !difficult_images) || (c->difficult_images && difficult_images && !strcmp(c->difficult_images, difficult_images))))
+    {
+        return c;
+    }
+
+    int i;
+    free_map_truth();
+
+    c->valid_images = copy_string(valid_images);
+    c->difficult_images = difficult_images ? copy_string(difficult_images) : NULL;
+    c->m = m;
+    c->images = (map_image_truth*)xcalloc(m, sizeof(map_image_truth));
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (i = 0; i < m; ++i) {
+        char labelpath[4096];
+        replace_image_to_label(paths[i], labelpath);
+        c->images[i].truth = read_boxes(labelpath, &c->images[i].num_labels);
+        if (paths_dif) {
+            char labelpath_dif[4096];
+            replace_image_to_label(paths_dif[i], labelpath_dif);
+            c->images[i].truth_dif = read_boxes(labelpath_dif, &c->images[i].num_labels_dif);
+        }
+    }
+
+    c->unique_truth_count = 0;
+    c->max_labels = 0;
+    for (i = 0; i < m; ++i) {
+        c->images[i].unique_truth_offset = c->unique_truth_count;
+        c->unique_truth_count += c->images[i].num_labels;
+        if (c->images[i].num_labels > c->max_labels) c->max_labels = c->images[i].num_labels;
+    }
+    return c;
+}
+
+// Sorts the detections of one class and integrates its precision-recall curve.
+// Objects only match detections of their own class, so classes can run in parallel on a shared truth_flags.
+static double map_class_average_precision(map_class_dets *c, int truth_count, char *truth_flags, int map_points)
+{
+    const int n = c->n;
+    if (n == 0) return 0;
+    qsort(c->d, n, sizeof(map_det), map_det_comparator);
+
+    double *precision = (double*)xcalloc(n, sizeof(double));
+    double *recall = (double*)xcalloc(n, sizeof(double));
+    int tp = 0, fp = 0;
+    int rank;
+    for (rank = 0; rank < n; ++rank) {
+        const int u = c->d[rank].unique_truth_index;
+        // if (detected && isn't detected before)
+        if (u >= 0 && !truth_flags[u]) {
+            truth_flags[u] = 1;
+            ++tp;   // true-positive
+        }
+        else ++fp;  // false-positive
+        const int fn = truth_count - tp;    // false-negative = objects - true-positive
+        precision[rank] = (double)tp / (double)(tp + fp);
+        recall[rank] = (tp + fn) > 0 ? (double)tp / (double)(tp + fn) : 0;
+    }
+
+    double avg_precision = 0;
+    // MS COCO - uses 101-Recall-points on PR-chart.
+    // PascalVOC2007 - uses 11-Recall-points on PR-chart.
+    // PascalVOC2010-2012 - uses Area-Under-Curve on PR-chart.
+    // ImageNet - uses Area-Under-Curve on PR-chart.
+
+    // correct mAP calculation: ImageNet, PascalVOC 2010-2012
+    if (map_points == 0)
+    {
+        double last_recall = recall[n - 1];
+        double last_precision = precision[n - 1];
+        for (rank = n - 2; rank >= 0; --rank)
+        {
+            double delta_recall = last_recall - recall[rank];
+            last_recall = recall[rank];
+
+            if (precision[rank] > last_precision) {
+                last_precision = precision[rank];
+            }
+
+            avg_precision += delta_recall * last_precision;
+        }
+        //add remaining area of PR curve when recall isn't 0 at rank-1
+        double delta_recall = last_recall - 0;
+        avg_precision += delta_recall * last_precision;
+    }
+    // MSCOCO - 101 Recall-points, PascalVOC - 11 Recall-points
+    else
+    {
+        int point;
+        for (point = 0; point < map_points; ++point) {
+            double cur_recall = point * 1.0 / (map_points-1);
+            double cur_precision = 0;
+            for (rank = 0; rank < n; ++rank)
+            {
+                if (recall[rank] >= cur_recall && precision[rank] > cur_precision) {    // > or >=
+                    cur_precision = precision[rank];
+                }
+            }
+            avg_precision += cur_precision;
+        }
+        avg_precision = avg_precision / map_points;
+    }
+
+    free(precision);
+    free(recall);
+    return avg_precision;
 }
 
 float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, float thresh_calc_avg_iou, const float iou_thresh, const int map_points, int letter_box, network *existing_net)
@@ -951,12 +1129,13 @@ float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, floa
         free_network_recurrent_state(*existing_net);
     }
     else {
-        net = parse_network_cfg_custom(cfgfile, 1, 1);    // set batch=1
+        net = parse_network_cfg_custom(cfgfile, 4, 1);    // set batch=4, one forward per group of loaded images
         if (weightfile) {
             load_weights(&net, weightfile);
         }
         //set_batch_network(&net, 1);
         fuse_conv_batchnorm(net);
+        optimize_network_graph(&net);
         calculate_binary_weights(net);
     }
     if (net.layers[net.n - 1].classes != names_size) {
@@ -996,8 +1175,22 @@ float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, floa
     const float nms = .45;
     //const float iou_thresh = 0.5;
 
+    map_truth_cache *gt = get_map_truth(valid_images, difficult_valid_images, paths, paths_dif, m);
+    const int unique_truth_count = gt->unique_truth_count;
+
     int nthreads = 4;
     if (m < 4) nthreads = m;
+    // a standalone run parses the network with batch=nthreads and predicts each loaded group at once;
+    // only [yolo] heads have a batched decode, the others stay at one image per forward
+    int net_batch = net.batch < nthreads ? net.batch : nthreads;
+    for (k = 0; k < net.n; ++k) {
+        LAYER_TYPE type = net.layers[k].type;
+        if (type == GAUSSIAN_YOLO || type == REGION || type == DETECTION) net_batch = 1;
+    }
+    if (net_batch < 1) net_batch = 1;
+    const size_t input_size = (size_t)net.w * net.h * net.c;
+    float *batch_input = (net_batch > 1) ? (float*)xcalloc(input_size * net_batch, sizeof(float)) : NULL;
+
     image* val = (image*)xcalloc(nthreads, sizeof(image));
     image* val_resized = (image*)xcalloc(nthreads, sizeof(image));
     image* buf = (image*)xcalloc(nthreads, sizeof(image));
@@ -1017,11 +1210,17 @@ float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, floa
     int tp_for_thresh = 0;
     int fp_for_thresh = 0;
 
-    box_prob* detections = (box_prob*)xcalloc(1, sizeof(box_prob));
-    int detections_count = 0;
-    int unique_truth_count = 0;
+    // detections are matched to the ground truth as each image arrives and kept per class
+    map_class_dets *class_dets = (map_class_dets*)xcalloc(classes, sizeof(map_class_dets));
+    char *claimed = (char*)xcalloc(gt->max_labels + 1, sizeof(char));
 
     int* truth_classes_count = (int*)xcalloc(classes, sizeof(int));
+    for (i = 0; i < m; ++i) {
+        for (j = 0; j < gt->images[i].num_labels; ++j) {
+            const int id = gt->images[i].truth[j].id;
+            if (id >= 0 && id < classes) truth_classes_count[id]++;
+        }
+    }
 
     // For multi-class precision and recall computation
     float *avg_iou_per_class = (float*)xcalloc(classes, sizeof(float));
@@ -1029,7 +1228,7 @@ float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, floa
     int *fp_for_thresh_per_class = (int*)xcalloc(classes, sizeof(int));
 
     for (t = 0; t < nthreads; ++t) {
-        args.path = paths[i + t];
+        args.path = paths[t];
         args.im = &buf[t];
         args.resized = &buf_resized[t];
         thr[t] = load_data_in_thread(args);
@@ -1042,29 +1241,36 @@ float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, floa
             val[t] = buf[t];
             val_resized[t] = buf_resized[t];
         }
+        const int group = (m - (i - nthreads)) < nthreads ? (m - (i - nthreads)) : nthreads;
         for (t = 0; t < nthreads && (i + t) < m; ++t) {
             args.path = paths[i + t];
             args.im = &buf[t];
             args.resized = &buf_resized[t];
             thr[t] = load_data_in_thread(args);
         }
-        for (t = 0; t < nthreads && i + t - nthreads < m; ++t) {
-            const int image_index = i + t - nthreads;
-            char *path = paths[image_index];
-            char *id = basecfg(path);
-            float *X = val_resized[t].data;
-            network_predict(net, X);
+        for (t = 0; t < group; ++t) {
+            const int slot = t % net_batch;
+            if (slot == 0) {
+                const int nb = (group - t) < net_batch ? (group - t) : net_batch;
+                float *X = val_resized[t].data;
+                if (net_batch > 1) {
+                    int b;
+                    for (b = 0; b < nb; ++b) memcpy(batch_input + b*input_size, val_resized[t + b].data, input_size * sizeof(float));
+                    X = batch_input;
+                }
+                if (net.batch != nb) set_batch_network(&net, nb);
+                network_predict(net, X);
+            }
 
+            const int image_index = i + t - nthreads;
             int nboxes = 0;
             float hier_thresh = 0;
+            const int w = (args.type == LETTERBOX_DATA) ? val[t].w : 1;
+            const int h = (args.type == LETTERBOX_DATA) ? val[t].h : 1;
+            const int relative = (args.type == LETTERBOX_DATA);
             detection *dets;
-            if (args.type == LETTERBOX_DATA) {
-                dets = get_network_boxes(&net, val[t].w, val[t].h, thresh, hier_thresh, 0, 1, &nboxes, letter_box);
-            }
-            else {
-                dets = get_network_boxes(&net, 1, 1, thresh, hier_thresh, 0, 0, &nboxes, letter_box);
-            }
-            //detection *dets = get_network_boxes(&net, val[t].w, val[t].h, thresh, hier_thresh, 0, 1, &nboxes, letter_box); // for letter_box=1
+            if (net_batch > 1) dets = get_network_boxes_batch_view(&net, w, h, thresh, hier_thresh, 0, relative, &nboxes, letter_box, slot);
+            else dets = get_network_boxes_view(&net, w, h, thresh, hier_thresh, 0, relative, &nboxes, letter_box);
             if (nms) {
                 if (l.nms_kind == DEFAULT_NMS) do_nms_sort(dets, nboxes, l.classes, nms);
                 else diounms_sort(dets, nboxes, l.classes, nms, l.nms_kind, l.beta_nms);
@@ -1072,89 +1278,57 @@ float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, floa
 
             //if (l.embedding_size) set_track_id(dets, nboxes, thresh, l.sim_thresh, l.track_ciou_norm, l.track_history_size, l.dets_for_track, l.dets_for_show);
 
-            char labelpath[4096];
-            replace_image_to_label(path, labelpath);
-            int num_labels = 0;
-            box_label *truth = read_boxes(labelpath, &num_labels);
-            int j;
-            for (j = 0; j < num_labels; ++j) {
-                truth_classes_count[truth[j].id]++;
-            }
-
-            // difficult
-            box_label *truth_dif = NULL;
-            int num_labels_dif = 0;
-            if (paths_dif)
-            {
-                char *path_dif = paths_dif[image_index];
-
-                char labelpath_dif[4096];
-                replace_image_to_label(path_dif, labelpath_dif);
-
-                truth_dif = read_boxes(labelpath_dif, &num_labels_dif);
-            }
-
-            const int checkpoint_detections_count = detections_count;
+            const map_image_truth *image_truth = &gt->images[image_index];
+            const box_label *truth = image_truth->truth;
+            const box_label *truth_dif = image_truth->truth_dif;
+            const int num_labels = image_truth->num_labels;
+            const int num_labels_dif = image_truth->num_labels_dif;
+            memset(claimed, 0, num_labels);
 
-            int i;
-            for (i = 0; i < nboxes; ++i) {
+            int d;
+            for (d = 0; d < nboxes; ++d) {
 
                 int class_id;
                 for (class_id = 0; class_id < classes; ++class_id) {
-                    float prob = dets[i].prob[class_id];
+                    float prob = dets[d].prob[class_id];
                     if (prob > 0) {
-                        detections_count++;
-                        detections = (box_prob*)xrealloc(detections, detections_count * sizeof(box_prob));
-                        detections[detections_count - 1].b = dets[i].bbox;
-                        detections[detections_count - 1].p = prob;
-                        detections[detections_count - 1].image_index = image_index;
-                        detections[detections_count - 1].class_id = class_id;
-                        detections[detections_count - 1].truth_flag = 0;
-                        detections[detections_count - 1].unique_truth_index = -1;
-
                         int truth_index = -1;
+                        int truth_j = -1;
                         float max_iou = 0;
                         for (j = 0; j < num_labels; ++j)
                         {
+                            if (class_id != truth[j].id) continue;
                             box t = { truth[j].x, truth[j].y, truth[j].w, truth[j].h };
-                            //printf(" IoU = %f, prob = %f, class_id = %d, truth[j].id = %d \n",
-                            //    box_iou(dets[i].bbox, t), prob, class_id, truth[j].id);
-                            float current_iou = box_iou(dets[i].bbox, t);
-                            if (current_iou > iou_thresh && class_id == truth[j].id) {
-                                if (current_iou > max_iou) {
-                                    max_iou = current_iou;
-                                    truth_index = unique_truth_count + j;
-                                }
+                            float current_iou = box_iou(dets[d].bbox, t);
+                            if (current_iou > iou_thresh && current_iou > max_iou) {
+                                max_iou = current_iou;
+                                truth_j = j;
+                                truth_index = image_truth->unique_truth_offset + j;
                             }
                         }
 
                         // best IoU
                         if (truth_index > -1) {
-                            detections[detections_count - 1].truth_flag = 1;
-                            detections[detections_count - 1].unique_truth_index = truth_index;
+                            map_class_dets_push(&class_dets[class_id], prob, truth_index);
                         }
                         else {
                             // if object is difficult then remove detection
+                            int difficult = 0;
                             for (j = 0; j < num_labels_dif; ++j) {
                                 box t = { truth_dif[j].x, truth_dif[j].y, truth_dif[j].w, truth_dif[j].h };
-                                float current_iou = box_iou(dets[i].bbox, t);
+                                float current_iou = box_iou(dets[d].bbox, t);
                                 if (current_iou > iou_thresh && class_id == truth_dif[j].id) {
-                                    --detections_count;
+                                    difficult = 1;
                                     break;
                                 }
                             }
+                            if (!difficult) map_class_dets_push(&class_dets[class_id], prob, -1);
                         }
 
                         // calc avg IoU, true-positives, false-positives for required Threshold
                         if (prob > thresh_calc_avg_iou) {
-                            int z, found = 0;
-                            for (z = checkpoint_detections_count; z < detections_count - 1; ++z) {
-                                if (detections[z].unique_truth_index == truth_index) {
-                                    found = 1; break;
-                                }
-                            }
-
-                            if (truth_index > -1 && found == 0) {
+                            // an object counts once, for the first detection of this image matched to it
+                            if (truth_index > -1 && !claimed[truth_j]) {
                                 avg_iou += max_iou;
                                 ++tp_for_thresh;
                                 avg_iou_per_class[class_id] += max_iou;
@@ -1165,23 +1339,11 @@ float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, floa
                                 fp_for_thresh_per_class[class_id]++;
                             }
                         }
+                        if (truth_j > -1) claimed[truth_j] = 1;
                     }
                 }
             }
 
-            unique_truth_count += num_labels;
-
-            //static int previous_errors = 0;
-            //int total_errors = fp_for_thresh + (unique_truth_count - tp_for_thresh);
-            //int errors_in_this_image = total_errors - previous_errors;
-            //previous_errors = total_errors;
-            //if(reinforcement_fd == NULL) reinforcement_fd = fopen("reinforcement.txt", "wb");
-            //char buff[1000];
-            //sprintf(buff, "%s\n", path);
-            //if(errors_in_this_image > 0) fwrite(buff, sizeof(char), strlen(buff), reinforcement_fd);
-
-            free_detections(dets, nboxes);
-            free(id);
             free_image(val[t]);
             free_image(val_resized[t]);
         }
@@ -1200,144 +1362,29 @@ float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, floa
             avg_iou_per_class[class_id] = avg_iou_per_class[class_id] / (tp_for_thresh_per_class[class_id] + fp_for_thresh_per_class[class_id]);
     }
 
-    // SORT(detections)
-    qsort(detections, detections_count, sizeof(box_prob), detections_comparator);
-
-    typedef struct {
-        double prob;
-        double precision;
-        double recall;
-        int tp, fp, fn;
-    } pr_t;
-
-    // for PR-curve
-    pr_t** pr = (pr_t**)xcalloc(classes, sizeof(pr_t*));
-    for (i = 0; i < classes; ++i) {
-        pr[i] = (pr_t*)xcalloc(detections_count, sizeof(pr_t));
-    }
+    int detections_count = 0;
+    for (i = 0; i < classes; ++i) detections_count += class_dets[i].n;
     printf("\n detections_count = %d, unique_truth_count = %d  \n", detections_count, unique_truth_count);
 
-
-    int* detection_per_class_count = (int*)xcalloc(classes, sizeof(int));
-    for (j = 0; j < detections_count; ++j) {
-        detection_per_class_count[detections[j].class_id]++;
-    }
-
-    int* truth_flags = (int*)xcalloc(unique_truth_count, sizeof(int));
-
-    int rank;
-    for (rank = 0; rank < detections_count; ++rank) {
-        if (rank % 100 == 0)
-            printf(" rank = %d of ranks = %d \r", rank, detections_count);
-
-        if (rank > 0) {
-            int class_id;
-            for (class_id = 0; class_id < classes; ++class_id) {
-                pr[class_id][rank].tp = pr[class_id][rank - 1].tp;
-                pr[class_id][rank].fp = pr[class_id][rank - 1].fp;
-            }
-        }
-
-        box_prob d = detections[rank];
-        pr[d.class_id][rank].prob = d.p;
-        // if (detected && isn't detected before)
-        if (d.truth_flag == 1) {
-            if (truth_flags[d.unique_truth_index] == 0)
-            {
-                truth_flags[d.unique_truth_index] = 1;
-                pr[d.class_id][rank].tp++;    // true-positive
-            } else
-                pr[d.class_id][rank].fp++;
-        }
-        else {
-            pr[d.class_id][rank].fp++;    // false-positive
-        }
-
-        for (i = 0; i < classes; ++i)
-        {
-            const int tp = pr[i][rank].tp;
-            const int fp = pr[i][rank].fp;
-            const int fn = truth_classes_count[i] - tp;    // false-negative = objects - true-positive
-            pr[i][rank].fn = fn;
-
-            if ((tp + fp) > 0) pr[i][rank].precision = (double)tp / (double)(tp + fp);
-            else pr[i][rank].precision = 0;
-
-            if ((tp + fn) > 0) pr[i][rank].recall = (double)tp / (double)(tp + fn);
-            else pr[i][rank].recall = 0;
-
-            if (rank == (detections_count - 1) && detection_per_class_count[i] != (tp + fp)) {    // check for last rank
-                    printf(" class_id: %d - detections = %d, tp+fp = %d, tp = %d, fp = %d \n", i, detection_per_class_count[i], tp+fp, tp, fp);
-            }
-        }
+    // PR-curve and AP of every class
+    double *average_precision = (double*)xcalloc(classes, sizeof(double));
+    char *truth_flags = (char*)xcalloc(unique_truth_count + 1, sizeof(char));
+    #pragma omp parallel for schedule(dynamic)
+    for (i = 0; i < classes; ++i) {
+        average_precision[i] = map_class_average_precision(&class_dets[i], truth_classes_count[i], truth_flags, map_points);
     }
-
     free(truth_flags);
 
-
     double mean_average_precision = 0;
-	
+
 	int unique_classes = 0;
     for (i = 0; i < classes; ++i) {
-        double avg_precision = 0;
-
-        // MS COCO - uses 101-Recall-points on PR-chart.
-        // PascalVOC2007 - uses 11-Recall-points on PR-chart.
-        // PascalVOC2010-2012 - uses Area-Under-Curve on PR-chart.
-        // ImageNet - uses Area-Under-Curve on PR-chart.
-
-        // correct mAP calculation: ImageNet, PascalVOC 2010-2012
-        if (map_points == 0)
-        {
-            double last_recall = pr[i][detections_count - 1].recall;
-            double last_precision = pr[i][detections_count - 1].precision;
-            for (rank = detections_count - 2; rank >= 0; --rank)
-            {
-                double delta_recall = last_recall - pr[i][rank].recall;
-                last_recall = pr[i][rank].recall;
-
-                if (pr[i][rank].precision > last_precision) {
-                    last_precision = pr[i][rank].precision;
-                }
-
-                avg_precision += delta_recall * last_precision;
-            }
-            //add remaining area of PR curve when recall isn't 0 at rank-1
-            double delta_recall = last_recall - 0;
-            avg_precision += delta_recall * last_precision;
-        }
-        // MSCOCO - 101 Recall-points, PascalVOC - 11 Recall-points
-        else
-        {
-            int point;
-            for (point = 0; point < map_points; ++point) {
-                double cur_recall = point * 1.0 / (map_points-1);
-                double cur_precision = 0;
-                double cur_prob = 0;
-                for (rank = 0; rank < detections_count; ++rank)
-                {
-                    if (pr[i][rank].recall >= cur_recall) {    // > or >=
-                        if (pr[i][rank].precision > cur_precision) {
-                            cur_precision = pr[i][rank].precision;
-                            cur_prob = pr[i][rank].prob;
-                        }
-                    }
-                }
-                //printf("class_id = %d, point = %d, cur_prob = %.4f, cur_recall = %.4f, cur_precision = %.4f \n", i, point, cur_prob, cur_recall, cur_precision);
-
-                avg_precision += cur_precision;
-            }
-            avg_precision = avg_precision / map_points;
-        }
+        double avg_precision = average_precision[i];
 		if(avg_precision) unique_classes++;
 
         printf("class_id = %d, name = %s, ap = %2.2f%%   \t (TP = %d, FP = %d) \n",
             i, names[i], avg_precision * 100, tp_for_thresh_per_class[i], fp_for_thresh_per_class[i]);
 
-        float class_precision = (float)tp_for_thresh_per_class[i] / ((float)tp_for_thresh_per_class[i] + (float)fp_for_thresh_per_class[i]);
-        float class_recall = (float)tp_for_thresh_per_class[i] / ((float)tp_for_thresh_per_class[i] + (float)(truth_classes_count[i] - tp_for_thresh_per_class[i]));
-        //printf("Precision = %1.2f, Recall = %1.2f, avg IOU = %2.2f%% \n\n", class_precision, class_recall, avg_iou_per_class[i]);
-
         mean_average_precision += avg_precision;
     }
 
@@ -1359,13 +1406,12 @@ float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, floa
     // printf(" mean average precision (mAP@%0.2f) = %f, or %2.2f %% \n", iou_thresh, mean_average_precision, mean_average_precision * 100);
 	printf("\n mean average precision (mAP) = %f, or %2.2f %% (%d classes)\n", mean_average_precision, mean_average_precision*100, unique_classes);
 
-    for (i = 0; i < classes; ++i) {
-        free(pr[i]);
-    }
-    free(pr);
-    free(detections);
+    for (i = 0; i < classes; ++i) free(class_dets[i].d);
+    free(class_dets);
+    free(claimed);
+    free(average_precision);
+    free(batch_input);
     free(truth_classes_count);
-    free(detection_per_class_count);
 
     free(avg_iou_per_class);
     free(tp_for_thresh_per_class);
@@ -1384,6 +1430,7 @@ float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, floa
     free_list(options);
 
     if (existing_net) {
+        existing_net->dets_arena = net.dets_arena;  // reused by the next call, released with *existing_net
         //set_batch_network(&net, initial_batch);
         //free_network_recurrent_state(*existing_net);
         restore_network_recurrent_state(*existing_net);
@@ -1391,6 +1438,7 @@ float validate_detector_map(char *datacfg, char *cfgfile, char *weightfile, floa
     }
     else {
         free_network(net);
+        free_map_truth();
     }
     if (val) free(val);
     if (val_resized) free(val_resized);
@@ -1426,6 +1474,158 @@ int anchors_data_comparator(const float **pa, const float **pb)
 }
 
 
+// 1 - IoU of two boxes sharing a center: the distance calc_anchors() clusters (w, h) pairs with
+static inline float anchor_distance(float w1, float h1, float w2, float h2)
+{
+    const float min_w = (w1 < w2) ? w1 : w2;
+    const float min_h = (h1 < h2) ? h1 : h2;
+    const float inter = min_w*min_h;
+    return 1 - inter / (w1*h1 + w2*h2 - inter);
+}
+
+static inline int closest_anchor(float w, float h, const float *cw, const float *ch, int k)
+{
+    int j, best = 0;
+    float best_dist = anchor_distance(w, h, cw[0], ch[0]);
+    for (j = 1; j < k; ++j) {
+        const float d = anchor_distance(w, h, cw[j], ch[j]);
+        if (d < best_dist) {
+            best_dist = d;
+            best = j;
+        }
+    }
+    return best;
+}
+
+// k-means++ seeding: each next center is drawn with probability proportional to the squared
+// distance of a box to its closest center so far
+static void anchors_kmeanspp(const float *bw, const float *bh, int n, float *cw, float *ch, int k)
+{
+    float *d2 = (float*)xcalloc(n, sizeof(float));
+    int i, c;
+    int first = (int)(((double)rand() / ((double)RAND_MAX + 1)) * n);
+    cw[0] = bw[first];
+    ch[0] = bh[first];
+    #pragma omp parallel for
+    for (i = 0; i < n; ++i) {
+        const float d = anchor_distance(bw[i], bh[i], cw[0], ch[0]);
+        d2[i] = d*d;
+    }
+    for (c = 1; c < k; ++c) {
+        double sum = 0;
+        for (i = 0; i < n; ++i) sum += d2[i];
+        const double r = ((double)rand() / ((double)RAND_MAX + 1)) * sum;
+        double acc = 0;
+        int pick = n - 1;
+        for (i = 0; i < n; ++i) {
+            acc += d2[i];
+            if (acc > r) {
+                pick = i;
+                break;
+            }
+        }
+        cw[c] = bw[pick];
+        ch[c] = bh[pick];
+        #pragma omp parallel for
+        for (i = 0; i < n; ++i) {
+            const float d = anchor_distance(bw[i], bh[i], cw[c], ch[c]);
+            if (d*d < d2[i]) d2[i] = d*d;
+        }
+    }
+    free(d2);
+}
+
+#define ANCHORS_BLOCK 16384
+#define ANCHORS_TILE 256
+
+// Lloyd iterations over SoA box sizes. Each block of boxes is assigned and summed in parallel into
+// its own partial sums, which are reduced in block order, so the result does not depend on the thread count.
+// Stops when no box changes cluster or no center moves by more than 1e-6 of its size.
+static int anchors_kmeans(const float *bw, const float *bh, int n, float *cw, float *ch, int k, int *assignments, int max_iterations)
+{
+    const int nblocks = (n + ANCHORS_BLOCK - 1) / ANCHORS_BLOCK;
+    double *partial = (double*)xcalloc((size_t)nblocks * k * 3, sizeof(double));   // sum w, sum h, count per block and center
+    int *block_changed = (int*)xcalloc(nblocks, sizeof(int));
+    int i, iter;
+    for (i = 0; i < n; ++i) assignments[i] = -1;
+
+    for (iter = 0; iter < max_iterations; ++iter) {
+        int b;
+        #pragma omp parallel for schedule(dynamic)
+        for (b = 0; b < nblocks; ++b) {
+            double *p = partial + (size_t)b * k * 3;
+            const int start = b * ANCHORS_BLOCK;
+            const int end = (start + ANCHORS_BLOCK < n) ? start + ANCHORS_BLOCK : n;
+            int j, t, changed = 0;
+            for (j = 0; j < k * 3; ++j) p[j] = 0;
+            for (t = start; t < end; t += ANCHORS_TILE) {
+                // centers in the outer loop, so the inner one runs over a tile of boxes and vectorizes
+                float best_iou[ANCHORS_TILE];
+                int best[ANCHORS_TILE];
+                const int len = (end - t < ANCHORS_TILE) ? end - t : ANCHORS_TILE;
+                const float *tw = bw + t;
+                const float *th = bh + t;
+                int c;
+                for (j = 0; j < len; ++j) {
+                    best_iou[j] = -1;
+                    best[j] = 0;
+                }
+                for (c = 0; c < k; ++c) {
+                    const float w = cw[c], h = ch[c];
+                    for (j = 0; j < len; ++j) {
+                        const float inter = fminf(tw[j], w) * fminf(th[j], h);
+                        const float iou = inter / (tw[j]*th[j] + w*h - inter);
+                        const int better = iou > best_iou[j];
+                        best_iou[j] = better ? iou : best_iou[j];
+                        best[j] = better ? c : best[j];
+                    }
+                }
+                for (j = 0; j < len; ++j) {
+                    const int a = best[j];
+                    changed += (a != assignments[t + j]);
+                    assignments[t + j] = a;
+                    p[a * 3 + 0] += tw[j];
+                    p[a * 3 + 1] += th[j];
+                    p[a * 3 + 2] += 1;
+                }
+            }
+            block_changed[b] = changed;
+        }
+
+        int changed = 0;
+        for (b = 0; b < nblocks; ++b) changed += block_changed[b];
+        if (changed == 0) break;
+
+        float max_shift = 0;
+        int c;
+        for (c = 0; c < k; ++c) {
+            double sw = 0, sh = 0, count = 0;
+            for (b = 0; b < nblocks; ++b) {
+                const double *p = partial + ((size_t)b * k + c) * 3;
+                sw += p[0];
+                sh += p[1];
+                count += p[2];
+            }
+            if (count == 0) continue;   // an empty cluster keeps its center
+            const float w = (float)(sw / count);
+            const float h = (float)(sh / count);
+            const float shift = fmaxf(fabsf(w - cw[c]) / cw[c], fabsf(h - ch[c]) / ch[c]);
+            if (shift > max_shift) max_shift = shift;
+            cw[c] = w;
+            ch[c] = h;
+        }
+        printf("\r k-means iteration %d: %d boxes changed cluster   ", iter + 1, changed);
+        fflush(stdout);
+        if (max_shift < 1e-6f) {
+            ++iter;
+            break;
+        }
+    }
+    free(partial);
+    free(block_changed);
+    return iter;
+}
+
 void calc_anchors(char *datacfg, int num_of_clusters, int width, int height, int show)
 {
     printf("\n num_of_clusters = %d, width = %d, height = %d \n", num_of_clusters, width, height);
@@ -1435,10 +1635,6 @@ void calc_anchors(char *datacfg, int num_of_clusters, int width, int height, int
         return;
     }
 
-    //float pointsdata[] = { 1,1, 2,2, 6,6, 5,5, 10,10 };
-    float* rel_width_height_array = (float*)xcalloc(1000, sizeof(float));
-
-
     list *options = read_data_cfg(datacfg);
     char *train_images = option_find_str(options, "train", "data/train.list");
     list *plist = get_paths(train_images);
@@ -1453,99 +1649,113 @@ void calc_anchors(char *datacfg, int num_of_clusters, int width, int height, int
     printf(" read labels from %d images \n", number_of_images);
 
     int i, j;
+    double time = get_time_point();
+    box_label **truths = (box_label**)xcalloc(number_of_images, sizeof(box_label*));
+    int *truth_counts = (int*)xcalloc(number_of_images, sizeof(int));
+    #pragma omp parallel for schedule(dynamic, 64)
     for (i = 0; i < number_of_images; ++i) {
-        char *path = paths[i];
         char labelpath[4096];
-        replace_image_to_label(path, labelpath);
+        replace_image_to_label(paths[i], labelpath);
+        truths[i] = read_boxes(labelpath, &truth_counts[i]);
+        if (i % 10000 == 0) {
+            printf("\r loaded \t image: %d", i);
+            fflush(stdout);
+        }
+    }
+    for (i = 0; i < number_of_images; ++i) number_of_boxes += truth_counts[i];
 
-        int num_labels = 0;
-        box_label *truth = read_boxes(labelpath, &num_labels);
-        //printf(" new path: %s \n", labelpath);
-        char *buff = (char*)xcalloc(6144, sizeof(char));
-        for (j = 0; j < num_labels; ++j)
+    // box sizes in network pixels, kept as separate w and h arrays for the clustering loops
+    float *box_w = (float*)xcalloc(number_of_boxes, sizeof(float));
+    float *box_h = (float*)xcalloc(number_of_boxes, sizeof(float));
+    int n = 0;
+    char *bad_label_cmd = (char*)xcalloc(6144, sizeof(char));
+    for (i = 0; i < number_of_images; ++i) {
+        box_label *truth = truths[i];
+        for (j = 0; j < truth_counts[i]; ++j)
         {
             if (truth[j].x > 1 || truth[j].x <= 0 || truth[j].y > 1 || truth[j].y <= 0 ||
                 truth[j].w > 1 || truth[j].w <= 0 || truth[j].h > 1 || truth[j].h <= 0)
             {
+                char labelpath[4096];
+                replace_image_to_label(paths[i], labelpath);
                 printf("\n\nWrong label: %s - j = %d, x = %f, y = %f, width = %f, height = %f \n",
                     labelpath, j, truth[j].x, truth[j].y, truth[j].w, truth[j].h);
-                sprintf(buff, "echo \"Wrong label: %s - j = %d, x = %f, y = %f, width = %f, height = %f\" >> bad_label.list",
+                sprintf(bad_label_cmd, "echo \"Wrong label: %s - j = %d, x = %f, y = %f, width = %f, height = %f\" >> bad_label.list",
                     labelpath, j, truth[j].x, truth[j].y, truth[j].w, truth[j].h);
-                system(buff);
+                system(bad_label_cmd);
                 if (check_mistakes) getchar();
             }
             if (truth[j].id >= classes) {
+                counter_per_class = (int*)xrealloc(counter_per_class, (truth[j].id + 1) * sizeof(int));
+                memset(counter_per_class + classes, 0, (truth[j].id + 1 - classes) * sizeof(int));
                 classes = truth[j].id + 1;
-                counter_per_class = (int*)xrealloc(counter_per_class, classes * sizeof(int));
             }
             counter_per_class[truth[j].id]++;
 
-            number_of_boxes++;
-            rel_width_height_array = (float*)xrealloc(rel_width_height_array, 2 * number_of_boxes * sizeof(float));
-
-            rel_width_height_array[number_of_boxes * 2 - 2] = truth[j].w * width;
-            rel_width_height_array[number_of_boxes * 2 - 1] = truth[j].h * height;
-            printf("\r loaded \t image: %d \t box: %d", i + 1, number_of_boxes);
-        }
-        free(buff);
-    }
-    printf("\n all loaded. \n");
-    printf("\n calculating k-means++ ...");
-
-    matrix boxes_data;
-    model anchors_data;
-    boxes_data = make_matrix(number_of_boxes, 2);
-
-    printf("\n");
-    for (i = 0; i < number_of_boxes; ++i) {
-        boxes_data.vals[i][0] = rel_width_height_array[i * 2];
-        boxes_data.vals[i][1] = rel_width_height_array[i * 2 + 1];
-        //if (w > 410 || h > 410) printf("i:%d,  w = %f, h = %f \n", i, w, h);
+            box_w[n] = truth[j].w * width;
+            box_h[n] = truth[j].h * height;
+            ++n;
+        }
+        free(truth);
+    }
+    free(bad_label_cmd);
+    free(truths);
+    free(truth_counts);
+    printf("\r loaded \t image: %d \t box: %d", number_of_images, number_of_boxes);
+    printf("\n all loaded in %.2f sec. \n", (get_time_point() - time) / 1000000);
+    if (number_of_boxes < num_of_clusters) {
+        printf(" Error: %d boxes are not enough for %d clusters \n", number_of_boxes, num_of_clusters);
+        free(box_w);
+        free(box_h);
+        free(counter_per_class);
+        return;
     }
+    printf("\n calculating k-means++ ...\n");
 
     // Is used: distance(box, centroid) = 1 - IoU(box, centroid)
 
     // K-means
-    anchors_data = do_kmeans(boxes_data, num_of_clusters);
+    time = get_time_point();
+    model anchors_data;
+    anchors_data.centers = make_matrix(num_of_clusters, 2);
+    anchors_data.assignments = (int*)xcalloc(number_of_boxes, sizeof(int));
+    float *center_w = (float*)xcalloc(num_of_clusters, sizeof(float));
+    float *center_h = (float*)xcalloc(num_of_clusters, sizeof(float));
+    anchors_kmeanspp(box_w, box_h, number_of_boxes, center_w, center_h, num_of_clusters);
+    int iterations = anchors_kmeans(box_w, box_h, number_of_boxes, center_w, center_h, num_of_clusters, anchors_data.assignments, 1000);
+    printf("\n iterations = %d, %.2f sec. \n", iterations, (get_time_point() - time) / 1000000);
+    for (i = 0; i < num_of_clusters; ++i) {
+        anchors_data.centers.vals[i][0] = center_w[i];
+        anchors_data.centers.vals[i][1] = center_h[i];
+    }
+    free(center_w);
+    free(center_h);
 
     qsort((void*)anchors_data.centers.vals, num_of_clusters, 2 * sizeof(float), (__compar_fn_t)anchors_data_comparator);
 
     //gen_anchors.py = 1.19, 1.99, 2.79, 4.60, 4.53, 8.92, 8.06, 5.29, 10.32, 10.66
     //float orig_anch[] = { 1.19, 1.99, 2.79, 4.60, 4.53, 8.92, 8.06, 5.29, 10.32, 10.66 };
 
+    float *anchor_w = (float*)xcalloc(num_of_clusters, sizeof(float));
+    float *anchor_h = (float*)xcalloc(num_of_clusters, sizeof(float));
+    for (i = 0; i < num_of_clusters; ++i) {
+        anchor_w[i] = anchors_data.centers.vals[i][0];
+        anchor_h[i] = anchors_data.centers.vals[i][1];
+    }
     printf("\n");
-    float avg_iou = 0;
+    double avg_iou = 0;
+    #pragma omp parallel for reduction(+:avg_iou)
     for (i = 0; i < number_of_boxes; ++i) {
-        float box_w = rel_width_height_array[i * 2]; //points->data.fl[i * 2];
-        float box_h = rel_width_height_array[i * 2 + 1]; //points->data.fl[i * 2 + 1];
-                                                         //int cluster_idx = labels->data.i[i];
-        int cluster_idx = 0;
-        float min_dist = FLT_MAX;
-        float best_iou = 0;
-        for (j = 0; j < num_of_clusters; ++j) {
-            float anchor_w = anchors_data.centers.vals[j][0];   // centers->data.fl[j * 2];
-            float anchor_h = anchors_data.centers.vals[j][1];   // centers->data.fl[j * 2 + 1];
-            float min_w = (box_w < anchor_w) ? box_w : anchor_w;
-            float min_h = (box_h < anchor_h) ? box_h : anchor_h;
-            float box_intersect = min_w*min_h;
-            float box_union = box_w*box_h + anchor_w*anchor_h - box_intersect;
-            float iou = box_intersect / box_union;
-            float distance = 1 - iou;
-            if (distance < min_dist) {
-              min_dist = distance;
-              cluster_idx = j;
-              best_iou = iou;
-            }
-        }
-
-        float anchor_w = anchors_data.centers.vals[cluster_idx][0]; //centers->data.fl[cluster_idx * 2];
-        float anchor_h = anchors_data.centers.vals[cluster_idx][1]; //centers->data.fl[cluster_idx * 2 + 1];
+        const int cluster_idx = closest_anchor(box_w[i], box_h[i], anchor_w, anchor_h, num_of_clusters);
+        const float best_iou = 1 - anchor_distance(box_w[i], box_h[i], anchor_w[cluster_idx], anchor_h[cluster_idx]);
         if (best_iou > 1 || best_iou < 0) { // || box_w > width || box_h > height) {
             printf(" Wrong label: i = %d, box_w = %f, box_h = %f, anchor_w = %f, anchor_h = %f, iou = %f \n",
-                i, box_w, box_h, anchor_w, anchor_h, best_iou);
+                i, box_w[i], box_h[i], anchor_w[cluster_idx], anchor_h[cluster_idx], best_iou);
         }
         else avg_iou += best_iou;
     }
+    free(anchor_w);
+    free(anchor_h);
 
     char buff[1024];
     FILE* fwc = fopen("counters_per_class.txt", "wb");
@@ -1598,16 +1808,55 @@ void calc_anchors(char *datacfg, int num_of_clusters, int width, int height, int
 
     if (show) {
 #ifdef OPENCV
+        float *rel_width_height_array = (float*)xcalloc(2 * number_of_boxes, sizeof(float));
+        for (i = 0; i < number_of_boxes; ++i) {
+            rel_width_height_array[i * 2] = box_w[i];
+            rel_width_height_array[i * 2 + 1] = box_h[i];
+        }
         show_acnhors(number_of_boxes, num_of_clusters, rel_width_height_array, anchors_data, width, height);
+        free(rel_width_height_array);
 #endif // OPENCV
     }
-    free(rel_width_height_array);
+    free(box_w);
+    free(box_h);
+    free(anchors_data.assignments);
+    free_matrix(anchors_data.centers);
     free(counter_per_class);
 
     getchar();
 }
 
 
+// Writes the best class of every detection above thresh as a label file next to the image
+static void save_detection_labels(char *image_path, detection *dets, int nboxes, int classes, float thresh)
+{
+    char labelpath[4096];
+    replace_image_to_label(image_path, labelpath);
+
+    FILE* fw = fopen(labelpath, "wb");
+    if (!fw) {
+        printf(" Can't open label file %s \n", labelpath);
+        return;
+    }
+    int i, j;
+    for (i = 0; i < nboxes; ++i) {
+        char buff[1024];
+        int class_id = -1;
+        float prob = 0;
+        for (j = 0; j < classes; ++j) {
+            if (dets[i].prob[j] > thresh && dets[i].prob[j] > prob) {
+                prob = dets[i].prob[j];
+                class_id = j;
+            }
+        }
+        if (class_id >= 0) {
+            sprintf(buff, "%d %2.4f %2.4f %2.4f %2.4f\n", class_id, dets[i].bbox.x, dets[i].bbox.y, dets[i].bbox.w, dets[i].bbox.h);
+            fwrite(buff, sizeof(char), strlen(buff), fw);
+        }
+    }
+    fclose(fw);
+}
+
 void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filename, float thresh,
     float hier_thresh, int dont_show, int ext_output, int save_labels, char *outfile, int letter_box, int benchmark_layers)
 {
@@ -1623,7 +1872,9 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
     }
     if (net.letter_box) letter_box = 1;
     net.benchmark_layers = benchmark_layers;
+    if (benchmark_layers && gpu_index < 0) net.profiler = make_network_profiler(net.n, 1000);
     fuse_conv_batchnorm(net);
+    optimize_network_graph(&net);
     calculate_binary_weights(net);
     if (net.layers[net.n - 1].classes != names_size) {
         printf("\n Error: in the file %s number of names %d that isn't equal to classes=%d in the file %s \n",
@@ -1690,7 +1941,7 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
         //printf("%s: Predicted in %f seconds.\n", input, (what_time_is_it_now()-time));
 
         int nboxes = 0;
-        detection *dets = get_network_boxes(&net, im.w, im.h, thresh, hier_thresh, 0, 1, &nboxes, letter_box);
+        detection *dets = get_network_boxes_view(&net, im.w, im.h, thresh, hier_thresh, 0, 1, &nboxes, letter_box);
         if (nms) {
             if (l.nms_kind == DEFAULT_NMS) do_nms_sort(dets, nboxes, l.classes, nms);
             else diounms_sort(dets, nboxes, l.classes, nms, l.nms_kind, l.beta_nms);
@@ -1714,32 +1965,8 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
         }
 
         // pseudo labeling concept - fast.ai
-        if (save_labels)
-        {
-            char labelpath[4096];
-            replace_image_to_label(input, labelpath);
-
-            FILE* fw = fopen(labelpath, "wb");
-            int i;
-            for (i = 0; i < nboxes; ++i) {
-                char buff[1024];
-                int class_id = -1;
-                float prob = 0;
-                for (j = 0; j < l.classes; ++j) {
-                    if (dets[i].prob[j] > thresh && dets[i].prob[j] > prob) {
-                        prob = dets[i].prob[j];
-                        class_id = j;
-                    }
-                }
-                if (class_id >= 0) {
-                    sprintf(buff, "%d %2.4f %2.4f %2.4f %2.4f\n", class_id, dets[i].bbox.x, dets[i].bbox.y, dets[i].bbox.w, dets[i].bbox.h);
-                    fwrite(buff, sizeof(char), strlen(buff), fw);
-                }
-            }
-            fclose(fw);
-        }
+        if (save_labels) save_detection_labels(input, dets, nboxes, l.classes, thresh);
 
-        free_detections(dets, nboxes);
         free_image(im);
         free_image(sized);
 
@@ -1758,6 +1985,7 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
     }
 
     // free memory
+    print_network_profile(net, 0, 0);
     free_ptrs((void**)names, net.layers[net.n - 1].classes);
     free_list_contents_kvp(options);
     free_list(options);
@@ -1775,6 +2003,540 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
     free_network(net);
 }
 
+// Throughput mode of "detector test" over an image list (-batch N): worker threads decode and resize
+// images ahead of the network and run NMS, output and drawing behind it, while the calling thread only
+// runs batched forward passes. Image i lives in slot i % nslots from decode until its results are written,
+// and results are written in list order.
+typedef enum {
+    TEST_SLOT_FREE, TEST_SLOT_DECODING, TEST_SLOT_DECODED, TEST_SLOT_INFERRED, TEST_SLOT_POSTING, TEST_SLOT_DONE
+} test_slot_state;
+
+typedef struct test_slot {
+    test_slot_state state;
+    int index;              // position in the image list
+    image im;               // original image, kept only for drawing
+    int im_w, im_h;
+    image sized;            // net.w x net.h network input, allocated once per slot
+    detection *dets;
+    int nboxes;
+    char *json;
+} test_slot;
+
+typedef struct test_pipeline {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_mutex_t draw_mutex;     // draw_detections_v3() prints the objects and keeps a static frame counter
+    test_slot *slots;
+    int nslots;
+    char **paths;
+    int m;
+    int next_decode;
+    int next_write;
+
+    int c;
+    int classes;
+    char **names;
+    image **alphabet;
+    float thresh;
+    float nms;
+    NMS_KIND nms_kind;
+    float beta_nms;
+    int letter_box;
+    int ext_output;
+    int save_labels;
+    char *out_dir;
+    FILE *json_file;
+    FILE *coco_file;
+
+    double decode_time;     // micro-seconds summed over images, guarded by mutex
+    double post_time;
+} test_pipeline;
+
+static void test_pipeline_decode(test_pipeline *p, test_slot *s)
+{
+    image im = load_image(p->paths[s->index], 0, 0, p->c);
+    if (p->letter_box) letterbox_image_into_padded(im, s->sized, .5);
+    else resize_image_into(im, s->sized);
+    s->im_w = im.w;
+    s->im_h = im.h;
+    if (p->out_dir) s->im = im;
+    else free_image(im);
+}
+
+static void test_pipeline_post(test_pipeline *p, test_slot *s)
+{
+    char *path = p->paths[s->index];
+    if (p->nms) {
+        if (p->nms_kind == DEFAULT_NMS) do_nms_sort(s->dets, s->nboxes, p->classes, p->nms);
+        else diounms_sort(s->dets, s->nboxes, p->classes, p->nms, p->nms_kind, p->beta_nms);
+    }
+    if (p->json_file) s->json = detection_to_json(s->dets, s->nboxes, p->classes, p->names, s->index + 1, path);
+    if (p->save_labels) save_detection_labels(path, s->dets, s->nboxes, p->classes, p->thresh);
+    if (p->out_dir) {
+        pthread_mutex_lock(&p->draw_mutex);
+        printf("%s: \n", path);
+        draw_detections_v3(s->im, s->dets, s->nboxes, p->thresh, p->names, p->alphabet, p->classes, p->ext_output);
+        pthread_mutex_unlock(&p->draw_mutex);
+        char buff[4096];
+        char *base = basecfg(path);
+        snprintf(buff, sizeof(buff), "%s/%s", p->out_dir, base);
+        free(base);
+        save_image(s->im, buff);
+    }
+    if (p->coco_file) {
+        // print_cocos() expects absolute coordinates
+        int i;
+        for (i = 0; i < s->nboxes; ++i) {
+            s->dets[i].bbox.x *= s->im_w;
+            s->dets[i].bbox.w *= s->im_w;
+            s->dets[i].bbox.y *= s->im_h;
+            s->dets[i].bbox.h *= s->im_h;
+        }
+    }
+}
+
+// Writes and releases the finished images that are next in list order; called with the mutex held
+static void test_pipeline_flush(test_pipeline *p)
+{
+    while (p->next_write < p->m) {
+        test_slot *s = &p->slots[p->next_write % p->nslots];
+        if (s->state != TEST_SLOT_DONE || s->index != p->next_write) break;
+        if (p->json_file && s->json) {
+            if (s->index > 0) fwrite(", \n", sizeof(char), 3, p->json_file);
+            fwrite(s->json, sizeof(char), strlen(s->json), p->json_file);
+        }
+        if (p->coco_file) print_cocos(p->coco_file, p->paths[s->index], s->dets, s->nboxes, p->classes, s->im_w, s->im_h);
+        free_detections(s->dets, s->nboxes);
+        s->dets = NULL;
+        free(s->json);
+        s->json = NULL;
+        if (s->im.data) free_image(s->im);
+        s->im.data = NULL;
+        s->state = TEST_SLOT_FREE;
+        ++p->next_write;
+    }
+}
+
+// Workers prefer post-processing the oldest inferred image, so slots are recycled as early as possible
+static void *test_pipeline_worker(void *ptr)
+{
+    test_pipeline *p = (test_pipeline *)ptr;
+    pthread_mutex_lock(&p->mutex);
+    while (p->next_write < p->m) {
+        test_slot *s = NULL;
+        int post = 0;
+        int i;
+        for (i = p->next_write; i < p->next_decode; ++i) {
+            if (p->slots[i % p->nslots].state == TEST_SLOT_INFERRED) {
+                s = &p->slots[i % p->nslots];
+                post = 1;
+                break;
+            }
+        }
+        if (!s && p->next_decode < p->m && p->slots[p->next_decode % p->nslots].state == TEST_SLOT_FREE) {
+            s = &p->slots[p->next_decode % p->nslots];
+            s->index = p->next_decode++;
+        }
+        if (!s) {
+            pthread_cond_wait(&p->cond, &p->mutex);
+            continue;
+        }
+        s->state = post ? TEST_SLOT_POSTING : TEST_SLOT_DECODING;
+        pthread_mutex_unlock(&p->mutex);
+
+        double start = get_time_point();
+        if (post) test_pipeline_post(p, s);
+        else test_pipeline_decode(p, s);
+        double elapsed = get_time_point() - start;
+
+        pthread_mutex_lock(&p->mutex);
+        if (post) {
+            p->post_time += elapsed;
+            s->state = TEST_SLOT_DONE;
+            test_pipeline_flush(p);
+        }
+        else {
+            p->decode_time += elapsed;
+            s->state = TEST_SLOT_DECODED;
+        }
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return 0;
+}
+
+void test_detector_batch(char *datacfg, char *cfgfile, char *weightfile, char *filename, float thresh, float hier_thresh,
+    int ext_output, int save_labels, char *outfile, char *coco_outfile, char *out_dir, int letter_box, int batch, int nthreads,
+    int benchmark_layers)
+{
+    list *options = read_data_cfg(datacfg);
+    char *name_list = option_find_str(options, "names", "data/names.list");
+    int names_size = 0;
+    char **names = get_labels_custom(name_list, &names_size); //get_labels(name_list);
+
+    if (batch < 1) batch = 1;
+    if (nthreads < 1) nthreads = 1;
+    network net = parse_network_cfg_custom(cfgfile, batch, 1);
+    if (weightfile) {
+        load_weights(&net, weightfile);
+    }
+    if (net.letter_box) letter_box = 1;
+    net.benchmark_layers = benchmark_layers;
+    if (benchmark_layers && gpu_index < 0) net.profiler = make_network_profiler(net.n, 1000);
+    fuse_conv_batchnorm(net);
+    optimize_network_graph(&net);
+    calculate_binary_weights(net);
+    if (net.layers[net.n - 1].classes != names_size) {
+        printf("\n Error: in the file %s number of names %d that isn't equal to classes=%d in the file %s \n",
+            name_list, names_size, net.layers[net.n - 1].classes, cfgfile);
+        if (net.layers[net.n - 1].classes > names_size) getchar();
+    }
+
+    layer l = net.layers[net.n - 1];
+    int k;
+    for (k = 0; k < net.n; ++k) {
+        layer lk = net.layers[k];
+        if (lk.type == YOLO || lk.type == GAUSSIAN_YOLO || lk.type == REGION) l = lk;
+        // only [yolo] heads have a batched decode, the others stay at one image per forward
+        if (lk.type == GAUSSIAN_YOLO || lk.type == REGION || lk.type == DETECTION) batch = 1;
+    }
+    if (net.batch != batch) set_batch_network(&net, batch);
+
+    char **paths;
+    int m;
+    list *plist = NULL;
+    if (strlen(filename) > 4 && !strcmp(filename + strlen(filename) - 4, ".txt")) {
+        plist = get_paths(filename);
+        paths = (char **)list_to_array(plist);
+        m = plist->size;
+    }
+    else {
+        paths = &filename;
+        m = 1;
+    }
+
+    test_pipeline p = { 0 };
+    p.paths = paths;
+    p.m = m;
+    p.nslots = 2 * batch + nthreads;
+    p.slots = (test_slot*)xcalloc(p.nslots, sizeof(test_slot));
+    for (k = 0; k < p.nslots; ++k) p.slots[k].sized = make_image(net.w, net.h, net.c);
+    p.c = net.c;
+    p.classes = l.classes;
+    p.names = names;
+    p.alphabet = out_dir ? load_alphabet() : NULL;
+    p.thresh = thresh;
+    p.nms = .45;
+    p.nms_kind = l.nms_kind;
+    p.beta_nms = l.beta_nms;
+    p.letter_box = letter_box;
+    p.ext_output = ext_output;
+    p.save_labels = save_labels;
+    p.out_dir = out_dir;
+    if (outfile) {
+        p.json_file = fopen(outfile, "wb");
+        if (!p.json_file) error("fopen failed", DARKNET_LOC);
+        fwrite("[\n", sizeof(char), 2, p.json_file);
+    }
+    if (coco_outfile) {
+        p.coco_file = fopen(coco_outfile, "wb");
+        if (!p.coco_file) error("fopen failed", DARKNET_LOC);
+        fprintf(p.coco_file, "[\n");
+    }
+    if (pthread_mutex_init(&p.mutex, 0) || pthread_mutex_init(&p.draw_mutex, 0) || pthread_cond_init(&p.cond, 0)) {
+        error("pthread_mutex_init failed", DARKNET_LOC);
+    }
+
+    printf(" Detecting %d images: batch = %d, threads = %d \n", m, batch, nthreads);
+    double start_time = get_time_point();
+    pthread_t* thr = (pthread_t*)xcalloc(nthreads, sizeof(pthread_t));
+    for (k = 0; k < nthreads; ++k) {
+        if (pthread_create(&thr[k], 0, test_pipeline_worker, &p)) error("Thread creation failed", DARKNET_LOC);
+    }
+
+    const size_t input_size = (size_t)net.w*net.h*net.c;
+    float *X = (float*)xcalloc(input_size * batch, sizeof(float));
+    double infer_time = 0, wait_time = 0;
+    int batches = 0;
+    int start;
+    for (start = 0; start < m; start += batch) {
+        const int n = (m - start) < batch ? (m - start) : batch;
+        double time = get_time_point();
+        pthread_mutex_lock(&p.mutex);
+        for (k = 0; k < n; ++k) {
+            test_slot *s = &p.slots[(start + k) % p.nslots];
+            while (s->state != TEST_SLOT_DECODED || s->index != start + k) pthread_cond_wait(&p.cond, &p.mutex);
+        }
+        pthread_mutex_unlock(&p.mutex);
+        double ready = get_time_point();
+        wait_time += ready - time;
+
+        for (k = 0; k < n; ++k) memcpy(X + k*input_size, p.slots[(start + k) % p.nslots].sized.data, input_size * sizeof(float));
+        if (net.batch != n) set_batch_network(&net, n);
+        network_predict(net, X);
+        for (k = 0; k < n; ++k) {
+            test_slot *s = &p.slots[(start + k) % p.nslots];
+            if (batch == 1) {
+                s->dets = get_network_boxes(&net, s->im_w, s->im_h, thresh, hier_thresh, 0, 1, &s->nboxes, letter_box);
+            }
+            else {
+                s->dets = make_network_boxes_batch(&net, thresh, &s->nboxes, k);
+                fill_network_boxes_batch(&net, s->im_w, s->im_h, thresh, hier_thresh, 0, 1, s->dets, letter_box, k);
+            }
+        }
+        infer_time += get_time_point() - ready;
+        ++batches;
+
+        pthread_mutex_lock(&p.mutex);
+        for (k = 0; k < n; ++k) p.slots[(start + k) % p.nslots].state = TEST_SLOT_INFERRED;
+        pthread_cond_broadcast(&p.cond);
+        pthread_mutex_unlock(&p.mutex);
+    }
+    for (k = 0; k < nthreads; ++k) pthread_join(thr[k], 0);
+    double total_time = get_time_point() - start_time;
+
+    printf("\n Detected %d images in %lf seconds: %.2lf img/sec \n", m, total_time / 1000000, m / (total_time / 1000000));
+    if (m > 0) {
+        printf(" decode+resize: %lf ms/img (%d threads), inference: %lf ms/img (%lf ms/batch of %d), post: %lf ms/img \n",
+            p.decode_time / 1000 / m, nthreads, infer_time / 1000 / m, infer_time / 1000 / batches, batch, p.post_time / 1000 / m);
+        printf(" inference waited %lf ms for decoded images \n", wait_time / 1000);
+    }
+
+    if (p.json_file) {
+        fwrite("\n]", sizeof(char), 2, p.json_file);
+        fclose(p.json_file);
+    }
+    if (p.coco_file) {
+        if (ftell(p.coco_file) > 2) {
+#ifdef WIN32
+            fseek(p.coco_file, -3, SEEK_CUR);
+#else
+            fseek(p.coco_file, -2, SEEK_CUR);
+#endif
+        }
+        fprintf(p.coco_file, "\n]\n");
+        fclose(p.coco_file);
+    }
+
+    pthread_mutex_destroy(&p.mutex);
+    pthread_mutex_destroy(&p.draw_mutex);
+    pthread_cond_destroy(&p.cond);
+    free(thr);
+    free(X);
+    for (k = 0; k < p.nslots; ++k) free_image(p.slots[k].sized);
+    free(p.slots);
+    if (p.alphabet) {
+        int i, j;
+        const int nsize = 8;
+        for (j = 0; j < nsize; ++j) {
+            for (i = 32; i < 127; ++i) {
+                free_image(p.alphabet[j][i]);
+            }
+            free(p.alphabet[j]);
+        }
+        free(p.alphabet);
+    }
+    if (plist) {
+        free_list_contents(plist);
+        free_list(plist);
+        free(paths);
+    }
+    print_network_profile(net, 0, 0);
+    free_ptrs((void**)names, names_size);
+    free_list_contents_kvp(options);
+    free_list(options);
+    free_network(net);
+}
+
+typedef struct nms_bench_set {
+    detection *dets;        // as returned by get_network_boxes()
+    int nboxes;
+    float *probs;           // snapshot of every dets[i].prob, restored before each run
+    detection *work;
+} nms_bench_set;
+
+static int compare_detection_prob_ptr(const void *pa, const void *pb)
+{
+    const float *a = ((const detection *)pa)->prob;
+    const float *b = ((const detection *)pb)->prob;
+    return (a > b) - (a < b);
+}
+
+static void restore_nms_bench_set(nms_bench_set *s, int classes)
+{
+    int i;
+    memcpy(s->work, s->dets, s->nboxes * sizeof(detection));
+    for (i = 0; i < s->nboxes; ++i) memcpy(s->dets[i].prob, s->probs + (size_t)i*classes, classes * sizeof(float));
+}
+
+// Kept (prob > 0) pattern after an NMS run, in a fixed detection order; the legacy functions reorder dets
+static void nms_bench_result(nms_bench_set *s, int classes, unsigned char *kept)
+{
+    int i, k;
+    qsort(s->work, s->nboxes, sizeof(detection), compare_detection_prob_ptr);
+    for (i = 0; i < s->nboxes; ++i) {
+        for (k = 0; k < classes; ++k) kept[(size_t)i*classes + k] = s->work[i].prob[k] > 0;
+    }
+}
+
+// Times the legacy qsort()-per-class NMS against the NMS engine on detection sets recorded from
+// real network outputs (use a low -thresh, e.g. 0.005 as for mAP, to get large sets).
+void benchmark_nms(char *datacfg, char *cfgfile, char *weightfile, char *filename, float thresh, float hier_thresh, int iters)
+{
+    network net = parse_network_cfg_custom(cfgfile, 1, 1);    // set batch=1
+    if (weightfile) {
+        load_weights(&net, weightfile);
+    }
+    fuse_conv_batchnorm(net);
+    optimize_network_graph(&net);
+    calculate_binary_weights(net);
+    layer l = net.layers[net.n - 1];
+    const int classes = l.classes;
+
+    list *options = read_data_cfg(datacfg);
+    list *plist = NULL;
+    char **paths = &filename;
+    int m = 1;
+    if (!filename || strstr(filename, ".txt")) {
+        plist = get_paths(filename ? filename : option_find_str(options, "valid", "data/train.txt"));
+        paths = (char **)list_to_array(plist);
+        m = min_val_cmp(plist->size, 32);
+    }
+
+    int i, j, t;
+    int total_boxes = 0, max_boxes = 0;
+    nms_bench_set *sets = (nms_bench_set *)xcalloc(m, sizeof(nms_bench_set));
+    for (i = 0; i < m; ++i) {
+        image im = load_image(paths[i], 0, 0, net.c);
+        network_predict_image(&net, im);
+        sets[i].dets = get_network_boxes(&net, im.w, im.h, thresh, hier_thresh, 0, 1, &sets[i].nboxes, 0);
+        sets[i].probs = (float *)xcalloc((size_t)sets[i].nboxes * classes + 1, sizeof(float));
+        sets[i].work = (detection *)xcalloc(sets[i].nboxes + 1, sizeof(detection));
+        for (j = 0; j < sets[i].nboxes; ++j) memcpy(sets[i].probs + (size_t)j*classes, sets[i].dets[j].prob, classes * sizeof(float));
+        total_boxes += sets[i].nboxes;
+        max_boxes = max_val_cmp(max_boxes, sets[i].nboxes);
+        free_image(im);
+    }
+    printf("\n %d detection sets, %d boxes (max %d per set), %d classes, thresh = %.4f, %d iterations \n",
+        m, total_boxes, max_boxes, classes, thresh, iters);
+
+    const float nms = .45;
+    const char *names[] = { "do_nms_sort", "diounms_sort GREEDY", "diounms_sort DIOU", "do_nms_obj" };
+    unsigned char *kept_legacy = (unsigned char *)xcalloc((size_t)max_boxes * classes + 1, 1);
+    unsigned char *kept_engine = (unsigned char *)xcalloc((size_t)max_boxes * classes + 1, 1);
+    printf(" %-20s | legacy, ms | engine, ms | speedup | mismatches \n", "method");
+    for (t = 0; t < 4; ++t) {
+        double time_legacy = 0, time_engine = 0;
+        long long mismatches = 0;
+        for (i = 0; i < m; ++i) {
+            nms_bench_set *s = &sets[i];
+            int v;
+            for (v = 0; v < 2; ++v) {
+                int it;
+                for (it = 0; it < iters; ++it) {
+                    restore_nms_bench_set(s, classes);
+                    double start = get_time_point();
+                    if (v == 0) {
+                        if (t == 0) do_nms_sort_legacy(s->work, s->nboxes, classes, nms);
+                        else if (t == 1) diounms_sort_legacy(s->work, s->nboxes, classes, nms, GREEDY_NMS, l.beta_nms);
+                        else if (t == 2) diounms_sort_legacy(s->work, s->nboxes, classes, nms, DIOU_NMS, l.beta_nms);
+                        else do_nms_obj_legacy(s->work, s->nboxes, classes, nms);
+                        time_legacy += get_time_point() - start;
+                    }
+                    else {
+                        if (t == 0) do_nms_sort(s->work, s->nboxes, classes, nms);
+                        else if (t == 1) diounms_sort(s->work, s->nboxes, classes, nms, GREEDY_NMS, l.beta_nms);
+                        else if (t == 2) diounms_sort(s->work, s->nboxes, classes, nms, DIOU_NMS, l.beta_nms);
+                        else do_nms_obj(s->work, s->nboxes, classes, nms);
+                        time_engine += get_time_point() - start;
+                    }
+                }
+                nms_bench_result(s, classes, v == 0 ? kept_legacy : kept_engine);
+            }
+            for (j = 0; j < s->nboxes * classes; ++j) mismatches += kept_legacy[j] != kept_engine[j];
+        }
+        time_legacy /= 1000. * iters * m;
+        time_engine /= 1000. * iters * m;
+        printf(" %-20s | %10.3f | %10.3f | %6.1fx | %lld \n", names[t], time_legacy, time_engine,
+            time_engine > 0 ? time_legacy / time_engine : 0, mismatches);
+    }
+    double time_soft = 0;
+    for (i = 0; i < m; ++i) {
+        int it;
+        for (it = 0; it < iters; ++it) {
+            restore_nms_bench_set(&sets[i], classes);
+            double start = get_time_point();
+            soft_nms_sort(sets[i].work, sets[i].nboxes, classes, 0.5, thresh);
+            time_soft += get_time_point() - start;
+        }
+    }
+    printf(" %-20s | %10s | %10.3f | \n", "soft_nms_sort", "-", time_soft / (1000. * iters * m));
+    printf(" (ms per detection set; mismatches = kept/suppressed (box, class) decisions that differ, only score ties may differ) \n");
+
+    for (i = 0; i < m; ++i) {
+        free_detections(sets[i].dets, sets[i].nboxes);
+        free(sets[i].probs);
+        free(sets[i].work);
+    }
+    free(sets);
+    free(kept_legacy);
+    free(kept_engine);
+    if (plist) {
+        free_list_contents(plist);
+        free_list(plist);
+        free(paths);
+    }
+    free_list_contents_kvp(options);
+    free_list(options);
+    free_network(net);
+}
+
+// HTTP inference server: requests from many clients are batched dynamically (see run_detector_server()).
+// With -benchmark and an image, runs a local load generator instead and reports latency and throughput.
+void serve_detector(char *datacfg, char *cfgfile, char *weightfile, char *filename, float thresh, float hier_thresh, int letter_box,
+    int port, int max_batch, int max_latency_ms, int benchmark, int clients, int requests)
+{
+    list *options = read_data_cfg(datacfg);
+    char *name_list = option_find_str(options, "names", "data/names.list");
+    int names_size = 0;
+    char **names = get_labels_custom(name_list, &names_size); //get_labels(name_list);
+
+    if (max_batch < 1) max_batch = 1;
+    network net = parse_network_cfg_custom(cfgfile, max_batch, 1); // buffers for the largest batch
+    if (weightfile) {
+        load_weights(&net, weightfile);
+    }
+    if (net.letter_box) letter_box = 1;
+    // only [yolo] heads have a batched decode, the others serve one image per forward
+    int k;
+    for (k = 0; k < net.n; ++k) {
+        LAYER_TYPE type = net.layers[k].type;
+        if (type == GAUSSIAN_YOLO || type == REGION || type == DETECTION) max_batch = 1;
+    }
+    if (net.batch != max_batch) set_batch_network(&net, max_batch);
+    fuse_conv_batchnorm(net);
+    optimize_network_graph(&net);
+    calculate_binary_weights(net);
+    const int classes = net.layers[net.n - 1].classes;
+    if (classes != names_size) {
+        printf("\n Error: in the file %s number of names %d that isn't equal to classes=%d in the file %s \n",
+            name_list, names_size, classes, cfgfile);
+        if (classes > names_size) getchar();
+    }
+
+    if (benchmark && filename) {
+        benchmark_detector_server(&net, names, classes, filename, port, max_batch, max_latency_ms, clients, requests, thresh, hier_thresh, letter_box);
+    }
+    else {
+        run_detector_server(&net, names, classes, port, max_batch, max_latency_ms, thresh, hier_thresh, letter_box);
+    }
+
+    free_ptrs((void**)names, names_size);
+    free_list_contents_kvp(options);
+    free_list(options);
+    free_network(net);
+}
+
 #if defined(OPENCV) && defined(GPU)
 
 // adversarial attack dnn
@@ -1984,7 +2746,7 @@ void run_detector(int argc, char **argv)
     int save_labels = find_arg(argc, argv, "-save_labels");
     char* chart_path = find_char_arg(argc, argv, "-chart", 0);
     if (argc < 4) {
-        fprintf(stderr, "usage: %s %s [train/test/valid/demo/map] [data] [cfg] [weights (optional)]\n", argv[0], argv[1]);
+        fprintf(stderr, "usage: %s %s [train/test/valid/demo/map/serve] [data] [cfg] [weights (optional)]\n", argv[0], argv[1]);
         return;
     }
     char *gpu_list = find_char_arg(argc, argv, "-gpus", 0);
@@ -2010,6 +2772,14 @@ void run_detector(int argc, char **argv)
         gpus = &gpu;
         ngpus = 1;
     }
+#ifndef GPU
+    // CPU builds: train this many replicas of the network in parallel, one part of the data each
+    int train_threads = find_int_arg(argc, argv, "-train_threads", 1);
+    if (train_threads > 1 && !gpu_list) {
+        ngpus = train_threads;
+        gpus = (int*)xcalloc(ngpus, sizeof(int));
+    }
+#endif
 
     int clear = find_arg(argc, argv, "-clear");
 
@@ -2020,11 +2790,30 @@ void run_detector(int argc, char **argv)
         if (strlen(weights) > 0)
             if (weights[strlen(weights) - 1] == 0x0d) weights[strlen(weights) - 1] = 0;
     char *filename = (argc > 6) ? argv[6] : 0;
-    if (0 == strcmp(argv[2], "test")) test_detector(datacfg, cfg, weights, filename, thresh, hier_thresh, dont_show, ext_output, save_labels, outfile, letter_box, benchmark_layers);
+    if (0 == strcmp(argv[2], "test")) {
+        int batch = find_int_arg(argc, argv, "-batch", 0);    // > 0 - pipelined throughput mode, e.g. for a list of images
+        if (batch > 0 && filename) {
+            int threads = find_int_arg(argc, argv, "-threads", 4);
+            char *coco_outfile = find_char_arg(argc, argv, "-coco_out", 0);
+            char *out_dir = find_char_arg(argc, argv, "-out_dir", 0);    // draw and save the detections to this directory
+            test_detector_batch(datacfg, cfg, weights, filename, thresh, hier_thresh, ext_output, save_labels, outfile, coco_outfile,
+                out_dir, letter_box, batch, threads, benchmark_layers);
+        }
+        else test_detector(datacfg, cfg, weights, filename, thresh, hier_thresh, dont_show, ext_output, save_labels, outfile, letter_box, benchmark_layers);
+    }
     else if (0 == strcmp(argv[2], "train")) train_detector(datacfg, cfg, weights, gpus, ngpus, clear, dont_show, calc_map, thresh, iou_thresh, mjpeg_port, show_imgs, benchmark_layers, chart_path);
     else if (0 == strcmp(argv[2], "valid")) validate_detector(datacfg, cfg, weights, outfile);
     else if (0 == strcmp(argv[2], "recall")) validate_detector_recall(datacfg, cfg, weights);
     else if (0 == strcmp(argv[2], "map")) validate_detector_map(datacfg, cfg, weights, thresh, iou_thresh, map_points, letter_box, NULL);
+    else if (0 == strcmp(argv[2], "nms_bench")) benchmark_nms(datacfg, cfg, weights, filename, thresh, hier_thresh, find_int_arg(argc, argv, "-iters", 20));
+    else if (0 == strcmp(argv[2], "serve")) {
+        int port = find_int_arg(argc, argv, "-port", 8090);
+        int max_batch = find_int_arg(argc, argv, "-max_batch", 8);
+        int max_latency = find_int_arg(argc, argv, "-max_latency", 10);    // ms
+        int clients = find_int_arg(argc, argv, "-clients", 16);
+        int requests = find_int_arg(argc, argv, "-requests", 256);
+        serve_detector(datacfg, cfg, weights, filename, thresh, hier_thresh, letter_box, port, max_batch, max_latency, benchmark, clients, requests);
+    }
     else if (0 == strcmp(argv[2], "calc_anchors")) calc_anchors(datacfg, num_of_clusters, width, height, show);
     else if (0 == strcmp(argv[2], "draw")) {
         int it_num = 100;
@@ -2038,13 +2827,22 @@ void run_detector(int argc, char **argv)
         if (filename)
             if (strlen(filename) > 0)
                 if (filename[strlen(filename) - 1] == 0x0d) filename[strlen(filename) - 1] = 0;
-        demo(cfg, weights, thresh, hier_thresh, cam_index, filename, names, classes, avgframes, frame_skip, prefix, out_filename,
-            mjpeg_port, dontdraw_bbox, json_port, dont_show, ext_output, letter_box, time_limit_sec, http_post_host, benchmark, benchmark_layers);
+        char *sources = find_char_arg(argc, argv, "-sources", 0);    // e.g. -sources 0,1,video.mp4
+        if (sources) {
+            int max_batch = find_int_arg(argc, argv, "-max_batch", 0);    // 0 - number of sources
+            int max_latency = find_int_arg(argc, argv, "-max_latency", 10);    // ms
+            demo_multi(cfg, weights, thresh, hier_thresh, sources, names, classes, max_batch, max_latency, out_filename,
+                mjpeg_port, json_port, dont_show, ext_output, letter_box, time_limit_sec, benchmark_layers);
+        }
+        else {
+            demo(cfg, weights, thresh, hier_thresh, cam_index, filename, names, classes, avgframes, frame_skip, prefix, out_filename,
+                mjpeg_port, dontdraw_bbox, json_port, dont_show, ext_output, letter_box, time_limit_sec, http_post_host, benchmark, benchmark_layers);
+        }
 
         free_list_contents_kvp(options);
         free_list(options);
     }
     else printf(" There isn't such command: %s", argv[2]);
 
-    if (gpus && gpu_list && ngpus > 1) free(gpus);
+    if (gpus && ngpus > 1) free(gpus);
 }
@@ -0,0 +1,337 @@
+// Fixed-point accuracy regression: runs a network through the float reference gemm and through the
+// fixed-point gemm path side by side and reports the error per layer, sweeps the number of fractional
+// bits to find the narrowest format per layer and optionally compares mAP on a validation list.
+//
+//  darknet fxcheck [cfg] [weights] [image] [-scale 17] [-scales 8,10,...,24] [-snr 40] [-csv file]
+//                  [-data obj.data] [-thresh .25] [-iou_thresh .5] [-map_sweep] [-device]
+//
+// The fixed-point side is gemm_cpu() unless -device sends it through gemm() as built (gemm_fpga()
+// with FPGA_ACCEL); the accelerator bitstream only implements FXFP_SCALE.
+#include "darknet.h"
+#include "network.h"
+#include "parser.h"
+#include "image.h"
+#include "gemm.h"
+#include "utils.h"
+#include "fpga.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+typedef struct fx_layer_error {
+    double max_abs;
+    double mean_abs;
+    double snr;             // dB, +inf when the outputs match exactly
+    double ref_max;         // max |reference output|
+    size_t conversions;     // float->fixed conversions done by the layer's gemm calls
+    size_t saturated;       // ... of which were clipped to the int32 range
+} fx_layer_error;
+
+static fx_layer_error compare_outputs(const float *ref, const float *x, size_t n)
+{
+    fx_layer_error e = { 0 };
+    double signal = 0, noise = 0, sum = 0;
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        const double d = (double)x[i] - ref[i];
+        const double ad = fabs(d);
+        sum += ad;
+        if (ad > e.max_abs) e.max_abs = ad;
+        if (fabs(ref[i]) > e.ref_max) e.ref_max = fabs(ref[i]);
+        signal += (double)ref[i] * ref[i];
+        noise += d * d;
+    }
+    e.mean_abs = n ? sum / n : 0;
+    if (noise == 0) e.snr = INFINITY;
+    else if (signal == 0) e.snr = -INFINITY;
+    else e.snr = 10 * log10(signal / noise);
+    return e;
+}
+
+static int is_fx_output_layer(network net, int i)
+{
+    const LAYER_TYPE t = net.layers[i].type;
+    return i == net.n - 1 || t == YOLO || t == GAUSSIAN_YOLO || t == REGION || t == DETECTION;
+}
+
+// End-to-end accuracy: the worst SNR over the detection (or last) layers
+static double output_snr(network net, const fx_layer_error *err)
+{
+    double snr = INFINITY;
+    int i;
+    for (i = 0; i < net.n; ++i) {
+        if (is_fx_output_layer(net, i) && err[i].snr < snr) snr = err[i].snr;
+    }
+    return snr;
+}
+
+// gemm_cpu() writes the quantized operands back, so every fixed-point pass leaves the weights rounded
+// to its format. Keep a float copy and restore it before each pass.
+static float **snapshot_weights(network net)
+{
+    float **w = (float**)xcalloc(net.n, sizeof(float*));
+    int i;
+    for (i = 0; i < net.n; ++i) {
+        layer l = net.layers[i];
+        if ((l.type == CONVOLUTIONAL || l.type == CONNECTED) && l.weights && l.nweights > 0) {
+            w[i] = (float*)xcalloc(l.nweights, sizeof(float));
+            memcpy(w[i], l.weights, l.nweights * sizeof(float));
+        }
+    }
+    return w;
+}
+
+static void restore_weights(network net, float **w)
+{
+    int i;
+    for (i = 0; i < net.n; ++i) {
+        if (w[i]) memcpy(net.layers[i].weights, w[i], net.layers[i].nweights * sizeof(float));
+    }
+}
+
+// forward_network() one layer at a time. scales == NULL runs the float reference and stores every
+// output in ref[]; otherwise layer i runs in fixed-point with scales[i] fractional bits and its output
+// is compared to ref[i]. With local = 1 the output is then replaced by ref[i], so each layer is
+// measured on exact inputs instead of on the error accumulated by the layers before it.
+static void run_fx_pass(network net, float **weights, const float *input, float *X,
+    int fixed_path, const int *scales, float **ref, int local, fx_layer_error *err)
+{
+    network_state state = { 0 };
+    state.net = net;
+    state.workspace = net.workspace;
+    state.train = 0;
+    memcpy(X, input, net.inputs * sizeof(float));
+    state.input = X;
+    restore_weights(net, weights);
+
+    set_gemm_path(scales ? fixed_path : GEMM_PATH_FLOAT);
+    int i;
+    for (i = 0; i < net.n; ++i) {
+        state.index = i;
+        layer l = net.layers[i];
+        const size_t outputs = (size_t)l.outputs * l.batch;
+        if (scales) {
+            set_gemm_fx_scale(scales[i]);
+            reset_gemm_fx_saturation(1);
+        }
+        l.forward(l, state);
+        if (scales) {
+            err[i] = compare_outputs(ref[i], l.output, outputs);
+            get_gemm_fx_saturation(&err[i].conversions, &err[i].saturated);
+            if (local) memcpy(l.output, ref[i], outputs * sizeof(float));
+        }
+        else memcpy(ref[i], l.output, outputs * sizeof(float));
+        state.input = l.output;
+    }
+    set_gemm_path(GEMM_PATH_DEFAULT);
+    set_gemm_fx_scale(FXFP_SCALE);
+    reset_gemm_fx_saturation(0);
+}
+
+static void print_snr(FILE *fp, double snr)
+{
+    if (isinf(snr)) fprintf(fp, snr > 0 ? "    inf" : "   -inf");
+    else fprintf(fp, " %6.1f", snr);
+}
+
+// Integer bits needed for values up to max_abs (without the sign bit)
+static int fx_int_bits(double max_abs)
+{
+    if (max_abs < 1) return 0;
+    return (int)floor(log2(max_abs)) + 1;
+}
+
+static float fx_map(char *datacfg, char *cfgfile, char *weightfile, float thresh, float iou_thresh,
+    network *net, float **weights, int path, int scale)
+{
+    restore_weights(*net, weights);
+    set_gemm_path(path);
+    set_gemm_fx_scale(scale);
+    float map = validate_detector_map(datacfg, cfgfile, weightfile, thresh, iou_thresh, 0, net->letter_box, net);
+    set_gemm_path(GEMM_PATH_DEFAULT);
+    set_gemm_fx_scale(FXFP_SCALE);
+    return map;
+}
+
+void run_fxcheck(int argc, char **argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s fxcheck [cfg] [weights] [image] [-scale %d] [-scales 8,10,...] [-snr 40] [-csv file] "
+            "[-data obj.data] [-thresh .25] [-iou_thresh .5] [-map_sweep] [-device]\n", argv[0], FXFP_SCALE);
+        return;
+    }
+    // positional arguments first, find_*_arg() removes the options it finds from argv
+    char *cfgfile = argv[2];
+    char *weightfile = (argc > 3 && argv[3][0] != '-') ? argv[3] : 0;
+    char *filename = (weightfile && argc > 4 && argv[4][0] != '-') ? argv[4] : 0;
+    int report_scale = find_int_arg(argc, argv, "-scale", FXFP_SCALE);
+    char *scales_list = find_char_arg(argc, argv, "-scales", "8,10,12,13,14,15,16,17,18,20,22,24");
+    float target_snr = find_float_arg(argc, argv, "-snr", 40);
+    char *csv_file = find_char_arg(argc, argv, "-csv", 0);
+    char *datacfg = find_char_arg(argc, argv, "-data", 0);
+    float thresh = find_float_arg(argc, argv, "-thresh", .25);
+    float iou_thresh = find_float_arg(argc, argv, "-iou_thresh", .5);
+    int map_sweep = find_arg(argc, argv, "-map_sweep");
+    const int fixed_path = find_arg(argc, argv, "-device") ? GEMM_PATH_DEFAULT : GEMM_PATH_FIXED_CPU;
+
+    int nscales = 0;
+    int *sweep = (int*)xcalloc(strlen(scales_list) / 2 + 1, sizeof(int));
+    char *p = scales_list;
+    while (*p) {
+        int s = atoi(p);
+        if (s >= 8 && s <= 30 && (nscales == 0 || s > sweep[nscales - 1])) sweep[nscales++] = s;
+        else if (s < 8 || s > 30) printf(" fxcheck: ignoring scale %d, the fixed-point path supports 8..30 \n", s);
+        while (*p && *p != ',') ++p;
+        if (*p == ',') ++p;
+    }
+    if (nscales == 0) error("fxcheck: -scales must list ascending values in 8..30", DARKNET_LOC);
+    if (report_scale < 8 || report_scale > 30) error("fxcheck: -scale must be in 8..30", DARKNET_LOC);
+
+    gpu_index = -1;     // both paths go through gemm() on the CPU
+    network net = parse_network_cfg_custom(cfgfile, 1, 1);
+    if (weightfile) load_weights(&net, weightfile);
+    fuse_conv_batchnorm(net);
+    calculate_binary_weights(net);
+    float **weights = snapshot_weights(net);
+
+    float *input = (float*)xcalloc(net.inputs, sizeof(float));
+    float *X = (float*)xcalloc(net.inputs, sizeof(float));
+    if (filename) {
+        image im = load_image(filename, 0, 0, net.c);
+        image sized = net.letter_box ? letterbox_image(im, net.w, net.h) : resize_image(im, net.w, net.h);
+        memcpy(input, sized.data, net.inputs * sizeof(float));
+        free_image(im);
+        free_image(sized);
+    }
+    else {
+        int k;
+        for (k = 0; k < net.inputs; ++k) input[k] = rand_uniform(0, 1);
+    }
+
+    int i, j;
+    float **ref = (float**)xcalloc(net.n, sizeof(float*));
+    for (i = 0; i < net.n; ++i) ref[i] = (float*)xcalloc((size_t)net.layers[i].outputs * net.layers[i].batch, sizeof(float));
+    fx_layer_error *prop = (fx_layer_error*)xcalloc(net.n, sizeof(fx_layer_error));
+    fx_layer_error *local = (fx_layer_error*)xcalloc(net.n, sizeof(fx_layer_error));
+    fx_layer_error *tmp = (fx_layer_error*)xcalloc(net.n, sizeof(fx_layer_error));
+    double *local_snr = (double*)xcalloc((size_t)net.n * nscales, sizeof(double));     // [scale][layer]
+    double *sweep_snr = (double*)xcalloc(nscales, sizeof(double));
+    size_t *sweep_sat = (size_t*)xcalloc(nscales, sizeof(size_t));
+    int *scales = (int*)xcalloc(net.n, sizeof(int));
+
+    run_fx_pass(net, weights, input, X, GEMM_PATH_FLOAT, NULL, ref, 0, NULL);
+
+    for (i = 0; i < net.n; ++i) scales[i] = report_scale;
+    run_fx_pass(net, weights, input, X, fixed_path, scales, ref, 0, prop);
+    run_fx_pass(net, weights, input, X, fixed_path, scales, ref, 1, local);
+
+    for (j = 0; j < nscales; ++j) {
+        for (i = 0; i < net.n; ++i) scales[i] = sweep[j];
+        run_fx_pass(net, weights, input, X, fixed_path, scales, ref, 1, tmp);
+        for (i = 0; i < net.n; ++i) local_snr[j*net.n + i] = tmp[i].snr;
+        run_fx_pass(net, weights, input, X, fixed_path, scales, ref, 0, tmp);
+        sweep_snr[j] = output_snr(net, tmp);
+        for (i = 0; i < net.n; ++i) sweep_sat[j] += tmp[i].saturated;
+    }
+
+    // narrowest fractional bits per layer that keep the layer's own error under the target;
+    // layers without a gemm are insensitive to the format and run at the narrowest scale
+    int *frac_bits = (int*)xcalloc(net.n, sizeof(int));
+    for (i = 0; i < net.n; ++i) {
+        frac_bits[i] = -1;
+        for (j = 0; j < nscales && local[i].conversions; ++j) {
+            if (local_snr[j*net.n + i] >= target_snr) {
+                frac_bits[i] = sweep[j];
+                break;
+            }
+        }
+        if (frac_bits[i] >= 0) scales[i] = frac_bits[i];
+        else scales[i] = local[i].conversions ? sweep[nscales - 1] : sweep[0];
+    }
+    run_fx_pass(net, weights, input, X, fixed_path, scales, ref, 0, tmp);
+    const double mixed_snr = output_snr(net, tmp);
+
+    printf("\n fixed-point accuracy at Q.%d (propagated = whole network in fixed-point, local = float inputs per layer)\n", report_scale);
+    printf("   layer  type           max_abs    mean_abs  snr_dB  local_dB  saturated    |ref|max  narrowest (snr >= %.0f dB)\n", target_snr);
+    for (i = 0; i < net.n; ++i) {
+        const fx_layer_error e = prop[i];
+        printf(" %5d  %-12s %10.4g  %10.4g ", i, get_layer_string(net.layers[i].type), e.max_abs, e.mean_abs);
+        print_snr(stdout, e.snr);
+        printf("  ");
+        print_snr(stdout, local[i].snr);
+        printf("  %9zu  %10.4g  ", e.saturated, e.ref_max);
+        if (!local[i].conversions) printf(" - (no gemm)\n");
+        else if (frac_bits[i] < 0) printf(" none of the swept scales\n");
+        else {
+            const int int_bits = fx_int_bits(e.ref_max);
+            printf(" Q%d.%d (%d bits)%s\n", int_bits, frac_bits[i], 1 + int_bits + frac_bits[i],
+                1 + int_bits + frac_bits[i] > 32 ? " exceeds int32" : "");
+        }
+    }
+
+    printf("\n global scale sweep (end-to-end output SNR):\n");
+    printf("   scale  output_dB  saturated\n");
+    int narrowest_global = -1;
+    for (j = 0; j < nscales; ++j) {
+        printf("   %5d    ", sweep[j]);
+        print_snr(stdout, sweep_snr[j]);
+        printf("  %9zu\n", sweep_sat[j]);
+        if (narrowest_global < 0 && sweep_snr[j] >= target_snr) narrowest_global = sweep[j];
+    }
+    if (narrowest_global < 0) printf(" no global scale reaches %.1f dB at the output \n", target_snr);
+    else printf(" narrowest global scale: Q.%d \n", narrowest_global);
+    printf(" per-layer narrowest scales: output ");
+    print_snr(stdout, mixed_snr);
+    printf(" dB \n");
+
+    if (datacfg) {
+        const float map_float = fx_map(datacfg, cfgfile, weightfile, thresh, iou_thresh, &net, weights, GEMM_PATH_FLOAT, FXFP_SCALE);
+        const float map_fx = fx_map(datacfg, cfgfile, weightfile, thresh, iou_thresh, &net, weights, fixed_path, report_scale);
+        printf("\n mAP@%.2f: float = %2.2f %%, Q.%d = %2.2f %%, delta = %+2.2f %% \n", iou_thresh,
+            map_float * 100, report_scale, map_fx * 100, (map_fx - map_float) * 100);
+        if (map_sweep) {
+            for (j = 0; j < nscales; ++j) {
+                const float m = fx_map(datacfg, cfgfile, weightfile, thresh, iou_thresh, &net, weights, fixed_path, sweep[j]);
+                printf(" mAP@%.2f Q.%d = %2.2f %%, delta = %+2.2f %% \n", iou_thresh, sweep[j], m * 100, (m - map_float) * 100);
+            }
+        }
+    }
+
+    if (csv_file) {
+        FILE *fp = fopen(csv_file, "w");
+        if (!fp) file_error(csv_file);
+        fprintf(fp, "layer,type,max_abs,mean_abs,snr_db,local_snr_db,conversions,saturated,ref_max,narrowest_frac_bits,int_bits");
+        for (j = 0; j < nscales; ++j) fprintf(fp, ",local_snr_q%d", sweep[j]);
+        fprintf(fp, "\n");
+        for (i = 0; i < net.n; ++i) {
+            const fx_layer_error e = prop[i];
+            fprintf(fp, "%d,%s,%g,%g,%g,%g,%zu,%zu,%g,%d,%d", i, get_layer_string(net.layers[i].type), e.max_abs,
+                e.mean_abs, e.snr, local[i].snr, e.conversions, e.saturated, e.ref_max, frac_bits[i], fx_int_bits(e.ref_max));
+            for (j = 0; j < nscales; ++j) fprintf(fp, ",%g", local_snr[j*net.n + i]);
+            fprintf(fp, "\n");
+        }
+        fclose(fp);
+        printf(" saved %s \n", csv_file);
+    }
+
+    restore_weights(net, weights);
+    for (i = 0; i < net.n; ++i) {
+        free(ref[i]);
+        free(weights[i]);
+    }
+    free(ref);
+    free(weights);
+    free(prop);
+    free(local);
+    free(tmp);
+    free(local_snr);
+    free(sweep_snr);
+    free(sweep_sat);
+    free(scales);
+    free(frac_bits);
+    free(sweep);
+    free(input);
+    free(X);
+    free_network(net);
+}
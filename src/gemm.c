@@ -6,12 +6,18 @@
 #include <stdio.h>
 #include <math.h>
 #include <float.h>
+#include <limits.h>
 #include <string.h>
 #include <stddef.h>
 #include <stdint.h>
 #if defined(_OPENMP)
 #include <omp.h>
 #endif
+#if defined(__AVX512VPOPCNTDQ__) && defined(__AVX512F__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 
 #define FPGA_ACCEL
 #define __INFINITE_MEM__
@@ -112,12 +118,60 @@ void time_random_matrix(int TA, int TB, int m, int k, int n)
 }
 
 
+// Fixed-point format of the software gemm path. fx_scale replaces FXFP_SCALE at run time so that
+// fxcheck can sweep formats; gemm_path can pin gemm() to the float reference or to gemm_cpu().
+static int fx_scale = FXFP_SCALE;
+static float fx_one = (float)((fx_t)1 << FXFP_SCALE);
+static int gemm_path = GEMM_PATH_DEFAULT;
+static int fx_count_saturation = 0;
+static size_t fx_conversions = 0;
+static size_t fx_saturations = 0;
+
+void set_gemm_fx_scale(int scale)
+{
+    if (scale < 8) scale = 8;
+    if (scale > 30) scale = 30;
+    fx_scale = scale;
+    fx_one = (float)((fx_t)1 << scale);
+}
+
+int get_gemm_fx_scale()
+{
+    return fx_scale;
+}
+
+void set_gemm_path(int path)
+{
+    gemm_path = path;
+}
+
+void reset_gemm_fx_saturation(int count)
+{
+    fx_count_saturation = count;
+    fx_conversions = 0;
+    fx_saturations = 0;
+}
+
+void get_gemm_fx_saturation(size_t *conversions, size_t *saturated)
+{
+    if (conversions) *conversions = fx_conversions;
+    if (saturated) *saturated = fx_saturations;
+}
+
 void gemm(int TA, int TB, int M, int N, int K, float ALPHA,
         float *A, int lda,
         float *B, int ldb,
         float BETA,
         float *C, int ldc)
 {
+    if (gemm_path == GEMM_PATH_FLOAT) {
+        cpu_gemm(TA, TB, M, N, K, ALPHA, A, lda, B, ldb, BETA, C, ldc);
+        return;
+    }
+    if (gemm_path == GEMM_PATH_FIXED_CPU) {
+        gemm_cpu(TA, TB, M, N, K, ALPHA, A, lda, B, ldb, BETA, C, ldc);
+        return;
+    }
 #ifdef FPGA_ACCEL
     gemm_fpga( TA,  TB,  M, N, K, ALPHA, A, lda, B, ldb, BETA, C, ldc);
 #else
@@ -125,6 +179,115 @@ void gemm(int TA, int TB, int M, int N, int K, float ALPHA,
 #endif
 }
 
+void gemm_groups(int groups, int M, int N, int K, float ALPHA,
+        float *A, int lda, size_t stride_a,
+        float *B, int ldb, size_t stride_b,
+        float BETA,
+        float *C, int ldc, size_t stride_c)
+{
+    int g;
+    if (gemm_path == GEMM_PATH_FLOAT) {
+        // cpu_gemm() is single-threaded: one group per thread
+        #pragma omp parallel for
+        for (g = 0; g < groups; ++g) {
+            cpu_gemm(0, 0, M, N, K, ALPHA, A + g*stride_a, lda, B + g*stride_b, ldb, BETA, C + g*stride_c, ldc);
+        }
+        return;
+    }
+    for (g = 0; g < groups; ++g) {
+        gemm(0, 0, M, N, K, ALPHA, A + g*stride_a, lda, B + g*stride_b, ldb, BETA, C + g*stride_c, ldc);
+    }
+}
+
+// out[out_h][out_w] += padded (*) wk for a K x K kernel (dilation 1) on a zero-padded input plane:
+// with K a constant the taps stay in registers and the loop over x vectorizes
+static inline void depthwise_plane_k(const int K, const float *padded, int padded_w, const float *wk,
+    float *out, int out_w, int out_h, int stride_x, int stride_y)
+{
+    int y, x, ky, kx;
+    for (y = 0; y < out_h; ++y) {
+        const float *in_row = padded + (size_t)y*stride_y*padded_w;
+        float *out_row = out + (size_t)y*out_w;
+        for (x = 0; x < out_w; ++x) {
+            float sum = out_row[x];
+            for (ky = 0; ky < K; ++ky) {
+                for (kx = 0; kx < K; ++kx) {
+                    sum += wk[ky*K + kx] * in_row[ky*padded_w + x*stride_x + kx];
+                }
+            }
+            out_row[x] = sum;
+        }
+    }
+}
+
+// out[out_h][out_w] += in (*) wk for any kernel size and dilation: each weight is applied to a whole
+// output row at once, for stride 1 the inner loop is a contiguous multiply-add
+static void depthwise_plane(const float *in, int w, int h, const float *wk, int ksize, int stride_x, int stride_y,
+    int pad, int dilation, float *out, int out_w, int out_h)
+{
+    int y, ky, kx, x;
+    for (y = 0; y < out_h; ++y) {
+        float *out_row = out + (size_t)y*out_w;
+        for (ky = 0; ky < ksize; ++ky) {
+            const int in_y = y*stride_y - pad + ky*dilation;
+            if (in_y < 0 || in_y >= h) continue;
+            const float *in_row = in + (size_t)in_y*w;
+            for (kx = 0; kx < ksize; ++kx) {
+                const float wv = wk[ky*ksize + kx];
+                const int x_offset = kx*dilation - pad;
+                // out_row[x] reads in_row[x*stride_x + x_offset], valid for 0 <= x*stride_x + x_offset < w
+                int x_begin = x_offset < 0 ? (-x_offset + stride_x - 1) / stride_x : 0;
+                int x_end = x_offset < w ? (w - 1 - x_offset) / stride_x + 1 : 0;
+                if (x_end > out_w) x_end = out_w;
+                if (stride_x == 1) {
+                    const float *src = in_row + x_offset;
+                    for (x = x_begin; x < x_end; ++x) out_row[x] += wv * src[x];
+                }
+                else {
+                    for (x = x_begin; x < x_end; ++x) out_row[x] += wv * in_row[x*stride_x + x_offset];
+                }
+            }
+        }
+    }
+}
+
+// output[n][out_h][out_w] += input[n / (n / c)] (*) weights[n][ksize][ksize]: the im2col_cpu_ext() +
+// gemm(M = n / c, K = ksize*ksize) of every group in one pass over the input, threaded over the filters.
+// 3x3 and 5x5 kernels without dilation copy the plane into a zero-padded buffer and run unrolled.
+void convolution_depthwise(int w, int h, int c, int n, int ksize, int stride_x, int stride_y,
+    int pad, int dilation, int out_w, int out_h, float *weights, float *input, float *output)
+{
+    const int multiplier = n / c;
+    const int unrolled = dilation == 1 && (ksize == 3 || ksize == 5);
+    int padded_w = (out_w - 1)*stride_x + ksize;
+    int padded_h = (out_h - 1)*stride_y + ksize;
+    if (padded_w < w + pad) padded_w = w + pad;
+    if (padded_h < h + pad) padded_h = h + pad;
+
+    #pragma omp parallel
+    {
+        float *padded = unrolled ? (float*)xcalloc((size_t)padded_w*padded_h, sizeof(float)) : NULL;
+        int f;
+        #pragma omp for
+        for (f = 0; f < n; ++f) {
+            const float *in = input + (size_t)(f / multiplier)*h*w;
+            const float *wk = weights + (size_t)f*ksize*ksize;
+            float *out = output + (size_t)f*out_h*out_w;
+            if (!unrolled) {
+                depthwise_plane(in, w, h, wk, ksize, stride_x, stride_y, pad, dilation, out, out_w, out_h);
+                continue;
+            }
+            // the borders stay zero, only the interior is rewritten for every filter
+            int y;
+            for (y = 0; y < h; ++y) {
+                memcpy(padded + (size_t)(y + pad)*padded_w + pad, in + (size_t)y*w, w * sizeof(float));
+            }
+            if (ksize == 3) depthwise_plane_k(3, padded, padded_w, wk, out, out_w, out_h, stride_x, stride_y);
+            else depthwise_plane_k(5, padded, padded_w, wk, out, out_w, out_h, stride_x, stride_y);
+        }
+        free(padded);
+    }
+}
 
 //--------------------------------------------
 // XNOR bitwise GEMM for binary neural network
@@ -2094,39 +2257,6 @@ void convolution_2d(int w, int h, int ksize, int n, int c, int pad, int stride,
     }
 }
 
-void gemm_nn_custom_bin_mean_transposed(int M, int N, int K, float ALPHA_UNUSED,
-    unsigned char *A, int lda,
-    unsigned char *B, int ldb,
-    float *C, int ldc, float *mean_arr)
-{
-    int i;
-
-    #pragma omp parallel for
-    for (i = 0; i < M; ++i) {   // l.n - filters [16 - 55 - 1024]
-        int j, k;
-        float mean_val = mean_arr[i];
-
-        for (j = 0; j < N; ++j) { // out_h*out_w - one channel output size [169 - 173056]
-            int count = 0;
-
-            for (k = 0; k < K; k += 64) {   // l.size*l.size*l.c - one filter size [27 - 9216]
-                uint64_t a_bit64 = *((uint64_t *)(A + (i*lda + k) / 8));
-                uint64_t b_bit64 = *((uint64_t *)(B + (j*ldb + k) / 8));
-                uint64_t c_bit64 = xnor_int64(a_bit64, b_bit64);
-
-                int tmp_count = POPCNT64(c_bit64);
-
-                if (K - k < 64)  tmp_count = tmp_count - (64 - (K - k));    // remove extra bits
-                count += tmp_count;
-                //binary_int64_printf(c_bit64);
-                //printf(", count = %d \n\n", tmp_count);
-            }
-
-            C[i*ldc + j] = (2 * count - K) * mean_val;
-        }
-    }
-}
-
 void im2col_cpu_custom_transpose(float* data_im,
     int channels, int height, int width,
     int ksize, int stride, int pad, float* data_col, int ldb_align)
@@ -2361,32 +2491,30 @@ void activate_array_cpu_custom(float *x, const int n, const ACTIVATION a)
 
 void float_to_bit(float *src, unsigned char *dst, size_t size)
 {
-    size_t dst_size = size / 8 + 1;
-    memset(dst, 0, dst_size);
-
+    const size_t full_bytes = size / 8;
     size_t i;
-    char* byte_arr = (char*)xcalloc(size, sizeof(char));
-    for (i = 0; i < size; ++i) {
-        if (src[i] > 0) byte_arr[i] = 1;
-    }
 
-    //for (i = 0; i < size; ++i) {
-    //    dst[i / 8] |= byte_arr[i] << (i % 8);
-    //}
+    #pragma omp parallel for
+    for (i = 0; i < full_bytes; ++i) {
+        const float *s = src + i * 8;
+        unsigned char dst_tmp = 0;
+        dst_tmp |= (s[0] > 0) << 0;
+        dst_tmp |= (s[1] > 0) << 1;
+        dst_tmp |= (s[2] > 0) << 2;
+        dst_tmp |= (s[3] > 0) << 3;
+        dst_tmp |= (s[4] > 0) << 4;
+        dst_tmp |= (s[5] > 0) << 5;
+        dst_tmp |= (s[6] > 0) << 6;
+        dst_tmp |= (s[7] > 0) << 7;
+        dst[i] = dst_tmp;
+    }
 
-    for (i = 0; i < size; i += 8) {
-        char dst_tmp = 0;
-        dst_tmp |= byte_arr[i + 0] << 0;
-        dst_tmp |= byte_arr[i + 1] << 1;
-        dst_tmp |= byte_arr[i + 2] << 2;
-        dst_tmp |= byte_arr[i + 3] << 3;
-        dst_tmp |= byte_arr[i + 4] << 4;
-        dst_tmp |= byte_arr[i + 5] << 5;
-        dst_tmp |= byte_arr[i + 6] << 6;
-        dst_tmp |= byte_arr[i + 7] << 7;
-        dst[i / 8] = dst_tmp;
+    // the last (partial) byte, dst is size / 8 + 1 bytes as before
+    unsigned char dst_tmp = 0;
+    for (i = full_bytes * 8; i < size; ++i) {
+        if (src[i] > 0) dst_tmp |= 1 << (i % 8);
     }
-    free(byte_arr);
+    dst[full_bytes] = dst_tmp;
 }
 
 static inline void transpose_scalar_block(float *A, float *B, const int lda, const int ldb, const int block_size)
@@ -2464,9 +2592,11 @@ void forward_maxpool_layer_avx(float *src, float *dst, int *indexes, int size, i
 void repack_input(float *input, float *re_packed_input, int w, int h, int c)
 {
     const int items_per_channel = w * h;
-    int chan, i;
+    int chan;
+    #pragma omp parallel for
     for (chan = 0; chan < c; chan += 32)
     {
+        int i;
         for (i = 0; i < items_per_channel; ++i)
         {
             int c_pack;
@@ -2479,13 +2609,34 @@ void repack_input(float *input, float *re_packed_input, int w, int h, int c)
     }
 }
 
+// 32 channels -> 1 x uint32_t: bit c_pack of re_packed_input_bin[chan/32*w*h + i] is (input[(chan + c_pack)*w*h + i] > 0),
+// the same bits as repack_input() followed by float_to_bit(), without the float copy of the input
+void repack_input_bin(float *input, uint32_t *re_packed_input_bin, int w, int h, int c)
+{
+    const int items_per_channel = w * h;
+    int chan;
+    #pragma omp parallel for
+    for (chan = 0; chan < c; chan += 32)
+    {
+        uint32_t *dst = re_packed_input_bin + (chan / 32)*items_per_channel;
+        int i, c_pack;
+        for (i = 0; i < items_per_channel; ++i) dst[i] = 0;
+        for (c_pack = 0; c_pack < 32; ++c_pack) {
+            const float *src = input + (chan + c_pack)*items_per_channel;
+            for (i = 0; i < items_per_channel; ++i) {
+                dst[i] |= (uint32_t)(src[i] > 0) << c_pack;
+            }
+        }
+    }
+}
+
 void transpose_uint32(uint32_t *src, uint32_t *dst, int src_h, int src_w, int src_align, int dst_align)
 {
     //l.bit_align - algined (n) by 32
     //new_ldb - aligned (k) by 256
 
     int i;
-    //#pragma omp parallel for
+    #pragma omp parallel for
     for (i = 0; i < src_h; i += 1)  // l.size*l.size*l.c;
     {
         int j;
@@ -2496,6 +2647,107 @@ void transpose_uint32(uint32_t *src, uint32_t *dst, int src_h, int src_w, int sr
     }
 }
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(__POPCNT__)
+// without -mpopcnt __builtin_popcountll() is a libgcc call, count the bits in registers instead
+static inline int popcount64_swar(uint64_t v)
+{
+    v = v - ((v >> 1) & 0x5555555555555555ULL);
+    v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+    v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (int)((v * 0x0101010101010101ULL) >> 56);
+}
+#define XNOR_POPCNT64(x) popcount64_swar(x)
+#else
+#define XNOR_POPCNT64(x) POPCNT64(x)
+#endif
+
+// Number of differing bits of a[0..words) and b[0..words), i.e. popcount(a ^ b).
+// The XNOR count of K bits is then K - xor_count: padding bits are zero in both weights and inputs.
+#if defined(__AVX512VPOPCNTDQ__) && defined(__AVX512F__)
+#define XNOR_SIMD_WORDS 8   // 512 bits per AVX-512 VPOPCNTDQ step
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define XNOR_SIMD_WORDS 2   // 128 bits per NEON vcnt step
+#else
+#define XNOR_SIMD_WORDS INT_MAX
+#endif
+
+static inline int xor_count_bits(const uint64_t *a, const uint64_t *b, int words)
+{
+    int count = 0;
+    int w = 0;
+#if defined(__AVX512VPOPCNTDQ__) && defined(__AVX512F__)
+    if (words >= 8) {
+        __m512i acc = _mm512_setzero_si512();
+        for (; w <= words - 8; w += 8) {
+            __m512i x = _mm512_xor_si512(_mm512_loadu_si512(a + w), _mm512_loadu_si512(b + w));
+            acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(x));
+        }
+        count = (int)_mm512_reduce_add_epi64(acc);
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    if (words >= 2) {
+        uint32x4_t acc = vdupq_n_u32(0);
+        for (; w <= words - 2; w += 2) {
+            uint8x16_t x = veorq_u8(vld1q_u8((const uint8_t*)(a + w)), vld1q_u8((const uint8_t*)(b + w)));
+            acc = vpadalq_u16(acc, vpaddlq_u8(vcntq_u8(x)));
+        }
+#if defined(__aarch64__)
+        count = (int)vaddvq_u32(acc);
+#else
+        uint64x2_t acc64 = vpaddlq_u32(acc);
+        count = (int)(vgetq_lane_u64(acc64, 0) + vgetq_lane_u64(acc64, 1));
+#endif
+    }
+#endif
+    for (; w < words; ++w) count += XNOR_POPCNT64(a[w] ^ b[w]);
+    return count;
+}
+
+// short filters (and builds without SIMD popcount): XNOR_TILE_N pixels share each load of the filter row
+#define XNOR_TILE_N 4
+
+void gemm_nn_custom_bin_mean_transposed(int M, int N, int K, float ALPHA_UNUSED,
+    unsigned char *A, int lda,
+    unsigned char *B, int ldb,
+    float *C, int ldc, float *mean_arr)
+{
+    const int words = (K + 63) / 64;
+    int i;
+
+    // threads over output channels, each one streams the whole (transposed) input through its filter
+    #pragma omp parallel for
+    for (i = 0; i < M; ++i) {   // l.n - filters [16 - 55 - 1024]
+        const uint64_t *a = (const uint64_t *)(A + (size_t)i*lda / 8);
+        const float mean_val = mean_arr[i];
+        int j = 0;
+
+        if (words < XNOR_SIMD_WORDS) for (; j <= N - XNOR_TILE_N; j += XNOR_TILE_N) {
+            const uint64_t *b0 = (const uint64_t *)(B + (size_t)(j + 0)*ldb / 8);
+            const uint64_t *b1 = (const uint64_t *)(B + (size_t)(j + 1)*ldb / 8);
+            const uint64_t *b2 = (const uint64_t *)(B + (size_t)(j + 2)*ldb / 8);
+            const uint64_t *b3 = (const uint64_t *)(B + (size_t)(j + 3)*ldb / 8);
+            int c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+            int w;
+            for (w = 0; w < words; ++w) {
+                const uint64_t a_bit64 = a[w];
+                c0 += XNOR_POPCNT64(a_bit64 ^ b0[w]);
+                c1 += XNOR_POPCNT64(a_bit64 ^ b1[w]);
+                c2 += XNOR_POPCNT64(a_bit64 ^ b2[w]);
+                c3 += XNOR_POPCNT64(a_bit64 ^ b3[w]);
+            }
+            C[i*ldc + j + 0] = (2 * (K - c0) - K) * mean_val;
+            C[i*ldc + j + 1] = (2 * (K - c1) - K) * mean_val;
+            C[i*ldc + j + 2] = (2 * (K - c2) - K) * mean_val;
+            C[i*ldc + j + 3] = (2 * (K - c3) - K) * mean_val;
+        }
+        for (; j < N; ++j) { // out_h*out_w - one channel output size [169 - 173056]
+            const uint64_t *b = (const uint64_t *)(B + (size_t)j*ldb / 8);
+            const int count = K - xor_count_bits(a, b, words);
+            C[i*ldc + j] = (2 * count - K) * mean_val;
+        }
+    }
+}
+
 void gemm_nn_bin_transposed_32bit_packed(int M, int N, int K, float ALPHA,
     uint32_t *A, int lda,
     uint32_t *B, int ldb,
@@ -2666,22 +2918,22 @@ void get_stats(float *A, int size)
 
 static inline fx_t fx_mul(fx_t a, fx_t b)
 {
-    return ((int_fast64_t)(a*b)>>FXFP_SCALE);
+    return ((int_fast64_t)(a*b)>>fx_scale);
 }
 
 static inline fx_t fx_mul_opt(fx_t a, uint8_t ashf, fx_t b)
 {
-    return ((a >> ashf) * (b >> (FXFP_SCALE - ashf)));
+    return ((a >> ashf) * (b >> (fx_scale - ashf)));
 }
 
-#define FX_MUL_OPT(a, ashf, b) (((a >> ashf) * (b >> (FXFP_SCALE - ashf))))
+#define FX_MUL_OPT(a, ashf, b) (((a >> ashf) * (b >> (fx_scale - ashf))))
 
 static inline fx_t fx_mul_dopt(fx_t a, uint8_t ashf, fx_t b, uint8_t bshf)
 {
-    return ((a >> ashf) * (b >> bshf)) >> (FXFP_SCALE - ashf - bshf);
+    return ((a >> ashf) * (b >> bshf)) >> (fx_scale - ashf - bshf);
 }
 
-#define FX_MUL_DOPT(a, ashf, b, bshf) (((a >> ashf) * (b >> bshf)) >> (FXFP_SCALE - ashf - bshf))
+#define FX_MUL_DOPT(a, ashf, b, bshf) (((a >> ashf) * (b >> bshf)) >> (fx_scale - ashf - bshf))
 
 static inline fx_t roundup(float fp_number)
 {
@@ -2690,21 +2942,34 @@ static inline fx_t roundup(float fp_number)
 
 static inline fx_t fp2fx(float fp)
 {
-    return fp*((fx_t)1 << FXFP_SCALE);
+    return fp*fx_one;
 }
-#define FP2FX(fp) (fx_t)((fp)*((fx_t)1 << FXFP_SCALE))
+#define FP2FX(fp) (fx_t)((fp)*fx_one)
 
 static inline float fx2fp(fx_t fx)
 {
-    return (float) (fx)/((fx_t)1 << FXFP_SCALE);
+    return (float) (fx)/fx_one;
 }
-#define FX2FP(fx) ((float)(fx)/((fx_t)1 << FXFP_SCALE))
+#define FX2FP(fx) ((float)(fx)/fx_one)
 
 fx_t * fp2fxarr(float* arr, size_t n)
 {
     fx_t * fx = (fx_t *) xcalloc(n, sizeof(fx_t));
     size_t i;
     float temp;
+    if (fx_count_saturation) {
+        // clamp instead of the undefined float->int overflow and count the clipped values
+        size_t saturated = 0;
+        for (i = 0; i < n; ++i) {
+            temp = arr[i] * fx_one;
+            if (temp >= 2147483648.f) { fx[i] = INT32_MAX; ++saturated; }
+            else if (temp < -2147483648.f) { fx[i] = INT32_MIN; ++saturated; }
+            else fx[i] = (fx_t)temp;
+        }
+        fx_conversions += n;
+        fx_saturations += saturated;
+        return fx;
+    }
     for (i = 0; i < n; ++i) {
         temp = arr[i];
 	fx[i] = FP2FX(temp);
@@ -2731,7 +2996,7 @@ void gemm_nn_fx(int M, int N, int K, fx_t ALPHA,
     int i, j, k;
     for (i = 0; i < M; ++i) {
         for (k = 0; k < K; ++k) {
-            PUT_IN_REGISTER fx_t A_PART = FX_MUL_OPT(ALPHA, FXFP_SCALE, A[i * lda + k]);
+            PUT_IN_REGISTER fx_t A_PART = FX_MUL_OPT(ALPHA, fx_scale, A[i * lda + k]);
             for (j = 0; j < N; ++j) {
             	C[i*ldc + j] += FX_MUL_DOPT(A_PART, 3, B[k*ldb + j], 5);
 	    }
@@ -2785,6 +3050,38 @@ void gemm_fpga(int TA, int TB, int M, int N, int K, float ALPHA,
 }
 #endif
 
+// Software model of gemm_fpga(): same fixed-point conversion and row/column tiling, with the
+// fixed-point MAC of gemm_cpu() standing in for the device. Lets the accelerator path be checked
+// for accuracy without the hardware.
+void gemm_fpga_sim(int TA, int TB, int M, int N, int K, float ALPHA,
+        float *A, int lda,
+        float *B, int ldb,
+        float BETA,
+        float *C, int ldc)
+{
+    fx_t * a = fp2fxarr(A, M*K);
+    fx_t * b = fp2fxarr(B, K*N);
+    fx_t * c = fp2fxarr(C, M*N);
+
+    int m, n, nleft;
+    int nstep = 1024;
+    for (m = 0; m < M; ++m) {
+        nleft = N;
+        for (n = 0; n < N; n+=nstep, nleft-=nstep) {
+            gemm_nn_fx(1,
+                    (nleft > nstep ? nstep : nleft),
+                    K,
+                    FP2FX(1),
+                    a + m*lda, lda,
+                    b + n, ldb,
+                    c + m*ldc + n, ldc);
+        }
+    }
+    free(a);
+    free(b);
+    fx2fparr(C, c, M*N);
+}
+
 /*** ---End--- ***/
 
 // #define CACHE_OPT
@@ -2818,9 +3115,10 @@ void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA,
 
     if (beta != 1){
         int i, j;
+        const int beta_shf = fx_scale < 14 ? fx_scale : 14;
         for(i = 0; i < M; ++i){
             for(j = 0; j < N; ++j){
-                c[i*ldc + j] = FX_MUL_OPT(beta, 14, c[i*ldc + j]);
+                c[i*ldc + j] = FX_MUL_OPT(beta, beta_shf, c[i*ldc + j]);
             }
         }
     }
@@ -67,6 +67,7 @@ void gemm_bin(int M, int N, int K, float ALPHA,
         float *C, int ldc);
 
 void repack_input(float *input, float *re_packed_input, int w, int h, int c);
+void repack_input_bin(float *input, uint32_t *re_packed_input_bin, int w, int h, int c);
 
 void convolution_repacked(uint32_t *packed_input, uint32_t *packed_weights, float *output,
     int w, int h, int c, int n, int size, int pad, int new_lda, float *mean_arr);
@@ -94,6 +95,17 @@ void gemm(int TA, int TB, int M, int N, int K, float ALPHA,
                     float BETA,
                     float *C, int ldc);
 
+// gemm(0, 0, ...) of `groups` independent blocks: A + g*stride_a, B + g*stride_b, C + g*stride_c
+void gemm_groups(int groups, int M, int N, int K, float ALPHA,
+        float *A, int lda, size_t stride_a,
+        float *B, int ldb, size_t stride_b,
+        float BETA,
+        float *C, int ldc, size_t stride_c);
+
+// direct depthwise convolution (groups == c, n a multiple of c), accumulates into output
+void convolution_depthwise(int w, int h, int c, int n, int ksize, int stride_x, int stride_y,
+    int pad, int dilation, int out_w, int out_h, float *weights, float *input, float *output);
+
 void gemm_fpga(int TA, int TB, int M, int N, int K, float ALPHA,
         float *A, int lda,
         float *B, int ldb,
@@ -106,6 +118,34 @@ void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA,
         float BETA,
         float *C, int ldc);
 
+void gemm_fpga_sim(int TA, int TB, int M, int N, int K, float ALPHA,
+        float *A, int lda,
+        float *B, int ldb,
+        float BETA,
+        float *C, int ldc);
+
+void gemm_nn_fast(int M, int N, int K, float ALPHA,
+    float *A, int lda,
+    float *B, int ldb,
+    float *C, int ldc);
+
+// float reference implementation, cpu_gemm.c
+void cpu_gemm(int TA, int TB, int M, int N, int K, float ALPHA,
+        float *A, int lda,
+        float *B, int ldb,
+        float BETA,
+        float *C, int ldc);
+
+// fractional bits of the software fixed-point path (FXFP_SCALE by default, clamped to [8, 30])
+void set_gemm_fx_scale(int scale);
+int get_gemm_fx_scale();
+// GEMM_PATH_DEFAULT: gemm_fpga() with FPGA_ACCEL, else gemm_cpu(); FLOAT: cpu_gemm(); FIXED_CPU: gemm_cpu()
+enum { GEMM_PATH_DEFAULT, GEMM_PATH_FLOAT, GEMM_PATH_FIXED_CPU };
+void set_gemm_path(int path);
+// clears the counters; count = 1 makes the float->fixed conversions saturate and count clipped values
+void reset_gemm_fx_saturation(int count);
+void get_gemm_fx_saturation(size_t *conversions, size_t *saturated);
+
 #ifdef GPU
 void gemm_ongpu(int TA, int TB, int M, int N, int K, float ALPHA,
         float *A_gpu, int lda,
@@ -0,0 +1,449 @@
+// GEMM / im2col micro-benchmark: times every GEMM backend on the convolution shapes of a cfg (or on a
+// default set of square shapes), checks each one against the float reference and writes CSV/JSON results.
+// The XNOR layers of the cfg (e.g. cfg/darknet53_448_xnor.cfg) also time the bit-packed popcount GEMM.
+//
+//  gemm_bench [cfg] [-iters 3] [-csv file] [-json file] [-tolerance 0.001] [-fx_tolerance 0.01]
+//
+// Exits with 1 if a backend exceeds its tolerance (max-abs-error relative to max |reference|).
+#include "darknet.h"
+#include "gemm.h"
+#include "im2col.h"
+#include "parser.h"
+#include "utils.h"
+#include "fpga.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+typedef void (*gemm_backend_fn)(int TA, int TB, int M, int N, int K, float ALPHA,
+    float *A, int lda, float *B, int ldb, float BETA, float *C, int ldc);
+
+typedef struct gemm_backend {
+    const char *name;
+    gemm_backend_fn fn;
+    int fixed_point;
+} gemm_backend;
+
+typedef struct bench_shape {
+    int layer;              // -1 for the default shapes
+    int M, N, K;
+    int c, h, w, size, stride, pad, dilation;   // im2col input of the layer
+    int xnor;               // also time the bit-packed XNOR GEMM of the layer
+    int groups;             // M, K and c are per group
+} bench_shape;
+
+typedef struct bench_result {
+    int shape;
+    const char *backend;
+    double best_ms;
+    double mean_ms;
+    double gflops;          // GB/s for the memory-bound ones
+    int bandwidth;          // im2col, depthwise
+    double max_abs_err;
+    double rel_err;
+    int failed;
+} bench_result;
+
+static void fast_gemm(int TA, int TB, int M, int N, int K, float ALPHA,
+    float *A, int lda, float *B, int ldb, float BETA, float *C, int ldc)
+{
+    gemm_nn_fast(M, N, K, ALPHA, A, lda, B, ldb, C, ldc);
+}
+
+#ifdef FPGA_ACCEL
+static int fpga_available = 0;
+
+static void fpga_gemm_backend(int TA, int TB, int M, int N, int K, float ALPHA,
+    float *A, int lda, float *B, int ldb, float BETA, float *C, int ldc)
+{
+    gemm_fpga(TA, TB, M, N, K, ALPHA, A, lda, B, ldb, BETA, C, ldc);
+}
+#endif
+
+static const gemm_backend backends[] = {
+    { "reference", cpu_gemm, 0 },
+    { "gemm_nn_fast", fast_gemm, 0 },
+    { "gemm_cpu_fx", gemm_cpu, 1 },
+    { "fpga_sim", gemm_fpga_sim, 1 },
+#ifdef GPU
+    { "gpu", gemm_gpu, 0 },
+#endif
+#ifdef FPGA_ACCEL
+    { "fpga", fpga_gemm_backend, 1 },
+#endif
+};
+
+static void fill_random(float *x, size_t n, float min, float max)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) x[i] = rand_uniform(min, max);
+}
+
+static int add_shape(bench_shape **shapes, int *n, bench_shape s)
+{
+    int i;
+    for (i = 0; i < *n; ++i) {
+        bench_shape o = (*shapes)[i];
+        if (o.M == s.M && o.N == s.N && o.K == s.K && o.c == s.c && o.h == s.h && o.w == s.w &&
+            o.size == s.size && o.stride == s.stride && o.pad == s.pad && o.dilation == s.dilation && o.xnor == s.xnor &&
+            o.groups == s.groups) return 0;
+    }
+    *shapes = (bench_shape*)xrealloc(*shapes, (*n + 1) * sizeof(bench_shape));
+    (*shapes)[(*n)++] = s;
+    return 1;
+}
+
+// The gemm(0, 0, m, n, k, ...) calls of forward_convolutional_layer() for batch = 1
+static bench_shape *get_cfg_shapes(char *cfgfile, int *n)
+{
+    bench_shape *shapes = NULL;
+    *n = 0;
+    network net = parse_network_cfg_custom(cfgfile, 1, 1);
+    int i;
+    for (i = 0; i < net.n; ++i) {
+        layer l = net.layers[i];
+        if (l.type != CONVOLUTIONAL) continue;
+        bench_shape s = { 0 };
+        s.layer = i;
+        s.M = l.n / l.groups;
+        s.N = l.out_w * l.out_h;
+        s.K = l.size * l.size * l.c / l.groups;
+        s.c = l.c / l.groups;
+        s.h = l.h;
+        s.w = l.w;
+        s.size = l.size;
+        s.stride = l.stride_y;
+        s.pad = l.pad * l.dilation;
+        s.dilation = l.dilation;
+        s.xnor = l.xnor;
+        s.groups = l.groups;
+        add_shape(&shapes, n, s);
+    }
+    free_network(net);
+    return shapes;
+}
+
+static bench_shape *get_default_shapes(int *n)
+{
+    static const int sizes[] = { 64, 128, 256, 512 };
+    bench_shape *shapes = NULL;
+    *n = 0;
+    int i;
+    for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); ++i) {
+        bench_shape s = { 0 };
+        s.layer = -1;
+        s.M = s.N = s.K = sizes[i];
+        add_shape(&shapes, n, s);
+    }
+    return shapes;
+}
+
+static bench_result run_gemm_backend(const gemm_backend *b, bench_shape s, int iters,
+    const float *A, const float *B, const float *ref, float *a, float *bb, float *c, float tolerance)
+{
+    bench_result r = { 0 };
+    r.backend = b->name;
+    const size_t a_size = (size_t)s.M * s.K;
+    const size_t b_size = (size_t)s.K * s.N;
+    const size_t c_size = (size_t)s.M * s.N;
+    double total = 0;
+    int i;
+    r.best_ms = -1;
+    for (i = 0; i < iters; ++i) {
+        // gemm_cpu() writes the quantized operands back, every run starts from the original ones
+        memcpy(a, A, a_size * sizeof(float));
+        memcpy(bb, B, b_size * sizeof(float));
+        memset(c, 0, c_size * sizeof(float));
+        double start = get_time_point();
+        b->fn(0, 0, s.M, s.N, s.K, 1, a, s.K, bb, s.N, 1, c, s.N);
+        double ms = (get_time_point() - start) / 1000;
+        total += ms;
+        if (r.best_ms < 0 || ms < r.best_ms) r.best_ms = ms;
+    }
+    r.mean_ms = total / iters;
+    r.gflops = 2.0 * s.M * s.N * s.K / (r.best_ms * 1e6);
+
+    double max_ref = 0;
+    size_t k;
+    for (k = 0; k < c_size; ++k) {
+        const double err = fabs((double)c[k] - ref[k]);
+        if (err > r.max_abs_err) r.max_abs_err = err;
+        if (fabs(ref[k]) > max_ref) max_ref = fabs(ref[k]);
+    }
+    r.rel_err = max_ref > 0 ? r.max_abs_err / max_ref : r.max_abs_err;
+    r.failed = r.rel_err > tolerance;
+    return r;
+}
+
+static bench_result run_im2col(bench_shape s, int iters)
+{
+    bench_result r = { 0 };
+    r.backend = "im2col_cpu_ext";
+    r.bandwidth = 1;
+    const size_t im_size = (size_t)s.c * s.h * s.w;
+    const size_t col_size = (size_t)s.K * s.N;
+    float *im = (float*)xcalloc(im_size, sizeof(float));
+    float *col = (float*)xcalloc(col_size, sizeof(float));
+    fill_random(im, im_size, 0, 1);
+    double total = 0;
+    int i;
+    r.best_ms = -1;
+    for (i = 0; i < iters; ++i) {
+        double start = get_time_point();
+        im2col_cpu_ext(im, s.c, s.h, s.w, s.size, s.size, s.pad, s.pad, s.stride, s.stride, s.dilation, s.dilation, col);
+        double ms = (get_time_point() - start) / 1000;
+        total += ms;
+        if (r.best_ms < 0 || ms < r.best_ms) r.best_ms = ms;
+    }
+    r.mean_ms = total / iters;
+    r.gflops = (im_size + col_size) * sizeof(float) / (r.best_ms * 1e6);
+    free(im);
+    free(col);
+    return r;
+}
+
+static void depthwise_run(bench_shape s, const float *weights, const float *im, float *out, float *col, int direct)
+{
+    const int c = s.c * s.groups;
+    const int out_size = (s.h + 2 * s.pad - s.size) / s.stride + 1;
+    int g;
+    memset(out, 0, (size_t)s.M * s.groups * s.N * sizeof(float));
+    if (direct) {
+        convolution_depthwise(s.w, s.h, c, s.M * s.groups, s.size, s.stride, s.stride, s.pad, s.dilation,
+            out_size, out_size, (float*)weights, (float*)im, out);
+        return;
+    }
+    // the previous forward_convolutional_layer(): im2col + gemm per group
+    for (g = 0; g < s.groups; ++g) {
+        im2col_cpu_ext(im + (size_t)g*s.h*s.w, 1, s.h, s.w, s.size, s.size, s.pad, s.pad, s.stride, s.stride, s.dilation, s.dilation, col);
+        cpu_gemm(0, 0, s.M, s.N, s.K, 1, (float*)weights + (size_t)g*s.M*s.K, s.K, col, s.N, 1, out + (size_t)g*s.M*s.N, s.N);
+    }
+}
+
+// depthwise convolution (groups == c): the per-group im2col + GEMM loop against convolution_depthwise(),
+// GB/s of the input, weights and output
+static void run_depthwise(bench_shape s, int iters, bench_result *loop, bench_result *direct)
+{
+    const size_t im_size = (size_t)s.c * s.groups * s.h * s.w;
+    const size_t w_size = (size_t)s.M * s.groups * s.K;
+    const size_t out_size = (size_t)s.M * s.groups * s.N;
+    float *im = (float*)xcalloc(im_size, sizeof(float));
+    float *weights = (float*)xcalloc(w_size, sizeof(float));
+    float *col = (float*)xcalloc((size_t)s.K * s.N, sizeof(float));
+    float *ref = (float*)xcalloc(out_size, sizeof(float));
+    float *out = (float*)xcalloc(out_size, sizeof(float));
+    fill_random(im, im_size, 0, 1);
+    fill_random(weights, w_size, -.5, .5);
+    const double bytes = (im_size + w_size + out_size) * sizeof(float);
+    int d, i;
+    for (d = 0; d < 2; ++d) {
+        bench_result *r = d ? direct : loop;
+        float *dst = d ? out : ref;
+        double total = 0;
+        r->backend = d ? "depthwise" : "groups_loop";
+        r->bandwidth = 1;
+        r->best_ms = -1;
+        for (i = 0; i < iters; ++i) {
+            double start = get_time_point();
+            depthwise_run(s, weights, im, dst, col, d);
+            double ms = (get_time_point() - start) / 1000;
+            total += ms;
+            if (r->best_ms < 0 || ms < r->best_ms) r->best_ms = ms;
+        }
+        r->mean_ms = total / iters;
+        r->gflops = bytes / (r->best_ms * 1e6);
+    }
+    double max_ref = 0;
+    size_t k;
+    for (k = 0; k < out_size; ++k) {
+        const double err = fabs((double)out[k] - ref[k]);
+        if (err > direct->max_abs_err) direct->max_abs_err = err;
+        if (fabs(ref[k]) > max_ref) max_ref = fabs(ref[k]);
+    }
+    direct->rel_err = max_ref > 0 ? direct->max_abs_err / max_ref : direct->max_abs_err;
+    free(im);
+    free(weights);
+    free(col);
+    free(ref);
+    free(out);
+}
+
+// gemm_nn_custom_bin_mean_transposed() of an XNOR layer on random bits, rows aligned as in
+// forward_convolutional_layer() (l.lda_align = 256). Checked bit by bit on a subset of the outputs.
+static bench_result run_xnor_gemm(bench_shape s, int iters)
+{
+    bench_result r = { 0 };
+    r.backend = "xnor_popcount";
+    const int ld = s.K + (256 - s.K % 256);
+    const size_t c_size = (size_t)s.M * s.N;
+    unsigned char *A = (unsigned char*)xcalloc((size_t)s.M * ld / 8, sizeof(unsigned char));
+    unsigned char *B = (unsigned char*)xcalloc((size_t)s.N * ld / 8, sizeof(unsigned char));
+    float *mean = (float*)xcalloc(s.M, sizeof(float));
+    float *c = (float*)xcalloc(c_size, sizeof(float));
+    int i, j, k;
+    for (i = 0; i < s.M; ++i) for (k = 0; k < s.K; ++k) if (random_gen() & 1) set_bit(A, (size_t)i*ld + k);
+    for (j = 0; j < s.N; ++j) for (k = 0; k < s.K; ++k) if (random_gen() & 1) set_bit(B, (size_t)j*ld + k);
+    fill_random(mean, s.M, .1, 1);
+
+    double total = 0;
+    r.best_ms = -1;
+    for (i = 0; i < iters; ++i) {
+        double start = get_time_point();
+        gemm_nn_custom_bin_mean_transposed(s.M, s.N, s.K, 1, A, ld, B, ld, c, s.N, mean);
+        double ms = (get_time_point() - start) / 1000;
+        total += ms;
+        if (r.best_ms < 0 || ms < r.best_ms) r.best_ms = ms;
+    }
+    r.mean_ms = total / iters;
+    r.gflops = 2.0 * s.M * s.N * s.K / (r.best_ms * 1e6);   // binary ops
+
+    const int j_step = s.N > 64 ? s.N / 64 : 1;
+    double max_ref = 0;
+    for (i = 0; i < s.M; ++i) {
+        for (j = 0; j < s.N; j += j_step) {
+            int count = 0;
+            for (k = 0; k < s.K; ++k) count += get_bit(A, (size_t)i*ld + k) == get_bit(B, (size_t)j*ld + k);
+            const float ref = (2 * count - s.K) * mean[i];
+            const double err = fabs((double)c[(size_t)i*s.N + j] - ref);
+            if (err > r.max_abs_err) r.max_abs_err = err;
+            if (fabs(ref) > max_ref) max_ref = fabs(ref);
+        }
+    }
+    r.rel_err = max_ref > 0 ? r.max_abs_err / max_ref : r.max_abs_err;
+    r.failed = r.max_abs_err > 0;   // integer bit counts: must be exact
+    free(A);
+    free(B);
+    free(mean);
+    free(c);
+    return r;
+}
+
+int main(int argc, char **argv)
+{
+    char *cfgfile = (argc > 1 && argv[1][0] != '-') ? argv[1] : 0;    // before find_*_arg() shift argv
+    int iters = find_int_arg(argc, argv, "-iters", 3);
+    char *csv_file = find_char_arg(argc, argv, "-csv", 0);
+    char *json_file = find_char_arg(argc, argv, "-json", 0);
+    float tolerance = find_float_arg(argc, argv, "-tolerance", .001);
+    float fx_tolerance = find_float_arg(argc, argv, "-fx_tolerance", .01);
+    if (iters < 1) iters = 1;
+#ifndef GPU
+    gpu_index = -1;
+#endif
+    srand(2222222);
+
+    int nshapes = 0;
+    bench_shape *shapes = cfgfile ? get_cfg_shapes(cfgfile, &nshapes) : get_default_shapes(&nshapes);
+    int nbackends = sizeof(backends) / sizeof(backends[0]);
+#ifdef FPGA_ACCEL
+    fpga_available = fpga_init() == 0;
+    if (!fpga_available) --nbackends;   // "fpga" is the last backend, skip it without the device
+#endif
+    bench_result *results = (bench_result*)xcalloc((size_t)nshapes * (nbackends + 3), sizeof(bench_result));
+    int nresults = 0;
+    int failed = 0;
+
+    int i, j;
+    for (i = 0; i < nshapes; ++i) {
+        bench_shape s = shapes[i];
+        const size_t a_size = (size_t)s.M * s.K;
+        const size_t b_size = (size_t)s.K * s.N;
+        const size_t c_size = (size_t)s.M * s.N;
+        float *A = (float*)xcalloc(a_size, sizeof(float));
+        float *B = (float*)xcalloc(b_size, sizeof(float));
+        float *ref = (float*)xcalloc(c_size, sizeof(float));
+        float *a = (float*)xcalloc(a_size, sizeof(float));
+        float *b = (float*)xcalloc(b_size, sizeof(float));
+        float *c = (float*)xcalloc(c_size, sizeof(float));
+        // weights around zero, activations positive, as in a conv layer after leaky/relu
+        fill_random(A, a_size, -.5, .5);
+        fill_random(B, b_size, 0, 1);
+        cpu_gemm(0, 0, s.M, s.N, s.K, 1, A, s.K, B, s.N, 1, ref, s.N);
+
+        for (j = 0; j < nbackends; ++j) {
+            bench_result r = run_gemm_backend(&backends[j], s, iters, A, B, ref, a, b, c,
+                backends[j].fixed_point ? fx_tolerance : tolerance);
+            r.shape = i;
+            failed |= r.failed;
+            results[nresults++] = r;
+        }
+        if (s.size > 0) {
+            results[nresults] = run_im2col(s, iters);
+            results[nresults++].shape = i;
+        }
+        if (s.groups > 1 && s.c == 1) {
+            bench_result loop = { 0 }, direct = { 0 };
+            run_depthwise(s, iters, &loop, &direct);
+            loop.shape = direct.shape = i;
+            direct.failed = direct.rel_err > tolerance;
+            failed |= direct.failed;
+            results[nresults++] = loop;
+            results[nresults++] = direct;
+        }
+        if (s.xnor) {
+            bench_result r = run_xnor_gemm(s, iters);
+            r.shape = i;
+            failed |= r.failed;
+            results[nresults++] = r;
+        }
+        free(A);
+        free(B);
+        free(ref);
+        free(a);
+        free(b);
+        free(c);
+    }
+
+    printf("\n layer     M      N      K  backend          best ms   mean ms   GFLOP/s  max_abs_err    rel_err\n");
+    for (i = 0; i < nresults; ++i) {
+        bench_result r = results[i];
+        bench_shape s = shapes[r.shape];
+        if (r.bandwidth) {
+            printf(" %5d %5d %6d %6d  %-14s %9.3f %9.3f %7.2f GB/s", s.layer, s.M, s.N, s.K, r.backend, r.best_ms, r.mean_ms, r.gflops);
+            if (!strcmp(r.backend, "depthwise")) printf(" %10g %10g %s", r.max_abs_err, r.rel_err, r.failed ? "FAIL" : "");
+            printf("\n");
+            continue;
+        }
+        printf(" %5d %5d %6d %6d  %-14s %9.3f %9.3f %9.2f %12g %10g %s\n", s.layer, s.M, s.N, s.K, r.backend,
+            r.best_ms, r.mean_ms, r.gflops, r.max_abs_err, r.rel_err, r.failed ? "FAIL" : "");
+    }
+
+    if (csv_file) {
+        FILE *fp = fopen(csv_file, "w");
+        if (!fp) file_error(csv_file);
+        fprintf(fp, "layer,M,N,K,backend,best_ms,mean_ms,gflops,gbps,max_abs_err,rel_err,failed\n");
+        for (i = 0; i < nresults; ++i) {
+            bench_result r = results[i];
+            bench_shape s = shapes[r.shape];
+            const int is_bw = r.bandwidth;
+            fprintf(fp, "%d,%d,%d,%d,%s,%f,%f,%f,%f,%g,%g,%d\n", s.layer, s.M, s.N, s.K, r.backend, r.best_ms, r.mean_ms,
+                is_bw ? 0 : r.gflops, is_bw ? r.gflops : 0, r.max_abs_err, r.rel_err, r.failed);
+        }
+        fclose(fp);
+    }
+    if (json_file) {
+        FILE *fp = fopen(json_file, "w");
+        if (!fp) file_error(json_file);
+        fprintf(fp, "{\n \"cfg\": \"%s\",\n \"iters\": %d,\n \"results\": [\n", cfgfile ? cfgfile : "", iters);
+        for (i = 0; i < nresults; ++i) {
+            bench_result r = results[i];
+            bench_shape s = shapes[r.shape];
+            const int is_bw = r.bandwidth;
+            fprintf(fp, "  {\"layer\":%d, \"M\":%d, \"N\":%d, \"K\":%d, \"backend\":\"%s\", \"best_ms\":%f, \"mean_ms\":%f, "
+                "\"gflops\":%f, \"gbps\":%f, \"max_abs_err\":%g, \"rel_err\":%g, \"failed\":%s}%s\n",
+                s.layer, s.M, s.N, s.K, r.backend, r.best_ms, r.mean_ms, is_bw ? 0 : r.gflops, is_bw ? r.gflops : 0,
+                r.max_abs_err, r.rel_err, r.failed ? "true" : "false", (i < nresults - 1) ? "," : "");
+        }
+        fprintf(fp, " ]\n}\n");
+        fclose(fp);
+    }
+
+#ifdef FPGA_ACCEL
+    if (fpga_available) fpga_free();
+#endif
+    free(results);
+    free(shapes);
+    return failed;
+}
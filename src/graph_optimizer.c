@@ -0,0 +1,274 @@
+// Inference graph optimizer, run after load_weights() and fuse_conv_batchnorm():
+// folds standalone [batchnorm], [activation] and implicit [scale_channels] into the preceding
+// convolution, drops layers that are the identity at inference and layers nothing reads any more,
+// and rewires the layer indices of [route], [shortcut], [scale_channels], [sam] and [yolo].
+#include "darknet.h"
+#include "network.h"
+#include "convolutional_layer.h"
+#include "profiler.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+typedef struct graph_opt_stats {
+    int identity;       // dropout, empty, linear activation, single-input route, 1x1/1 maxpool
+    int folded;         // batchnorm, activation and scale_channels merged into a convolution
+    int dead;           // outputs nobody reads
+    double flops;
+    double bytes;
+} graph_opt_stats;
+
+// route and implicit ignore state.input, every other layer consumes the output of the previous one
+static int layer_reads_input(layer l)
+{
+    return l.type != ROUTE && l.type != IMPLICIT;
+}
+
+static int is_graph_output(network net, int i)
+{
+    const LAYER_TYPE t = net.layers[i].type;
+    return i == net.n - 1 || t == YOLO || t == GAUSSIAN_YOLO || t == REGION || t == DETECTION || t == COST;
+}
+
+static int layer_references(layer l, int j)
+{
+    int k;
+    if (l.type == ROUTE || l.type == SHORTCUT) {
+        for (k = 0; k < l.n; ++k) if (l.input_layers[k] == j) return 1;
+    }
+    if ((l.type == SHORTCUT || l.type == SCALE_CHANNELS || l.type == SAM) && l.index == j) return 1;
+    if (l.type == YOLO && l.embedding_output && l.embedding_layer_id == j) return 1;
+    return 0;
+}
+
+// Readers of layer j's output, the outputs of the network count as one
+static int layer_consumers(network net, int j)
+{
+    int k, n = is_graph_output(net, j);
+    for (k = 0; k < net.n; ++k) n += layer_references(net.layers[k], j);
+    if (j + 1 < net.n && layer_reads_input(net.layers[j + 1])) ++n;
+    return n;
+}
+
+static int remap_index(int j, int first, int last, int target)
+{
+    if (j < first) return j;
+    if (j <= last) return target;
+    return j - (last - first + 1);
+}
+
+// Removes layers [first, last]. target is the layer whose output equals the output of layer last
+// (references to last are redirected to it), or -1 if nothing reads the range.
+// Returns 0 and leaves the network untouched when the removal would change what some layer reads.
+static int remove_layers(network *net, int first, int last, int target, graph_opt_stats *stats)
+{
+    int i, k;
+    const int count = last - first + 1;
+    if (first < 1) return 0;
+    if (last + 1 < net->n && layer_reads_input(net->layers[last + 1]) && target != first - 1) return 0;
+    if (last + 1 == net->n && target != first - 1) return 0;    // target must become the last layer
+    for (k = 0; k < net->n; ++k) {
+        if (k >= first && k <= last) continue;
+        for (i = first; i <= last; ++i) {
+            if (layer_references(net->layers[k], i) && (i != last || target < 0)) return 0;
+            if (net->layers[k].share_layer == &net->layers[i]) return 0;
+        }
+    }
+    for (i = first; i <= last; ++i) {
+        if (is_graph_output(*net, i) && (i != last || target < 0)) return 0;
+    }
+
+    float *old_output = net->layers[last].output;
+    float *new_output = target >= 0 ? net->layers[target].output : NULL;
+#ifdef GPU
+    float *old_output_gpu = net->layers[last].output_gpu;
+    float *new_output_gpu = target >= 0 ? net->layers[target].output_gpu : NULL;
+#endif
+    for (k = 0; k < net->n; ++k) {
+        if (k >= first && k <= last) continue;
+        layer *l = &net->layers[k];
+        if (l->type == ROUTE || l->type == SHORTCUT) {
+            for (i = 0; i < l->n; ++i) l->input_layers[i] = remap_index(l->input_layers[i], first, last, target);
+        }
+        if (l->type == SHORTCUT || l->type == SCALE_CHANNELS || l->type == SAM) l->index = remap_index(l->index, first, last, target);
+        if (l->type == YOLO && l->embedding_output) l->embedding_layer_id = remap_index(l->embedding_layer_id, first, last, target);
+        // dropout/empty alias the buffer of the layer before them, shortcut keeps pointers to its inputs
+        if (new_output && l->output == old_output) l->output = new_output;
+        if (new_output && l->type == SHORTCUT) {
+            for (i = 0; i < l->n; ++i) if (l->layers_output[i] == old_output) l->layers_output[i] = new_output;
+        }
+#ifdef GPU
+        if (new_output_gpu && l->output_gpu == old_output_gpu) l->output_gpu = new_output_gpu;
+        if (new_output_gpu && l->type == SHORTCUT && l->layers_output_gpu) {
+            for (i = 0; i < l->n; ++i) if (l->layers_output_gpu[i] == old_output_gpu) l->layers_output_gpu[i] = new_output_gpu;
+        }
+#endif
+    }
+
+    for (i = first; i <= last; ++i) {
+        layer l = net->layers[i];
+        const layer_cost c = get_layer_cost(l);
+        stats->flops += c.flops;
+        stats->bytes += c.bytes_read + c.bytes_written;
+        free_layer(l);
+    }
+    memmove(net->layers + first, net->layers + last + 1, (net->n - last - 1) * sizeof(layer));
+    net->n -= count;
+    for (k = 0; k < net->n; ++k) {
+        layer *l = &net->layers[k];
+        if (l->share_layer && l->share_layer > net->layers + last) l->share_layer -= count;
+    }
+    return 1;
+}
+
+// A convolution whose output can absorb a per-channel affine transform or an activation
+static int conv_foldable(network net, int j)
+{
+    if (j < 0) return 0;
+    layer l = net.layers[j];
+    if (l.type != CONVOLUTIONAL || l.activation != LINEAR || l.batch_normalize) return 0;
+    if (l.binary || l.xnor || l.share_layer || l.antialiasing || l.assisted_excitation || l.deform) return 0;
+    int k;
+    for (k = 0; k < net.n; ++k) if (net.layers[k].share_layer == &net.layers[j]) return 0;
+    return 1;
+}
+
+// out = conv * scale[f] + bias[f] per output channel
+static void fold_conv_affine(layer *l, const float *scale, const float *bias)
+{
+    const size_t filter_size = l->nweights / l->n;
+    int f;
+    size_t i;
+    for (f = 0; f < l->n; ++f) {
+        for (i = 0; i < filter_size; ++i) l->weights[f*filter_size + i] *= scale[f];
+        l->biases[f] = l->biases[f] * scale[f] + (bias ? bias[f] : 0);
+    }
+#ifdef GPU
+    if (gpu_index >= 0) push_convolutional_layer(*l);
+#endif
+}
+
+static int fold_batchnorm(network *net, int i, graph_opt_stats *stats)
+{
+    layer *bn = &net->layers[i];
+    if (!conv_foldable(*net, i - 1) || layer_consumers(*net, i - 1) != 1) return 0;
+    layer *conv = &net->layers[i - 1];
+    if (bn->out_c != conv->n || bn->outputs != conv->outputs) return 0;
+
+    float *scale = (float*)xcalloc(bn->out_c, sizeof(float));
+    float *bias = (float*)xcalloc(bn->out_c, sizeof(float));
+    int f;
+    for (f = 0; f < bn->out_c; ++f) {
+        scale[f] = bn->scales[f] / sqrt(bn->rolling_variance[f] + .00001f);
+        bias[f] = bn->biases[f] - bn->rolling_mean[f] * scale[f];
+    }
+    fold_conv_affine(conv, scale, bias);
+    free(scale);
+    free(bias);
+    if (!remove_layers(net, i, i, i - 1, stats)) error("graph optimizer: batchnorm fold could not be removed", DARKNET_LOC);
+    stats->folded++;
+    return 1;
+}
+
+// activations that forward_convolutional_layer() applies without extra buffers
+static int conv_activation_supported(ACTIVATION a)
+{
+    return a != SWISH && a != MISH && a != HARD_MISH && a != NORM_CHAN && a != NORM_CHAN_SOFTMAX && a != NORM_CHAN_SOFTMAX_MAXVAL;
+}
+
+static int fold_activation(network *net, int i, graph_opt_stats *stats)
+{
+    layer *l = &net->layers[i];
+    if (l->activation == LINEAR) {
+        if (!remove_layers(net, i, i, i - 1, stats)) return 0;
+        stats->identity++;
+        return 1;
+    }
+    if (!conv_activation_supported(l->activation) || !conv_foldable(*net, i - 1) || layer_consumers(*net, i - 1) != 1) return 0;
+    const ACTIVATION a = l->activation;
+    if (!remove_layers(net, i, i, i - 1, stats)) return 0;
+    net->layers[i - 1].activation = a;
+    stats->folded++;
+    return 1;
+}
+
+// conv -> ... -> [implicit] -> [scale_channels] from=conv: the implicit multiplier is a constant per
+// channel, fold it into the convolution and drop both layers
+static int fold_scale_channels(network *net, int i, graph_opt_stats *stats)
+{
+    layer *l = &net->layers[i];
+    if (l->scale_wh || l->activation != LINEAR || i < 2) return 0;
+    layer *m = &net->layers[i - 1];
+    const int c = l->index;
+    if (m->type != IMPLICIT || m->out_h != 1 || c != i - 2 || !conv_foldable(*net, c)) return 0;
+    if (m->nweights != net->layers[c].n || layer_consumers(*net, c) != 1 || layer_consumers(*net, i - 1) != 1) return 0;
+    if (l->outputs != net->layers[c].outputs) return 0;
+
+    fold_conv_affine(&net->layers[c], m->weights, NULL);
+    if (!remove_layers(net, i - 1, i, c, stats)) error("graph optimizer: scale_channels fold could not be removed", DARKNET_LOC);
+    stats->folded++;
+    return 1;
+}
+
+static int is_identity_layer(layer l)
+{
+    if (l.type == DROPOUT || l.type == EMPTY) return 1;
+    if (l.type == MAXPOOL && l.size == 1 && l.stride_x == 1 && l.stride_y == 1 && !l.maxpool_depth && !l.antialiasing &&
+        l.out_w == l.w && l.out_h == l.h && l.out_c == l.c) return 1;
+    return 0;
+}
+
+static int optimize_layer(network *net, int i, graph_opt_stats *stats)
+{
+    layer l = net->layers[i];
+    if (is_identity_layer(l)) {
+        if (!remove_layers(net, i, i, i - 1, stats)) return 0;
+        stats->identity++;
+        return 1;
+    }
+    if (l.type == ROUTE && l.n == 1 && l.groups == 1) {
+        // a copy of one layer: free when that layer is the previous one, otherwise only if nothing
+        // consumes the route sequentially
+        if (!remove_layers(net, i, i, l.input_layers[0], stats)) return 0;
+        stats->identity++;
+        return 1;
+    }
+    if (l.type == BATCHNORM) return fold_batchnorm(net, i, stats);
+    if (l.type == ACTIVE) return fold_activation(net, i, stats);
+    if (l.type == SCALE_CHANNELS) return fold_scale_channels(net, i, stats);
+    if (layer_consumers(*net, i) == 0 && remove_layers(net, i, i, -1, stats)) {
+        stats->dead++;
+        return 1;
+    }
+    return 0;
+}
+
+void optimize_network_graph(network *net)
+{
+    int i;
+    for (i = 0; i < net->n; ++i) {
+        // contrastive layers keep raw pointers into net->layers, leave such graphs alone
+        if (net->layers[i].type == CONTRASTIVE) return;
+    }
+
+    graph_opt_stats stats = { 0 };
+    const int n = net->n;
+    double total_flops = 0;
+    for (i = 0; i < net->n; ++i) total_flops += get_layer_cost(net->layers[i]).flops;
+
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (i = net->n - 1; i > 0; --i) {
+            if (optimize_layer(net, i, &stats)) changed = 1;
+        }
+    }
+    if (net->n == n) return;
+
+    net->outputs = get_network_output_size(*net);
+    net->output = get_network_output(*net);
+    fprintf(stderr, " graph optimizer: %d -> %d layers (%d identity, %d folded, %d unused), %.3f of %.3f BFLOPs, %.2f MB eliminated \n",
+        n, net->n, stats.identity, stats.folded, stats.dead, stats.flops / 1e9, total_flops / 1e9, stats.bytes / (1024 * 1024));
+}
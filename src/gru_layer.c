@@ -85,6 +85,13 @@ layer make_gru_layer(int batch, int inputs, int outputs, int steps, int batch_no
     l.z_cpu = (float*)xcalloc(outputs * batch, sizeof(float));
     l.h_cpu = (float*)xcalloc(outputs * batch, sizeof(float));
 
+    // state_z and state_r read the same state: stacked, a step does one GEMM for both
+    if (!batch_normalize) {
+        l.packed_state_weights = (float*)xcalloc(2 * outputs * outputs, sizeof(float));
+        l.packed_state_output = (float*)xcalloc(2 * batch*outputs, sizeof(float));
+        pack_gru_weights(l);
+    }
+
     l.forward = forward_gru_layer;
     l.backward = backward_gru_layer;
     l.update = update_gru_layer;
@@ -108,11 +115,48 @@ layer make_gru_layer(int batch, int inputs, int outputs, int steps, int batch_no
     return l;
 }
 
+void pack_gru_weights(layer l)
+{
+    if (!l.packed_state_weights) return;
+    layer *w[2] = { l.state_z_layer, l.state_r_layer };
+    pack_connected_weights(w, 2, l.packed_state_weights);
+}
+
 void update_gru_layer(layer l, int batch, float learning_rate, float momentum, float decay)
 {
     update_connected_layer(*(l.input_layer), batch, learning_rate, momentum, decay);
     update_connected_layer(*(l.self_layer), batch, learning_rate, momentum, decay);
     update_connected_layer(*(l.output_layer), batch, learning_rate, momentum, decay);
+    pack_gru_weights(l);
+}
+
+// z = logistic(input_z + state_z), r = logistic(input_r + state_r), forgot_state = state*r
+static void gru_gates_cpu(int n, float *iz, float *sz, float *ir, float *sr, float *state,
+    float *z, float *r, float *forgot_state)
+{
+    int j;
+    #pragma omp parallel for
+    for (j = 0; j < n; ++j) {
+        z[j] = logistic_activate(iz[j] + sz[j]);
+        r[j] = logistic_activate(ir[j] + sr[j]);
+        forgot_state[j] = state[j] * r[j];
+    }
+}
+
+// h = act(input_h + state_h), output = z*state + (1-z)*h, state = output
+static void gru_output_cpu(int n, float *ih, float *sh, float *z, float *h, float *state, float *output)
+{
+    int j;
+    #pragma omp parallel for
+    for (j = 0; j < n; ++j) {
+        #ifdef USET
+        h[j] = tanh_activate(ih[j] + sh[j]);
+        #else
+        h[j] = logistic_activate(ih[j] + sh[j]);
+        #endif
+        output[j] = z[j]*state[j] + (1-z[j])*h[j];
+        state[j] = output[j];
+    }
 }
 
 void forward_gru_layer(layer l, network_state state)
@@ -141,44 +185,43 @@ void forward_gru_layer(layer l, network_state state)
         copy_cpu(l.outputs*l.batch, l.state, 1, l.prev_state, 1);
     }
 
-    for (i = 0; i < l.steps; ++i) {
-        s.input = l.state;
-        forward_connected_layer(state_z_layer, s);
-        forward_connected_layer(state_r_layer, s);
-
+    // the input projections don't depend on the state: one GEMM over all timesteps,
+    // unless batch normalization collects per-step training statistics
+    const int batched = !(state.train && input_z_layer.batch_normalize);
+    if (batched) {
         s.input = state.input;
+        input_z_layer.batch *= l.steps;
+        input_r_layer.batch *= l.steps;
+        input_h_layer.batch *= l.steps;
         forward_connected_layer(input_z_layer, s);
         forward_connected_layer(input_r_layer, s);
         forward_connected_layer(input_h_layer, s);
+        input_z_layer.batch = input_r_layer.batch = input_h_layer.batch = l.batch;
+    }
 
-
-        copy_cpu(l.outputs*l.batch, input_z_layer.output, 1, l.z_cpu, 1);
-        axpy_cpu(l.outputs*l.batch, 1, state_z_layer.output, 1, l.z_cpu, 1);
-
-        copy_cpu(l.outputs*l.batch, input_r_layer.output, 1, l.r_cpu, 1);
-        axpy_cpu(l.outputs*l.batch, 1, state_r_layer.output, 1, l.r_cpu, 1);
-
-        activate_array(l.z_cpu, l.outputs*l.batch, LOGISTIC);
-        activate_array(l.r_cpu, l.outputs*l.batch, LOGISTIC);
-
-        copy_cpu(l.outputs*l.batch, l.state, 1, l.forgot_state, 1);
-        mul_cpu(l.outputs*l.batch, l.r_cpu, 1, l.forgot_state, 1);
+    layer *w[2] = { &state_z_layer, &state_r_layer };
+    for (i = 0; i < l.steps; ++i) {
+        s.input = l.state;
+        if (l.packed_state_weights) forward_connected_layers_packed(w, 2, l.packed_state_weights, l.packed_state_output, s);
+        else {
+            forward_connected_layer(state_z_layer, s);
+            forward_connected_layer(state_r_layer, s);
+        }
+
+        if (!batched) {
+            s.input = state.input;
+            forward_connected_layer(input_z_layer, s);
+            forward_connected_layer(input_r_layer, s);
+            forward_connected_layer(input_h_layer, s);
+        }
+
+        gru_gates_cpu(l.outputs*l.batch, input_z_layer.output, state_z_layer.output,
+            input_r_layer.output, state_r_layer.output, l.state, l.z_cpu, l.r_cpu, l.forgot_state);
 
         s.input = l.forgot_state;
         forward_connected_layer(state_h_layer, s);
 
-        copy_cpu(l.outputs*l.batch, input_h_layer.output, 1, l.h_cpu, 1);
-        axpy_cpu(l.outputs*l.batch, 1, state_h_layer.output, 1, l.h_cpu, 1);
-
-        #ifdef USET
-        activate_array(l.h_cpu, l.outputs*l.batch, TANH);
-        #else
-        activate_array(l.h_cpu, l.outputs*l.batch, LOGISTIC);
-        #endif
-
-        weighted_sum_cpu(l.state, l.h_cpu, l.z_cpu, l.outputs*l.batch, l.output);
-
-        copy_cpu(l.outputs*l.batch, l.output, 1, l.state, 1);
+        gru_output_cpu(l.outputs*l.batch, input_h_layer.output, state_h_layer.output, l.z_cpu, l.h_cpu, l.state, l.output);
 
         state.input += l.inputs*l.batch;
         l.output += l.outputs*l.batch;
@@ -14,6 +14,8 @@ layer make_gru_layer(int batch, int inputs, int outputs, int steps, int batch_no
 void forward_gru_layer(layer l, network_state state);
 void backward_gru_layer(layer l, network_state state);
 void update_gru_layer(layer l, int batch, float learning_rate, float momentum, float decay);
+// refreshes the stacked state_z/state_r weights after they were changed
+void pack_gru_weights(layer l);
 
 #ifdef GPU
 void forward_gru_layer_gpu(layer l, network_state state);
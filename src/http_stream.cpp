@@ -12,6 +12,7 @@
 #include <iostream>
 #include <algorithm>
 #include <memory>
+#include <map>
 #include <mutex>
 #include <thread>
 #include <atomic>
@@ -288,19 +289,22 @@ public:
 };
 // ----------------------------------------
 
-static std::unique_ptr<JSON_sender> js_ptr;
+// one sender per port, so several streams can be served side by side
+static std::map<int, std::unique_ptr<JSON_sender>> js_senders;
 static std::mutex mtx;
 
 void delete_json_sender()
 {
     std::lock_guard<std::mutex> lock(mtx);
-    js_ptr.release();
+    for (auto &js : js_senders) js.second.release();
+    js_senders.clear();
 }
 
 void send_json_custom(char const* send_buf, int port, int timeout)
 {
     try {
         std::lock_guard<std::mutex> lock(mtx);
+        std::unique_ptr<JSON_sender> &js_ptr = js_senders[port];
         if(!js_ptr) js_ptr.reset(new JSON_sender(port, timeout));
 
         js_ptr->write(send_buf);
@@ -538,9 +542,11 @@ void send_mjpeg(mat_cv* mat, int port, int timeout, int quality)
 {
     try {
         std::lock_guard<std::mutex> lock(mtx_mjpeg);
-        static MJPG_sender wri(port, timeout, quality);
+        static std::map<int, std::unique_ptr<MJPG_sender>> senders;    // one per port
+        std::unique_ptr<MJPG_sender> &wri = senders[port];
+        if (!wri) wri.reset(new MJPG_sender(port, timeout, quality));
         //cv::Mat mat = cv::cvarrToMat(ipl);
-        wri.write(*(cv::Mat*)mat);
+        wri->write(*(cv::Mat*)mat);
         std::cout << " MJPEG-stream sent. \n";
     }
     catch (...) {
@@ -938,3 +944,250 @@ void set_track_id(detection *new_dets, int new_dets_num, float thresh, float sim
         }
     }
 }
+
+// -----------------------------------------------------
+// Batched inference server: HTTP worker threads decode and preprocess posted images,
+// a single batcher thread groups queued requests into one forward pass of up to max_batch
+// images, waiting at most max_latency_ms after the oldest queued request.
+
+#ifndef __CYGWIN__
+
+#ifndef   NI_MAXHOST
+#define   NI_MAXHOST 1025
+#endif
+
+#ifndef   NI_NUMERICHOST
+#define NI_NUMERICHOST  0x02
+#endif
+
+#include "httplib.h"
+#include "network.h"
+#include "stb_image.h"
+#include <condition_variable>
+#include <fstream>
+#include <future>
+
+struct detect_request_t {
+    std::vector<float> input;   // net.w x net.h x net.c, already resized or letterboxed
+    int w, h;                   // size of the posted frame
+    std::chrono::steady_clock::time_point arrival;
+    std::promise<std::string> json;
+};
+
+class Detector_server
+{
+    network *net;
+    char **names;
+    int classes;
+    int max_batch;
+    int max_latency_ms;
+    float thresh, hier_thresh, nms;
+    int letter_box;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::shared_ptr<detect_request_t>> queue;
+    bool stopping;
+    long long frame_id;
+    long long batches, images;
+    std::vector<float> batch_input;
+    std::thread batcher, listener;
+    httplib::Server srv;
+
+public:
+    Detector_server(network *net, char **names, int classes, int max_batch, int max_latency_ms, float thresh, float hier_thresh, int letter_box)
+        : net(net), names(names), classes(classes), max_batch(std::max(1, max_batch)), max_latency_ms(std::max(0, max_latency_ms)),
+        thresh(thresh), hier_thresh(hier_thresh), nms(.45), letter_box(letter_box), stopping(false), frame_id(0), batches(0), images(0)
+    {
+        batch_input.resize((size_t)this->max_batch * net->w * net->h * net->c);
+        // every in-flight request holds a worker until its batch is done, so allow enough of them to fill two batches
+        const int workers = std::max(8, 2 * this->max_batch);
+        srv.new_task_queue = [workers] { return new httplib::ThreadPool(workers); };
+        srv.set_payload_max_length(64 * 1024 * 1024);
+        srv.Post("/detect", [this](const httplib::Request &req, httplib::Response &res) {
+            std::string body;
+            if (req.has_file("image")) {
+                const httplib::MultipartFile file = req.get_file_value("image");
+                body = req.body.substr(file.offset, file.length);
+            }
+            const std::string &data = body.empty() ? req.body : body;
+            std::string json = detect((const unsigned char *)data.data(), data.size());
+            if (json.empty()) {
+                res.status = 400;
+                res.set_content("{\"error\":\"cannot decode image\"}", "application/json");
+            }
+            else res.set_content(json, "application/json");
+        });
+    }
+
+    ~Detector_server() { stop(); }
+
+    bool start(int port)
+    {
+        if (!srv.bind_to_port("0.0.0.0", port)) return false;
+        batcher = std::thread(&Detector_server::batch_loop, this);
+        listener = std::thread([this] { srv.listen_after_bind(); });
+        return true;
+    }
+
+    void wait() { if (listener.joinable()) listener.join(); }
+
+    void stop()
+    {
+        srv.stop();
+        if (listener.joinable()) listener.join();
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (batcher.joinable()) batcher.join();
+    }
+
+    double avg_batch() const { return batches ? (double)images / batches : 0; }
+
+    // Decodes an encoded (jpg/png/bmp...) image, queues it and blocks until its batch is processed.
+    // Returns the detections as JSON, or an empty string if the image cannot be decoded.
+    std::string detect(const unsigned char *encoded, size_t size)
+    {
+        int w, h, c;
+        unsigned char *pixels = stbi_load_from_memory(encoded, (int)size, &w, &h, &c, 3);
+        if (!pixels) return std::string();
+        auto req = std::make_shared<detect_request_t>();
+        req->w = w;
+        req->h = h;
+        req->input.resize((size_t)net->w * net->h * net->c);
+        image in = { net->w, net->h, net->c, req->input.data() };
+        bytes_to_image_into(pixels, w, h, 3, w * 3, 0, letter_box, in);
+        free(pixels);
+
+        std::future<std::string> result = req->json.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            req->arrival = std::chrono::steady_clock::now();
+            queue.push_back(req);
+        }
+        cv.notify_all();
+        return result.get();
+    }
+
+private:
+    void batch_loop()
+    {
+        while (true) {
+            std::vector<std::shared_ptr<detect_request_t>> batch;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (queue.empty()) break;
+                const auto deadline = queue.front()->arrival + std::chrono::milliseconds(max_latency_ms);
+                cv.wait_until(lock, deadline, [this] { return stopping || (int)queue.size() >= max_batch; });
+                while (!queue.empty() && (int)batch.size() < max_batch) {
+                    batch.push_back(queue.front());
+                    queue.pop_front();
+                }
+            }
+            run_batch(batch);
+        }
+    }
+
+    // One forward pass for the whole batch. network_predict_batch() corrects every box with a single
+    // frame size, so boxes are filled per slot here with each request's own size (needed for letter_box).
+    void run_batch(std::vector<std::shared_ptr<detect_request_t>> &batch)
+    {
+        const int n = (int)batch.size();
+        const size_t size = (size_t)net->w * net->h * net->c;
+        for (int i = 0; i < n; ++i) memcpy(batch_input.data() + i*size, batch[i]->input.data(), size * sizeof(float));
+        if (net->batch != n) set_batch_network(net, n);
+        network_predict(*net, batch_input.data());
+
+        for (int i = 0; i < n; ++i) {
+            int nboxes = 0;
+            detection *dets = get_network_boxes_batch_view(net, batch[i]->w, batch[i]->h, thresh, hier_thresh, 0, 1, &nboxes, letter_box, i);
+            if (nms) do_nms_sort(dets, nboxes, classes, nms);
+            char *json = detection_to_json(dets, nboxes, classes, names, frame_id++, NULL);
+            batch[i]->json.set_value(json ? std::string(json) : std::string("{}"));
+            free(json);
+        }
+        ++batches;
+        images += n;
+    }
+};
+
+// The network must have been parsed with batch >= max_batch, so its buffers can hold a full batch
+void run_detector_server(network *net, char **names, int classes, int port, int max_batch, int max_latency_ms,
+    float thresh, float hier_thresh, int letter_box)
+{
+    Detector_server server(net, names, classes, max_batch, max_latency_ms, thresh, hier_thresh, letter_box);
+    if (!server.start(port)) {
+        cerr << " Can't bind the detector server to port " << port << endl;
+        return;
+    }
+    printf(" Detector server: POST images to http://localhost:%d/detect (max_batch = %d, max_latency = %d ms) \n",
+        port, max_batch, max_latency_ms);
+    server.wait();
+}
+
+// Closed-loop load generator: `clients` threads post the same image back to back against an in-process
+// server, for max_batch = 1, 2, 4 ... up to max_batch, and report latency percentiles and throughput.
+void benchmark_detector_server(network *net, char **names, int classes, char *filename, int port, int max_batch, int max_latency_ms,
+    int clients, int requests, float thresh, float hier_thresh, int letter_box)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) {
+        cerr << " Can't open " << filename << endl;
+        return;
+    }
+    const std::string body((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    clients = std::max(1, clients);
+    requests = std::max(clients, requests);
+
+    printf("\n clients = %d, requests = %d, max_latency = %d ms \n", clients, requests, max_latency_ms);
+    printf(" max_batch | avg_batch |  p50, ms |  p99, ms |  img/sec \n");
+    for (int b = 1; b <= max_batch; b = (b == max_batch) ? b + 1 : std::min(2 * b, max_batch)) {
+        Detector_server server(net, names, classes, b, max_latency_ms, thresh, hier_thresh, letter_box);
+        if (!server.start(port)) {
+            cerr << " Can't bind the detector server to port " << port << endl;
+            return;
+        }
+        std::vector<double> latency(requests);
+        std::atomic<int> next(0), failed(0);
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (int t = 0; t < clients; ++t) {
+            threads.emplace_back([&] {
+                httplib::Client cli("127.0.0.1", port, 60);
+                for (int i = next++; i < requests; i = next++) {
+                    const auto sent = std::chrono::steady_clock::now();
+                    auto res = cli.Post("/detect", body, "application/octet-stream");
+                    if (!res || res->status != 200) ++failed;
+                    latency[i] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sent).count();
+                }
+            });
+        }
+        for (auto &t : threads) t.join();
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        server.stop();
+
+        std::sort(latency.begin(), latency.end());
+        printf(" %9d | %9.2f | %8.2f | %8.2f | %8.2f \n", b, server.avg_batch(),
+            latency[(requests - 1) / 2], latency[std::min(requests - 1, (int)(0.99 * requests))], requests / elapsed);
+        if (failed) printf(" %d requests failed \n", (int)failed);
+    }
+}
+
+#else   //  __CYGWIN__
+
+void run_detector_server(network *net, char **names, int classes, int port, int max_batch, int max_latency_ms,
+    float thresh, float hier_thresh, int letter_box)
+{
+    std::cerr << " run_detector_server() isn't implemented \n";
+}
+
+void benchmark_detector_server(network *net, char **names, int classes, char *filename, int port, int max_batch, int max_latency_ms,
+    int clients, int requests, float thresh, float hier_thresh, int letter_box)
+{
+    std::cerr << " benchmark_detector_server() isn't implemented \n";
+}
+
+#endif   //  __CYGWIN__
@@ -18,6 +18,11 @@ int send_http_post_request(char *http_post_host, int server_port, const char *vi
 
 #endif  // OPENCV
 
+void run_detector_server(network *net, char **names, int classes, int port, int max_batch, int max_latency_ms,
+    float thresh, float hier_thresh, int letter_box);
+void benchmark_detector_server(network *net, char **names, int classes, char *filename, int port, int max_batch, int max_latency_ms,
+    int clients, int requests, float thresh, float hier_thresh, int letter_box);
+
 typedef void* custom_thread_t;
 typedef void* custom_attr_t;
 
@@ -10,6 +10,7 @@
 #define _USE_MATH_DEFINES
 #endif
 #include <math.h>
+#include <pthread.h>
 
 #ifndef STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_IMPLEMENTATION
@@ -59,11 +60,6 @@ static void set_pixel(image m, int x, int y, int c, float val)
     assert(x < m.w && y < m.h && c < m.c);
     m.data[c*m.h*m.w + y*m.w + x] = val;
 }
-static void add_pixel(image m, int x, int y, int c, float val)
-{
-    assert(x < m.w && y < m.h && c < m.c);
-    m.data[c*m.h*m.w + y*m.w + x] += val;
-}
 
 void composite_image(image source, image dest, int dx, int dy)
 {
@@ -976,45 +972,287 @@ void fill_image(image m, float s)
     for (i = 0; i < m.h*m.w*m.c; ++i) m.data[i] = s;
 }
 
-void letterbox_image_into(image im, int w, int h, image boxed)
+// Bilinear tap tables for one (src_w, src_h) -> (dst_w, dst_h) pair. They depend only on the
+// geometry, so they are built once and cached: video and network_predict_image() resize every
+// frame with the same pair and would otherwise redo the per-pixel index arithmetic each time.
+typedef struct resize_taps {
+    int src_w, src_h, dst_w, dst_h;
+    int *x0, *x1, *y0, *y1;
+    float *fx, *fy;
+    int *qx, *qy;       // fx, fy in RESIZE_Q_BITS fixed point, for 8-bit sources
+    int refs;           // resizes using the table right now, guarded by resize_taps_mutex
+    int cached;         // 0 - evicted or never cached, freed by the last release_resize_taps()
+    unsigned int last_use;
+} resize_taps;
+
+#define RESIZE_Q_BITS 11
+#define RESIZE_Q_ONE (1 << RESIZE_Q_BITS)
+
+#define RESIZE_TAPS_CACHE 8
+static resize_taps *resize_taps_cache[RESIZE_TAPS_CACHE];
+static int resize_taps_cached = 0;
+static unsigned int resize_taps_clock = 0;
+static pthread_mutex_t resize_taps_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Same sampling as the original two-pass resize_image(): src = dst*(src_n-1)/(dst_n-1),
+// the last destination row/column takes the last source pixel exactly.
+static void make_resize_axis(int src_n, int dst_n, int *i0, int *i1, float *f)
 {
-    int new_w = im.w;
-    int new_h = im.h;
-    if (((float)w / im.w) < ((float)h / im.h)) {
-        new_w = w;
-        new_h = (im.h * w) / im.w;
+    int i;
+    float scale = (dst_n > 1) ? (float)(src_n - 1) / (dst_n - 1) : 0;
+    for (i = 0; i < dst_n; ++i) {
+        if (i == dst_n - 1 || src_n == 1) {
+            i0[i] = i1[i] = src_n - 1;
+            f[i] = 0;
+        }
+        else {
+            float s = i*scale;
+            int is = (int)s;
+            if (is > src_n - 2) is = src_n - 2;
+            i0[i] = is;
+            i1[i] = is + 1;
+            f[i] = s - is;
+        }
     }
-    else {
-        new_h = h;
-        new_w = (im.w * h) / im.h;
+}
+
+static resize_taps *make_resize_taps(int src_w, int src_h, int dst_w, int dst_h)
+{
+    resize_taps *t = (resize_taps*)xcalloc(1, sizeof(resize_taps));
+    t->src_w = src_w;
+    t->src_h = src_h;
+    t->dst_w = dst_w;
+    t->dst_h = dst_h;
+    t->x0 = (int*)xcalloc(2 * dst_w, sizeof(int));
+    t->x1 = t->x0 + dst_w;
+    t->y0 = (int*)xcalloc(2 * dst_h, sizeof(int));
+    t->y1 = t->y0 + dst_h;
+    t->fx = (float*)xcalloc(dst_w, sizeof(float));
+    t->fy = (float*)xcalloc(dst_h, sizeof(float));
+    make_resize_axis(src_w, dst_w, t->x0, t->x1, t->fx);
+    make_resize_axis(src_h, dst_h, t->y0, t->y1, t->fy);
+    t->qx = (int*)xcalloc(dst_w, sizeof(int));
+    t->qy = (int*)xcalloc(dst_h, sizeof(int));
+    int i;
+    for (i = 0; i < dst_w; ++i) t->qx[i] = (int)(t->fx[i] * RESIZE_Q_ONE + .5f);
+    for (i = 0; i < dst_h; ++i) t->qy[i] = (int)(t->fy[i] * RESIZE_Q_ONE + .5f);
+    return t;
+}
+
+static void free_resize_taps(resize_taps *t)
+{
+    free(t->x0);
+    free(t->y0);
+    free(t->fx);
+    free(t->fy);
+    free(t->qx);
+    free(t->qy);
+    free(t);
+}
+
+// The cache keeps the RESIZE_TAPS_CACHE most recently used geometries, so multi-scale training
+// (random=1) and changing video sizes replace stale entries instead of growing it. A returned
+// table is referenced until release_resize_taps(), an evicted table is freed by its last user.
+static resize_taps *get_resize_taps(int src_w, int src_h, int dst_w, int dst_h)
+{
+    int i;
+    resize_taps *t = NULL;
+    pthread_mutex_lock(&resize_taps_mutex);
+    for (i = 0; i < resize_taps_cached; ++i) {
+        resize_taps *c = resize_taps_cache[i];
+        if (c->src_w == src_w && c->src_h == src_h && c->dst_w == dst_w && c->dst_h == dst_h) {
+            t = c;
+            break;
+        }
     }
-    image resized = resize_image(im, new_w, new_h);
-    embed_image(resized, boxed, (w - new_w) / 2, (h - new_h) / 2);
-    free_image(resized);
+    if (!t) {
+        t = make_resize_taps(src_w, src_h, dst_w, dst_h);
+        t->cached = 1;
+        if (resize_taps_cached < RESIZE_TAPS_CACHE) resize_taps_cache[resize_taps_cached++] = t;
+        else {
+            int lru = 0;
+            for (i = 1; i < resize_taps_cached; ++i) {
+                if (resize_taps_clock - resize_taps_cache[i]->last_use > resize_taps_clock - resize_taps_cache[lru]->last_use) lru = i;
+            }
+            resize_taps *old = resize_taps_cache[lru];
+            old->cached = 0;
+            if (!old->refs) free_resize_taps(old);
+            resize_taps_cache[lru] = t;
+        }
+    }
+    t->refs++;
+    t->last_use = ++resize_taps_clock;
+    pthread_mutex_unlock(&resize_taps_mutex);
+    return t;
 }
 
-image letterbox_image(image im, int w, int h)
+static void release_resize_taps(resize_taps *t)
+{
+    pthread_mutex_lock(&resize_taps_mutex);
+    if (--t->refs == 0 && !t->cached) free_resize_taps(t);
+    pthread_mutex_unlock(&resize_taps_mutex);
+}
+
+// Resamples im to w x h in a single pass and writes it into the w x h window at (dx, dy) of
+// a planar dst_w x dst_h x im.c buffer. Rows of all channels are processed in parallel.
+static void resize_bilinear_into(image im, int w, int h, float *dst, int dst_w, int dst_h, int dx, int dy)
+{
+    resize_taps *t = get_resize_taps(im.w, im.h, w, h);
+    const int *x0 = t->x0, *x1 = t->x1;
+    const float *fx = t->fx;
+    int kr;
+    #pragma omp parallel for
+    for (kr = 0; kr < im.c*h; ++kr) {
+        const int k = kr / h;
+        const int r = kr % h;
+        const float *row0 = im.data + (size_t)k*im.w*im.h + (size_t)t->y0[r]*im.w;
+        const float *row1 = im.data + (size_t)k*im.w*im.h + (size_t)t->y1[r]*im.w;
+        const float wy1 = t->fy[r];
+        const float wy0 = 1 - wy1;
+        float *out = dst + (size_t)k*dst_w*dst_h + (size_t)(r + dy)*dst_w + dx;
+        int c;
+        for (c = 0; c < w; ++c) {
+            const float wx1 = fx[c];
+            const float wx0 = 1 - wx1;
+            const float top = wx0*row0[x0[c]] + wx1*row0[x1[c]];
+            const float bot = wx0*row1[x0[c]] + wx1*row1[x1[c]];
+            out[c] = wy0*top + wy1*bot;
+        }
+    }
+    release_resize_taps(t);
+}
+
+void resize_image_into(image im, image resized)
+{
+    if (im.w == resized.w && im.h == resized.h) {
+        memcpy(resized.data, im.data, (size_t)im.w*im.h*im.c * sizeof(float));
+        return;
+    }
+    resize_bilinear_into(im, resized.w, resized.h, resized.data, resized.w, resized.h, 0, 0);
+}
+
+image resize_image(image im, int w, int h)
+{
+    if (im.w == w && im.h == h) return copy_image(im);
+
+    image resized = make_image(w, h, im.c);
+    resize_bilinear_into(im, w, h, resized.data, w, h, 0, 0);
+    return resized;
+}
+
+static void letterbox_size(image im, int w, int h, int *new_w, int *new_h)
 {
-    int new_w = im.w;
-    int new_h = im.h;
     if (((float)w / im.w) < ((float)h / im.h)) {
-        new_w = w;
-        new_h = (im.h * w) / im.w;
+        *new_w = w;
+        *new_h = (im.h * w) / im.w;
     }
     else {
-        new_h = h;
-        new_w = (im.w * h) / im.h;
+        *new_h = h;
+        *new_w = (im.w * h) / im.h;
     }
-    image resized = resize_image(im, new_w, new_h);
+}
+
+// Fills everything in boxed outside the new_w x new_h window at (dx, dy) with pad.
+static void fill_letterbox_border(image boxed, int dx, int dy, int new_w, int new_h, float pad)
+{
+    int k, y, x;
+    for (k = 0; k < boxed.c; ++k) {
+        float *plane = boxed.data + (size_t)k*boxed.w*boxed.h;
+        for (y = 0; y < boxed.h; ++y) {
+            float *row = plane + (size_t)y*boxed.w;
+            if (y < dy || y >= dy + new_h) {
+                for (x = 0; x < boxed.w; ++x) row[x] = pad;
+                continue;
+            }
+            for (x = 0; x < dx; ++x) row[x] = pad;
+            for (x = dx + new_w; x < boxed.w; ++x) row[x] = pad;
+        }
+    }
+}
+
+void letterbox_image_into(image im, int w, int h, image boxed)
+{
+    int new_w, new_h;
+    letterbox_size(im, w, h, &new_w, &new_h);
+    resize_bilinear_into(im, new_w, new_h, boxed.data, boxed.w, boxed.h, (w - new_w) / 2, (h - new_h) / 2);
+}
+
+// Letterboxes im into the preallocated boxed image (boxed.w x boxed.h), padding with pad.
+void letterbox_image_into_padded(image im, image boxed, float pad)
+{
+    int new_w, new_h;
+    letterbox_size(im, boxed.w, boxed.h, &new_w, &new_h);
+    const int dx = (boxed.w - new_w) / 2;
+    const int dy = (boxed.h - new_h) / 2;
+    fill_letterbox_border(boxed, dx, dy, new_w, new_h, pad);
+    resize_bilinear_into(im, new_w, new_h, boxed.data, boxed.w, boxed.h, dx, dy);
+}
+
+image letterbox_image(image im, int w, int h)
+{
     image boxed = make_image(w, h, im.c);
-    fill_image(boxed, .5);
-    //int i;
-    //for(i = 0; i < boxed.w*boxed.h*boxed.c; ++i) boxed.data[i] = 0;
-    embed_image(resized, boxed, (w - new_w) / 2, (h - new_h) / 2);
-    free_image(resized);
+    letterbox_image_into_padded(im, boxed, .5);
     return boxed;
 }
 
+// 8-bit counterpart of resize_bilinear_into(): src holds src_w x src_h pixels of src_c interleaved
+// channels, rows stride bytes apart. Interpolation runs in integers (11-bit weights keep the
+// 2-D sum of 8-bit pixels within 31 bits); the single float multiply also applies the 1/255 scale.
+static void resize_bytes_into(const unsigned char *src, int src_w, int src_h, int src_c, int stride, int swap_rb,
+    int w, int h, image dst, int dx, int dy)
+{
+    resize_taps *t = get_resize_taps(src_w, src_h, w, h);
+    const int *x0 = t->x0, *x1 = t->x1, *qx = t->qx;
+    const float norm = 1.f / (255.f * RESIZE_Q_ONE * RESIZE_Q_ONE);
+    int kr;
+    #pragma omp parallel for
+    for (kr = 0; kr < dst.c*h; ++kr) {
+        const int k = kr / h;
+        const int r = kr % h;
+        const int sk = (src_c == 1) ? 0 : (swap_rb && k < 3) ? 2 - k : k;
+        const unsigned char *row0 = src + (size_t)t->y0[r]*stride + sk;
+        const unsigned char *row1 = src + (size_t)t->y1[r]*stride + sk;
+        const int wy1 = t->qy[r];
+        const int wy0 = RESIZE_Q_ONE - wy1;
+        float *out = dst.data + (size_t)k*dst.w*dst.h + (size_t)(r + dy)*dst.w + dx;
+        int c;
+        if (w == src_w) {
+            for (c = 0; c < w; ++c) out[c] = (wy0*row0[c*src_c] + wy1*row1[c*src_c]) * (norm * RESIZE_Q_ONE);
+            continue;
+        }
+        for (c = 0; c < w; ++c) {
+            const int i0 = x0[c] * src_c;
+            const int i1 = x1[c] * src_c;
+            const int wx1 = qx[c];
+            const int wx0 = RESIZE_Q_ONE - wx1;
+            const int top = wx0*row0[i0] + wx1*row0[i1];
+            const int bot = wx0*row1[i0] + wx1*row1[i1];
+            out[c] = (wy0*top + wy1*bot) * norm;
+        }
+    }
+    release_resize_taps(t);
+}
+
+// Converts a packed 8-bit frame straight into the planar float image dst (e.g. the network input):
+// bilinear resize to dst.w x dst.h, or letterbox with .5 padding if letter is set, scaling to [0, 1]
+// and BGR -> RGB when swap_rb is set, all in one pass. A 1-channel source fills every dst channel.
+void bytes_to_image_into(const unsigned char *src, int src_w, int src_h, int src_c, int stride, int swap_rb, int letter, image dst)
+{
+    if (src_c != 1 && src_c < dst.c) error("bytes_to_image_into: source has fewer channels than the destination", DARKNET_LOC);
+    if (swap_rb && src_c != 1 && src_c < 3) error("bytes_to_image_into: BGR -> RGB swap needs 3 or more channels", DARKNET_LOC);
+    if (!letter) {
+        resize_bytes_into(src, src_w, src_h, src_c, stride, swap_rb, dst.w, dst.h, dst, 0, 0);
+        return;
+    }
+    image geom = { src_w, src_h, src_c, NULL };
+    int new_w, new_h;
+    letterbox_size(geom, dst.w, dst.h, &new_w, &new_h);
+    const int dx = (dst.w - new_w) / 2;
+    const int dy = (dst.h - new_h) / 2;
+    fill_letterbox_border(dst, dx, dy, new_w, new_h, .5);
+    resize_bytes_into(src, src_w, src_h, src_c, stride, swap_rb, new_w, new_h, dst, dx, dy);
+}
+
 image resize_max(image im, int max)
 {
     int w = im.w;
@@ -1086,82 +1324,72 @@ float three_way_min(float a, float b, float c)
     return (a < b) ? ( (a < c) ? a : c) : ( (b < c) ? b : c) ;
 }
 
+static inline float constrain01(float a)
+{
+    return (a < 0) ? 0 : ((a > 1) ? 1 : a);
+}
+
 // http://www.cs.rit.edu/~ncs/color/t_convert.html
+// branch-free per-pixel conversions, so that the plane loops below vectorize
+static inline void rgb_to_hsv_px(float r, float g, float b, float *h, float *s, float *v)
+{
+    float max = three_way_max(r, g, b);
+    float min = three_way_min(r, g, b);
+    float delta = max - min;
+    float inv_delta = (delta > 0) ? 1.f / delta : 0;
+    float hr = (g - b) * inv_delta;
+    float hg = 2 + (b - r) * inv_delta;
+    float hb = 4 + (r - g) * inv_delta;
+    float hh = (r == max) ? hr : ((g == max) ? hg : hb);
+    hh = (hh < 0) ? hh + 6 : hh;
+    *h = (delta > 0) ? hh / 6.f : 0;
+    *s = (max > 0) ? delta / max : 0;
+    *v = max;
+}
+
+static inline void hsv_to_rgb_px(float h, float s, float v, float *r, float *g, float *b)
+{
+    h = 6 * h;
+    float index = (float)(int)h;   // h is non-negative, so truncation is floor
+    float f = h - index;
+    float p = v*(1 - s);
+    float q = v*(1 - s*f);
+    float t = v*(1 - s*(1 - f));
+    float rr = ((index < 1) | (index >= 5)) ? v : (index < 2) ? q : (index >= 4) ? t : p;
+    float gg = ((index >= 1) & (index < 3)) ? v : (index < 1) ? t : (index < 4) ? q : p;
+    float bb = ((index >= 3) & (index < 5)) ? v : (index >= 5) ? q : (index >= 2) ? t : p;
+    *r = (s == 0) ? v : rr;
+    *g = (s == 0) ? v : gg;
+    *b = (s == 0) ? v : bb;
+}
+
 void rgb_to_hsv(image im)
 {
     assert(im.c == 3);
-    int i, j;
-    float r, g, b;
-    float h, s, v;
-    for(j = 0; j < im.h; ++j){
-        for(i = 0; i < im.w; ++i){
-            r = get_pixel(im, i , j, 0);
-            g = get_pixel(im, i , j, 1);
-            b = get_pixel(im, i , j, 2);
-            float max = three_way_max(r,g,b);
-            float min = three_way_min(r,g,b);
-            float delta = max - min;
-            v = max;
-            if(max == 0){
-                s = 0;
-                h = 0;
-            }else{
-                s = delta/max;
-                if(r == max){
-                    h = (g - b) / delta;
-                } else if (g == max) {
-                    h = 2 + (b - r) / delta;
-                } else {
-                    h = 4 + (r - g) / delta;
-                }
-                if (h < 0) h += 6;
-                h = h/6.;
-            }
-            set_pixel(im, i, j, 0, h);
-            set_pixel(im, i, j, 1, s);
-            set_pixel(im, i, j, 2, v);
-        }
+    const int size = im.w*im.h;
+    float *R = im.data, *G = im.data + size, *B = im.data + 2*size;
+    int i;
+    for(i = 0; i < size; ++i){
+        float h, s, v;
+        rgb_to_hsv_px(R[i], G[i], B[i], &h, &s, &v);
+        R[i] = h;
+        G[i] = s;
+        B[i] = v;
     }
 }
 
 void hsv_to_rgb(image im)
 {
     assert(im.c == 3);
-    int i, j;
-    float r, g, b;
-    float h, s, v;
-    float f, p, q, t;
-    for(j = 0; j < im.h; ++j){
-        for(i = 0; i < im.w; ++i){
-            h = 6 * get_pixel(im, i , j, 0);
-            s = get_pixel(im, i , j, 1);
-            v = get_pixel(im, i , j, 2);
-            if (s == 0) {
-                r = g = b = v;
-            } else {
-                int index = floor(h);
-                f = h - index;
-                p = v*(1-s);
-                q = v*(1-s*f);
-                t = v*(1-s*(1-f));
-                if(index == 0){
-                    r = v; g = t; b = p;
-                } else if(index == 1){
-                    r = q; g = v; b = p;
-                } else if(index == 2){
-                    r = p; g = v; b = t;
-                } else if(index == 3){
-                    r = p; g = q; b = v;
-                } else if(index == 4){
-                    r = t; g = p; b = v;
-                } else {
-                    r = v; g = p; b = q;
-                }
-            }
-            set_pixel(im, i, j, 0, r);
-            set_pixel(im, i, j, 1, g);
-            set_pixel(im, i, j, 2, b);
-        }
+    const int size = im.w*im.h;
+    float *H = im.data, *S = im.data + size, *V = im.data + 2*size;
+    int i;
+    for(i = 0; i < size; ++i){
+        float r, g, b;
+        hsv_to_rgb_px(H[i], S[i], V[i], &r, &g, &b);
+        H[i] = r;
+        S[i] = g;
+        V[i] = b;
     }
 }
 
@@ -1272,26 +1500,42 @@ void exposure_image(image im, float sat)
     constrain_image(im);
 }
 
+#define DISTORT_TILE 256
+
+// rgb -> hsv, scale s/v, shift h, hsv -> rgb and constrain in a single pass over the planes,
+// done in small tiles so that both halves of the conversion stay vectorizable and in L1
 void distort_image(image im, float hue, float sat, float val)
 {
+    const int size = im.w*im.h;
+    int i, j;
     if (im.c >= 3)
     {
-        rgb_to_hsv(im);
-        scale_image_channel(im, 1, sat);
-        scale_image_channel(im, 2, val);
-        int i;
-        for(i = 0; i < im.w*im.h; ++i){
-            im.data[i] = im.data[i] + hue;
-            if (im.data[i] > 1) im.data[i] -= 1;
-            if (im.data[i] < 0) im.data[i] += 1;
+        float *R = im.data, *G = im.data + size, *B = im.data + 2*size;
+        float H[DISTORT_TILE], S[DISTORT_TILE], V[DISTORT_TILE];
+        for(j = 0; j < size; j += DISTORT_TILE){
+            const int n = min_val_cmp(DISTORT_TILE, size - j);
+            float *r = R + j, *g = G + j, *b = B + j;
+            for(i = 0; i < n; ++i){
+                rgb_to_hsv_px(r[i], g[i], b[i], &H[i], &S[i], &V[i]);
+            }
+            for(i = 0; i < n; ++i){
+                float h = H[i] + hue;
+                h = (h > 1) ? h - 1 : h;
+                h = (h < 0) ? h + 1 : h;
+                float rr, gg, bb;
+                hsv_to_rgb_px(h, S[i]*sat, V[i]*val, &rr, &gg, &bb);
+                r[i] = constrain01(rr);
+                g[i] = constrain01(gg);
+                b[i] = constrain01(bb);
+            }
         }
-        hsv_to_rgb(im);
+        for(i = 3*size; i < im.c*size; ++i) im.data[i] = constrain01(im.data[i]);
     }
     else
     {
-        scale_image_channel(im, 0, val);
+        for(i = 0; i < size; ++i) im.data[i] = constrain01(im.data[i]*val);
+        for(i = size; i < im.c*size; ++i) im.data[i] = constrain01(im.data[i]);
     }
-    constrain_image(im);
 }
 
 void random_distort_image(image im, float hue, float saturation, float exposure)
@@ -1386,52 +1630,133 @@ image make_attention_image(int img_size, float *original_delta_cpu, float *origi
     return attention_img;
 }
 
-image resize_image(image im, int w, int h)
-{
-    if (im.w == w && im.h == h) return copy_image(im);
 
-    image resized = make_image(w, h, im.c);
-    image part = make_image(w, im.h, im.c);
+
+// Same sampling as resize_image(crop_image(im, dx, dy, crop_w, crop_h), w, h) followed by an optional
+// flip_image(), but done in a single resampling pass: the crop offset, border clamping and the flip
+// are folded into per-column and per-row tap tables, so no intermediate images are allocated.
+image crop_resize_image(image im, int dx, int dy, int crop_w, int crop_h, int w, int h, int flip)
+{
+    image out = make_image(w, h, im.c);
+    int *x0 = (int*)xcalloc(w, sizeof(int));
+    int *x1 = (int*)xcalloc(w, sizeof(int));
+    float *fx = (float*)xcalloc(w, sizeof(float));
+    const float w_scale = (w > 1) ? (float)(crop_w - 1) / (w - 1) : 0;
+    const float h_scale = (h > 1) ? (float)(crop_h - 1) / (h - 1) : 0;
     int r, c, k;
-    float w_scale = (float)(im.w - 1) / (w - 1);
-    float h_scale = (float)(im.h - 1) / (h - 1);
-    for(k = 0; k < im.c; ++k){
-        for(r = 0; r < im.h; ++r){
-            for(c = 0; c < w; ++c){
-                float val = 0;
-                if(c == w-1 || im.w == 1){
-                    val = get_pixel(im, im.w-1, r, k);
-                } else {
-                    float sx = c*w_scale;
-                    int ix = (int) sx;
-                    float dx = sx - ix;
-                    val = (1 - dx) * get_pixel(im, ix, r, k) + dx * get_pixel(im, ix+1, r, k);
-                }
-                set_pixel(part, c, r, k, val);
+    for (c = 0; c < w; ++c) {
+        int ix = crop_w - 1;
+        float a = 0;
+        if (c != w - 1 && crop_w != 1) {
+            float sx = c*w_scale;
+            ix = (int)sx;
+            a = sx - ix;
+        }
+        const int dst = flip ? (w - 1 - c) : c;
+        x0[dst] = constrain_int(ix + dx, 0, im.w - 1);
+        x1[dst] = constrain_int(ix + 1 + dx, 0, im.w - 1);
+        fx[dst] = a;
+    }
+    // horizontally interpolated source rows are cached, so each source row is resampled once per channel
+    float *hrow0 = (float*)xcalloc(w, sizeof(float));
+    float *hrow1 = (float*)xcalloc(w, sizeof(float));
+    for (k = 0; k < im.c; ++k) {
+        const float *plane = im.data + k*im.w*im.h;
+        int cached0 = -1, cached1 = -1;
+        for (r = 0; r < h; ++r) {
+            int iy = crop_h - 1;
+            float b = 0;
+            if (r != h - 1 && crop_h != 1) {
+                float sy = r*h_scale;
+                iy = (int)sy;
+                b = sy - iy;
+            }
+            const int y0 = constrain_int(iy + dy, 0, im.h - 1);
+            const int y1 = constrain_int(iy + 1 + dy, 0, im.h - 1);
+            if (y0 == cached1) {
+                float *swap = hrow0;
+                hrow0 = hrow1;
+                hrow1 = swap;
+                cached0 = cached1;
+                cached1 = -1;
+            }
+            if (y0 != cached0) {
+                const float *row = plane + y0*im.w;
+                for (c = 0; c < w; ++c) hrow0[c] = row[x0[c]] + fx[c] * (row[x1[c]] - row[x0[c]]);
+                cached0 = y0;
             }
+            if (y1 != cached1) {
+                const float *row = plane + y1*im.w;
+                for (c = 0; c < w; ++c) hrow1[c] = row[x0[c]] + fx[c] * (row[x1[c]] - row[x0[c]]);
+                cached1 = y1;
+            }
+            float *dst = out.data + k*w*h + r*w;
+            for (c = 0; c < w; ++c) dst[c] = hrow0[c] + b * (hrow1[c] - hrow0[c]);
         }
     }
-    for(k = 0; k < im.c; ++k){
-        for(r = 0; r < h; ++r){
-            float sy = r*h_scale;
-            int iy = (int) sy;
-            float dy = sy - iy;
-            for(c = 0; c < w; ++c){
-                float val = (1-dy) * get_pixel(part, c, iy, k);
-                set_pixel(resized, c, r, k, val);
+    free(hrow0);
+    free(hrow1);
+    free(x0);
+    free(x1);
+    free(fx);
+    return out;
+}
+
+#ifndef OPENCV    // image_opencv.cpp provides blur_image() through cv::GaussianBlur()
+// Separable gaussian blur with replicated borders, sigma is chosen as cv::GaussianBlur() does for sigma = 0
+image blur_image(image im, int ksize)
+{
+    if (ksize < 3) return copy_image(im);
+    ksize = (ksize / 2) * 2 + 1;
+    const int half = ksize / 2;
+    const float sigma = 0.3f*((ksize - 1)*0.5f - 1) + 0.8f;
+    float *kernel = (float*)xcalloc(ksize, sizeof(float));
+    float sum = 0;
+    int i, x, y, k;
+    for (i = 0; i < ksize; ++i) {
+        float d = i - half;
+        kernel[i] = expf(-d*d / (2 * sigma*sigma));
+        sum += kernel[i];
+    }
+    for (i = 0; i < ksize; ++i) kernel[i] /= sum;
+
+    image tmp = make_image(im.w, im.h, im.c);
+    image out = make_image(im.w, im.h, im.c);
+    float *padded = (float*)xcalloc(im.w + 2 * half, sizeof(float));
+    for (k = 0; k < im.c; ++k) {
+        // horizontal pass
+        for (y = 0; y < im.h; ++y) {
+            const float *src = im.data + k*im.w*im.h + y*im.w;
+            float *dst = tmp.data + k*im.w*im.h + y*im.w;
+            for (x = 0; x < half; ++x) {
+                padded[x] = src[0];
+                padded[half + im.w + x] = src[im.w - 1];
+            }
+            memcpy(padded + half, src, im.w * sizeof(float));
+            for (i = 0; i < ksize; ++i) {
+                const float kv = kernel[i];
+                const float *p = padded + i;
+                if (i == 0) for (x = 0; x < im.w; ++x) dst[x] = kv*p[x];
+                else for (x = 0; x < im.w; ++x) dst[x] += kv*p[x];
             }
-            if(r == h-1 || im.h == 1) continue;
-            for(c = 0; c < w; ++c){
-                float val = dy * get_pixel(part, c, iy+1, k);
-                add_pixel(resized, c, r, k, val);
+        }
+        // vertical pass, accumulated row by row
+        for (y = 0; y < im.h; ++y) {
+            float *dst = out.data + k*im.w*im.h + y*im.w;
+            for (i = 0; i < ksize; ++i) {
+                const float kv = kernel[i];
+                const int sy = constrain_int(y + i - half, 0, im.h - 1);
+                const float *src = tmp.data + k*im.w*im.h + sy*im.w;
+                for (x = 0; x < im.w; ++x) dst[x] += kv*src[x];
             }
         }
     }
-
-    free_image(part);
-    return resized;
+    free(padded);
+    free(kernel);
+    free_image(tmp);
+    return out;
 }
-
+#endif    // OPENCV
 
 void test_resize(char *filename)
 {
@@ -41,7 +41,11 @@ void random_distort_image(image im, float hue, float saturation, float exposure)
 //LIB_API image resize_image(image im, int w, int h);
 //LIB_API void copy_image_from_bytes(image im, char *pdata);
 void fill_image(image m, float s);
+void resize_image_into(image im, image resized);
 void letterbox_image_into(image im, int w, int h, image boxed);
+void letterbox_image_into_padded(image im, image boxed, float pad);
+image crop_resize_image(image im, int dx, int dy, int crop_w, int crop_h, int w, int h, int flip);
+image blur_image(image im, int ksize);
 //LIB_API image letterbox_image(image im, int w, int h);
 // image resize_min(image im, int min);
 image resize_max(image im, int max);
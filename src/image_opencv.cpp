@@ -833,10 +833,9 @@ extern "C" image get_image_from_stream_letterbox(cap_cv *cap, int w, int h, int
     *in_img = (mat_cv *)new cv::Mat(src->rows, src->cols, CV_8UC(c));
     cv::resize(*src, **(cv::Mat**)in_img, (*(cv::Mat**)in_img)->size(), 0, 0, cv::INTER_LINEAR);
 
-    if (c>1) cv::cvtColor(*src, *src, cv::COLOR_RGB2BGR);
-    image tmp = mat_to_image(*src);
-    image im = letterbox_image(tmp, w, h);
-    free_image(tmp);
+    // BGR -> RGB, letterbox and 1/255 scaling straight from the 8-bit frame
+    image im = make_image(w, h, c);
+    bytes_to_image_into(src->data, src->cols, src->rows, src->channels(), (int)src->step, c > 1, 1, im);
     release_mat((mat_cv **)&src);
 
     //show_image_cv(im, "im");
@@ -845,6 +844,14 @@ extern "C" image get_image_from_stream_letterbox(cap_cv *cap, int w, int h, int
 }
 // ----------------------------------------
 
+// Converts a BGR frame straight into the planar RGB network input (resized or letterboxed, scaled to [0, 1])
+extern "C" void mat_to_input_cv(mat_cv *mat, image input, int letter_box)
+{
+    cv::Mat *src = (cv::Mat *)mat;
+    bytes_to_image_into(src->data, src->cols, src->rows, src->channels(), (int)src->step, src->channels() > 1, letter_box, input);
+}
+// ----------------------------------------
+
 extern "C" void consume_frame(cap_cv *cap){
     cv::Mat *src = NULL;
     src = (cv::Mat *)get_capture_frame_cv(cap);
@@ -85,6 +85,7 @@ image get_image_from_stream_cpp(cap_cv *cap);
 image get_image_from_stream_resize(cap_cv *cap, int w, int h, int c, mat_cv** in_img, int dont_close);
 image get_image_from_stream_letterbox(cap_cv *cap, int w, int h, int c, mat_cv** in_img, int dont_close);
 void consume_frame(cap_cv *cap);
+void mat_to_input_cv(mat_cv *mat, image input, int letter_box);
 
 // Image Saving
 void save_cv_png(mat_cv *img, const char *name);
@@ -18,6 +18,12 @@ void free_layer(layer l)
 void free_layer_custom(layer l, int keep_cudnn_desc)
 {
     if (l.share_layer != NULL) return;    // don't free shared layers
+    if (l.param_arena) {    // owned by the network parameter arena, see free_network_parameter_arena()
+        l.weights = l.biases = l.scales = l.rolling_mean = l.rolling_variance = NULL;
+        l.weight_updates = l.bias_updates = l.scale_updates = NULL;
+        l.weights_ema = l.biases_ema = l.scales_ema = NULL;
+        l.m = l.v = l.bias_m = l.bias_v = l.scale_m = l.scale_v = NULL;
+    }
     if (l.antialiasing) {
         free_sublayer(l.input_layer);
     }
@@ -54,6 +60,7 @@ void free_layer_custom(layer l, int keep_cudnn_desc)
         l.delta_gpu = NULL;
 #endif // GPU
     }
+    if (l.type == EMPTY) return;    // output and delta belong to the previous layer
     if (l.type == DROPOUT) {
         if (l.rand)           free(l.rand);
 #ifdef GPU
@@ -76,6 +83,8 @@ void free_layer_custom(layer l, int keep_cudnn_desc)
     if (l.cost)               free(l.cost);
     if (l.labels && !l.detection) free(l.labels);
     if (l.class_ids && !l.detection) free(l.class_ids);
+    if (l.train_scratch)      free(l.train_scratch);
+    if (l.train_scratch_int)  free(l.train_scratch_int);
     if (l.cos_sim)            free(l.cos_sim);
     if (l.exp_cos_sim)        free(l.exp_cos_sim);
     if (l.p_constrastive)     free(l.p_constrastive);
@@ -143,6 +152,8 @@ void free_layer_custom(layer l, int keep_cudnn_desc)
     if (l.temp2_cpu)           free(l.temp2_cpu);
     if (l.temp3_cpu)           free(l.temp3_cpu);
     if (l.dc_cpu)              free(l.dc_cpu);
+    if (l.packed_state_weights) free(l.packed_state_weights);
+    if (l.packed_state_output) free(l.packed_state_output);
     if (l.dh_cpu)              free(l.dh_cpu);
     if (l.prev_state_cpu)      free(l.prev_state_cpu);
     if (l.prev_cell_cpu)       free(l.prev_cell_cpu);
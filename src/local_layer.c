@@ -168,12 +168,8 @@ void update_local_layer(local_layer l, int batch, float learning_rate, float mom
 {
     int locations = l.out_w*l.out_h;
     int size = l.size*l.size*l.c*l.n*locations;
-    axpy_cpu(l.outputs, learning_rate/batch, l.bias_updates, 1, l.biases, 1);
-    scal_cpu(l.outputs, momentum, l.bias_updates, 1);
-
-    axpy_cpu(size, -decay*batch, l.weights, 1, l.weight_updates, 1);
-    axpy_cpu(size, learning_rate/batch, l.weight_updates, 1, l.weights, 1);
-    scal_cpu(size, momentum, l.weight_updates, 1);
+    sgd_update_cpu(l.outputs, l.biases, l.bias_updates, NULL, learning_rate/batch, momentum, 0, 0);
+    sgd_update_cpu(size, l.weights, l.weight_updates, NULL, learning_rate/batch, momentum, decay*batch, 0);
 }
 
 #ifdef GPU
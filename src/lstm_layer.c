@@ -113,6 +113,14 @@ layer make_lstm_layer(int batch, int inputs, int outputs, int steps, int batch_n
     l.dc_cpu =          (float*)xcalloc(batch*outputs, sizeof(float));
     l.dh_cpu =          (float*)xcalloc(batch*outputs, sizeof(float));
 
+    // the four hidden-state GEMMs of a step read the same h: with the gate weights stacked they are
+    // one [4*outputs x outputs] GEMM (not with batch normalization, which works per sublayer)
+    if (!batch_normalize) {
+        l.packed_state_weights = (float*)xcalloc(4 * outputs * outputs, sizeof(float));
+        l.packed_state_output = (float*)xcalloc(4 * batch*outputs, sizeof(float));
+        pack_lstm_weights(l);
+    }
+
 #ifdef GPU
     l.forward_gpu = forward_lstm_layer_gpu;
     l.backward_gpu = backward_lstm_layer_gpu;
@@ -157,6 +165,13 @@ layer make_lstm_layer(int batch, int inputs, int outputs, int steps, int batch_n
     return l;
 }
 
+void pack_lstm_weights(layer l)
+{
+    if (!l.packed_state_weights) return;
+    layer *w[4] = { l.wf, l.wi, l.wg, l.wo };
+    pack_connected_weights(w, 4, l.packed_state_weights);
+}
+
 void update_lstm_layer(layer l, int batch, float learning_rate, float momentum, float decay)
 {
     update_connected_layer(*(l.wf), batch, learning_rate, momentum, decay);
@@ -167,6 +182,28 @@ void update_lstm_layer(layer l, int batch, float learning_rate, float momentum,
     update_connected_layer(*(l.ui), batch, learning_rate, momentum, decay);
     update_connected_layer(*(l.ug), batch, learning_rate, momentum, decay);
     update_connected_layer(*(l.uo), batch, learning_rate, momentum, decay);
+    pack_lstm_weights(l);
+}
+
+// One pass over the gates of a timestep: f, i, o = logistic, g = tanh of the hidden + input projections,
+// c = c*f + i*g, h = tanh(c)*o. Same operations in the same order as the copy/axpy/activate chain,
+// the gate activations aren't stored: backward_lstm_layer() recomputes them from the sublayer outputs.
+static void lstm_cell_cpu(int n, float *wf, float *wi, float *wg, float *wo,
+    float *uf, float *ui, float *ug, float *uo, float *c, float *h, float *cell, float *output)
+{
+    int j;
+    #pragma omp parallel for
+    for (j = 0; j < n; ++j) {
+        const float f = logistic_activate(wf[j] + uf[j]);
+        const float in = logistic_activate(wi[j] + ui[j]);
+        const float g = tanh_activate(wg[j] + ug[j]);
+        const float o = logistic_activate(wo[j] + uo[j]);
+        const float temp = in*g;
+        c[j] = c[j] * f + temp;
+        h[j] = tanh_activate(c[j]) * o;
+        cell[j] = c[j];
+        output[j] = h[j];
+    }
 }
 
 void forward_lstm_layer(layer l, network_state state)
@@ -198,47 +235,43 @@ void forward_lstm_layer(layer l, network_state state)
         fill_cpu(l.outputs * l.batch * l.steps, 0, l.delta, 1);
     }
 
-    for (i = 0; i < l.steps; ++i) {
-        s.input = l.h_cpu;
-        forward_connected_layer(wf, s);
-        forward_connected_layer(wi, s);
-        forward_connected_layer(wg, s);
-        forward_connected_layer(wo, s);
-
+    // the input projections don't depend on the recurrence: one GEMM over all timesteps,
+    // unless batch normalization collects per-step training statistics
+    const int batched = !(state.train && uf.batch_normalize);
+    if (batched) {
         s.input = state.input;
+        uf.batch *= l.steps;
+        ui.batch *= l.steps;
+        ug.batch *= l.steps;
+        uo.batch *= l.steps;
         forward_connected_layer(uf, s);
         forward_connected_layer(ui, s);
         forward_connected_layer(ug, s);
         forward_connected_layer(uo, s);
+        uf.batch = ui.batch = ug.batch = uo.batch = l.batch;
+    }
 
-        copy_cpu(l.outputs*l.batch, wf.output, 1, l.f_cpu, 1);
-        axpy_cpu(l.outputs*l.batch, 1, uf.output, 1, l.f_cpu, 1);
-
-        copy_cpu(l.outputs*l.batch, wi.output, 1, l.i_cpu, 1);
-        axpy_cpu(l.outputs*l.batch, 1, ui.output, 1, l.i_cpu, 1);
-
-        copy_cpu(l.outputs*l.batch, wg.output, 1, l.g_cpu, 1);
-        axpy_cpu(l.outputs*l.batch, 1, ug.output, 1, l.g_cpu, 1);
-
-        copy_cpu(l.outputs*l.batch, wo.output, 1, l.o_cpu, 1);
-        axpy_cpu(l.outputs*l.batch, 1, uo.output, 1, l.o_cpu, 1);
-
-        activate_array(l.f_cpu, l.outputs*l.batch, LOGISTIC);
-        activate_array(l.i_cpu, l.outputs*l.batch, LOGISTIC);
-        activate_array(l.g_cpu, l.outputs*l.batch, TANH);
-        activate_array(l.o_cpu, l.outputs*l.batch, LOGISTIC);
-
-        copy_cpu(l.outputs*l.batch, l.i_cpu, 1, l.temp_cpu, 1);
-        mul_cpu(l.outputs*l.batch, l.g_cpu, 1, l.temp_cpu, 1);
-        mul_cpu(l.outputs*l.batch, l.f_cpu, 1, l.c_cpu, 1);
-        axpy_cpu(l.outputs*l.batch, 1, l.temp_cpu, 1, l.c_cpu, 1);
-
-        copy_cpu(l.outputs*l.batch, l.c_cpu, 1, l.h_cpu, 1);
-        activate_array(l.h_cpu, l.outputs*l.batch, TANH);
-        mul_cpu(l.outputs*l.batch, l.o_cpu, 1, l.h_cpu, 1);
-
-        copy_cpu(l.outputs*l.batch, l.c_cpu, 1, l.cell_cpu, 1);
-        copy_cpu(l.outputs*l.batch, l.h_cpu, 1, l.output, 1);
+    layer *w[4] = { &wf, &wi, &wg, &wo };
+    for (i = 0; i < l.steps; ++i) {
+        s.input = l.h_cpu;
+        if (l.packed_state_weights) forward_connected_layers_packed(w, 4, l.packed_state_weights, l.packed_state_output, s);
+        else {
+            forward_connected_layer(wf, s);
+            forward_connected_layer(wi, s);
+            forward_connected_layer(wg, s);
+            forward_connected_layer(wo, s);
+        }
+
+        if (!batched) {
+            s.input = state.input;
+            forward_connected_layer(uf, s);
+            forward_connected_layer(ui, s);
+            forward_connected_layer(ug, s);
+            forward_connected_layer(uo, s);
+        }
+
+        lstm_cell_cpu(l.outputs*l.batch, wf.output, wi.output, wg.output, wo.output,
+            uf.output, ui.output, ug.output, uo.output, l.c_cpu, l.h_cpu, l.cell_cpu, l.output);
 
         state.input += l.inputs*l.batch;
         l.output    += l.outputs*l.batch;
@@ -14,6 +14,8 @@ layer make_lstm_layer(int batch, int inputs, int outputs, int steps, int batch_n
 void forward_lstm_layer(layer l, network_state state);
 void backward_lstm_layer(layer l, network_state state);
 void update_lstm_layer(layer l, int batch, float learning_rate, float momentum, float decay);
+// refreshes the stacked hidden-to-gate weights after the wf/wi/wg/wo weights were changed
+void pack_lstm_weights(layer l);
 
 #ifdef GPU
 void forward_lstm_layer_gpu(layer l, network_state state);
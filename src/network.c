@@ -3,6 +3,9 @@
 #include <stdio.h>
 #include <time.h>
 #include <assert.h>
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
 
 #include "network.h"
 #include "image.h"
@@ -38,6 +41,9 @@
 #include "gaussian_yolo_layer.h"
 #include "upsample_layer.h"
 #include "parser.h"
+#include "profiler.h"
+#include "http_stream.h"
+#include "thread_pool.h"
 
 #include "fpga.h"
 
@@ -235,6 +241,18 @@ char *get_layer_string(LAYER_TYPE a)
             return "normalization";
         case BATCHNORM:
             return "batchnorm";
+        case UPSAMPLE:
+            return "upsample";
+        case CONV_LSTM:
+            return "conv_lstm";
+        case LOCAL_AVGPOOL:
+            return "local_avgpool";
+        case REORG_OLD:
+            return "reorg_old";
+        case IMPLICIT:
+            return "implicit";
+        case EMPTY:
+            return "empty";
         default:
             break;
     }
@@ -277,6 +295,8 @@ void forward_network(network net, network_state state)
         fflush(stdout);
     }
 
+    if (net.profiler) profiler_begin_run(net.profiler);
+
     int i;
     for(i = 0; i < net.n; ++i){
         state.index = i;
@@ -284,9 +304,9 @@ void forward_network(network net, network_state state)
         if(l.delta && state.train && l.train){
             scal_cpu(l.outputs * l.batch, 0, l.delta, 1);
         }
-        //double time = get_time_point();
+        double time = net.profiler ? get_time_point() : 0;
         l.forward(l, state);
-        //printf("%d - Predicted in %lf milli-seconds.\n", i, ((double)get_time_point() - time) / 1000);
+        if (net.profiler) profiler_record_layer(net.profiler, i, time, get_time_point());
         state.input = l.output;
 
         /*
@@ -301,12 +321,28 @@ void forward_network(network net, network_state state)
 }
 
 void update_network(network net)
+{
+    update_network_batch(net, net.batch*net.subdivisions);
+}
+
+static void ema_update_layer(layer l, float ema_alpha);
+
+// ema_alpha >= 0 folds ema_update(net, ema_alpha) into the weight update pass of the conv layers.
+// The step stays per layer rather than one pass over net.params: the arena keeps the weights-file
+// order, so a layer's biases, scales, rolling statistics and weights alternate, and runs of the same
+// rate/decay class are never longer than one array. Every array is already one fused kernel call.
+static void update_network_layers(network net, int update_batch, float ema_alpha)
 {
     int i;
-    int update_batch = net.batch*net.subdivisions;
     float rate = get_current_rate(net);
     for(i = 0; i < net.n; ++i){
         layer l = net.layers[i];
+        l.t = get_current_batch(net);
+        if (l.type == CONVOLUTIONAL && ema_alpha >= 0) {
+            if (l.train && l.update) update_convolutional_layer_ema(l, update_batch, rate, net.momentum, net.decay, ema_alpha);
+            else ema_update_layer(l, ema_alpha);
+            continue;
+        }
         if (l.train == 0) continue;
         if(l.update){
             l.update(l, update_batch, rate, net.momentum, net.decay);
@@ -314,6 +350,22 @@ void update_network(network net)
     }
 }
 
+// update_batch: number of images the accumulated gradients were computed over
+void update_network_batch(network net, int update_batch)
+{
+    update_network_layers(net, update_batch, -1);
+}
+
+// EMA coefficient for the update that finish_network_update() is about to follow with ema_update(),
+// or -1 when that step does not blend (EMA off, not initialized yet, or at/after the apply point)
+static float network_ema_alpha_due(network net)
+{
+    const int iteration = (*net.cur_iteration);
+    if (!net.ema_alpha || iteration < net.max_batches / 2 || iteration >= net.max_batches - 1000) return -1;
+    if (!is_ema_initialized(net)) return -1;
+    return net.ema_alpha;
+}
+
 float *get_network_output(network net)
 {
 #ifdef GPU
@@ -409,6 +461,49 @@ float train_network_sgd(network net, data d, int n)
     return (float)sum/(n*batch);
 }
 
+// EMA and similar-weights rejection after update_network(); step is the number of iterations the
+// update advanced cur_iteration by, so that the periodic points are not skipped.
+// ema_done: the update already blended the EMA (update_network_layers() with network_ema_alpha_due())
+static void finish_network_update(network net, int step, int ema_done)
+{
+    const int iteration = (*net.cur_iteration);
+    const int prev_iteration = iteration - step;
+    int ema_start_point = net.max_batches / 2;
+
+    if (net.ema_alpha && iteration >= ema_start_point)
+    {
+        int ema_apply_point = net.max_batches - 1000;
+
+        if (!is_ema_initialized(net))
+        {
+            ema_update(net, 0); // init EMA
+            printf(" EMA initialization \n");
+        }
+
+        if (prev_iteration < ema_apply_point && iteration >= ema_apply_point)
+        {
+            ema_apply(net); // apply EMA (BN rolling mean/var recalculation is required)
+            printf(" ema_apply() \n");
+        }
+        else
+        if (iteration < ema_apply_point)
+        {
+            if (!ema_done) ema_update(net, net.ema_alpha); // update EMA
+            printf(" ema_update(), ema_alpha = %f \n", net.ema_alpha);
+        }
+    }
+
+    int reject_stop_point = net.max_batches*3/4;
+
+    if (iteration < reject_stop_point &&
+        net.weights_reject_freq &&
+        iteration / net.weights_reject_freq != prev_iteration / net.weights_reject_freq)
+    {
+        float sim_threshold = 0.4;
+        reject_similar_weights(net, sim_threshold);
+    }
+}
+
 float train_network(network net, data d)
 {
     return train_network_waitkey(net, d, 0);
@@ -434,53 +529,453 @@ float train_network_waitkey(network net, data d, int wait_key)
     (*net.cur_iteration) += 1;
 #ifdef GPU
     update_network_gpu(net);
+    finish_network_update(net, 1, 0);
 #else   // GPU
-    update_network(net);
+    float ema_alpha = network_ema_alpha_due(net);
+    update_network_layers(net, net.batch*net.subdivisions, ema_alpha);
+    finish_network_update(net, 1, ema_alpha >= 0);
 #endif  // GPU
 
-    int ema_start_point = net.max_batches / 2;
+    free(X);
+    free(y);
+    return (float)sum/(n*batch);
+}
 
-    if (net.ema_alpha && (*net.cur_iteration) >= ema_start_point)
-    {
-        int ema_period = (net.max_batches - ema_start_point - 1000) * (1.0 - net.ema_alpha);
-        int ema_apply_point = net.max_batches - 1000;
 
-        if (!is_ema_initialized(net))
-        {
-            ema_update(net, 0); // init EMA
-            printf(" EMA initialization \n");
+// ------------------------------------------------------------------------------------------------
+// Parameter arena: the parameter arrays of all layers are moved into one allocation per kind
+// (values, gradients, EMA, Adam m/v) and the layer pointers become views into it. The values are
+// laid out in weights-file order, so that a whole network can be saved or loaded with one fwrite()
+// or fread(), and the other kinds use the same offsets, so that whole-network operations such as the
+// gradient all-reduce run as one pass over a large vector.
+
+typedef struct param_slot {
+    layer *owner;
+    float **w;      // view into params
+    float **u;      // view into param_updates
+    float **ema;    // view into params_ema
+    float **m;      // view into params_m
+    float **v;      // view into params_v
+    size_t n;
+} param_slot;
+
+#define MAX_LAYER_PARAM_SLOTS 64
+
+static int add_param_slot(param_slot *s, int k, layer *owner, float **w, float **u, float **ema, float **m, float **v, size_t n)
+{
+    param_slot slot = { owner, w, u, ema, m, v, n };
+    s[k] = slot;
+    return k + 1;
+}
+
+static int convolutional_param_slots(layer *l, param_slot *s, int k)
+{
+    if (l->share_layer) return k;   // the arrays belong to the shared layer and aren't saved
+    k = add_param_slot(s, k, l, &l->biases, &l->bias_updates, &l->biases_ema, &l->bias_m, &l->bias_v, l->n);
+    if (l->batch_normalize) {
+        k = add_param_slot(s, k, l, &l->scales, &l->scale_updates, &l->scales_ema, &l->scale_m, &l->scale_v, l->n);
+        k = add_param_slot(s, k, l, &l->rolling_mean, NULL, NULL, NULL, NULL, l->n);
+        k = add_param_slot(s, k, l, &l->rolling_variance, NULL, NULL, NULL, NULL, l->n);
+    }
+    return add_param_slot(s, k, l, &l->weights, &l->weight_updates, &l->weights_ema, &l->m, &l->v, l->nweights);
+}
+
+static int connected_param_slots(layer *l, param_slot *s, int k)
+{
+    k = add_param_slot(s, k, l, &l->biases, &l->bias_updates, NULL, NULL, NULL, l->outputs);
+    k = add_param_slot(s, k, l, &l->weights, &l->weight_updates, NULL, NULL, NULL, (size_t)l->inputs*l->outputs);
+    if (l->batch_normalize) {
+        k = add_param_slot(s, k, l, &l->scales, &l->scale_updates, NULL, NULL, NULL, l->outputs);
+        k = add_param_slot(s, k, l, &l->rolling_mean, NULL, NULL, NULL, NULL, l->outputs);
+        k = add_param_slot(s, k, l, &l->rolling_variance, NULL, NULL, NULL, NULL, l->outputs);
+    }
+    return k;
+}
+
+// parameter arrays of a layer in the order save_weights_upto() writes them
+static int layer_param_slots(layer *l, param_slot *s)
+{
+    int k = 0;
+    switch (l->type) {
+    case CONVOLUTIONAL:
+        return convolutional_param_slots(l, s, k);
+    case CONNECTED:
+        return connected_param_slots(l, s, k);
+    case BATCHNORM:
+        k = add_param_slot(s, k, l, &l->biases, &l->bias_updates, NULL, NULL, NULL, l->c);
+        k = add_param_slot(s, k, l, &l->scales, &l->scale_updates, NULL, NULL, NULL, l->c);
+        k = add_param_slot(s, k, l, &l->rolling_mean, NULL, NULL, NULL, NULL, l->c);
+        return add_param_slot(s, k, l, &l->rolling_variance, NULL, NULL, NULL, NULL, l->c);
+    case SHORTCUT:
+        if (l->nweights <= 0) return 0;
+        return add_param_slot(s, k, l, &l->weights, &l->weight_updates, NULL, NULL, NULL, l->nweights);
+    case IMPLICIT:
+        return add_param_slot(s, k, l, &l->weights, &l->weight_updates, NULL, NULL, NULL, l->nweights);
+    case LOCAL:
+        k = add_param_slot(s, k, l, &l->biases, &l->bias_updates, NULL, NULL, NULL, l->outputs);
+        return add_param_slot(s, k, l, &l->weights, &l->weight_updates, NULL, NULL, NULL, (size_t)l->size*l->size*l->c*l->n*l->out_w*l->out_h);
+    case RNN:
+        k = connected_param_slots(l->input_layer, s, k);
+        k = connected_param_slots(l->self_layer, s, k);
+        return connected_param_slots(l->output_layer, s, k);
+    case GRU:
+        k = connected_param_slots(l->input_z_layer, s, k);
+        k = connected_param_slots(l->input_r_layer, s, k);
+        k = connected_param_slots(l->input_h_layer, s, k);
+        k = connected_param_slots(l->state_z_layer, s, k);
+        k = connected_param_slots(l->state_r_layer, s, k);
+        return connected_param_slots(l->state_h_layer, s, k);
+    case LSTM:
+        k = connected_param_slots(l->wf, s, k);
+        k = connected_param_slots(l->wi, s, k);
+        k = connected_param_slots(l->wg, s, k);
+        k = connected_param_slots(l->wo, s, k);
+        k = connected_param_slots(l->uf, s, k);
+        k = connected_param_slots(l->ui, s, k);
+        k = connected_param_slots(l->ug, s, k);
+        return connected_param_slots(l->uo, s, k);
+    case CONV_LSTM:
+        if (l->peephole) {
+            k = convolutional_param_slots(l->vf, s, k);
+            k = convolutional_param_slots(l->vi, s, k);
+            k = convolutional_param_slots(l->vo, s, k);
         }
+        k = convolutional_param_slots(l->wf, s, k);
+        if (!l->bottleneck) {
+            k = convolutional_param_slots(l->wi, s, k);
+            k = convolutional_param_slots(l->wg, s, k);
+            k = convolutional_param_slots(l->wo, s, k);
+        }
+        k = convolutional_param_slots(l->uf, s, k);
+        k = convolutional_param_slots(l->ui, s, k);
+        k = convolutional_param_slots(l->ug, s, k);
+        return convolutional_param_slots(l->uo, s, k);
+    case CRNN:
+        k = convolutional_param_slots(l->input_layer, s, k);
+        k = convolutional_param_slots(l->self_layer, s, k);
+        return convolutional_param_slots(l->output_layer, s, k);
+    default:
+        return 0;
+    }
+}
 
-        if ((*net.cur_iteration) == ema_apply_point)
-        {
-            ema_apply(net); // apply EMA (BN rolling mean/var recalculation is required)
-            printf(" ema_apply() \n");
+static void move_to_arena(float **p, float *arena, size_t offset, size_t n)
+{
+    if (!p || !*p) return;
+    memcpy(arena + offset, *p, n * sizeof(float));
+    free(*p);
+    *p = arena + offset;
+}
+
+void make_network_parameter_arena(network *net)
+{
+    param_slot s[MAX_LAYER_PARAM_SLOTS];
+    size_t total = 0;
+    int has_updates = 0, has_ema = 0, has_adam = 0;
+    int i, k, n;
+    if (net->params) return;
+    for (i = 0; i < net->n; ++i) {
+        n = layer_param_slots(&net->layers[i], s);
+        for (k = 0; k < n; ++k) {
+            if (!*s[k].w) continue;
+            total += s[k].n;
+            if (s[k].u && *s[k].u) has_updates = 1;
+            if (s[k].ema && *s[k].ema) has_ema = 1;
+            if (s[k].m && *s[k].m) has_adam = 1;
         }
-        else
-        if ((*net.cur_iteration) < ema_apply_point)// && (*net.cur_iteration) % ema_period == 0)
-        {
-            ema_update(net, net.ema_alpha); // update EMA
-            printf(" ema_update(), ema_alpha = %f \n", net.ema_alpha);
+    }
+    if (!total) return;
+
+    net->nparams = total;
+    net->params = (float*)xcalloc(total, sizeof(float));
+    if (has_updates) net->param_updates = (float*)xcalloc(total, sizeof(float));
+    if (has_ema) net->params_ema = (float*)xcalloc(total, sizeof(float));
+    if (has_adam) {
+        net->params_m = (float*)xcalloc(total, sizeof(float));
+        net->params_v = (float*)xcalloc(total, sizeof(float));
+    }
+
+    size_t offset = 0;
+    for (i = 0; i < net->n; ++i) {
+        n = layer_param_slots(&net->layers[i], s);
+        for (k = 0; k < n; ++k) {
+            if (!*s[k].w) continue;
+            move_to_arena(s[k].w, net->params, offset, s[k].n);
+            move_to_arena(s[k].u, net->param_updates, offset, s[k].n);
+            move_to_arena(s[k].ema, net->params_ema, offset, s[k].n);
+            move_to_arena(s[k].m, net->params_m, offset, s[k].n);
+            move_to_arena(s[k].v, net->params_v, offset, s[k].n);
+            s[k].owner->param_arena = 1;
+            offset += s[k].n;
         }
     }
 
+    // conv layers with share_index copied the pointers of the layer they share
+    for (i = 0; i < net->n; ++i) {
+        layer *l = &net->layers[i];
+        if (l->type != CONVOLUTIONAL || !l->share_layer) continue;
+        l->weights = l->share_layer->weights;
+        l->weight_updates = l->share_layer->weight_updates;
+        l->biases = l->share_layer->biases;
+        l->bias_updates = l->share_layer->bias_updates;
+        if (l->batch_normalize) {
+            l->scales = l->share_layer->scales;
+            l->scale_updates = l->share_layer->scale_updates;
+            l->rolling_mean = l->share_layer->rolling_mean;
+            l->rolling_variance = l->share_layer->rolling_variance;
+        }
+    }
+}
 
-    int reject_stop_point = net.max_batches*3/4;
+void free_network_parameter_arena(network *net)
+{
+    free(net->params);
+    free(net->param_updates);
+    free(net->params_ema);
+    free(net->params_m);
+    free(net->params_v);
+    net->params = net->param_updates = net->params_ema = net->params_m = net->params_v = NULL;
+    net->nparams = 0;
+}
 
-    if ((*net.cur_iteration) < reject_stop_point &&
-        net.weights_reject_freq &&
-        (*net.cur_iteration) % net.weights_reject_freq == 0)
-    {
-        float sim_threshold = 0.4;
-        reject_similar_weights(net, sim_threshold);
+// Number of floats at the start of net.params that hold layers [0, cutoff) exactly as the weights-file
+// stores them, or 0 when some array isn't at its file position (no arena, layers removed or fused
+// after it was made) and the file has to be read/written layer by layer
+size_t network_parameter_span(network net, int cutoff)
+{
+    param_slot s[MAX_LAYER_PARAM_SLOTS];
+    size_t offset = 0;
+    int i, k, n;
+    if (!net.params) return 0;
+    for (i = 0; i < net.n && i < cutoff; ++i) {
+        n = layer_param_slots(&net.layers[i], s);
+        for (k = 0; k < n; ++k) {
+            if (*s[k].w != net.params + offset) return 0;
+            offset += s[k].n;
+        }
     }
+    return offset;
+}
+
+
+// ------------------------------------------------------------------------------------------------
+// CPU data-parallel training: n replicas of one network, replica 0 owns the parameters and the
+// others point to them. Every replica trains on its part of the loaded data on its own thread with
+// its own activations and gradient buffers, the gradients are summed by a tree all-reduce into
+// replica 0 and a single update_network() is applied.
+
+// Sizes of the parameter/gradient arrays of the layer types the replicas can share; returns 0 for
+// layers that have parameters of another kind (recurrent, local, ...)
+static int layer_parameter_sizes(layer l, int *nweights, int *nbiases, int *nscales, int *nrolling)
+{
+    *nweights = *nbiases = *nscales = *nrolling = 0;
+    if (l.type == CONVOLUTIONAL) {
+        *nweights = l.nweights;
+        *nbiases = l.n;
+        if (l.scale_updates) *nscales = l.n;
+        if (l.rolling_mean) *nrolling = l.n;
+    }
+    else if (l.type == CONNECTED) {
+        *nweights = l.inputs*l.outputs;
+        *nbiases = l.outputs;
+        if (l.scale_updates) *nscales = l.outputs;
+        if (l.rolling_mean) *nrolling = l.outputs;
+    }
+    else if (l.type == BATCHNORM) {
+        *nbiases = *nscales = *nrolling = l.c;
+    }
+    else if (l.type == SHORTCUT || l.type == IMPLICIT) {
+        if (l.weight_updates) *nweights = l.nweights;
+    }
+    else return l.update == NULL;
+    return 1;
+}
+
+int share_network_parameters(network *nets, int n)
+{
+    int j, k, nw, nb, ns, nr;
+    for (j = 0; j < nets[0].n; ++j) {
+        if (!layer_parameter_sizes(nets[0].layers[j], &nw, &nb, &ns, &nr)) return 0;
+    }
+    for (k = 1; k < n; ++k) {
+        for (j = 0; j < nets[k].n; ++j) {
+            layer *l = &nets[k].layers[j];
+            layer base = nets[0].layers[j];
+            layer_parameter_sizes(*l, &nw, &nb, &ns, &nr);
+            if (!l->share_layer && !l->param_arena) {
+                if (nw) free(l->weights);
+                if (nb) free(l->biases);
+                if (ns) free(l->scales);
+            }
+            if (nw) l->weights = base.weights;
+            if (nb) l->biases = base.biases;
+            if (ns) l->scales = base.scales;
+        }
+    }
+    return 1;
+}
+
+void unshare_network_parameters(network *nets, int n)
+{
+    int j, k, nw, nb, ns, nr;
+    for (k = 1; k < n; ++k) {
+        for (j = 0; j < nets[k].n; ++j) {
+            layer *l = &nets[k].layers[j];
+            layer_parameter_sizes(*l, &nw, &nb, &ns, &nr);
+            if (nw) l->weights = NULL;
+            if (nb) l->biases = NULL;
+            if (ns) l->scales = NULL;
+        }
+    }
+}
+
+// dst += src for all gradients, src is cleared for the next iteration
+static void reduce_network_gradients(network dst, network src)
+{
+    int j, nw, nb, ns, nr;
+    if (dst.param_updates && src.param_updates && dst.nparams == src.nparams) {
+        axpy_cpu(dst.nparams, 1, src.param_updates, 1, dst.param_updates, 1);
+        fill_cpu(dst.nparams, 0, src.param_updates, 1);
+        return;
+    }
+    for (j = 0; j < dst.n; ++j) {
+        layer d = dst.layers[j];
+        layer s = src.layers[j];
+        layer_parameter_sizes(d, &nw, &nb, &ns, &nr);
+        if (nw) {
+            axpy_cpu(nw, 1, s.weight_updates, 1, d.weight_updates, 1);
+            fill_cpu(nw, 0, s.weight_updates, 1);
+        }
+        if (nb) {
+            axpy_cpu(nb, 1, s.bias_updates, 1, d.bias_updates, 1);
+            fill_cpu(nb, 0, s.bias_updates, 1);
+        }
+        if (ns) {
+            axpy_cpu(ns, 1, s.scale_updates, 1, d.scale_updates, 1);
+            fill_cpu(ns, 0, s.scale_updates, 1);
+        }
+    }
+}
+
+// BN rolling statistics are updated by each replica's forward pass: average them and give every
+// replica the same values
+static void average_rolling_statistics(network *nets, int n)
+{
+    int j, k, nw, nb, ns, nr;
+    const float s = 1.f / n;
+    for (j = 0; j < nets[0].n; ++j) {
+        layer base = nets[0].layers[j];
+        layer_parameter_sizes(base, &nw, &nb, &ns, &nr);
+        if (!nr) continue;
+        for (k = 1; k < n; ++k) {
+            axpy_cpu(nr, 1, nets[k].layers[j].rolling_mean, 1, base.rolling_mean, 1);
+            axpy_cpu(nr, 1, nets[k].layers[j].rolling_variance, 1, base.rolling_variance, 1);
+        }
+        scal_cpu(nr, s, base.rolling_mean, 1);
+        scal_cpu(nr, s, base.rolling_variance, 1);
+        for (k = 1; k < n; ++k) {
+            copy_cpu(nr, base.rolling_mean, 1, nets[k].layers[j].rolling_mean, 1);
+            copy_cpu(nr, base.rolling_variance, 1, nets[k].layers[j].rolling_variance, 1);
+        }
+    }
+}
 
 
+typedef struct cpu_replica_args {
+    network *nets;
+    int n;
+    int k;
+    int omp_threads;
+    data d;
+    float loss;
+    volatile int *reduced;     // reduced[k] = 1 once replica k holds the sum of its subtree
+} cpu_replica_args;
+
+static void train_cpu_replica(cpu_replica_args *a)
+{
+    network net = a->nets[a->k];
+#ifdef _OPENMP
+    const int omp_threads = omp_get_max_threads();
+    omp_set_num_threads(a->omp_threads);
+#endif
+    const int batch = net.batch;
+    const int subdivisions = a->d.X.rows / batch;
+    float* X = (float*)xcalloc(batch * a->d.X.cols, sizeof(float));
+    float* y = (float*)xcalloc(batch * a->d.y.cols, sizeof(float));
+    int i;
+    a->loss = 0;
+    for (i = 0; i < subdivisions; ++i) {
+        get_next_batch(a->d, batch, i*batch, X, y);
+        net.current_subdivision = i;
+        a->loss += train_network_datum(net, X, y);
+    }
     free(X);
     free(y);
-    return (float)sum/(n*batch);
+
+    // tree all-reduce without locks: at level s replica k (k % 2s == 0) waits until replica k+s has
+    // reduced its own subtree and adds it, the others publish their sum and stop
+    int s;
+    for (s = 1; s < a->n; s *= 2) {
+        if (a->k % (2 * s)) break;
+        if (a->k + s >= a->n) continue;
+        while (!custom_atomic_load_int(&a->reduced[a->k + s])) this_thread_yield();
+        reduce_network_gradients(net, a->nets[a->k + s]);
+    }
+    custom_atomic_store_int(&a->reduced[a->k], 1);
+#ifdef _OPENMP
+    omp_set_num_threads(omp_threads);
+#endif
 }
 
+// replicas are taken from the pool in the order n-1, ..., 0: replica k only waits for replicas
+// above k, so they are already running or done however few threads the pool has
+static void train_cpu_replicas(int begin, int end, void *ptr)
+{
+    cpu_replica_args *args = (cpu_replica_args*)ptr;
+    int i;
+    for (i = begin; i < end; ++i) train_cpu_replica(&args[args[0].n - 1 - i]);
+}
+
+float train_networks_cpu(network *nets, int n, data d)
+{
+    assert(d.X.rows % (nets[0].batch * n) == 0);
+    int k;
+    cpu_replica_args *args = (cpu_replica_args*)xcalloc(n, sizeof(cpu_replica_args));
+    volatile int *reduced = (volatile int*)xcalloc(n, sizeof(int));
+    int omp_threads = 1;
+#ifdef _OPENMP
+    omp_threads = max_val_cmp(1, omp_get_max_threads() / min_val_cmp(n, thread_pool_size()));
+#endif
+    for (k = 0; k < n; ++k) {
+        args[k].nets = nets;
+        args[k].n = n;
+        args[k].k = k;
+        args[k].omp_threads = omp_threads;
+        args[k].d = get_data_part(d, k, n);
+        args[k].reduced = reduced;
+    }
+    parallel_for(n, 1, train_cpu_replicas, args);
+    float sum = 0;
+    for (k = 0; k < n; ++k) sum += args[k].loss;
+
+    // one update for the whole n * batch * subdivisions images, cur_iteration advances by n as in
+    // multi-GPU training so that the steps/burn_in/max_batches schedule stays in images
+    network net = nets[0];
+    average_rolling_statistics(nets, n);
+    (*net.cur_iteration) += n;
+    *net.seen = (uint64_t)net.batch * net.subdivisions * get_current_iteration(net);
+    float ema_alpha = network_ema_alpha_due(net);
+    update_network_layers(net, net.batch * net.subdivisions * n, ema_alpha);
+    finish_network_update(net, n, ema_alpha >= 0);
+    for (k = 1; k < n; ++k) {
+        *nets[k].cur_iteration = *net.cur_iteration;
+        *nets[k].seen = *net.seen;
+    }
+
+    free(args);
+    free((void*)reduced);
+    return sum / (d.X.rows);
+}
 
 float train_network_batch(network net, data d, int n)
 {
@@ -589,6 +1084,8 @@ int resize_network(network *net, int w, int h)
     //if(w == net->w && h == net->h) return 0;
     net->w = w;
     net->h = h;
+    free(net->input);   // staging buffer of network_predict_image(), reallocated on next use
+    net->input = NULL;
     int inputs = 0;
     size_t workspace_size = 0;
     //fprintf(stderr, "Resizing to %d x %d...\n", w, h);
@@ -990,6 +1487,135 @@ void free_detections(detection *dets, int n)
     free(dets);
 }
 
+// Per-network detection arena: DETS_ARENA_SLOTS slabs sized for the largest candidate count
+// the output layers can produce, each holding the detection array plus contiguous prob, uc,
+// mask and embedding rows. Slots are handed out round-robin, so a view stays valid until
+// DETS_ARENA_SLOTS more views were taken (lets demo() draw frame N while frame N+1 is decoded).
+#define DETS_ARENA_SLOTS 2
+
+typedef struct detection_arena {
+    int capacity;           // boxes per slot
+    int classes, uc, mask, embedding_size;  // floats per box in each row block
+    int next;
+    detection *dets[DETS_ARENA_SLOTS];
+    float *data[DETS_ARENA_SLOTS];
+} detection_arena;
+
+static int max_network_boxes(network *net)
+{
+    int i;
+    int s = 0;
+    for (i = 0; i < net->n; ++i) {
+        layer l = net->layers[i];
+        if (l.type == YOLO || l.type == GAUSSIAN_YOLO || l.type == DETECTION || l.type == REGION) {
+            s += l.w*l.h*l.n;
+        }
+    }
+    return s;
+}
+
+static void free_detection_arena(detection_arena *a)
+{
+    int k;
+    if (!a) return;
+    for (k = 0; k < DETS_ARENA_SLOTS; ++k) {
+        free(a->dets[k]);
+        free(a->data[k]);
+    }
+    free(a);
+}
+
+static detection_arena *make_detection_arena(network *net, int capacity)
+{
+    int i, k;
+    layer l = net->layers[net->n - 1];
+    for (i = 0; i < net->n; ++i) {
+        layer l_tmp = net->layers[i];
+        if (l_tmp.type == YOLO || l_tmp.type == GAUSSIAN_YOLO || l_tmp.type == DETECTION || l_tmp.type == REGION) {
+            l = l_tmp;
+            break;
+        }
+    }
+
+    detection_arena *a = (detection_arena*)xcalloc(1, sizeof(detection_arena));
+    a->capacity = capacity;
+    a->classes = l.classes;
+    a->uc = (l.type == GAUSSIAN_YOLO) ? 4 : 0;
+    a->mask = (l.coords > 4) ? l.coords - 4 : 0;
+    a->embedding_size = l.embedding_output ? l.embedding_size : 0;
+    const size_t per_box = (size_t)a->classes + a->uc + a->mask + a->embedding_size;
+    const size_t cap = capacity > 0 ? capacity : 1;
+
+    for (k = 0; k < DETS_ARENA_SLOTS; ++k) {
+        a->dets[k] = (detection*)xcalloc(cap, sizeof(detection));
+        a->data[k] = (float*)xcalloc(cap * per_box, sizeof(float));
+        float *prob = a->data[k];
+        float *uc = prob + cap * a->classes;
+        float *mask = uc + cap * a->uc;
+        float *embeddings = mask + cap * a->mask;
+        for (i = 0; i < capacity; ++i) {
+            detection *d = &a->dets[k][i];
+            d->prob = prob + (size_t)i * a->classes;
+            d->uc = a->uc ? uc + (size_t)i * a->uc : NULL;
+            d->mask = a->mask ? mask + (size_t)i * a->mask : NULL;
+            d->embeddings = a->embedding_size ? embeddings + (size_t)i * a->embedding_size : NULL;
+            d->embedding_size = l.embedding_size;
+        }
+    }
+    return a;
+}
+
+// Same contents as make_network_boxes(), but the boxes are a view into the network's arena:
+// do not pass them to free_detections(). The arena is rebuilt when the network input size changed.
+static detection *make_network_boxes_view(network *net, float thresh, int *num, int batch)
+{
+    int i;
+    const int capacity = max_network_boxes(net);
+    detection_arena *a = net->dets_arena;
+    if (!a || a->capacity != capacity) {
+        free_detection_arena(a);
+        a = net->dets_arena = make_detection_arena(net, capacity);
+    }
+
+    int nboxes = (batch < 0) ? num_detections(net, thresh) : num_detections_batch(net, thresh, batch);
+    if (num) *num = nboxes;
+
+    const int k = a->next;
+    a->next = (a->next + 1) % DETS_ARENA_SLOTS;
+    detection *dets = a->dets[k];
+    for (i = 0; i < nboxes; ++i) {
+        detection d = { 0 };
+        d.prob = dets[i].prob;
+        d.uc = dets[i].uc;
+        d.mask = dets[i].mask;
+        d.embeddings = dets[i].embeddings;
+        d.embedding_size = dets[i].embedding_size;
+        dets[i] = d;
+    }
+    // row blocks are contiguous, so clearing the used part of each is one memset
+    const size_t cap = capacity > 0 ? capacity : 1;
+    float *prob = a->data[k];
+    memset(prob, 0, (size_t)nboxes * a->classes * sizeof(float));
+    if (a->uc) memset(prob + cap*a->classes, 0, (size_t)nboxes * a->uc * sizeof(float));
+    if (a->mask) memset(prob + cap*(a->classes + a->uc), 0, (size_t)nboxes * a->mask * sizeof(float));
+    if (a->embedding_size) memset(prob + cap*(a->classes + a->uc + a->mask), 0, (size_t)nboxes * a->embedding_size * sizeof(float));
+    return dets;
+}
+
+detection *get_network_boxes_view(network *net, int w, int h, float thresh, float hier, int *map, int relative, int *num, int letter)
+{
+    detection *dets = make_network_boxes_view(net, thresh, num, -1);
+    fill_network_boxes(net, w, h, thresh, hier, map, relative, dets, letter);
+    return dets;
+}
+
+detection *get_network_boxes_batch_view(network *net, int w, int h, float thresh, float hier, int *map, int relative, int *num, int letter, int batch)
+{
+    detection *dets = make_network_boxes_view(net, thresh, num, batch);
+    fill_network_boxes_batch(net, w, h, thresh, hier, map, relative, dets, letter, batch);
+    return dets;
+}
+
 void free_batch_detections(det_num_pair *det_num_pairs, int n)
 {
     int  i;
@@ -1055,6 +1681,15 @@ char *detection_to_json(detection *dets, int nboxes, int classes, char **names,
 }
 
 
+// Persistent net->w x net->h x net->c staging buffer for the resized frame, so single-image
+// prediction does not allocate per call. Released by free_network() and resize_network().
+static image get_network_input_image(network *net)
+{
+    if (!net->input) net->input = (float*)xcalloc((size_t)net->w*net->h*net->c, sizeof(float));
+    image imr = { net->w, net->h, net->c, net->input };
+    return imr;
+}
+
 float *network_predict_image(network *net, image im)
 {
     //image imr = letterbox_image(im, net->w, net->h);
@@ -1066,9 +1701,9 @@ float *network_predict_image(network *net, image im)
     }
     else {
         // Need to resize image to the desired size for the net
-        image imr = resize_image(im, net->w, net->h);
+        image imr = get_network_input_image(net);
+        resize_image_into(im, imr);
         p = network_predict(*net, imr.data);
-        free_image(imr);
     }
     return p;
 }
@@ -1099,13 +1734,28 @@ float *network_predict_image_letterbox(network *net, image im)
     }
     else {
         // Need to resize image to the desired size for the net
-        image imr = letterbox_image(im, net->w, net->h);
+        image imr = get_network_input_image(net);
+        letterbox_image_into_padded(im, imr, .5);
         p = network_predict(*net, imr.data);
-        free_image(imr);
     }
     return p;
 }
 
+// Converts a packed 8-bit frame (c interleaved channels, rows stride bytes apart, BGR if swap_rb)
+// into the persistent single-image network input buffer: resized or letterboxed and normalized in one pass.
+float *network_input_from_bytes(network *net, const unsigned char *data, int w, int h, int c, int stride, int swap_rb, int letter)
+{
+    image imr = get_network_input_image(net);
+    bytes_to_image_into(data, w, h, c, stride, swap_rb, letter, imr);
+    return imr.data;
+}
+
+float *network_predict_bytes(network *net, const unsigned char *data, int w, int h, int c, int stride, int swap_rb, int letter)
+{
+    if (net->batch != 1) set_batch_network(net, 1);
+    return network_predict(*net, network_input_from_bytes(net, data, w, h, c, stride, swap_rb, letter));
+}
+
 int network_width(network *net) { return net->w; }
 int network_height(network *net) { return net->h; }
 
@@ -1250,6 +1900,10 @@ void free_network(network net)
     free(net.cur_iteration);
     free(net.total_bbox);
     free(net.rewritten_bbox);
+    free(net.input);
+    free_network_parameter_arena(&net);
+    free_detection_arena(net.dets_arena);
+    free_network_profiler(net.profiler);
 
 #ifdef GPU
     if (gpu_index >= 0) cuda_free(net.workspace);
@@ -1423,6 +2077,22 @@ void calculate_binary_weights(network net)
             }
         }
     }
+
+    // consecutive XNOR layers on the CPU: the first one packs the signs of its outputs straight into
+    // the input bits of the second one while applying the bias and activation
+    for (j = 0; j + 1 < net.n; ++j) {
+        layer *l = &net.layers[j];
+        layer *next = &net.layers[j + 1];
+        l->bin_re_packed_output = NULL;
+        next->bin_input_packed = 0;
+        if (l->type != CONVOLUTIONAL || !l->xnor || l->stride_x != l->stride_y || l->batch != 1) continue;
+        if (l->n % 32 || l->activation == SWISH || l->activation == MISH || l->activation == HARD_MISH ||
+            l->activation == NORM_CHAN || l->activation == NORM_CHAN_SOFTMAX || l->activation == NORM_CHAN_SOFTMAX_MAXVAL) continue;
+        if (next->type != CONVOLUTIONAL || !next->xnor || next->c % 32 || next->stride_x != next->stride_y) continue;
+
+        l->bin_re_packed_output = next->bin_re_packed_input;
+        next->bin_input_packed = 1;
+    }
     //printf("\n calculate_binary_weights Done! \n");
 
 }
@@ -1549,6 +2219,90 @@ void restore_network_recurrent_state(network net)
     }
 }
 
+// The recurrent state arrays of a layer, laid out as l.batch rows of `size` floats.
+// Returns how many there are (0 for non-recurrent layers).
+static int layer_recurrent_state(layer l, float **cpu, float **gpu, int *size)
+{
+    gpu[0] = gpu[1] = NULL;
+    switch (l.type) {
+    case RNN:
+    case CRNN:
+        cpu[0] = l.state; size[0] = l.hidden;
+#ifdef GPU
+        gpu[0] = l.state_gpu;
+#endif
+        return 1;
+    case GRU:
+        cpu[0] = l.state; size[0] = l.outputs;
+#ifdef GPU
+        gpu[0] = l.state_gpu;
+#endif
+        return 1;
+    case LSTM:
+    case CONV_LSTM:
+        cpu[0] = l.c_cpu; cpu[1] = l.h_cpu; size[0] = size[1] = l.outputs;
+#ifdef GPU
+        gpu[0] = l.c_gpu; gpu[1] = l.h_gpu;
+#endif
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+int get_network_recurrent_state_size(network net)
+{
+    float *cpu[2], *gpu[2];
+    int size[2];
+    int k, j, total = 0;
+    for (k = 0; k < net.n; ++k) {
+        const int n = layer_recurrent_state(net.layers[k], cpu, gpu, size);
+        for (j = 0; j < n; ++j) total += size[j];
+    }
+    return total;
+}
+
+// Copies the recurrent state of batch row b to dst (get_network_recurrent_state_size() floats):
+// with inference every row of the batch is an independent sequence, so the state of one of them
+// can be put aside and continued later in any row.
+void remember_network_recurrent_state_row(network net, int b, float *dst)
+{
+    float *cpu[2], *gpu[2];
+    int size[2];
+    int k, j;
+    for (k = 0; k < net.n; ++k) {
+        const int n = layer_recurrent_state(net.layers[k], cpu, gpu, size);
+        for (j = 0; j < n; ++j) {
+#ifdef GPU
+            if (gpu_index >= 0 && gpu[j]) cuda_pull_array(gpu[j] + b*size[j], cpu[j] + b*size[j], size[j]);
+#endif
+            memcpy(dst, cpu[j] + b*size[j], size[j] * sizeof(float));
+            dst += size[j];
+        }
+    }
+}
+
+// Puts a state saved by remember_network_recurrent_state_row() into batch row b, src = NULL clears the row
+void restore_network_recurrent_state_row(network net, int b, float *src)
+{
+    float *cpu[2], *gpu[2];
+    int size[2];
+    int k, j;
+    for (k = 0; k < net.n; ++k) {
+        const int n = layer_recurrent_state(net.layers[k], cpu, gpu, size);
+        for (j = 0; j < n; ++j) {
+            if (src) {
+                memcpy(cpu[j] + b*size[j], src, size[j] * sizeof(float));
+                src += size[j];
+            }
+            else memset(cpu[j] + b*size[j], 0, size[j] * sizeof(float));
+#ifdef GPU
+            if (gpu_index >= 0 && gpu[j]) cuda_push_array(gpu[j] + b*size[j], cpu[j] + b*size[j], size[j]);
+#endif
+        }
+    }
+}
+
 
 int is_ema_initialized(network net)
 {
@@ -1568,6 +2322,21 @@ int is_ema_initialized(network net)
     return 0;
 }
 
+static void ema_update_layer(layer l, float ema_alpha)
+{
+    int k;
+    if (l.weights_ema) {
+        for (k = 0; k < l.nweights; ++k) {
+            l.weights_ema[k] = ema_alpha * l.weights_ema[k] + (1 - ema_alpha) * l.weights[k];
+        }
+    }
+
+    for (k = 0; k < l.n; ++k) {
+        if (l.biases_ema) l.biases_ema[k] = ema_alpha * l.biases_ema[k] + (1 - ema_alpha) * l.biases[k];
+        if (l.scales_ema) l.scales_ema[k] = ema_alpha * l.scales_ema[k] + (1 - ema_alpha) * l.scales[k];
+    }
+}
+
 void ema_update(network net, float ema_alpha)
 {
     int i;
@@ -1579,17 +2348,7 @@ void ema_update(network net, float ema_alpha)
                 pull_convolutional_layer(l);
             }
 #endif
-            int k;
-            if (l.weights_ema) {
-                for (k = 0; k < l.nweights; ++k) {
-                    l.weights_ema[k] = ema_alpha * l.weights_ema[k] + (1 - ema_alpha) * l.weights[k];
-                }
-            }
-
-            for (k = 0; k < l.n; ++k) {
-                if (l.biases_ema) l.biases_ema[k] = ema_alpha * l.biases_ema[k] + (1 - ema_alpha) * l.biases[k];
-                if (l.scales_ema) l.scales_ema[k] = ema_alpha * l.scales_ema[k] + (1 - ema_alpha) * l.scales[k];
-            }
+            ema_update_layer(l, ema_alpha);
         }
     }
 }
@@ -118,6 +118,14 @@ network make_network(int n);
 void forward_network(network net, network_state state);
 void backward_network(network net, network_state state);
 void update_network(network net);
+void update_network_batch(network net, int update_batch);
+// CPU data-parallel training, replicas share the parameters of nets[0]
+float train_networks_cpu(network *nets, int n, data d);
+void make_network_parameter_arena(network *net);
+void free_network_parameter_arena(network *net);
+size_t network_parameter_span(network net, int cutoff);
+int share_network_parameters(network *nets, int n);
+void unshare_network_parameters(network *nets, int n);
 
 float train_network(network net, data d);
 float train_network_waitkey(network net, data d, int wait_key);
@@ -151,6 +159,9 @@ float get_network_cost(network net);
 //LIB_API detection *get_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, int *num, int letter);
 //LIB_API detection *make_network_boxes(network *net, float thresh, int *num);
 //LIB_API void free_detections(detection *dets, int n);
+detection *make_network_boxes_batch(network *net, float thresh, int *num, int batch);
+void fill_network_boxes_batch(network *net, int w, int h, float thresh, float hier, int *map, int relative, detection *dets, int letter, int batch);
+detection *get_network_boxes_batch_view(network *net, int w, int h, float thresh, float hier, int *map, int relative, int *num, int letter, int batch);
 //LIB_API void reset_rnn(network *net);
 //LIB_API network *load_network_custom(char *cfg, char *weights, int clear, int batch);
 //LIB_API network *load_network(char *cfg, char *weights, int clear);
@@ -171,6 +182,9 @@ void free_network_recurrent_state(network net);
 void randomize_network_recurrent_state(network net);
 void remember_network_recurrent_state(network net);
 void restore_network_recurrent_state(network net);
+int get_network_recurrent_state_size(network net);
+void remember_network_recurrent_state_row(network net, int b, float *dst);
+void restore_network_recurrent_state_row(network net, int b, float *src);
 int is_ema_initialized(network net);
 void ema_update(network net, float ema_alpha);
 void ema_apply(network net);
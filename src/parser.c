@@ -1761,10 +1761,11 @@ network parse_network_cfg_custom(char *filename, int batch, int time_steps)
 #endif
 
     set_train_only_bn(net); // set l.train_only_bn for all required layers
+    make_network_parameter_arena(&net);
 
     net.outputs = get_network_output_size(net);
     net.output = get_network_output(net);
-    avg_outputs = avg_outputs / avg_counter;
+    if (avg_counter) avg_outputs = avg_outputs / avg_counter;   // 0 for networks without spatial layers (char-RNN)
     fprintf(stderr, "Total BFLOPS %5.3f \n", bflops);
     fprintf(stderr, "avg_outputs = %d \n", avg_outputs);
 #ifdef GPU
@@ -1995,6 +1996,16 @@ void save_connected_weights(layer l, FILE *fp)
     }
 }
 
+// the host arrays hold the current parameters, nothing has to be pulled from or pushed to the GPU
+static int params_on_host(void)
+{
+#ifdef GPU
+    return gpu_index < 0;
+#else
+    return 1;
+#endif
+}
+
 void save_weights_upto(network net, char *filename, int cutoff, int save_ema)
 {
 #ifdef GPU
@@ -2015,6 +2026,14 @@ void save_weights_upto(network net, char *filename, int cutoff, int save_ema)
     (*net.seen) = get_current_iteration(net) * net.batch * net.subdivisions; // remove this line, when you will save to weights-file both: seen & cur_iteration
     fwrite(net.seen, sizeof(uint64_t), 1, fp);
 
+    // the parameter arena is laid out as the file: one write for the whole network
+    size_t span = (save_ema || !params_on_host()) ? 0 : network_parameter_span(net, cutoff);
+    if (span) {
+        if (fwrite(net.params, sizeof(float), span, fp) != span) fprintf(stderr, " Error: couldn't write %s \n", filename);
+        fclose(fp);
+        return;
+    }
+
     int i;
     for(i = 0; i < net.n && i < cutoff; ++i){
         layer l = net.layers[i];
@@ -2255,6 +2274,17 @@ void load_implicit_weights(layer l, FILE *fp)
 #endif
 }
 
+// the stacked hidden-state weights of [lstm]/[gru]/[conv_lstm] layers are copies of the loaded ones
+static void pack_recurrent_weights(network net, int cutoff)
+{
+    int i;
+    for (i = 0; i < net.n && i < cutoff; ++i) {
+        if (net.layers[i].type == LSTM) pack_lstm_weights(net.layers[i]);
+        if (net.layers[i].type == GRU) pack_gru_weights(net.layers[i]);
+        if (net.layers[i].type == CONV_LSTM) pack_conv_lstm_weights(net.layers[i]);
+    }
+}
+
 void load_weights_upto(network *net, char *filename, int cutoff)
 {
 #ifdef GPU
@@ -2290,6 +2320,23 @@ void load_weights_upto(network *net, char *filename, int cutoff)
     int transpose = (major > 1000) || (minor > 1000);
 
     int i;
+    // the parameter arena is laid out as the file: one read for the whole network, unless some layer
+    // skips or transforms its part of the file
+    size_t span = (transpose || !params_on_host()) ? 0 : network_parameter_span(*net, cutoff);
+    for (i = 0; i < net->n && i < cutoff && span; ++i) {
+        layer l = net->layers[i];
+        if (l.dontload || l.dontloadscales || l.flipped) span = 0;
+    }
+    if (span) {
+        size_t read_floats = fread(net->params, sizeof(float), span, fp);
+        for (i = 0; i < net->n && i < cutoff && network_parameter_span(*net, i + 1) <= read_floats; ++i);
+        if (read_floats < span) printf("\n Warning: Unexpected end of wights-file! l.index = %d \n", i);
+        fprintf(stderr, "Done! Loaded %d layers from weights-file \n", i);
+        fclose(fp);
+        pack_recurrent_weights(*net, cutoff);
+        return;
+    }
+
     for(i = 0; i < net->n && i < cutoff; ++i){
         layer l = net->layers[i];
         if (l.dontload) continue;
@@ -2368,6 +2415,7 @@ void load_weights_upto(network *net, char *filename, int cutoff)
     }
     fprintf(stderr, "Done! Loaded %d layers from weights-file \n", i);
     fclose(fp);
+    pack_recurrent_weights(*net, cutoff);
 }
 
 void load_weights(network *net, char *filename)
@@ -2386,6 +2434,7 @@ network *load_network_custom(char *cfg, char *weights, int clear, int batch)
         load_weights(net, weights);
     }
     fuse_conv_batchnorm(*net);
+    optimize_network_graph(net);
     if (clear) {
         (*net->seen) = 0;
         (*net->cur_iteration) = 0;
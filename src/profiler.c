@@ -0,0 +1,362 @@
+#include "profiler.h"
+#include "network.h"
+#include "parser.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+network_profiler *make_network_profiler(int n, int max_runs)
+{
+    network_profiler *p = (network_profiler*)xcalloc(1, sizeof(network_profiler));
+    if (max_runs < 1) max_runs = 1;
+    p->n = n;
+    p->max_runs = max_runs;
+    p->origin = get_time_point();
+    p->starts = (double*)xcalloc((size_t)n * max_runs, sizeof(double));
+    p->times = (double*)xcalloc((size_t)n * max_runs, sizeof(double));
+    return p;
+}
+
+void free_network_profiler(network_profiler *p)
+{
+    if (!p) return;
+    free(p->starts);
+    free(p->times);
+    free(p);
+}
+
+void profiler_begin_run(network_profiler *p)
+{
+    ++p->runs;
+}
+
+void profiler_record_layer(network_profiler *p, int i, double start, double end)
+{
+    if (p->runs < 1 || i >= p->n) return;
+    const size_t slot = (size_t)((p->runs - 1) % p->max_runs) * p->n + i;
+    p->starts[slot] = start - p->origin;
+    p->times[slot] = end - start;
+}
+
+static int recorded_runs(const network_profiler *p)
+{
+    return p->runs < p->max_runs ? p->runs : p->max_runs;
+}
+
+static void add_sublayer_cost(layer_cost *c, layer *l, int steps)
+{
+    if (!l) return;
+    layer_cost s = get_layer_cost(*l);
+    c->flops += s.flops * steps;
+    c->bytes_read += s.bytes_read * steps;
+    c->bytes_written += s.bytes_written * steps;
+}
+
+layer_cost get_layer_cost(layer l)
+{
+    layer_cost c = { 0 };
+    const double batch = l.batch;
+    const double fs = sizeof(float);
+    const double outputs = (double)l.outputs * batch;
+    c.bytes_read = (double)l.inputs * batch * fs;
+    c.bytes_written = outputs * fs;
+
+    switch (l.type) {
+    case CONVOLUTIONAL:
+        // multiply-adds, then bias and activation per output
+        c.flops = 2.0 * l.nweights * l.out_h * l.out_w * batch + 2 * outputs;
+        c.bytes_read += (l.nweights + l.n) * fs;
+        if (l.batch_normalize) {
+            c.flops += 2 * outputs;
+            c.bytes_read += 3.0 * l.n * fs;
+        }
+        break;
+    case DECONVOLUTIONAL:
+        c.flops = 2.0 * l.nweights * l.h * l.w * batch + 2 * outputs;
+        c.bytes_read += (l.nweights + l.n) * fs;
+        break;
+    case CONNECTED:
+        c.flops = 2.0 * l.inputs * l.outputs * batch + 2 * outputs;
+        c.bytes_read += ((double)l.inputs * l.outputs + l.outputs) * fs;
+        break;
+    case LOCAL:
+        c.flops = 2.0 * l.size * l.size * l.c * outputs;
+        c.bytes_read += (double)l.size * l.size * l.c * l.outputs * fs;
+        break;
+    case MAXPOOL:
+    case LOCAL_AVGPOOL:
+        c.flops = (double)l.size * l.size * outputs;
+        break;
+    case AVGPOOL:
+    case SOFTMAX:
+    case L2NORM:
+        c.flops = 3.0 * l.inputs * batch;
+        break;
+    case SHORTCUT:
+        // every extra input is read in full and accumulated
+        c.flops = outputs * l.n * (l.weights_type ? 2 : 1);
+        c.bytes_read += outputs * l.n * fs;
+        break;
+    case SCALE_CHANNELS:
+    case SAM:
+        c.flops = outputs;
+        c.bytes_read += outputs * fs;
+        break;
+    case BATCHNORM:
+        c.flops = 4 * outputs;
+        c.bytes_read += 4.0 * l.c * fs;
+        break;
+    case ACTIVE:
+    case YOLO:
+    case GAUSSIAN_YOLO:
+    case REGION:
+        c.flops = outputs;
+        break;
+    case RNN:
+    case CRNN:
+        add_sublayer_cost(&c, l.input_layer, l.steps);
+        add_sublayer_cost(&c, l.self_layer, l.steps);
+        add_sublayer_cost(&c, l.output_layer, l.steps);
+        break;
+    case GRU:
+        add_sublayer_cost(&c, l.input_z_layer, l.steps);
+        add_sublayer_cost(&c, l.input_r_layer, l.steps);
+        add_sublayer_cost(&c, l.input_h_layer, l.steps);
+        add_sublayer_cost(&c, l.state_z_layer, l.steps);
+        add_sublayer_cost(&c, l.state_r_layer, l.steps);
+        add_sublayer_cost(&c, l.state_h_layer, l.steps);
+        c.flops += 6 * outputs * l.steps;
+        break;
+    case LSTM:
+    case CONV_LSTM:
+        add_sublayer_cost(&c, l.uf, l.steps);
+        add_sublayer_cost(&c, l.ui, l.steps);
+        add_sublayer_cost(&c, l.ug, l.steps);
+        add_sublayer_cost(&c, l.uo, l.steps);
+        add_sublayer_cost(&c, l.wf, l.steps);
+        add_sublayer_cost(&c, l.wi, l.steps);
+        add_sublayer_cost(&c, l.wg, l.steps);
+        add_sublayer_cost(&c, l.wo, l.steps);
+        if (l.type == CONV_LSTM && l.peephole) {
+            add_sublayer_cost(&c, l.vf, l.steps);
+            add_sublayer_cost(&c, l.vi, l.steps);
+            add_sublayer_cost(&c, l.vo, l.steps);
+        }
+        c.flops += 9 * outputs * l.steps;
+        break;
+    default:
+        // route, upsample, reorg, crop, dropout ... only move data
+        break;
+    }
+    return c;
+}
+
+static int compare_doubles(const void *pa, const void *pb)
+{
+    const double a = *(const double *)pa;
+    const double b = *(const double *)pb;
+    return (a > b) - (a < b);
+}
+
+typedef struct layer_times {
+    double min, mean, p99;      // milli-seconds
+} layer_times;
+
+// buf holds recorded_runs(p) doubles
+static layer_times get_layer_times(const network_profiler *p, int i, double *buf)
+{
+    layer_times t = { 0 };
+    const int runs = recorded_runs(p);
+    if (runs == 0) return t;
+    int r;
+    double sum = 0;
+    for (r = 0; r < runs; ++r) {
+        buf[r] = p->times[(size_t)r * p->n + i] / 1000;
+        sum += buf[r];
+    }
+    qsort(buf, runs, sizeof(double), compare_doubles);
+    int p99 = (int)ceil(0.99 * runs) - 1;
+    if (p99 < 0) p99 = 0;
+    t.min = buf[0];
+    t.mean = sum / runs;
+    t.p99 = buf[p99];
+    return t;
+}
+
+typedef struct layer_profile {
+    layer_times t;
+    layer_cost cost;
+    double gflops;      // achieved, from the mean time
+    double gbps;
+    double intensity;   // FLOP per byte moved
+} layer_profile;
+
+// Returns the per-layer statistics and the sum of the mean layer times in *total_ms
+static layer_profile *get_network_profile(network net, double *total_ms)
+{
+    network_profiler *p = net.profiler;
+    layer_profile *lp = (layer_profile*)xcalloc(net.n, sizeof(layer_profile));
+    double *buf = (double*)xcalloc(p->max_runs, sizeof(double));
+    int i;
+    *total_ms = 0;
+    for (i = 0; i < net.n; ++i) {
+        lp[i].t = get_layer_times(p, i, buf);
+        lp[i].cost = get_layer_cost(net.layers[i]);
+        const double bytes = lp[i].cost.bytes_read + lp[i].cost.bytes_written;
+        if (lp[i].t.mean > 0) {
+            lp[i].gflops = lp[i].cost.flops / (lp[i].t.mean * 1000000);
+            lp[i].gbps = bytes / (lp[i].t.mean * 1000000);
+        }
+        if (bytes > 0) lp[i].intensity = lp[i].cost.flops / bytes;
+        *total_ms += lp[i].t.mean;
+    }
+    free(buf);
+    return lp;
+}
+
+void print_network_profile(network net, double peak_gflops, double peak_gbps)
+{
+    if (!net.profiler || recorded_runs(net.profiler) == 0) return;
+    const int roofline = peak_gflops > 0 && peak_gbps > 0;
+    double total_ms;
+    layer_profile *lp = get_network_profile(net, &total_ms);
+    double flops = 0, bytes = 0;
+    int i;
+
+    printf("\n Per-layer forward profile over %d runs (batch = %d) \n", recorded_runs(net.profiler), net.batch);
+    printf(" layer type             min ms   mean ms    p99 ms  time %%     GFLOP   MB moved  GFLOP/s     GB/s  FLOP/B");
+    if (roofline) printf("  roof GFLOP/s  %%roof bound");
+    printf("\n");
+    for (i = 0; i < net.n; ++i) {
+        const double moved = lp[i].cost.bytes_read + lp[i].cost.bytes_written;
+        printf(" %5d %-14s %8.3f %9.3f %9.3f %6.2f %9.4f %10.3f %8.2f %8.2f %7.2f",
+            i, get_layer_string(net.layers[i].type), lp[i].t.min, lp[i].t.mean, lp[i].t.p99,
+            total_ms > 0 ? 100 * lp[i].t.mean / total_ms : 0, lp[i].cost.flops / 1e9, moved / 1e6,
+            lp[i].gflops, lp[i].gbps, lp[i].intensity);
+        if (roofline) {
+            const double memory_roof = lp[i].intensity * peak_gbps;
+            const double roof = memory_roof < peak_gflops ? memory_roof : peak_gflops;
+            printf(" %13.2f %6.1f %s", roof, roof > 0 ? 100 * lp[i].gflops / roof : 0,
+                memory_roof < peak_gflops ? "memory" : "compute");
+        }
+        printf("\n");
+        flops += lp[i].cost.flops;
+        bytes += moved;
+    }
+    printf(" total: %.3f ms, %.3f GFLOP, %.3f MB moved -> %.2f GFLOP/s, %.2f GB/s \n", total_ms, flops / 1e9, bytes / 1e6,
+        total_ms > 0 ? flops / (total_ms * 1e6) : 0, total_ms > 0 ? bytes / (total_ms * 1e6) : 0);
+    free(lp);
+}
+
+void save_network_profile_csv(network net, const char *filename)
+{
+    if (!net.profiler) return;
+    FILE *fp = fopen(filename, "w");
+    if (!fp) file_error((char*)filename);
+    double total_ms;
+    layer_profile *lp = get_network_profile(net, &total_ms);
+    int i;
+    fprintf(fp, "layer,type,runs,min_ms,mean_ms,p99_ms,time_pct,flops,bytes_read,bytes_written,gflops,gbps,flop_per_byte\n");
+    for (i = 0; i < net.n; ++i) {
+        fprintf(fp, "%d,%s,%d,%f,%f,%f,%f,%.0f,%.0f,%.0f,%f,%f,%f\n", i, get_layer_string(net.layers[i].type),
+            recorded_runs(net.profiler), lp[i].t.min, lp[i].t.mean, lp[i].t.p99, total_ms > 0 ? 100 * lp[i].t.mean / total_ms : 0,
+            lp[i].cost.flops, lp[i].cost.bytes_read, lp[i].cost.bytes_written, lp[i].gflops, lp[i].gbps, lp[i].intensity);
+    }
+    fclose(fp);
+    free(lp);
+}
+
+void save_network_profile_json(network net, const char *filename)
+{
+    if (!net.profiler) return;
+    FILE *fp = fopen(filename, "w");
+    if (!fp) file_error((char*)filename);
+    double total_ms;
+    layer_profile *lp = get_network_profile(net, &total_ms);
+    int i;
+    fprintf(fp, "{\n \"runs\": %d,\n \"batch\": %d,\n \"mean_ms\": %f,\n \"layers\": [\n", recorded_runs(net.profiler), net.batch, total_ms);
+    for (i = 0; i < net.n; ++i) {
+        fprintf(fp, "  {\"layer\":%d, \"type\":\"%s\", \"min_ms\":%f, \"mean_ms\":%f, \"p99_ms\":%f, \"flops\":%.0f, "
+            "\"bytes_read\":%.0f, \"bytes_written\":%.0f, \"gflops\":%f, \"gbps\":%f, \"flop_per_byte\":%f}%s\n",
+            i, get_layer_string(net.layers[i].type), lp[i].t.min, lp[i].t.mean, lp[i].t.p99, lp[i].cost.flops,
+            lp[i].cost.bytes_read, lp[i].cost.bytes_written, lp[i].gflops, lp[i].gbps, lp[i].intensity, (i < net.n - 1) ? "," : "");
+    }
+    fprintf(fp, " ]\n}\n");
+    fclose(fp);
+    free(lp);
+}
+
+// Chrome trace-event format (chrome://tracing, Perfetto): one complete event per layer and run
+void save_network_profile_trace(network net, const char *filename)
+{
+    network_profiler *p = net.profiler;
+    if (!p) return;
+    FILE *fp = fopen(filename, "w");
+    if (!fp) file_error((char*)filename);
+    const int runs = recorded_runs(p);
+    int r, i;
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (r = 0; r < runs; ++r) {
+        for (i = 0; i < p->n; ++i) {
+            const size_t slot = (size_t)r * p->n + i;
+            fprintf(fp, "{\"name\":\"%d %s\",\"cat\":\"layer\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+                i, get_layer_string(net.layers[i].type), p->starts[slot], p->times[slot],
+                (r < runs - 1 || i < p->n - 1) ? "," : "");
+        }
+    }
+    fprintf(fp, "]}\n");
+    fclose(fp);
+}
+
+// darknet benchmark <cfg>: profiles forward passes of the network on random input, no weights or images needed
+void run_benchmark(int argc, char **argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s benchmark [cfg] [-iters 100] [-warmup 5] [-batch 1] [-csv file] [-json file] [-trace file] "
+            "[-peak_gflops X -peak_gbps Y]\n", argv[0]);
+        return;
+    }
+    char *cfgfile = argv[2];
+    int iters = find_int_arg(argc, argv, "-iters", 100);
+    int warmup = find_int_arg(argc, argv, "-warmup", 5);
+    int batch = find_int_arg(argc, argv, "-batch", 1);
+    char *csv_file = find_char_arg(argc, argv, "-csv", 0);
+    char *json_file = find_char_arg(argc, argv, "-json", 0);
+    char *trace_file = find_char_arg(argc, argv, "-trace", 0);
+    float peak_gflops = find_float_arg(argc, argv, "-peak_gflops", 0);
+    float peak_gbps = find_float_arg(argc, argv, "-peak_gbps", 0);
+    if (iters < 1) iters = 1;
+    if (batch < 1) batch = 1;
+
+    gpu_index = -1;     // layers are timed in forward_network()
+    network net = parse_network_cfg_custom(cfgfile, batch, 1);
+    fuse_conv_batchnorm(net);
+    optimize_network_graph(&net);
+    calculate_binary_weights(net);
+
+    const size_t input_size = (size_t)net.w * net.h * net.c * net.batch;
+    float *X = (float*)xcalloc(input_size, sizeof(float));
+    size_t k;
+    for (k = 0; k < input_size; ++k) X[k] = rand_uniform(0, 1);
+
+    int i;
+    for (i = 0; i < warmup; ++i) network_predict(net, X);
+
+    net.profiler = make_network_profiler(net.n, iters);
+    double start = get_time_point();
+    for (i = 0; i < iters; ++i) network_predict(net, X);
+    double total_ms = (get_time_point() - start) / 1000;
+
+    print_network_profile(net, peak_gflops, peak_gbps);
+    printf("\n %d iterations, batch = %d: %lf ms/iteration, %.2lf img/sec \n", iters, net.batch, total_ms / iters,
+        net.batch * iters * 1000 / total_ms);
+    if (csv_file) save_network_profile_csv(net, csv_file);
+    if (json_file) save_network_profile_json(net, json_file);
+    if (trace_file) save_network_profile_trace(net, trace_file);
+
+    free(X);
+    free_network(net);
+}
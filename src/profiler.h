@@ -0,0 +1,47 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "darknet.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Analytic cost of one forward pass of a layer for the whole batch: arithmetic operations and the
+// compulsory memory traffic (inputs, weights and outputs, without im2col/workspace re-reads)
+typedef struct layer_cost {
+    double flops;
+    double bytes_read;
+    double bytes_written;
+} layer_cost;
+
+// Per-layer wall times of forward_network(), recorded while net.profiler is set.
+// Keeps the last max_runs runs, older ones are overwritten.
+typedef struct network_profiler {
+    int n;
+    int max_runs;
+    int runs;           // forward passes started so far
+    double origin;      // get_time_point() at creation, trace timestamps are relative to it
+    double *starts;     // [max_runs][n] micro-seconds since origin
+    double *times;      // [max_runs][n] micro-seconds
+} network_profiler;
+
+network_profiler *make_network_profiler(int n, int max_runs);
+void free_network_profiler(network_profiler *p);
+void profiler_begin_run(network_profiler *p);
+void profiler_record_layer(network_profiler *p, int i, double start, double end);
+
+layer_cost get_layer_cost(layer l);
+
+// peak_gflops / peak_gbps > 0 add the roofline columns (attainable performance and bound)
+void print_network_profile(network net, double peak_gflops, double peak_gbps);
+void save_network_profile_csv(network net, const char *filename);
+void save_network_profile_json(network net, const char *filename);
+void save_network_profile_trace(network net, const char *filename);
+
+void run_benchmark(int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
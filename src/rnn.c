@@ -4,6 +4,8 @@
 #include "blas.h"
 #include "parser.h"
 
+#include <pthread.h>
+
 typedef struct {
     float *x;
     float *y;
@@ -285,6 +287,288 @@ void test_char_rnn(char *cfgfile, char *weightfile, int num, char *seed, float t
     printf("\n");
 }
 
+// Generation service: sessions are fed from stdin and sampled in one batched forward per step,
+// every batch row of the network runs its own session.
+//
+// request (one per line):  <id> <num> [seed]   feed the seed (\n, \t, \\ escapes) and generate num symbols
+//                          <id> close          forget the session
+// output (streamed):       <id>\t<symbol>      one line per generated symbol, escaped the same way
+//                          <id>                the request is done
+//
+// A session keeps its recurrent state between requests, so a follow-up request continues the text
+// without feeding the history again. Sessions without work are parked: their state is copied out of
+// the batch row and restored into whichever row is free when their next request comes.
+
+typedef struct rnn_request {
+    char id[64];
+    int num;
+    int close;
+    int *seed;          // symbols of the seed, with the escapes decoded
+    int nseed;
+    struct rnn_request *next;
+} rnn_request;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    rnn_request *head, *tail;
+    int eof;
+    int inputs;         // symbols are indices of the network input, seeds with larger ones are rejected
+} rnn_request_queue;
+
+typedef struct {
+    char id[64];
+    float *state;       // parked recurrent state, NULL before the first request
+    int *feed;          // symbols still to go through the network, the last one starts the generation
+    int nfeed, feed_size;
+    int remaining;      // symbols left to generate
+    int slot;           // batch row, -1 when parked
+    int queued;         // has a request that waits for a free row
+    int produced;
+} rnn_session;
+
+static void *read_rnn_requests(void *ptr)
+{
+    rnn_request_queue *q = (rnn_request_queue*)ptr;
+    char *line;
+    while ((line = fgetl(stdin))) {
+        rnn_request *r = (rnn_request*)xcalloc(1, sizeof(rnn_request));
+        char cmd[32] = { 0 };
+        int offset = 0;
+        if (sscanf(line, "%63s %31s%n", r->id, cmd, &offset) < 2) {
+            fprintf(stderr, " Bad request: %s \n", line);
+            free(r);
+            free(line);
+            continue;
+        }
+        if (0 == strcmp(cmd, "close")) r->close = 1;
+        else r->num = atoi(cmd);
+        if (line[offset] == ' ') ++offset;
+        r->seed = (int*)xcalloc(strlen(line + offset) + 1, sizeof(int));
+        char *c;
+        int sym = 0;
+        for (c = line + offset; *c; ++c) {
+            sym = (unsigned char)*c;
+            if (*c == '\\' && c[1]) {
+                ++c;
+                sym = (*c == 'n') ? '\n' : (*c == 't') ? '\t' : (unsigned char)*c;
+            }
+            if (sym >= q->inputs) break;
+            r->seed[r->nseed++] = sym;
+        }
+        if (*c) {
+            fprintf(stderr, " Bad request, symbol %d is out of the %d inputs: %s \n", sym, q->inputs, line);
+            free(r->seed);
+            free(r);
+            free(line);
+            continue;
+        }
+        free(line);
+
+        pthread_mutex_lock(&q->mutex);
+        if (q->tail) q->tail->next = r;
+        else q->head = r;
+        q->tail = r;
+        pthread_cond_signal(&q->cond);
+        pthread_mutex_unlock(&q->mutex);
+    }
+    pthread_mutex_lock(&q->mutex);
+    q->eof = 1;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+    return 0;
+}
+
+static void push_rnn_feed(rnn_session *s, int c)
+{
+    if (s->nfeed == s->feed_size) {
+        s->feed_size = s->feed_size ? 2 * s->feed_size : 64;
+        s->feed = (int*)xrealloc(s->feed, s->feed_size * sizeof(int));
+    }
+    s->feed[s->nfeed++] = c;
+}
+
+static void print_rnn_symbol(char *id, int c, char **tokens)
+{
+    printf("%s\t", id);
+    if (tokens) printf("%s", tokens[c]);
+    else if (c == '\n') printf("\\n");
+    else if (c == '\t') printf("\\t");
+    else if (c == '\\') printf("\\\\");
+    else putchar(c);
+    putchar('\n');
+}
+
+static rnn_session *find_rnn_session(rnn_session **sessions, int *n, char *id, int create)
+{
+    int i;
+    for (i = 0; i < *n; ++i) {
+        if (0 == strcmp((*sessions)[i].id, id)) return &(*sessions)[i];
+    }
+    if (!create) return NULL;
+    *sessions = (rnn_session*)xrealloc(*sessions, (*n + 1) * sizeof(rnn_session));
+    rnn_session *s = &(*sessions)[(*n)++];
+    memset(s, 0, sizeof(rnn_session));
+    strcpy(s->id, id);
+    s->slot = -1;
+    return s;
+}
+
+void serve_char_rnn(char *cfgfile, char *weightfile, int slots, float temp, int rseed, char *token_file)
+{
+    char **tokens = 0;
+    if(token_file){
+        size_t n;
+        tokens = read_tokens(token_file, &n);
+    }
+
+    srand(rseed);
+    if (slots < 1) slots = 1;
+    network net = parse_network_cfg_custom(cfgfile, slots, 1);  // one batch row per concurrent session, time_steps=1
+    if(weightfile){
+        load_weights(&net, weightfile);
+    }
+    int inputs = get_network_input_size(net);
+    const int state_size = get_network_recurrent_state_size(net);
+    int i, j, b;
+    for(i = 0; i < net.n; ++i) net.layers[i].temperature = temp;
+    fprintf(stderr, " Serving %s: %d concurrent sessions, %d floats of recurrent state per session \n", cfgfile, slots, state_size);
+
+    float *input = (float*)xcalloc(inputs * slots, sizeof(float));
+    int *slot_session = (int*)xcalloc(slots, sizeof(int));
+    for (b = 0; b < slots; ++b) slot_session[b] = -1;
+    rnn_session *sessions = NULL;
+    int nsessions = 0;
+
+    rnn_request_queue q = { 0 };
+    q.inputs = inputs;
+    pthread_mutex_init(&q.mutex, NULL);
+    pthread_cond_init(&q.cond, NULL);
+    pthread_t reader;
+    if (pthread_create(&reader, 0, read_rnn_requests, &q)) error("Thread creation failed", DARKNET_LOC);
+
+    double start = 0;
+    double steps = 0, symbols = 0, busy_rows = 0;
+    while (1) {
+        // take the requests of sessions that aren't busy, the rest waits for the session to finish
+        pthread_mutex_lock(&q.mutex);
+        while (1) {
+            rnn_request *r = q.head, *prev = NULL;
+            while (r) {
+                rnn_request *next = r->next;
+                rnn_session *s = find_rnn_session(&sessions, &nsessions, r->id, !r->close);
+                if (!s || !(s->queued || s->slot >= 0)) {
+                    if (prev) prev->next = next;
+                    else q.head = next;
+                    if (q.tail == r) q.tail = prev;
+                    if (s && r->close) {
+                        free(s->state);
+                        free(s->feed);
+                        *s = sessions[--nsessions];
+                        for (b = 0; b < slots; ++b) {
+                            if (slot_session[b] == nsessions) slot_session[b] = s - sessions;
+                        }
+                    }
+                    else if (s) {
+                        for (j = 0; j < r->nseed; ++j) push_rnn_feed(s, r->seed[j]);
+                        if (!s->nfeed) push_rnn_feed(s, '\n' < inputs ? '\n' : 0);  // a new session without a seed
+                        s->remaining = r->num;
+                        if (s->nfeed > 1 || s->remaining) s->queued = 1;
+                        else {
+                            printf("%s\n", s->id);  // nothing to feed or generate
+                            fflush(stdout);
+                        }
+                    }
+                    free(r->seed);
+                    free(r);
+                }
+                else prev = r;
+                r = next;
+            }
+            int work = 0;
+            for (i = 0; i < nsessions; ++i) work |= sessions[i].queued || sessions[i].slot >= 0;
+            if (work || (q.eof && !q.head)) break;
+            pthread_cond_wait(&q.cond, &q.mutex);
+        }
+        int done = q.eof && !q.head;
+        pthread_mutex_unlock(&q.mutex);
+
+        // queued sessions take the free rows in the order of the session table
+        for (i = 0, b = 0; i < nsessions && b < slots; ++i) {
+            rnn_session *s = &sessions[i];
+            if (!s->queued) continue;
+            while (b < slots && slot_session[b] >= 0) ++b;
+            if (b == slots) break;
+            restore_network_recurrent_state_row(net, b, s->state);
+            s->slot = b;
+            s->queued = 0;
+            slot_session[b] = i;
+        }
+
+        int active = 0;
+        fill_cpu(inputs * slots, 0, input, 1);
+        for (b = 0; b < slots; ++b) {
+            if (slot_session[b] < 0) continue;
+            rnn_session *s = &sessions[slot_session[b]];
+            input[b*inputs + s->feed[0]] = 1;
+            ++active;
+        }
+        if (!active) {
+            if (done) break;
+            continue;
+        }
+        if (!start) start = what_time_is_it_now();
+
+        float *out = network_predict(net, input);
+        ++steps;
+        busy_rows += active;
+
+        for (b = 0; b < slots; ++b) {
+            if (slot_session[b] < 0) continue;
+            rnn_session *s = &sessions[slot_session[b]];
+            memmove(s->feed, s->feed + 1, (s->nfeed - 1) * sizeof(int));
+            s->nfeed--;
+            if (!s->nfeed && s->remaining) {
+                float *p = out + b*inputs;
+                for (j = 0; j < inputs; ++j) {
+                    if (p[j] < .0001) p[j] = 0;
+                }
+                int c = sample_array(p, inputs);
+                print_rnn_symbol(s->id, c, tokens);
+                push_rnn_feed(s, c);
+                s->remaining--;
+                s->produced++;
+                ++symbols;
+            }
+            if (s->nfeed == 1 && !s->remaining) {
+                // the request is done: park the session, its last symbol is the input of the next request
+                if (!s->state) s->state = (float*)xcalloc(state_size, sizeof(float));
+                remember_network_recurrent_state_row(net, b, s->state);
+                s->slot = -1;
+                slot_session[b] = -1;
+                printf("%s\n", s->id);
+            }
+        }
+        fflush(stdout);
+    }
+    pthread_join(reader, 0);
+
+    double time = start ? what_time_is_it_now() - start : 0;
+    fprintf(stderr, " Generated %.0f symbols in %.0f steps, %.2f s: %.1f symbols/s, %.2f sessions per step \n",
+        symbols, steps, time, time > 0 ? symbols / time : 0, steps ? busy_rows / steps : 0);
+
+    for (i = 0; i < nsessions; ++i) {
+        free(sessions[i].state);
+        free(sessions[i].feed);
+    }
+    free(sessions);
+    free(slot_session);
+    free(input);
+    pthread_mutex_destroy(&q.mutex);
+    pthread_cond_destroy(&q.cond);
+    free_network(net);
+}
+
 void test_tactic_rnn(char *cfgfile, char *weightfile, int num, float temp, int rseed, char *token_file)
 {
     char **tokens = 0;
@@ -475,7 +759,7 @@ void vec_char_rnn(char *cfgfile, char *weightfile, char *seed)
 void run_char_rnn(int argc, char **argv)
 {
     if(argc < 4){
-        fprintf(stderr, "usage: %s %s [train/test/valid] [cfg] [weights (optional)]\n", argv[0], argv[1]);
+        fprintf(stderr, "usage: %s %s [train/test/valid/serve] [cfg] [weights (optional)]\n", argv[0], argv[1]);
         return;
     }
     char *filename = find_char_arg(argc, argv, "-file", "data/shakespeare.txt");
@@ -486,6 +770,7 @@ void run_char_rnn(int argc, char **argv)
     int clear = find_arg(argc, argv, "-clear");
     int tokenized = find_arg(argc, argv, "-tokenized");
     char *tokens = find_char_arg(argc, argv, "-tokens", 0);
+    int sessions = find_int_arg(argc, argv, "-sessions", 8);
 
     char *cfg = argv[3];
     char *weights = (argc > 4) ? argv[4] : 0;
@@ -494,5 +779,6 @@ void run_char_rnn(int argc, char **argv)
     else if(0==strcmp(argv[2], "validtactic")) valid_tactic_rnn(cfg, weights, seed);
     else if(0==strcmp(argv[2], "vec")) vec_char_rnn(cfg, weights, seed);
     else if(0==strcmp(argv[2], "generate")) test_char_rnn(cfg, weights, len, seed, temp, rseed, tokens);
+    else if(0==strcmp(argv[2], "serve")) serve_char_rnn(cfg, weights, sessions, temp, rseed, tokens);
     else if(0==strcmp(argv[2], "generatetactic")) test_tactic_rnn(cfg, weights, len, temp, rseed, tokens);
 }
@@ -86,6 +86,16 @@ void update_rnn_layer(layer l, int batch, float learning_rate, float momentum, f
     update_connected_layer(*(l.output_layer), batch, learning_rate, momentum, decay);
 }
 
+// state = (shortcut ? old_state : 0) + input + self, old_state may be the state itself
+static void rnn_state_cpu(int n, int shortcut, float *old_state, float *input, float *self, float *state)
+{
+    int j;
+    #pragma omp parallel for
+    for (j = 0; j < n; ++j) {
+        state[j] = (shortcut ? old_state[j] : 0) + input[j] + self[j];
+    }
+}
+
 void forward_rnn_layer(layer l, network_state state)
 {
     network_state s = {0};
@@ -101,31 +111,48 @@ void forward_rnn_layer(layer l, network_state state)
     fill_cpu(l.hidden * l.batch * l.steps, 0, input_layer.delta, 1);
     if(state.train) fill_cpu(l.hidden * l.batch, 0, l.state, 1);
 
-    for (i = 0; i < l.steps; ++i) {
-
+    // the input projection doesn't depend on the state: one GEMM over all timesteps,
+    // unless batch normalization collects per-step training statistics. When training the
+    // states of all steps are kept side by side, so the output projection can go last in one GEMM.
+    const int batched = !(state.train && input_layer.batch_normalize);
+    const int batched_output = state.train && !output_layer.batch_normalize;
+    float *states = l.state;
+    if (batched) {
         s.input = state.input;
+        input_layer.batch *= l.steps;
         forward_connected_layer(input_layer, s);
+        input_layer.batch = l.batch;
+    }
+
+    for (i = 0; i < l.steps; ++i) {
+
+        if (!batched) {
+            s.input = state.input;
+            forward_connected_layer(input_layer, s);
+        }
 
         s.input = l.state;
         forward_connected_layer(self_layer, s);
 
         float *old_state = l.state;
         if(state.train) l.state += l.hidden*l.batch;
-        if(l.shortcut){
-            copy_cpu(l.hidden * l.batch, old_state, 1, l.state, 1);
-        }else{
-            fill_cpu(l.hidden * l.batch, 0, l.state, 1);
-        }
-        axpy_cpu(l.hidden * l.batch, 1, input_layer.output, 1, l.state, 1);
-        axpy_cpu(l.hidden * l.batch, 1, self_layer.output, 1, l.state, 1);
+        rnn_state_cpu(l.hidden * l.batch, l.shortcut, old_state, input_layer.output, self_layer.output, l.state);
 
-        s.input = l.state;
-        forward_connected_layer(output_layer, s);
+        if (!batched_output) {
+            s.input = l.state;
+            forward_connected_layer(output_layer, s);
+            increment_layer(&output_layer, 1);
+        }
 
         state.input += l.inputs*l.batch;
         increment_layer(&input_layer, 1);
         increment_layer(&self_layer, 1);
-        increment_layer(&output_layer, 1);
+    }
+
+    if (batched_output) {
+        s.input = states + l.hidden*l.batch;
+        output_layer.batch *= l.steps;
+        forward_connected_layer(output_layer, s);
     }
 }
 
@@ -194,9 +194,7 @@ void update_shortcut_layer(layer l, int batch, float learning_rate_init, float m
         //float decay = a.decay;
         //int batch = a.batch;
 
-        axpy_cpu(l.nweights, -decay*batch, l.weights, 1, l.weight_updates, 1);
-        axpy_cpu(l.nweights, learning_rate / batch, l.weight_updates, 1, l.weights, 1);
-        scal_cpu(l.nweights, momentum, l.weight_updates, 1);
+        sgd_update_cpu(l.nweights, l.weights, l.weight_updates, NULL, learning_rate / batch, momentum, decay*batch, 0);
     }
 }
 
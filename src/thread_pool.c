@@ -0,0 +1,326 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "thread_pool.h"
+#include "utils.h"
+#include "http_stream.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+// parallel_for() ranges and task_group tasks are both jobs: `n` iterations handed out in chunks
+// of `grain`, a task is a job with n = 1
+typedef struct pool_job {
+    parallel_for_fn fn;
+    void (*task)(void *arg);
+    void *arg;
+    int n;
+    int grain;
+    int next;               // first iteration that isn't claimed yet
+    int done;               // iterations that have finished
+    task_group *group;      // task jobs are allocated by task_group_run() and freed by task_group_wait()
+    struct pool_job *next_job;
+} pool_job;
+
+// everything below is guarded by pool_mutex
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;     // a job was queued or the pool stops
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;     // a job has finished
+static pool_job *queue_head = NULL;     // jobs with unclaimed iterations, oldest first
+static pool_job *queue_tail = NULL;
+static pthread_t *workers = NULL;
+static int workers_n = 0;
+static int pool_started = 0;
+static int pool_exit = 0;
+
+static int pool_threads = 0;    // configured size, 0 - not set yet
+static int pool_pin = 0;
+static int *pin_cpus = NULL;    // CPUs in pinning order
+static int pin_cpus_n = 0;
+
+#if defined(__linux__)
+static void add_cpu_list(const char *list, cpu_set_t *allowed, cpu_set_t *added)
+{
+    const char *p = list;
+    while (*p) {
+        char *end;
+        int first = (int)strtol(p, &end, 10);
+        if (end == p) break;
+        int last = first;
+        p = end;
+        if (*p == '-') {
+            last = (int)strtol(p + 1, &end, 10);
+            p = end;
+        }
+        int cpu;
+        for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, allowed) && !CPU_ISSET(cpu, added)) {
+                CPU_SET(cpu, added);
+                pin_cpus[pin_cpus_n++] = cpu;
+            }
+        }
+        if (*p == ',') ++p;
+        else break;
+    }
+}
+
+// the CPUs this process may run on, grouped by NUMA node so that neighbouring workers share a node
+static void find_pin_cpus()
+{
+    cpu_set_t allowed, added;
+    CPU_ZERO(&added);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+    pin_cpus = (int*)xcalloc(CPU_SETSIZE, sizeof(int));
+    pin_cpus_n = 0;
+
+    int node;
+    char path[128], list[4096];
+    for (node = 0; node < 1024; ++node) {
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *fp = fopen(path, "r");
+        if (!fp) continue;
+        if (fgets(list, sizeof(list), fp)) add_cpu_list(list, &allowed, &added);
+        fclose(fp);
+    }
+    int cpu;
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed) && !CPU_ISSET(cpu, &added)) pin_cpus[pin_cpus_n++] = cpu;
+    }
+}
+
+static void pin_current_thread(int index)
+{
+    if (!pin_cpus_n) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(pin_cpus[index % pin_cpus_n], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+#else
+static void find_pin_cpus() {}
+static void pin_current_thread(int index) {}
+#endif
+
+static void remove_job(pool_job *job)
+{
+    pool_job *prev = NULL, *j = queue_head;
+    while (j && j != job) {
+        prev = j;
+        j = j->next_job;
+    }
+    if (!j) return;
+    if (prev) prev->next_job = job->next_job;
+    else queue_head = job->next_job;
+    if (queue_tail == job) queue_tail = prev;
+    job->next_job = NULL;
+}
+
+static void queue_job(pool_job *job)
+{
+    job->next_job = NULL;
+    if (queue_tail) queue_tail->next_job = job;
+    else queue_head = job;
+    queue_tail = job;
+}
+
+// claims the next chunk of the job and runs it with the mutex released
+static void run_chunk_locked(pool_job *job)
+{
+    const int begin = job->next;
+    const int end = (job->n - begin > job->grain) ? begin + job->grain : job->n;
+    job->next = end;
+    if (end == job->n) remove_job(job);
+    parallel_for_fn fn = job->fn;
+    void (*task)(void *arg) = job->task;
+    void *arg = job->arg;
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (task) task(arg);
+    else fn(begin, end, arg);
+
+    pthread_mutex_lock(&pool_mutex);
+    job->done += end - begin;
+    if (job->done == job->n) {
+        if (job->group) {
+            // the job is off the queue: hand it back to its group, task_group_wait() frees it
+            job->next_job = job->group->finished;
+            job->group->finished = job;
+            job->group->pending--;
+        }
+        pthread_cond_broadcast(&pool_done);
+    }
+}
+
+static void *pool_worker(void *ptr)
+{
+    const int index = (int)(size_t)ptr;
+    if (pool_pin) pin_current_thread(index);
+    pthread_mutex_lock(&pool_mutex);
+    while (1) {
+        if (queue_head) run_chunk_locked(queue_head);
+        else if (pool_exit) break;
+        else pthread_cond_wait(&pool_work, &pool_mutex);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return 0;
+}
+
+static int configured_threads()
+{
+    char *env = getenv("DARKNET_THREADS");
+    if (env && atoi(env) > 0) return atoi(env);
+    return 0;
+}
+
+static void start_pool_locked()
+{
+    if (pool_started) return;
+    if (pool_threads <= 0) {
+        pool_threads = configured_threads();
+        if (pool_threads <= 0) pool_threads = get_num_threads();
+        if (pool_threads <= 0) pool_threads = 1;
+        char *env = getenv("DARKNET_PIN_THREADS");
+        if (env && atoi(env)) pool_pin = 1;
+    }
+    if (pool_pin && !pin_cpus) find_pin_cpus();
+
+    // worker i is participant i + 1, participant 0 is the thread that waits for the work
+    workers_n = pool_threads - 1;
+    workers = (pthread_t*)xcalloc(workers_n > 0 ? workers_n : 1, sizeof(pthread_t));
+    int i;
+    for (i = 0; i < workers_n; ++i) {
+        if (pthread_create(&workers[i], 0, pool_worker, (void*)(size_t)(i + 1))) error("Thread creation failed", DARKNET_LOC);
+    }
+    pool_started = 1;
+}
+
+void init_thread_pool(int threads, int pin)
+{
+    free_thread_pool();
+    pthread_mutex_lock(&pool_mutex);
+#ifdef _OPENMP
+    int explicit_size = threads > 0 || configured_threads() > 0;
+#endif
+    pool_threads = threads > 0 ? threads : configured_threads();
+    if (pool_threads <= 0) pool_threads = get_num_threads();
+    if (pool_threads <= 0) pool_threads = 1;
+    char *env = getenv("DARKNET_PIN_THREADS");
+    pool_pin = pin || (env && atoi(env));
+    if (pool_pin && !pin_cpus) find_pin_cpus();
+    // the workers start on the first use of the pool
+    pthread_mutex_unlock(&pool_mutex);
+
+#ifdef _OPENMP
+    // the kernels keep their OpenMP loops: give them the same number of threads as the pool
+    if (explicit_size) omp_set_num_threads(pool_threads);
+#endif
+    if (pool_pin) {
+        pin_current_thread(0);
+#ifdef _OPENMP
+        #pragma omp parallel
+        pin_current_thread(omp_get_thread_num());
+#endif
+    }
+    fprintf(stderr, " Thread pool: %d threads%s \n", pool_threads, (pool_pin && pin_cpus_n) ? ", pinned to CPUs" : "");
+}
+
+void free_thread_pool()
+{
+    int i;
+    pthread_mutex_lock(&pool_mutex);
+    if (!pool_started) {
+        pthread_mutex_unlock(&pool_mutex);
+        return;
+    }
+    pool_exit = 1;
+    pthread_cond_broadcast(&pool_work);
+    pthread_mutex_unlock(&pool_mutex);
+    for (i = 0; i < workers_n; ++i) pthread_join(workers[i], 0);
+
+    pthread_mutex_lock(&pool_mutex);
+    free(workers);
+    workers = NULL;
+    workers_n = 0;
+    pool_started = 0;
+    pool_exit = 0;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+int thread_pool_size()
+{
+    pthread_mutex_lock(&pool_mutex);
+    start_pool_locked();
+    int size = pool_threads;
+    pthread_mutex_unlock(&pool_mutex);
+    return size;
+}
+
+void parallel_for(int n, int grain, parallel_for_fn fn, void *arg)
+{
+    if (n <= 0) return;
+    if (grain < 1) grain = 1;
+    pthread_mutex_lock(&pool_mutex);
+    start_pool_locked();
+    if (!workers_n || n <= grain) {
+        pthread_mutex_unlock(&pool_mutex);
+        fn(0, n, arg);
+        return;
+    }
+    pool_job job = { 0 };
+    job.fn = fn;
+    job.arg = arg;
+    job.n = n;
+    job.grain = grain;
+    queue_job(&job);
+    pthread_cond_broadcast(&pool_work);
+    while (job.next < job.n) run_chunk_locked(&job);
+    while (job.done < job.n) pthread_cond_wait(&pool_done, &pool_mutex);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+void task_group_run(task_group *g, void (*fn)(void *arg), void *arg)
+{
+    pthread_mutex_lock(&pool_mutex);
+    start_pool_locked();
+    if (!workers_n) {
+        pthread_mutex_unlock(&pool_mutex);
+        fn(arg);
+        return;
+    }
+    pool_job *job = (pool_job*)xcalloc(1, sizeof(pool_job));
+    job->task = fn;
+    job->arg = arg;
+    job->n = 1;
+    job->grain = 1;
+    job->group = g;
+    g->pending++;
+    queue_job(job);
+    pthread_cond_signal(&pool_work);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+void task_group_wait(task_group *g)
+{
+    pthread_mutex_lock(&pool_mutex);
+    while (g->pending) {
+        // run the tasks of this group that no worker has taken yet
+        pool_job *job = queue_head;
+        while (job && job->group != g) job = job->next_job;
+        if (job) run_chunk_locked(job);
+        else pthread_cond_wait(&pool_done, &pool_mutex);
+    }
+    while (g->finished) {
+        pool_job *job = g->finished;
+        g->finished = job->next_job;
+        free(job);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
@@ -0,0 +1,44 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "darknet.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Process-wide pool of persistent worker threads for the CPU code: the per-image loss threads of
+// the yolo layer, the data loader workers and the CPU training replicas run on it instead of
+// creating their own threads on every call. The pool has thread_pool_size() participants, the
+// calling thread is one of them: parallel_for() and task_group_wait() run work on the caller
+// too, so they can be called from anywhere (also from inside a task) without deadlocks.
+//
+// The workers start on the first use of the pool. The size comes from init_thread_pool(), the
+// DARKNET_THREADS environment variable or the number of CPUs, in this order. With pinning
+// (init_thread_pool(n, 1) or DARKNET_PIN_THREADS=1) every worker is bound to one CPU, filling a
+// NUMA node before using the next one; init_thread_pool() also binds the calling thread and its
+// OpenMP team (Linux only, ignored elsewhere).
+
+typedef void (*parallel_for_fn)(int begin, int end, void *arg);
+
+// fn(begin, end, arg) over [0, n) in chunks of `grain` (>= 1) iterations, returns when all are done
+void parallel_for(int n, int grain, parallel_for_fn fn, void *arg);
+
+// independent tasks that are waited for together, zero-initialize it before the first task_group_run()
+typedef struct task_group {
+    int pending;
+    struct pool_job *finished;  // tasks that ran, freed by task_group_wait()
+} task_group;
+
+void task_group_run(task_group *g, void (*fn)(void *arg), void *arg);
+void task_group_wait(task_group *g);
+
+int thread_pool_size();
+// stops the workers, the next use of the pool starts it again with the same settings
+void free_thread_pool();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
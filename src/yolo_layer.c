@@ -3,6 +3,7 @@
 #include "blas.h"
 #include "box.h"
 #include "dark_cuda.h"
+#include "thread_pool.h"
 #include "utils.h"
 
 #include <math.h>
@@ -96,6 +97,11 @@ void resize_yolo_layer(layer *l, int w, int h)
     if (l->embedding_output) l->embedding_output = (float*)xrealloc(l->output, l->batch * l->embedding_size * l->n * l->h * l->w * sizeof(float));
     if (l->labels) l->labels = (int*)xrealloc(l->labels, l->batch * l->n * l->h * l->w * sizeof(int));
     if (l->class_ids) l->class_ids = (int*)xrealloc(l->class_ids, l->batch * l->n * l->h * l->w * sizeof(int));
+    // the training loss buffers depend on the size, the next training forward pass allocates them again
+    free(l->train_scratch);
+    free(l->train_scratch_int);
+    l->train_scratch = NULL;
+    l->train_scratch_int = NULL;
 
     if (!l->output_pinned) l->output = (float*)xrealloc(l->output, l->batch*l->outputs * sizeof(float));
     if (!l->delta_pinned) l->delta = (float*)xrealloc(l->delta, l->batch*l->outputs*sizeof(float));
@@ -374,292 +380,359 @@ static int entry_index(layer l, int batch, int location, int entry)
     return batch*l.outputs + n*l.w*l.h*(4+l.classes+1) + entry*l.w*l.h + loc;
 }
 
-typedef struct train_yolo_args {
-    layer l;
-    network_state state;
-    int b;
+// Buffers of one thread of the training loss, views of l.train_scratch and l.train_scratch_int.
+// Allocated on the first training forward pass for min(batch, thread pool size) threads.
+typedef struct yolo_train_slot {
+    float *x, *y, *w, *h;           // predicted boxes of the image, in l.output entry order
+    float *best_iou;                // best IoU of each prediction with any truth
+    float *best_match_iou;          // ... with a truth of a class the prediction scores above 0.25
+    int *best_t;
+    int *class_match;               // compare_yolo_class() of each prediction
+    // the spatial index of the image: extents of the predicted boxes of each column and row of
+    // the grid, a truth is only compared with the predictions of the columns and rows it overlaps
+    float *col_min, *col_max, *row_min, *row_max;
+    float *iou;                     // IoUs of a truth with a row of predictions
+    int *truths;                    // valid truths of the image
+    int *class_delta_set;           // predictions whose class deltas were written
+    float *anchor_x, *anchor_y, *anchor_w, *anchor_h, *anchor_iou, *anchor_iou_kind;
+    // sums over the images of this thread
+    float *tot_iou, *tot_iou_loss, *tot_giou_loss;
+    int *count, *class_count, *total_bbox, *rewritten_bbox;
+} yolo_train_slot;
+
+static size_t yolo_slot_floats(layer l)
+{
+    return 6 * (size_t)l.n*l.w*l.h + 3 * l.w + 2 * l.h + 6 * l.total + 3;
+}
 
-    float tot_iou;
-    float tot_giou_loss;
-    float tot_iou_loss;
-    int count;
-    int class_count;
-} train_yolo_args;
+static size_t yolo_slot_ints(layer l)
+{
+    return 3 * (size_t)l.n*l.w*l.h + l.max_boxes + 4;
+}
 
-void *process_batch(void* ptr)
+static yolo_train_slot get_yolo_train_slot(layer l, int k)
 {
-    {
-        train_yolo_args *args = (train_yolo_args*)ptr;
-        const layer l = args->l;
-        network_state state = args->state;
-        int b = args->b;
-
-        int i, j, t, n;
-
-        //printf(" b = %d \n", b, b);
-
-        //float tot_iou = 0;
-        float tot_giou = 0;
-        float tot_diou = 0;
-        float tot_ciou = 0;
-        //float tot_iou_loss = 0;
-        //float tot_giou_loss = 0;
-        float tot_diou_loss = 0;
-        float tot_ciou_loss = 0;
-        float recall = 0;
-        float recall75 = 0;
-        float avg_cat = 0;
-        float avg_obj = 0;
-        float avg_anyobj = 0;
-        //int count = 0;
-        //int class_count = 0;
+    yolo_train_slot s;
+    const int cells = l.n*l.w*l.h;
+    float *f = l.train_scratch + k * yolo_slot_floats(l);
+    int *d = l.train_scratch_int + k * yolo_slot_ints(l);
+    s.x = f; f += cells;
+    s.y = f; f += cells;
+    s.w = f; f += cells;
+    s.h = f; f += cells;
+    s.best_iou = f; f += cells;
+    s.best_match_iou = f; f += cells;
+    s.col_min = f; f += l.w;
+    s.col_max = f; f += l.w;
+    s.row_min = f; f += l.h;
+    s.row_max = f; f += l.h;
+    s.iou = f; f += l.w;
+    s.anchor_x = f; f += l.total;
+    s.anchor_y = f; f += l.total;
+    s.anchor_w = f; f += l.total;
+    s.anchor_h = f; f += l.total;
+    s.anchor_iou = f; f += l.total;
+    s.anchor_iou_kind = f; f += l.total;
+    s.tot_iou = f++;
+    s.tot_iou_loss = f++;
+    s.tot_giou_loss = f++;
+    s.best_t = d; d += cells;
+    s.class_match = d; d += cells;
+    s.truths = d; d += l.max_boxes;
+    s.class_delta_set = d; d += cells;
+    s.count = d++;
+    s.class_count = d++;
+    s.total_bbox = d++;
+    s.rewritten_bbox = d++;
+    return s;
+}
+
+// the loss of the truth t assigned to the anchor n (mask_n) of the cell (i, j)
+static void yolo_assign_truth(const layer l, network_state state, yolo_train_slot s, int b, int t, box truth, int n, int mask_n, int i, int j)
+{
+    int class_id = state.truth[t * l.truth_size + b * l.truths + 4];
+    if (l.map) class_id = l.map[class_id];
+
+    int box_index = entry_index(l, b, mask_n * l.w * l.h + j * l.w + i, 0);
+    const float class_multiplier = (l.classes_multipliers) ? l.classes_multipliers[class_id] : 1.0f;
+    ious all_ious = delta_yolo_box(truth, l.output, l.biases, n, box_index, i, j, l.w, l.h, state.net.w, state.net.h, l.delta, (2 - truth.w * truth.h), l.w * l.h, l.iou_normalizer * class_multiplier, l.iou_loss, 1, l.max_delta, s.rewritten_bbox, l.new_coords);
+    (*s.total_bbox)++;
+
+    // range is 0 <= 1
+    *s.tot_iou += all_ious.iou;
+    *s.tot_iou_loss += 1 - all_ious.iou;
+    // range is -1 <= giou <= 1
+    *s.tot_giou_loss += 1 - all_ious.giou;
+
+    int obj_index = entry_index(l, b, mask_n * l.w * l.h + j * l.w + i, 4);
+    if (l.objectness_smooth) {
+        float delta_obj = class_multiplier * l.obj_normalizer * (1 - l.output[obj_index]);
+        if (l.delta[obj_index] == 0) l.delta[obj_index] = delta_obj;
+    }
+    else l.delta[obj_index] = class_multiplier * l.obj_normalizer * (1 - l.output[obj_index]);
 
+    int class_index = entry_index(l, b, mask_n * l.w * l.h + j * l.w + i, 4 + 1);
+    delta_yolo_class(l.output, l.delta, class_index, class_id, l.classes, l.w * l.h, 0, l.focal_loss, l.label_smooth_eps, l.classes_multipliers, l.cls_normalizer);
+    s.class_delta_set[mask_n * l.w * l.h + j * l.w + i] = 1;
+
+    ++(*s.count);
+    ++(*s.class_count);
+}
+
+static void yolo_train_image(const layer l, network_state state, yolo_train_slot s, int b)
+{
+    const int stride = l.w * l.h;
+    int i, j, t, n, k;
+
+    int truths = 0;
+    for (t = 0; t < l.max_boxes; ++t) {
+        box truth = float_to_box_stride(state.truth + t * l.truth_size + b * l.truths, 1);
+        if (!truth.x) break;
+        int class_id = state.truth[t * l.truth_size + b * l.truths + 4];
+        if (class_id >= l.classes || class_id < 0) {
+            printf("\n Warning: in txt-labels class_id=%d >= classes=%d in cfg-file. In txt-labels class_id should be [from 0 to %d] \n", class_id, l.classes, l.classes - 1);
+            printf("\n truth.x = %f, truth.y = %f, truth.w = %f, truth.h = %f, class_id = %d \n", truth.x, truth.y, truth.w, truth.h, class_id);
+            if (check_mistakes) getchar();
+            continue; // if label contains class_id more than number of classes in the cfg-file and class_id check garbage value
+        }
+        s.truths[truths++] = t;
+    }
+
+    // predicted boxes and the spatial index
+    for (i = 0; i < l.w; ++i) {
+        s.col_min[i] = FLT_MAX;
+        s.col_max[i] = -FLT_MAX;
+    }
+    for (j = 0; j < l.h; ++j) {
+        s.row_min[j] = FLT_MAX;
+        s.row_max[j] = -FLT_MAX;
+    }
+    for (n = 0; n < l.n; ++n) {
         for (j = 0; j < l.h; ++j) {
             for (i = 0; i < l.w; ++i) {
-                for (n = 0; n < l.n; ++n) {
-                    const int class_index = entry_index(l, b, n * l.w * l.h + j * l.w + i, 4 + 1);
-                    const int obj_index = entry_index(l, b, n * l.w * l.h + j * l.w + i, 4);
-                    const int box_index = entry_index(l, b, n * l.w * l.h + j * l.w + i, 0);
-                    const int stride = l.w * l.h;
-                    box pred = get_yolo_box(l.output, l.biases, l.mask[n], box_index, i, j, l.w, l.h, state.net.w, state.net.h, l.w * l.h, l.new_coords);
-                    float best_match_iou = 0;
-                    int best_match_t = 0;
-                    float best_iou = 0;
-                    int best_t = 0;
-                    for (t = 0; t < l.max_boxes; ++t) {
-                        box truth = float_to_box_stride(state.truth + t * l.truth_size + b * l.truths, 1);
-                        if (!truth.x) break;  // continue;
-                        int class_id = state.truth[t * l.truth_size + b * l.truths + 4];
-                        if (class_id >= l.classes || class_id < 0) {
-                            printf("\n Warning: in txt-labels class_id=%d >= classes=%d in cfg-file. In txt-labels class_id should be [from 0 to %d] \n", class_id, l.classes, l.classes - 1);
-                            printf("\n truth.x = %f, truth.y = %f, truth.w = %f, truth.h = %f, class_id = %d \n", truth.x, truth.y, truth.w, truth.h, class_id);
-                            if (check_mistakes) getchar();
-                            continue; // if label contains class_id more than number of classes in the cfg-file and class_id check garbage value
-                        }
-
-                        float objectness = l.output[obj_index];
-                        if (isnan(objectness) || isinf(objectness)) l.output[obj_index] = 0;
-                        int class_id_match = compare_yolo_class(l.output, l.classes, class_index, l.w * l.h, objectness, class_id, 0.25f);
+                const int p = n * stride + j * l.w + i;
+                const int box_index = entry_index(l, b, p, 0);
+                const int obj_index = entry_index(l, b, p, 4);
+                box pred = get_yolo_box(l.output, l.biases, l.mask[n], box_index, i, j, l.w, l.h, state.net.w, state.net.h, stride, l.new_coords);
+                s.x[p] = pred.x;
+                s.y[p] = pred.y;
+                s.w[p] = pred.w;
+                s.h[p] = pred.h;
+                s.best_iou[p] = s.best_match_iou[p] = 0;
+                s.best_t[p] = 0;
+                s.class_delta_set[p] = 0;
+                if (!truths) continue;
+
+                float objectness = l.output[obj_index];
+                if (isnan(objectness) || isinf(objectness)) l.output[obj_index] = 0;
+                s.class_match[p] = compare_yolo_class(l.output, l.classes, entry_index(l, b, p, 4 + 1), stride, objectness, 0, 0.25f);
+
+                const float left = pred.x - pred.w / 2;
+                const float right = pred.x + pred.w / 2;
+                const float top = pred.y - pred.h / 2;
+                const float bot = pred.y + pred.h / 2;
+                if (left < s.col_min[i]) s.col_min[i] = left;
+                if (right > s.col_max[i]) s.col_max[i] = right;
+                if (top < s.row_min[j]) s.row_min[j] = top;
+                if (bot > s.row_max[j]) s.row_max[j] = bot;
+            }
+        }
+    }
 
-                        float iou = box_iou(pred, truth);
-                        if (iou > best_match_iou && class_id_match == 1) {
-                            best_match_iou = iou;
-                            best_match_t = t;
-                        }
-                        if (iou > best_iou) {
-                            best_iou = iou;
-                            best_t = t;
-                        }
+    // best truth of each prediction, in truth order as box_iou() over all pairs: predictions
+    // outside the index range have no overlap, IoU 0 never replaces the initial best
+    for (k = 0; k < truths; ++k) {
+        t = s.truths[k];
+        box truth = float_to_box_stride(state.truth + t * l.truth_size + b * l.truths, 1);
+        const float left = truth.x - truth.w / 2;
+        const float right = truth.x + truth.w / 2;
+        const float top = truth.y - truth.h / 2;
+        const float bot = truth.y + truth.h / 2;
+        int i0 = l.w, i1 = -1, j0 = l.h, j1 = -1;
+        for (i = 0; i < l.w; ++i) {
+            if (s.col_max[i] > left && s.col_min[i] < right) {
+                if (i0 > i) i0 = i;
+                i1 = i;
+            }
+        }
+        for (j = 0; j < l.h; ++j) {
+            if (s.row_max[j] > top && s.row_min[j] < bot) {
+                if (j0 > j) j0 = j;
+                j1 = j;
+            }
+        }
+        const int m = i1 - i0 + 1;
+        for (n = 0; n < l.n; ++n) {
+            for (j = j0; j <= j1 && m > 0; ++j) {
+                const int p = n * stride + j * l.w + i0;
+                box_iou_kind_soa(truth, s.x + p, s.y + p, s.w + p, s.h + p, m, IOU, s.iou);
+                for (i = 0; i < m; ++i) {
+                    const float iou = s.iou[i];
+                    if (iou > s.best_match_iou[p + i] && s.class_match[p + i]) s.best_match_iou[p + i] = iou;
+                    if (iou > s.best_iou[p + i]) {
+                        s.best_iou[p + i] = iou;
+                        s.best_t[p + i] = t;
                     }
+                }
+            }
+        }
+    }
 
-                    avg_anyobj += l.output[obj_index];
-                    l.delta[obj_index] = l.obj_normalizer * (0 - l.output[obj_index]);
-                    if (best_match_iou > l.ignore_thresh) {
-                        if (l.objectness_smooth) {
-                            const float delta_obj = l.obj_normalizer * (best_match_iou - l.output[obj_index]);
-                            if (delta_obj > l.delta[obj_index]) l.delta[obj_index] = delta_obj;
+    for (j = 0; j < l.h; ++j) {
+        for (i = 0; i < l.w; ++i) {
+            for (n = 0; n < l.n; ++n) {
+                const int p = n * stride + j * l.w + i;
+                const int class_index = entry_index(l, b, p, 4 + 1);
+                const int obj_index = entry_index(l, b, p, 4);
+                const int box_index = entry_index(l, b, p, 0);
+                const float best_match_iou = s.best_match_iou[p];
+                const float best_iou = s.best_iou[p];
+                const int best_t = s.best_t[p];
+
+                l.delta[obj_index] = l.obj_normalizer * (0 - l.output[obj_index]);
+                if (best_match_iou > l.ignore_thresh) {
+                    if (l.objectness_smooth) {
+                        const float delta_obj = l.obj_normalizer * (best_match_iou - l.output[obj_index]);
+                        if (delta_obj > l.delta[obj_index]) l.delta[obj_index] = delta_obj;
 
-                        }
-                        else l.delta[obj_index] = 0;
                     }
-                    else if (state.net.adversarial) {
-                        int stride = l.w * l.h;
-                        float scale = pred.w * pred.h;
-                        if (scale > 0) scale = sqrt(scale);
-                        l.delta[obj_index] = scale * l.obj_normalizer * (0 - l.output[obj_index]);
-                        int cl_id;
-                        int found_object = 0;
-                        for (cl_id = 0; cl_id < l.classes; ++cl_id) {
-                            if (l.output[class_index + stride * cl_id] * l.output[obj_index] > 0.25) {
-                                l.delta[class_index + stride * cl_id] = scale * (0 - l.output[class_index + stride * cl_id]);
-                                found_object = 1;
-                            }
-                        }
-                        if (found_object) {
-                            // don't use this loop for adversarial attack drawing
-                            for (cl_id = 0; cl_id < l.classes; ++cl_id)
-                                if (l.output[class_index + stride * cl_id] * l.output[obj_index] < 0.25)
-                                    l.delta[class_index + stride * cl_id] = scale * (1 - l.output[class_index + stride * cl_id]);
-
-                            l.delta[box_index + 0 * stride] += scale * (0 - l.output[box_index + 0 * stride]);
-                            l.delta[box_index + 1 * stride] += scale * (0 - l.output[box_index + 1 * stride]);
-                            l.delta[box_index + 2 * stride] += scale * (0 - l.output[box_index + 2 * stride]);
-                            l.delta[box_index + 3 * stride] += scale * (0 - l.output[box_index + 3 * stride]);
+                    else l.delta[obj_index] = 0;
+                }
+                else if (state.net.adversarial) {
+                    float scale = s.w[p] * s.h[p];
+                    if (scale > 0) scale = sqrt(scale);
+                    l.delta[obj_index] = scale * l.obj_normalizer * (0 - l.output[obj_index]);
+                    int cl_id;
+                    int found_object = 0;
+                    for (cl_id = 0; cl_id < l.classes; ++cl_id) {
+                        if (l.output[class_index + stride * cl_id] * l.output[obj_index] > 0.25) {
+                            l.delta[class_index + stride * cl_id] = scale * (0 - l.output[class_index + stride * cl_id]);
+                            found_object = 1;
                         }
                     }
-                    if (best_iou > l.truth_thresh) {
-                        const float iou_multiplier = best_iou * best_iou;// (best_iou - l.truth_thresh) / (1.0 - l.truth_thresh);
-                        if (l.objectness_smooth) l.delta[obj_index] = l.obj_normalizer * (iou_multiplier - l.output[obj_index]);
-                        else l.delta[obj_index] = l.obj_normalizer * (1 - l.output[obj_index]);
-                        //l.delta[obj_index] = l.obj_normalizer * (1 - l.output[obj_index]);
-
-                        int class_id = state.truth[best_t * l.truth_size + b * l.truths + 4];
-                        if (l.map) class_id = l.map[class_id];
-                        delta_yolo_class(l.output, l.delta, class_index, class_id, l.classes, l.w * l.h, 0, l.focal_loss, l.label_smooth_eps, l.classes_multipliers, l.cls_normalizer);
-                        const float class_multiplier = (l.classes_multipliers) ? l.classes_multipliers[class_id] : 1.0f;
-                        if (l.objectness_smooth) l.delta[class_index + stride * class_id] = class_multiplier * (iou_multiplier - l.output[class_index + stride * class_id]);
-                        box truth = float_to_box_stride(state.truth + best_t * l.truth_size + b * l.truths, 1);
-                        delta_yolo_box(truth, l.output, l.biases, l.mask[n], box_index, i, j, l.w, l.h, state.net.w, state.net.h, l.delta, (2 - truth.w * truth.h), l.w * l.h, l.iou_normalizer * class_multiplier, l.iou_loss, 1, l.max_delta, state.net.rewritten_bbox, l.new_coords);
-                        (*state.net.total_bbox)++;
+                    s.class_delta_set[p] = 1;
+                    if (found_object) {
+                        // don't use this loop for adversarial attack drawing
+                        for (cl_id = 0; cl_id < l.classes; ++cl_id)
+                            if (l.output[class_index + stride * cl_id] * l.output[obj_index] < 0.25)
+                                l.delta[class_index + stride * cl_id] = scale * (1 - l.output[class_index + stride * cl_id]);
+
+                        l.delta[box_index + 0 * stride] += scale * (0 - l.output[box_index + 0 * stride]);
+                        l.delta[box_index + 1 * stride] += scale * (0 - l.output[box_index + 1 * stride]);
+                        l.delta[box_index + 2 * stride] += scale * (0 - l.output[box_index + 2 * stride]);
+                        l.delta[box_index + 3 * stride] += scale * (0 - l.output[box_index + 3 * stride]);
                     }
                 }
-            }
-        }
-        for (t = 0; t < l.max_boxes; ++t) {
-            box truth = float_to_box_stride(state.truth + t * l.truth_size + b * l.truths, 1);
-            if (!truth.x) break;  // continue;
-            if (truth.x < 0 || truth.y < 0 || truth.x > 1 || truth.y > 1 || truth.w < 0 || truth.h < 0) {
-                char buff[256];
-                printf(" Wrong label: truth.x = %f, truth.y = %f, truth.w = %f, truth.h = %f \n", truth.x, truth.y, truth.w, truth.h);
-                sprintf(buff, "echo \"Wrong label: truth.x = %f, truth.y = %f, truth.w = %f, truth.h = %f\" >> bad_label.list",
-                    truth.x, truth.y, truth.w, truth.h);
-                system(buff);
-            }
-            int class_id = state.truth[t * l.truth_size + b * l.truths + 4];
-            if (class_id >= l.classes || class_id < 0) continue; // if label contains class_id more than number of classes in the cfg-file and class_id check garbage value
-
-            float best_iou = 0;
-            int best_n = 0;
-            i = (truth.x * l.w);
-            j = (truth.y * l.h);
-            box truth_shift = truth;
-            truth_shift.x = truth_shift.y = 0;
-            for (n = 0; n < l.total; ++n) {
-                box pred = { 0 };
-                pred.w = l.biases[2 * n] / state.net.w;
-                pred.h = l.biases[2 * n + 1] / state.net.h;
-                float iou = box_iou(pred, truth_shift);
-                if (iou > best_iou) {
-                    best_iou = iou;
-                    best_n = n;
+                if (best_iou > l.truth_thresh) {
+                    const float iou_multiplier = best_iou * best_iou;// (best_iou - l.truth_thresh) / (1.0 - l.truth_thresh);
+                    if (l.objectness_smooth) l.delta[obj_index] = l.obj_normalizer * (iou_multiplier - l.output[obj_index]);
+                    else l.delta[obj_index] = l.obj_normalizer * (1 - l.output[obj_index]);
+
+                    int class_id = state.truth[best_t * l.truth_size + b * l.truths + 4];
+                    if (l.map) class_id = l.map[class_id];
+                    delta_yolo_class(l.output, l.delta, class_index, class_id, l.classes, l.w * l.h, 0, l.focal_loss, l.label_smooth_eps, l.classes_multipliers, l.cls_normalizer);
+                    s.class_delta_set[p] = 1;
+                    const float class_multiplier = (l.classes_multipliers) ? l.classes_multipliers[class_id] : 1.0f;
+                    if (l.objectness_smooth) l.delta[class_index + stride * class_id] = class_multiplier * (iou_multiplier - l.output[class_index + stride * class_id]);
+                    box truth = float_to_box_stride(state.truth + best_t * l.truth_size + b * l.truths, 1);
+                    delta_yolo_box(truth, l.output, l.biases, l.mask[n], box_index, i, j, l.w, l.h, state.net.w, state.net.h, l.delta, (2 - truth.w * truth.h), l.w * l.h, l.iou_normalizer * class_multiplier, l.iou_loss, 1, l.max_delta, s.rewritten_bbox, l.new_coords);
+                    (*s.total_bbox)++;
                 }
             }
+        }
+    }
 
-            int mask_n = int_index(l.mask, best_n, l.n);
-            if (mask_n >= 0) {
-                int class_id = state.truth[t * l.truth_size + b * l.truths + 4];
-                if (l.map) class_id = l.map[class_id];
-
-                int box_index = entry_index(l, b, mask_n * l.w * l.h + j * l.w + i, 0);
-                const float class_multiplier = (l.classes_multipliers) ? l.classes_multipliers[class_id] : 1.0f;
-                ious all_ious = delta_yolo_box(truth, l.output, l.biases, best_n, box_index, i, j, l.w, l.h, state.net.w, state.net.h, l.delta, (2 - truth.w * truth.h), l.w * l.h, l.iou_normalizer * class_multiplier, l.iou_loss, 1, l.max_delta, state.net.rewritten_bbox, l.new_coords);
-                (*state.net.total_bbox)++;
-
-                const int truth_in_index = t * l.truth_size + b * l.truths + 5;
-                const int track_id = state.truth[truth_in_index];
-                const int truth_out_index = b * l.n * l.w * l.h + mask_n * l.w * l.h + j * l.w + i;
-                l.labels[truth_out_index] = track_id;
-                l.class_ids[truth_out_index] = class_id;
-                //printf(" track_id = %d, t = %d, b = %d, truth_in_index = %d, truth_out_index = %d \n", track_id, t, b, truth_in_index, truth_out_index);
-
-                // range is 0 <= 1
-                args->tot_iou += all_ious.iou;
-                args->tot_iou_loss += 1 - all_ious.iou;
-                // range is -1 <= giou <= 1
-                tot_giou += all_ious.giou;
-                args->tot_giou_loss += 1 - all_ious.giou;
-
-                tot_diou += all_ious.diou;
-                tot_diou_loss += 1 - all_ious.diou;
-
-                tot_ciou += all_ious.ciou;
-                tot_ciou_loss += 1 - all_ious.ciou;
-
-                int obj_index = entry_index(l, b, mask_n * l.w * l.h + j * l.w + i, 4);
-                avg_obj += l.output[obj_index];
-                if (l.objectness_smooth) {
-                    float delta_obj = class_multiplier * l.obj_normalizer * (1 - l.output[obj_index]);
-                    if (l.delta[obj_index] == 0) l.delta[obj_index] = delta_obj;
-                }
-                else l.delta[obj_index] = class_multiplier * l.obj_normalizer * (1 - l.output[obj_index]);
-
-                int class_index = entry_index(l, b, mask_n * l.w * l.h + j * l.w + i, 4 + 1);
-                delta_yolo_class(l.output, l.delta, class_index, class_id, l.classes, l.w * l.h, &avg_cat, l.focal_loss, l.label_smooth_eps, l.classes_multipliers, l.cls_normalizer);
-
-                //printf(" label: class_id = %d, truth.x = %f, truth.y = %f, truth.w = %f, truth.h = %f \n", class_id, truth.x, truth.y, truth.w, truth.h);
-                //printf(" mask_n = %d, l.output[obj_index] = %f, l.output[class_index + class_id] = %f \n\n", mask_n, l.output[obj_index], l.output[class_index + class_id]);
-
-                ++(args->count);
-                ++(args->class_count);
-                if (all_ious.iou > .5) recall += 1;
-                if (all_ious.iou > .75) recall75 += 1;
+    // truth-to-anchor matching against the anchor shapes centered at the truth
+    for (t = 0; t < l.max_boxes; ++t) {
+        box truth = float_to_box_stride(state.truth + t * l.truth_size + b * l.truths, 1);
+        if (!truth.x) break;  // continue;
+        if (truth.x < 0 || truth.y < 0 || truth.x > 1 || truth.y > 1 || truth.w < 0 || truth.h < 0) {
+            char buff[256];
+            printf(" Wrong label: truth.x = %f, truth.y = %f, truth.w = %f, truth.h = %f \n", truth.x, truth.y, truth.w, truth.h);
+            sprintf(buff, "echo \"Wrong label: truth.x = %f, truth.y = %f, truth.w = %f, truth.h = %f\" >> bad_label.list",
+                truth.x, truth.y, truth.w, truth.h);
+            system(buff);
+        }
+        int class_id = state.truth[t * l.truth_size + b * l.truths + 4];
+        if (class_id >= l.classes || class_id < 0) continue; // if label contains class_id more than number of classes in the cfg-file and class_id check garbage value
+
+        i = (truth.x * l.w);
+        j = (truth.y * l.h);
+        box truth_shift = truth;
+        truth_shift.x = truth_shift.y = 0;
+        box_iou_kind_soa(truth_shift, s.anchor_x, s.anchor_y, s.anchor_w, s.anchor_h, l.total, IOU, s.anchor_iou);
+        float best_iou = 0;
+        int best_n = 0;
+        for (n = 0; n < l.total; ++n) {
+            if (s.anchor_iou[n] > best_iou) {
+                best_iou = s.anchor_iou[n];
+                best_n = n;
             }
+        }
 
-            // iou_thresh
-            for (n = 0; n < l.total; ++n) {
-                int mask_n = int_index(l.mask, n, l.n);
-                if (mask_n >= 0 && n != best_n && l.iou_thresh < 1.0f) {
-                    box pred = { 0 };
-                    pred.w = l.biases[2 * n] / state.net.w;
-                    pred.h = l.biases[2 * n + 1] / state.net.h;
-                    float iou = box_iou_kind(pred, truth_shift, l.iou_thresh_kind); // IOU, GIOU, MSE, DIOU, CIOU
-                    // iou, n
-
-                    if (iou > l.iou_thresh) {
-                        int class_id = state.truth[t * l.truth_size + b * l.truths + 4];
-                        if (l.map) class_id = l.map[class_id];
-
-                        int box_index = entry_index(l, b, mask_n * l.w * l.h + j * l.w + i, 0);
-                        const float class_multiplier = (l.classes_multipliers) ? l.classes_multipliers[class_id] : 1.0f;
-                        ious all_ious = delta_yolo_box(truth, l.output, l.biases, n, box_index, i, j, l.w, l.h, state.net.w, state.net.h, l.delta, (2 - truth.w * truth.h), l.w * l.h, l.iou_normalizer * class_multiplier, l.iou_loss, 1, l.max_delta, state.net.rewritten_bbox, l.new_coords);
-                        (*state.net.total_bbox)++;
-
-                        // range is 0 <= 1
-                        args->tot_iou += all_ious.iou;
-                        args->tot_iou_loss += 1 - all_ious.iou;
-                        // range is -1 <= giou <= 1
-                        tot_giou += all_ious.giou;
-                        args->tot_giou_loss += 1 - all_ious.giou;
-
-                        tot_diou += all_ious.diou;
-                        tot_diou_loss += 1 - all_ious.diou;
-
-                        tot_ciou += all_ious.ciou;
-                        tot_ciou_loss += 1 - all_ious.ciou;
-
-                        int obj_index = entry_index(l, b, mask_n * l.w * l.h + j * l.w + i, 4);
-                        avg_obj += l.output[obj_index];
-                        if (l.objectness_smooth) {
-                            float delta_obj = class_multiplier * l.obj_normalizer * (1 - l.output[obj_index]);
-                            if (l.delta[obj_index] == 0) l.delta[obj_index] = delta_obj;
-                        }
-                        else l.delta[obj_index] = class_multiplier * l.obj_normalizer * (1 - l.output[obj_index]);
-
-                        int class_index = entry_index(l, b, mask_n * l.w * l.h + j * l.w + i, 4 + 1);
-                        delta_yolo_class(l.output, l.delta, class_index, class_id, l.classes, l.w * l.h, &avg_cat, l.focal_loss, l.label_smooth_eps, l.classes_multipliers, l.cls_normalizer);
+        int mask_n = int_index(l.mask, best_n, l.n);
+        if (mask_n >= 0) {
+            yolo_assign_truth(l, state, s, b, t, truth, best_n, mask_n, i, j);
 
-                        ++(args->count);
-                        ++(args->class_count);
-                        if (all_ious.iou > .5) recall += 1;
-                        if (all_ious.iou > .75) recall75 += 1;
-                    }
-                }
-            }
+            if (l.map) class_id = l.map[class_id];
+            const int truth_in_index = t * l.truth_size + b * l.truths + 5;
+            const int track_id = state.truth[truth_in_index];
+            const int truth_out_index = b * l.n * l.w * l.h + mask_n * l.w * l.h + j * l.w + i;
+            l.labels[truth_out_index] = track_id;
+            l.class_ids[truth_out_index] = class_id;
         }
 
+        // iou_thresh
         if (l.iou_thresh < 1.0f) {
-            // averages the deltas obtained by the function: delta_yolo_box()_accumulate
-            for (j = 0; j < l.h; ++j) {
-                for (i = 0; i < l.w; ++i) {
-                    for (n = 0; n < l.n; ++n) {
-                        int obj_index = entry_index(l, b, n*l.w*l.h + j*l.w + i, 4);
-                        int box_index = entry_index(l, b, n*l.w*l.h + j*l.w + i, 0);
-                        int class_index = entry_index(l, b, n*l.w*l.h + j*l.w + i, 4 + 1);
-                        const int stride = l.w*l.h;
-
-                        if (l.delta[obj_index] != 0)
-                            averages_yolo_deltas(class_index, box_index, stride, l.classes, l.delta);
-                    }
+            box_iou_kind_soa(truth_shift, s.anchor_x, s.anchor_y, s.anchor_w, s.anchor_h, l.total, l.iou_thresh_kind, s.anchor_iou_kind); // IOU, GIOU, MSE, DIOU, CIOU
+            for (n = 0; n < l.total; ++n) {
+                int mask_n = int_index(l.mask, n, l.n);
+                if (mask_n >= 0 && n != best_n && s.anchor_iou_kind[n] > l.iou_thresh) {
+                    yolo_assign_truth(l, state, s, b, t, truth, n, mask_n, i, j);
                 }
             }
         }
-
     }
 
-    return 0;
+    if (l.iou_thresh < 1.0f) {
+        // averages the deltas obtained by the function: delta_yolo_box()_accumulate
+        // only the predictions with class deltas can have a positive one to average over
+        for (k = 0; k < l.n * stride; ++k) {
+            if (!s.class_delta_set[k]) continue;
+            int obj_index = entry_index(l, b, k, 4);
+            int box_index = entry_index(l, b, k, 0);
+            int class_index = entry_index(l, b, k, 4 + 1);
+
+            if (l.delta[obj_index] != 0)
+                averages_yolo_deltas(class_index, box_index, stride, l.classes, l.delta);
+        }
+    }
 }
 
+typedef struct train_yolo_args {
+    layer l;
+    network_state state;
+    int slots;
+} train_yolo_args;
 
+// thread k of the pool takes the images k, k + slots, ... with the buffers of slot k
+static void train_yolo_slots(int begin, int end, void *ptr)
+{
+    train_yolo_args *args = (train_yolo_args*)ptr;
+    const layer l = args->l;
+    int k, b, n;
+    for (k = begin; k < end; ++k) {
+        yolo_train_slot s = get_yolo_train_slot(l, k);
+        for (n = 0; n < l.total; ++n) {
+            s.anchor_x[n] = s.anchor_y[n] = 0;
+            s.anchor_w[n] = l.biases[2 * n] / args->state.net.w;
+            s.anchor_h[n] = l.biases[2 * n + 1] / args->state.net.h;
+        }
+        *s.tot_iou = *s.tot_iou_loss = *s.tot_giou_loss = 0;
+        *s.count = *s.class_count = *s.total_bbox = *s.rewritten_bbox = 0;
+        for (b = k; b < l.batch; b += args->slots) yolo_train_image(l, args->state, s, b);
+    }
+}
 
 void forward_yolo_layer(const layer l, network_state state)
 {
@@ -668,6 +741,10 @@ void forward_yolo_layer(const layer l, network_state state)
     int b, n;
 
 #ifndef GPU
+    // At inference only the class scores of cells above the objectness threshold are ever read,
+    // so their logistic is left to get_yolo_detections() (see yolo_class_probs())
+    const int lazy = !state.train && !l.new_coords;
+    state.net.layers[state.index].lazy_class_logistic = lazy;
     for (b = 0; b < l.batch; ++b) {
         for (n = 0; n < l.n; ++n) {
             int bbox_index = entry_index(l, b, n*l.w*l.h, 0);
@@ -677,7 +754,7 @@ void forward_yolo_layer(const layer l, network_state state)
             else {
                 activate_array(l.output + bbox_index, 2 * l.w*l.h, LOGISTIC);        // x,y,
                 int obj_index = entry_index(l, b, n*l.w*l.h, 4);
-                activate_array(l.output + obj_index, (1 + l.classes)*l.w*l.h, LOGISTIC);
+                activate_array(l.output + obj_index, (1 + (lazy ? 0 : l.classes))*l.w*l.h, LOGISTIC);
             }
             scal_add_cpu(2 * l.w*l.h, l.scale_x_y, -0.5*(l.scale_x_y - 1), l.output + bbox_index, 1);    // scale x,y
         }
@@ -710,40 +787,32 @@ void forward_yolo_layer(const layer l, network_state state)
     *(l.cost) = 0;
 
 
-    int num_threads = l.batch;
-    pthread_t* threads = (pthread_t*)calloc(num_threads, sizeof(pthread_t));
-
-    struct train_yolo_args* yolo_args = (train_yolo_args*)xcalloc(l.batch, sizeof(struct train_yolo_args));
-
-    for (b = 0; b < l.batch; b++)
-    {
-        yolo_args[b].l = l;
-        yolo_args[b].state = state;
-        yolo_args[b].b = b;
-
-        yolo_args[b].tot_iou = 0;
-        yolo_args[b].tot_iou_loss = 0;
-        yolo_args[b].tot_giou_loss = 0;
-        yolo_args[b].count = 0;
-        yolo_args[b].class_count = 0;
-
-        if (pthread_create(&threads[b], 0, process_batch, &(yolo_args[b]))) error("Thread creation failed", DARKNET_LOC);
+    layer *train_l = &state.net.layers[state.index];
+    if (!train_l->train_scratch) {
+        train_l->train_scratch_slots = min_val_cmp(l.batch, thread_pool_size());
+        train_l->train_scratch = (float*)xcalloc(train_l->train_scratch_slots * yolo_slot_floats(l), sizeof(float));
+        train_l->train_scratch_int = (int*)xcalloc(train_l->train_scratch_slots * yolo_slot_ints(l), sizeof(int));
     }
-
-    for (b = 0; b < l.batch; b++)
+    train_yolo_args args;
+    args.l = l;
+    args.l.train_scratch = train_l->train_scratch;
+    args.l.train_scratch_int = train_l->train_scratch_int;
+    args.state = state;
+    args.slots = train_l->train_scratch_slots;
+    parallel_for(args.slots, 1, train_yolo_slots, &args);
+
+    for (b = 0; b < args.slots; b++)
     {
-        pthread_join(threads[b], 0);
-
-        tot_iou += yolo_args[b].tot_iou;
-        tot_iou_loss += yolo_args[b].tot_iou_loss;
-        tot_giou_loss += yolo_args[b].tot_giou_loss;
-        count += yolo_args[b].count;
-        class_count += yolo_args[b].class_count;
+        yolo_train_slot s = get_yolo_train_slot(args.l, b);
+        tot_iou += *s.tot_iou;
+        tot_iou_loss += *s.tot_iou_loss;
+        tot_giou_loss += *s.tot_giou_loss;
+        count += *s.count;
+        class_count += *s.class_count;
+        *state.net.total_bbox += *s.total_bbox;
+        *state.net.rewritten_bbox += *s.rewritten_bbox;
     }
 
-    free(yolo_args);
-    free(threads);
-
     // Search for an equidistant point from the distant boundaries of the local minimum
     int iteration_num = get_current_iteration(state.net);
     const int start_point = state.net.max_batches * 3 / 4;
@@ -1086,10 +1155,28 @@ void avg_flipped_yolo(layer l)
     }
 }
 
+// prob[j] = objectness * class score if above thresh, else 0. With lazy_class_logistic the class channels
+// are still logits, so the logistic runs here on the gathered row of this candidate only
+static void yolo_class_probs(layer l, const float *predictions, int class_index, float objectness, float thresh, float *prob)
+{
+    const int stride = l.w*l.h;
+    int j;
+    if (l.lazy_class_logistic) {
+        for (j = 0; j < l.classes; ++j) prob[j] = logistic_activate(predictions[class_index + j*stride]);
+    }
+    else {
+        for (j = 0; j < l.classes; ++j) prob[j] = predictions[class_index + j*stride];
+    }
+    for (j = 0; j < l.classes; ++j) {
+        float p = objectness*prob[j];
+        prob[j] = (p > thresh) ? p : 0;
+    }
+}
+
 int get_yolo_detections(layer l, int w, int h, int netw, int neth, float thresh, int *map, int relative, detection *dets, int letter)
 {
     //printf("\n l.batch = %d, l.w = %d, l.h = %d, l.n = %d \n", l.batch, l.w, l.h, l.n);
-    int i,j,n;
+    int i,n;
     float *predictions = l.output;
     // This snippet below is not necessary
     // Need to comment it in order to batch processing >= 2 images
@@ -1112,11 +1199,7 @@ int get_yolo_detections(layer l, int w, int h, int netw, int neth, float thresh,
                     get_embedding(l.embedding_output, l.w, l.h, l.n*l.embedding_size, l.embedding_size, col, row, n, 0, dets[count].embeddings);
                 }
 
-                for (j = 0; j < l.classes; ++j) {
-                    int class_index = entry_index(l, 0, n*l.w*l.h + i, 4 + 1 + j);
-                    float prob = objectness*predictions[class_index];
-                    dets[count].prob[j] = (prob > thresh) ? prob : 0;
-                }
+                yolo_class_probs(l, predictions, entry_index(l, 0, n*l.w*l.h + i, 4 + 1), objectness, thresh, dets[count].prob);
                 ++count;
             }
         }
@@ -1127,7 +1210,7 @@ int get_yolo_detections(layer l, int w, int h, int netw, int neth, float thresh,
 
 int get_yolo_detections_batch(layer l, int w, int h, int netw, int neth, float thresh, int *map, int relative, detection *dets, int letter, int batch)
 {
-    int i,j,n;
+    int i,n;
     float *predictions = l.output;
     //if (l.batch == 2) avg_flipped_yolo(l);
     int count = 0;
@@ -1148,11 +1231,7 @@ int get_yolo_detections_batch(layer l, int w, int h, int netw, int neth, float t
                     get_embedding(l.embedding_output, l.w, l.h, l.n*l.embedding_size, l.embedding_size, col, row, n, batch, dets[count].embeddings);
                 }
 
-                for (j = 0; j < l.classes; ++j) {
-                    int class_index = entry_index(l, batch, n*l.w*l.h + i, 4 + 1 + j);
-                    float prob = objectness*predictions[class_index];
-                    dets[count].prob[j] = (prob > thresh) ? prob : 0;
-                }
+                yolo_class_probs(l, predictions, entry_index(l, batch, n*l.w*l.h + i, 4 + 1), objectness, thresh, dets[count].prob);
                 ++count;
             }
         }
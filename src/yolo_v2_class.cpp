@@ -161,6 +161,7 @@ LIB_API Detector::Detector(std::string cfg_filename, std::string weight_filename
     set_batch_network(&net, batch_size);
     net.gpu_index = cur_gpu_id;
     fuse_conv_batchnorm(net);
+    optimize_network_graph(&net);
 
     layer l = net.layers[net.n - 1];
     int j;
@@ -267,41 +268,12 @@ LIB_API void Detector::free_image(image_t m)
     }
 }
 
-LIB_API std::vector<bbox_t> Detector::detect(image_t img, float thresh, bool use_mean)
+// Turns the output of the last network_predict() into boxes in the pixel coordinates of a w x h frame
+static std::vector<bbox_t> get_bbox_vec(detector_gpu_t &detector_gpu, float *prediction, int w, int h, float thresh, bool use_mean, float nms)
 {
-    detector_gpu_t &detector_gpu = *static_cast<detector_gpu_t *>(detector_gpu_ptr.get());
     network &net = detector_gpu.net;
-#ifdef GPU
-    int old_gpu_index;
-    cudaGetDevice(&old_gpu_index);
-    if(cur_gpu_id != old_gpu_index)
-        cudaSetDevice(net.gpu_index);
-
-    net.wait_stream = wait_stream;    // 1 - wait CUDA-stream, 0 - not to wait
-#endif
-    //std::cout << "net.gpu_index = " << net.gpu_index << std::endl;
-
-    image im;
-    im.c = img.c;
-    im.data = img.data;
-    im.h = img.h;
-    im.w = img.w;
-
-    image sized;
-
-    if (net.w == im.w && net.h == im.h) {
-        sized = make_image(im.w, im.h, im.c);
-        memcpy(sized.data, im.data, im.w*im.h*im.c * sizeof(float));
-    }
-    else
-        sized = resize_image(im, net.w, net.h);
-
     layer l = net.layers[net.n - 1];
 
-    float *X = sized.data;
-
-    float *prediction = network_predict(net, X);
-
     if (use_mean) {
         memcpy(detector_gpu.predictions[detector_gpu.demo_index], prediction, l.outputs * sizeof(float));
         mean_arrays(detector_gpu.predictions, NFRAMES, l.outputs, detector_gpu.avg);
@@ -314,7 +286,7 @@ LIB_API std::vector<bbox_t> Detector::detect(image_t img, float thresh, bool use
     int nboxes = 0;
     int letterbox = 0;
     float hier_thresh = 0.5;
-    detection *dets = get_network_boxes(&net, im.w, im.h, thresh, hier_thresh, 0, 1, &nboxes, letterbox);
+    detection *dets = get_network_boxes_view(&net, w, h, thresh, hier_thresh, 0, 1, &nboxes, letterbox);
     if (nms) do_nms_sort(dets, nboxes, l.classes, nms);
 
     std::vector<bbox_t> bbox_vec;
@@ -327,10 +299,10 @@ LIB_API std::vector<bbox_t> Detector::detect(image_t img, float thresh, bool use
         if (prob > thresh)
         {
             bbox_t bbox;
-            bbox.x = std::max((double)0, (b.x - b.w / 2.)*im.w);
-            bbox.y = std::max((double)0, (b.y - b.h / 2.)*im.h);
-            bbox.w = b.w*im.w;
-            bbox.h = b.h*im.h;
+            bbox.x = std::max((double)0, (b.x - b.w / 2.)*w);
+            bbox.y = std::max((double)0, (b.y - b.h / 2.)*h);
+            bbox.w = b.w*w;
+            bbox.h = b.h*h;
             bbox.obj_id = obj_id;
             bbox.prob = prob;
             bbox.track_id = 0;
@@ -343,7 +315,44 @@ LIB_API std::vector<bbox_t> Detector::detect(image_t img, float thresh, bool use
         }
     }
 
-    free_detections(dets, nboxes);
+    return bbox_vec;
+}
+
+LIB_API std::vector<bbox_t> Detector::detect(image_t img, float thresh, bool use_mean)
+{
+    detector_gpu_t &detector_gpu = *static_cast<detector_gpu_t *>(detector_gpu_ptr.get());
+    network &net = detector_gpu.net;
+#ifdef GPU
+    int old_gpu_index;
+    cudaGetDevice(&old_gpu_index);
+    if(cur_gpu_id != old_gpu_index)
+        cudaSetDevice(net.gpu_index);
+
+    net.wait_stream = wait_stream;    // 1 - wait CUDA-stream, 0 - not to wait
+#endif
+    //std::cout << "net.gpu_index = " << net.gpu_index << std::endl;
+
+    image im;
+    im.c = img.c;
+    im.data = img.data;
+    im.h = img.h;
+    im.w = img.w;
+
+    image sized;
+
+    if (net.w == im.w && net.h == im.h) {
+        sized = make_image(im.w, im.h, im.c);
+        memcpy(sized.data, im.data, im.w*im.h*im.c * sizeof(float));
+    }
+    else
+        sized = resize_image(im, net.w, net.h);
+
+    float *X = sized.data;
+
+    float *prediction = network_predict(net, X);
+
+    std::vector<bbox_t> bbox_vec = get_bbox_vec(detector_gpu, prediction, im.w, im.h, thresh, use_mean, nms);
+
     if(sized.data)
         free(sized.data);
 
@@ -355,6 +364,36 @@ LIB_API std::vector<bbox_t> Detector::detect(image_t img, float thresh, bool use
     return bbox_vec;
 }
 
+LIB_API std::vector<bbox_t> Detector::detect_bytes(const unsigned char *data, int w, int h, int c, int stride, bool bgr, float thresh, bool use_mean)
+{
+    if (data == NULL)
+        throw std::runtime_error("Image is empty");
+    detector_gpu_t &detector_gpu = *static_cast<detector_gpu_t *>(detector_gpu_ptr.get());
+    network &net = detector_gpu.net;
+#ifdef GPU
+    int old_gpu_index;
+    cudaGetDevice(&old_gpu_index);
+    if(cur_gpu_id != old_gpu_index)
+        cudaSetDevice(net.gpu_index);
+
+    net.wait_stream = wait_stream;    // 1 - wait CUDA-stream, 0 - not to wait
+#endif
+
+    // the frame goes straight into the network input buffer: no float copy of the frame, no resized copy
+    float *X = network_input_from_bytes(&net, data, w, h, c, stride, bgr, 0);
+
+    float *prediction = network_predict(net, X);
+
+    std::vector<bbox_t> bbox_vec = get_bbox_vec(detector_gpu, prediction, w, h, thresh, use_mean, nms);
+
+#ifdef GPU
+    if (cur_gpu_id != old_gpu_index)
+        cudaSetDevice(old_gpu_index);
+#endif
+
+    return bbox_vec;
+}
+
 LIB_API std::vector<std::vector<bbox_t>> Detector::detectBatch(image_t img, int batch_size, int width, int height, float thresh, bool make_nms)
 {
     detector_gpu_t &detector_gpu = *static_cast<detector_gpu_t *>(detector_gpu_ptr.get());